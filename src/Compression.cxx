@@ -0,0 +1,177 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "Compression.hxx"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+static const std::size_t MIN_MATCH = 4;
+static const std::size_t LAST_LITERALS = 5; // The last bytes of a block are always literals
+static const std::size_t MATCH_LIMIT = 12;  // The last match must start at least this many bytes before the end of the block
+static const std::size_t MAX_OFFSET = 65535;
+static const unsigned HASH_BITS = 12;
+
+// Reads 4 bytes of data, which may be unaligned
+static std::uint32_t read32(const std::uint8_t *data)
+{
+	std::uint32_t value;
+
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+// Appends the extra bytes of a length that does not fit in the token of a sequence
+static void appendLength(std::string &block, std::size_t length)
+{
+	for (; length >= 255; length -= 255)
+		block += char(255);
+
+	block += char(length);
+}
+
+// Reads the extra bytes of a length that does not fit in the token of a sequence, returning false if the block ends first
+static bool readLength(const std::uint8_t *block, std::size_t length, std::size_t &offset, std::size_t &value)
+{
+	std::uint8_t byte;
+
+	do
+	{
+		if (offset == length)
+			return false;
+
+		byte = block[offset++];
+		value += byte;
+	} while (byte == 255);
+
+	return true;
+}
+
+// Appends a sequence (literals followed by a match, or only literals if the match length is zero) to a block
+static void appendSequence(std::string &block, const std::uint8_t *literals, std::size_t literalLength, std::size_t offset, std::size_t matchLength)
+{
+	const std::size_t matchCode = matchLength ? matchLength - MIN_MATCH : 0;
+
+	block += char(((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+
+	if (literalLength >= 15)
+		appendLength(block, literalLength - 15);
+
+	block.append(reinterpret_cast<const char *>(literals), literalLength);
+
+	if (!matchLength)
+		return;
+
+	block += char(offset);
+	block += char(offset >> 8);
+
+	if (matchCode >= 15)
+		appendLength(block, matchCode - 15);
+}
+
+/** Compresses data into an LZ4 block.
+ *
+ * @param data the data to compress
+ * @param length the length of the data
+ * @param block the string the compressed block is appended to
+ * @return true if the compressed block is smaller than the data, otherwise false (the block is then incomplete and should not be used)
+ */
+bool k8psh::Compression::compress(const char *data, std::size_t length, std::string &block)
+{
+	const std::uint8_t *input = reinterpret_cast<const std::uint8_t *>(data);
+	std::uint32_t table[1 << HASH_BITS] = { }; // The position after the last occurrence of each hashed sequence (zero if none)
+	const std::size_t start = block.length();
+	std::size_t anchor = 0;
+
+	block.reserve(start + length);
+
+	for (std::size_t i = 0; i + MATCH_LIMIT <= length; )
+	{
+		const std::uint32_t sequence = read32(input + i);
+		std::uint32_t &entry = table[std::uint32_t(sequence * 2654435761U) >> (32 - HASH_BITS)];
+		const std::size_t match = std::size_t(entry) - 1;
+
+		entry = std::uint32_t(i + 1);
+
+		// Data without matches is skipped faster the longer it goes without one, so incompressible data costs little
+		if (match == std::size_t(-1) || i - match > MAX_OFFSET || read32(input + match) != sequence)
+		{
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+
+		std::size_t matchLength = MIN_MATCH;
+
+		while (i + matchLength < length - LAST_LITERALS && input[match + matchLength] == input[i + matchLength])
+			matchLength++;
+
+		appendSequence(block, input + anchor, i - anchor, i - match, matchLength);
+		i += matchLength;
+		anchor = i;
+
+		if (block.length() - start >= length)
+			return false;
+	}
+
+	appendSequence(block, input + anchor, length - anchor, 0, 0);
+	return block.length() - start < length;
+}
+
+/** Decompresses an LZ4 block.
+ *
+ * @param block the compressed block
+ * @param length the length of the compressed block
+ * @param decompressedLength the length of the data that was compressed
+ * @param data set to the decompressed data
+ * @return true if the block is valid and decompresses to the expected length, otherwise false
+ */
+bool k8psh::Compression::decompress(const char *block, std::size_t length, std::size_t decompressedLength, std::string &data)
+{
+	const std::uint8_t *input = reinterpret_cast<const std::uint8_t *>(block);
+	std::size_t offset = 0;
+	std::size_t end = 0;
+
+	data.resize(decompressedLength);
+
+	while (offset < length)
+	{
+		const std::uint8_t token = input[offset++];
+		std::size_t literalLength = token >> 4;
+
+		if ((literalLength == 15 && !readLength(input, length, offset, literalLength)) || literalLength > length - offset || literalLength > decompressedLength - end)
+			return false;
+
+		if (literalLength)
+			std::memcpy(&data[end], input + offset, literalLength);
+
+		offset += literalLength;
+		end += literalLength;
+
+		if (offset == length)
+			break; // The last sequence only has literals
+		else if (length - offset < 2)
+			return false;
+
+		const std::size_t matchOffset = std::size_t(input[offset]) | (std::size_t(input[offset + 1]) << 8);
+		std::size_t matchLength = token & 15;
+
+		offset += 2;
+
+		if (!matchOffset || matchOffset > end || (matchLength == 15 && !readLength(input, length, offset, matchLength)) || (matchLength += MIN_MATCH) > decompressedLength - end)
+			return false;
+
+		// Matches that overlap the data they produce (repeating the last bytes) are copied one byte at a time
+		if (matchOffset >= matchLength)
+			std::memcpy(&data[end], &data[end - matchOffset], matchLength);
+		else
+		{
+			for (std::size_t i = 0; i < matchLength; i++)
+				data[end + i] = data[end + i - matchOffset];
+		}
+
+		end += matchLength;
+	}
+
+	return end == decompressedLength;
+}
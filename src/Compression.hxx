@@ -0,0 +1,41 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_COMPRESSION_HXX
+#define K8PSH_COMPRESSION_HXX
+
+#include <cstddef>
+#include <string>
+
+namespace k8psh {
+
+// Compresses data using the LZ4 block format, which is fast enough to compress stdout and stderr data on the relay path (the data is not framed, so the decompressed length must be sent separately).
+class Compression
+{
+	// Compression class cannot be instantiated.
+	Compression();
+
+public:
+	/** Compresses data into an LZ4 block.
+	 *
+	 * @param data the data to compress
+	 * @param length the length of the data
+	 * @param block the string the compressed block is appended to
+	 * @return true if the compressed block is smaller than the data, otherwise false (the block is then incomplete and should not be used)
+	 */
+	static bool compress(const char *data, std::size_t length, std::string &block);
+
+	/** Decompresses an LZ4 block.
+	 *
+	 * @param block the compressed block
+	 * @param length the length of the compressed block
+	 * @param decompressedLength the length of the data that was compressed
+	 * @param data set to the decompressed data
+	 * @return true if the block is valid and decompresses to the expected length, otherwise false
+	 */
+	static bool decompress(const char *block, std::size_t length, std::size_t decompressedLength, std::string &data);
+};
+
+} // k8psh
+
+#endif // K8PSH_COMPRESSION_HXX
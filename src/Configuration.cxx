@@ -3,12 +3,15 @@
 
 #include "Configuration.hxx"
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "Socket.hxx"
 #include "Utilities.hxx"
 
 // Gets the remaining string in a line.
@@ -197,6 +200,187 @@ static std::size_t parseArguments(const std::string &configurationString, std::s
 	return offset;
 }
 
+// The identifier at the start of all configuration snapshots (the last 2 characters are the version).
+static const char SNAPSHOT_MAGIC[] = { 'K', '8', 'P', 'S', 'H', 'C', '0', '6' };
+
+// Hashes data using 64-bit FNV-1a.
+static std::uint64_t hashData(const std::string &data)
+{
+	std::uint64_t hash = 0xCBF29CE484222325;
+
+	for (std::size_t i = 0; i < data.length(); i++)
+		hash = (hash ^ std::uint8_t(data[i])) * 0x100000001B3;
+
+	return hash;
+}
+
+// Appends a little-endian value to a snapshot.
+static void appendSnapshotValue(std::string &snapshot, std::uint64_t value, std::size_t size)
+{
+	for (std::size_t i = 0; i < size; i++)
+		snapshot += char(value >> (8 * i));
+}
+
+// Appends a length-prefixed string to a snapshot.
+static void appendSnapshotString(std::string &snapshot, const std::string &value)
+{
+	appendSnapshotValue(snapshot, value.length(), 4);
+	snapshot += value;
+}
+
+// Reads data from a snapshot, validating that the data does not extend past the end of the snapshot.
+class SnapshotReader
+{
+	const char *_data;
+	std::size_t _size;
+	std::size_t _offset;
+
+public:
+	SnapshotReader(const char *data, std::size_t size, std::size_t offset) : _data(data), _size(size), _offset(offset) { }
+
+	// Gets the offset of the next read.
+	std::size_t getOffset() const { return _offset; }
+
+	// Reads a length-prefixed string, returning false if the string extends past the end of the snapshot.
+	bool readString(std::string &value)
+	{
+		std::uint64_t length;
+
+		if (!readValue(length, 4) || _size - _offset < length)
+			return false;
+
+		value.assign(_data + _offset, std::size_t(length));
+		_offset += std::size_t(length);
+		return true;
+	}
+
+	// Reads a little-endian value, returning false if the value extends past the end of the snapshot.
+	bool readValue(std::uint64_t &value, std::size_t size)
+	{
+		if (_offset > _size || _size - _offset < size)
+			return false;
+
+		value = 0;
+
+		for (std::size_t i = 0; i < size; i++)
+			value |= std::uint64_t(std::uint8_t(_data[_offset + i])) << (8 * i);
+
+		_offset += size;
+		return true;
+	}
+};
+
+// Removes all occurrences of an option with a value ("--option value" or "--option=value") from the options of a host, returning true if the option was found (the last value is used).
+static bool takeHostOption(std::vector<std::string> &options, const std::string &option, const std::string &host, std::string &value)
+{
+	bool found = false;
+
+	for (auto it = options.begin(); it != options.end();)
+	{
+		if (*it == option)
+		{
+			if (it + 1 == options.end())
+				LOG_ERROR << "Expecting value after " << option << " for host " << host;
+
+			value = *(it + 1);
+			it = options.erase(it, it + 2);
+		}
+		else if (it->compare(0, option.length() + 1, option + "=") == 0)
+		{
+			value = it->substr(option.length() + 1);
+			it = options.erase(it);
+		}
+		else
+		{
+			++it;
+			continue;
+		}
+
+		if (value.empty())
+			LOG_ERROR << "Expecting non-empty value for " << option << " for host " << host;
+
+		found = true;
+	}
+
+	return found;
+}
+
+// Removes a flag from the options of a host, returning true if the flag was found.
+static bool takeHostFlag(std::vector<std::string> &options, const std::string &flag)
+{
+	const auto it = std::find(options.begin(), options.end(), flag);
+
+	if (it == options.end())
+		return false;
+
+	options.erase(std::remove(it, options.end(), flag), options.end());
+	return true;
+}
+
+/** Parses the size of a host option.
+ *
+ * @param option the name of the option
+ * @param value the value of the option, which is a number of bytes with an optional K or M suffix (or "auto", if allowed)
+ * @param host the host of the option
+ * @param minSize the minimum size
+ * @param maxSize the maximum size
+ * @param allowAuto true if the size can be sized automatically
+ * @return the size in bytes, or AUTO_SIZE for an automatic size
+ */
+static std::size_t parseHostSize(const std::string &option, const std::string &value, const std::string &host, std::size_t minSize, std::size_t maxSize, bool allowAuto)
+{
+	if (allowAuto && value == "auto")
+		return k8psh::Configuration::Host::AUTO_SIZE;
+
+	std::size_t end = 0;
+	unsigned long long size = 0;
+
+	if (value[0] >= '0' && value[0] <= '9')
+	{
+		try { size = std::stoull(value, &end); }
+		catch (const std::exception &) { end = 0; }
+	}
+
+	const std::string suffix = value.substr(end);
+	const unsigned shift = suffix == "K" ? 10 : suffix == "M" ? 20 : 0;
+
+	if (!end || (!suffix.empty() && !shift))
+		LOG_ERROR << "Invalid size \"" << value << "\" for " << option << " for host " << host;
+	else if (size < (minSize >> shift) || size > (maxSize >> shift) || (size << shift) < minSize)
+		LOG_ERROR << "Expecting " << option << " from " << minSize << " to " << maxSize << " bytes for host " << host << ", but found " << value;
+
+	return std::size_t(size << shift);
+}
+
+// Gets the path of the file that is created once the server is listening.
+static std::string getReadyPath(const std::string &baseDirectory, const std::string &hostname, const std::string &socketPath)
+{
+	return socketPath.empty() ? k8psh::Utilities::normalizePath(baseDirectory + "/.k8psh-" + hostname + ".ready") : socketPath;
+}
+
+/** Resolves the address of the host to a numeric address, which is kept so the address is only resolved once. (The snapshot stores the resolved address, so clients loading the snapshot never wait on name resolution.)
+ *
+ * @return the numeric address (empty if the host uses the loopback address or the address cannot be resolved)
+ */
+const std::string &k8psh::Configuration::Host::resolveAddress() const
+{
+	if (!_address.empty() && _resolvedAddress.empty())
+		_resolvedAddress = Socket::resolve(_address);
+
+	return _resolvedAddress;
+}
+
+// Checks if sessions compress large stdout and stderr data, which is skipped for hosts using the loopback address or a Unix domain socket (where it only costs CPU).
+bool k8psh::Configuration::Host::shouldCompress() const
+{
+	if (!_compress || !_socketPath.empty())
+		return false;
+
+	const std::string &address = resolveAddress();
+
+	return !address.empty() && address.compare(0, 4, "127.") != 0 && address != "::1";
+}
+
 // Loads the configuration from a string.
 k8psh::Configuration k8psh::Configuration::load(const std::string &configurationString, const std::string &workingPath)
 {
@@ -207,6 +391,25 @@ k8psh::Configuration k8psh::Configuration::load(const std::string &configuration
 	// Assign the defaults
 	configuration._baseDirectory = absoluteWorkingPath;
 	configuration._connectTimeoutMs = 30000;
+	configuration._agentConnections = 4;
+	configuration._hash = hashData(configurationString);
+	configuration._workingPath = absoluteWorkingPath;
+
+	// Find all referenced environment variables (including those that are not substituted at load time), since snapshots are stale if any of them change
+	for (std::size_t j = configurationString.find("${"); j != std::string::npos; j = configurationString.find("${", j))
+	{
+		const std::size_t end = configurationString.find_first_of(":}\n", j += 2);
+
+		if (end != std::string::npos && configurationString[end] != '\n')
+		{
+			const std::string name = configurationString.substr(j, end - j);
+
+			if (std::find(configuration._environmentReferences.begin(), configuration._environmentReferences.end(), name) == configuration._environmentReferences.end())
+				configuration._environmentReferences.emplace_back(name);
+		}
+	}
+
+	std::string agentSocket;
 
 	// Parse client settings
 	for (;;)
@@ -230,11 +433,25 @@ k8psh::Configuration k8psh::Configuration::load(const std::string &configuration
 				try { configuration._connectTimeoutMs = std::stoll(value); }
 				catch (const std::exception &e) { LOG_ERROR << "Failed to parse connectTimeoutMs (" << value << "): " << e.what(); }
 			}
+			else if (key == "agentSocket")
+				agentSocket = value;
+			else if (key == "agentConnections")
+			{
+				try { configuration._agentConnections = std::stoll(value); }
+				catch (const std::exception &e) { LOG_ERROR << "Failed to parse agentConnections (" << value << "): " << e.what(); }
+
+				if (configuration._agentConnections < 1)
+					LOG_ERROR << "Expecting at least 1 for agentConnections, but found " << value;
+			}
 			else
 				LOG_ERROR << "Unrecognized configuration key \"" << key << '"';
 		}
 	}
 
+	// The agent socket is relative to the base directory, which may be set after it
+	if (!agentSocket.empty())
+		configuration._agentSocketPath = Utilities::normalizePath(Utilities::isAbsolutePath(agentSocket) ? agentSocket : configuration._baseDirectory + '/' + agentSocket);
+
 	// Parse server settings
 	std::shared_ptr<Host> currentHost;
 	unsigned short currentPort = DEFAULT_STARTING_PORT;
@@ -294,6 +511,46 @@ k8psh::Configuration k8psh::Configuration::load(const std::string &configuration
 
 				environmentVariables.emplace_back(std::make_pair(it->substr(0, equals), it->substr(equals + 1)));
 			}
+
+			// Parse the options for the Unix domain socket and the network addresses (used by both the client and the server, so they are not passed to the server)
+			std::string path;
+
+			if (takeHostOption(currentHost->_options, "--socket", host, path))
+				currentHost->_socketPath = Utilities::normalizePath(Utilities::isAbsolutePath(path) ? path : configuration._baseDirectory + '/' + path);
+
+			const bool hasAddress = takeHostOption(currentHost->_options, "--address", host, currentHost->_address);
+			const bool hasBindAddress = takeHostOption(currentHost->_options, "--bind-address", host, currentHost->_bindAddress);
+
+			if ((hasAddress || hasBindAddress) && !currentHost->_socketPath.empty())
+				LOG_ERROR << "Expecting --address and --bind-address to be used with TCP for host " << host;
+#ifdef K8PSH_STATIC
+			else if (hasAddress && Socket::resolve(currentHost->_address).empty())
+				LOG_ERROR << "Expecting a numeric --address for host " << host << ", since the statically-linked executable cannot resolve hostnames (found \"" << currentHost->_address << "\")";
+#endif
+
+			// Parse the options for passing stdio handles or relaying data through shared memory over the Unix domain socket and compressing output (also used by both the client and the server)
+			currentHost->_passStdio = takeHostFlag(currentHost->_options, "--pass-stdio");
+			currentHost->_sharedMemory = takeHostFlag(currentHost->_options, "--shared-memory");
+			currentHost->_compress = takeHostFlag(currentHost->_options, "--compress");
+
+			if (currentHost->_passStdio && currentHost->_socketPath.empty())
+				LOG_ERROR << "Expecting --pass-stdio to be used with a Unix domain socket for host " << host;
+			else if (currentHost->_sharedMemory && currentHost->_socketPath.empty())
+				LOG_ERROR << "Expecting --shared-memory to be used with a Unix domain socket for host " << host;
+
+			// Parse the options for the sizes of the session buffers, pipes, and sockets (the pipe size is only used by the server)
+			std::string size;
+
+			if (takeHostOption(currentHost->_options, "--buffer-size", host, size))
+				currentHost->_bufferSize = parseHostSize("--buffer-size", size, host, 1024, Host::MAX_BUFFER_SIZE, true);
+
+			if (takeHostOption(currentHost->_options, "--pipe-size", host, size))
+				currentHost->_pipeSize = parseHostSize("--pipe-size", size, host, 1024 * 4, 1024 * 1024 * 1024, true);
+
+			if (takeHostOption(currentHost->_options, "--socket-buffer-size", host, size))
+				currentHost->_socketBufferSize = parseHostSize("--socket-buffer-size", size, host, 1024, 1024 * 1024 * 1024, false);
+
+			currentHost->_readyPath = getReadyPath(configuration._baseDirectory, currentHost->_hostname, currentHost->_socketPath);
 		}
 		else // Executable
 		{
@@ -303,10 +560,49 @@ k8psh::Configuration k8psh::Configuration::load(const std::string &configuration
 
 			// Create the command
 			command._host = currentHost;
+			command._hosts.assign(1, currentHost);
 			command._name = std::move(values[0]);
 			command._environmentVariables = environmentVariables;
 
-			for (std::size_t j = 1; j < values.size(); j++)
+			// Parse the options for the command, which are listed before any environment variables
+			static const std::string cacheOption = "--cache";
+			static const std::string maxProcessesOption = "--max-processes=";
+			static const std::string persistentOption = "--persistent=";
+			static const std::string maxWorkerRequestsOption = "--max-worker-requests=";
+			std::size_t j = 1;
+
+			// Parses the value of a numeric option, which must be at least 1
+			auto parseCount = [&command](const std::string &option, const std::string &value)
+				{
+					long long count = 0;
+
+					try { count = std::stoll(value); }
+					catch (const std::exception &e) { LOG_ERROR << "Failed to parse " << option << " for command " << command.getName() << " (" << value << "): " << e.what(); }
+
+					if (count < 1)
+						LOG_ERROR << "Expecting at least 1 for " << option << " for command " << command.getName() << ", but found " << value;
+
+					return count;
+				};
+
+			for (; j < values.size(); j++)
+			{
+				if (values[j] == cacheOption)
+					command._cache = true;
+				else if (values[j].compare(0, maxProcessesOption.length(), maxProcessesOption) == 0)
+					command._maxProcesses = parseCount(maxProcessesOption, values[j].substr(maxProcessesOption.length()));
+				else if (values[j].compare(0, persistentOption.length(), persistentOption) == 0)
+					command._persistentWorkers = parseCount(persistentOption, values[j].substr(persistentOption.length()));
+				else if (values[j].compare(0, maxWorkerRequestsOption.length(), maxWorkerRequestsOption) == 0)
+					command._maxWorkerRequests = parseCount(maxWorkerRequestsOption, values[j].substr(maxWorkerRequestsOption.length()));
+				else
+					break;
+			}
+
+			if (command._maxWorkerRequests && !command._persistentWorkers)
+				LOG_ERROR << "Expecting " << maxWorkerRequestsOption << " to be used with " << persistentOption << " for command " << command.getName();
+
+			for (; j < values.size(); j++)
 			{
 				std::size_t equals;
 
@@ -319,11 +615,246 @@ k8psh::Configuration k8psh::Configuration::load(const std::string &configuration
 			if (command._executable.empty())
 				command._executable.emplace_back(command.getName());
 
-			// Add the command to the configuration
+			// Add the command to the configuration (commands in multiple sections are replicas, so the client uses the last definition and spreads sessions across all of their hosts)
 			configuration._hostCommands[currentHost->getHostname()][command.getName()] = command;
-			configuration._commands[command.getName()] = std::move(command);
+			Command &clientCommand = configuration._commands[command.getName()];
+			std::vector<std::shared_ptr<Host> > hosts = std::move(clientCommand._hosts);
+
+			hosts.erase(std::remove_if(hosts.begin(), hosts.end(), [&currentHost](const std::shared_ptr<Host> &host) { return host->getHostname() == currentHost->getHostname(); }), hosts.end());
+			hosts.push_back(currentHost);
+			clientCommand = std::move(command);
+			clientCommand._hosts = std::move(hosts);
 		}
 	}
 
 	return configuration;
 }
+
+// Loads the configuration for a single command from a snapshot created by createSnapshot(), without parsing the configuration.
+bool k8psh::Configuration::loadSnapshot(const char *snapshot, std::size_t size, const std::string &configurationString, const std::string &workingPath, const std::string &commandName, Configuration &configuration)
+{
+	SnapshotReader reader(snapshot, size, sizeof(SNAPSHOT_MAGIC));
+	Configuration result;
+	std::uint64_t count, value;
+	std::string name;
+
+	if (size < sizeof(SNAPSHOT_MAGIC) || std::memcmp(snapshot, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+	{
+		LOG_DEBUG << "Ignoring invalid snapshot";
+		return false;
+	}
+
+	// Check that the snapshot was created from the same configuration and environment
+	if (!reader.readValue(value, 8) || !reader.readString(result._workingPath) || !reader.readValue(count, 4))
+		return false;
+	else if (value != hashData(configurationString) || result._workingPath != Utilities::normalizePath(Utilities::getAbsolutePath(workingPath)))
+	{
+		LOG_DEBUG << "Ignoring stale snapshot created from a different configuration";
+		return false;
+	}
+
+	result._hash = value;
+
+	for (; count; count--)
+	{
+		std::string expected;
+
+		if (!reader.readString(name) || !reader.readValue(value, 1) || !reader.readString(expected))
+			return false;
+
+		const auto current = Utilities::getEnvironmentVariable(name);
+
+		if (bool(current) != bool(value) || static_cast<const std::string &>(current) != expected)
+		{
+			LOG_DEBUG << "Ignoring stale snapshot created with a different value for environment variable " << name;
+			return false;
+		}
+
+		result._environmentReferences.emplace_back(std::move(name));
+	}
+
+	// Load the client settings
+	if (!reader.readString(result._baseDirectory) || !reader.readValue(value, 8))
+		return false;
+
+	result._connectTimeoutMs = static_cast<long long>(value);
+
+	if (!reader.readString(result._agentSocketPath) || !reader.readValue(value, 8))
+		return false;
+
+	result._agentConnections = static_cast<long long>(value);
+
+	// Find the command in the index
+	std::uint64_t indexSize;
+
+	if (!reader.readValue(indexSize, 4) || !indexSize || (indexSize & (indexSize - 1)) != 0)
+		return false;
+
+	const std::size_t indexOffset = reader.getOffset();
+
+	for (std::uint64_t i = 0, entry = hashData(commandName) & (indexSize - 1); i < indexSize; i++, entry = (entry + 1) & (indexSize - 1))
+	{
+		SnapshotReader indexReader(snapshot, size, indexOffset + 4 * std::size_t(entry));
+
+		if (!indexReader.readValue(value, 4))
+			return false;
+		else if (!value)
+			break;
+
+		SnapshotReader commandReader(snapshot, size, std::size_t(value));
+
+		if (!commandReader.readString(name))
+			return false;
+		else if (name != commandName)
+			continue;
+
+		// Load the command and its hosts
+		Command command;
+
+		command._name = std::move(name);
+
+		if (!commandReader.readValue(count, 4) || !count)
+			return false;
+
+		for (; count; count--)
+		{
+			auto host = std::make_shared<Host>();
+
+			if (!commandReader.readString(host->_hostname) || !commandReader.readValue(value, 2) || !commandReader.readString(host->_address) || !commandReader.readString(host->_resolvedAddress) || !commandReader.readString(host->_socketPath))
+				return false;
+
+			host->_port = static_cast<unsigned short>(value);
+
+			if (!commandReader.readValue(value, 1))
+				return false;
+
+			host->_passStdio = (value & 1) != 0;
+			host->_compress = (value & 2) != 0;
+			host->_sharedMemory = (value & 4) != 0;
+
+			if (!commandReader.readValue(value, 4))
+				return false;
+
+			host->_bufferSize = value == 0xFFFFFFFF ? Host::AUTO_SIZE : std::size_t(value);
+
+			if (!commandReader.readValue(value, 4))
+				return false;
+
+			host->_socketBufferSize = std::size_t(value);
+			host->_readyPath = getReadyPath(result._baseDirectory, host->_hostname, host->_socketPath);
+			command._hosts.emplace_back(std::move(host));
+		}
+
+		command._host = command._hosts.back();
+
+		if (!commandReader.readValue(count, 4))
+			return false;
+
+		for (command._executable.resize(std::size_t(count)); count; count--)
+		{
+			if (!commandReader.readString(command._executable[command._executable.size() - std::size_t(count)]))
+				return false;
+		}
+
+		if (!commandReader.readValue(count, 4))
+			return false;
+
+		for (command._environmentVariables.resize(std::size_t(count)); count; count--)
+		{
+			auto &environmentVariable = command._environmentVariables[command._environmentVariables.size() - std::size_t(count)];
+
+			if (!commandReader.readString(environmentVariable.first) || !commandReader.readString(environmentVariable.second))
+				return false;
+		}
+
+		result._hostCommands[command.getHost().getHostname()][command.getName()] = command;
+		result._commands[command.getName()] = std::move(command);
+		break;
+	}
+
+	LOG_DEBUG << "Loaded command " << commandName << " from snapshot";
+	configuration = std::move(result);
+	return true;
+}
+
+// Creates a snapshot of the configuration that contains an index of all commands, which can be loaded using loadSnapshot(). (The addresses of the hosts are resolved and stored in the snapshot.)
+std::string k8psh::Configuration::createSnapshot() const
+{
+	std::string snapshot(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+
+	// Add the data used to check that the snapshot is not stale
+	appendSnapshotValue(snapshot, _hash, 8);
+	appendSnapshotString(snapshot, _workingPath);
+	appendSnapshotValue(snapshot, _environmentReferences.size(), 4);
+
+	for (auto it = _environmentReferences.begin(); it != _environmentReferences.end(); ++it)
+	{
+		const auto value = Utilities::getEnvironmentVariable(*it);
+
+		appendSnapshotString(snapshot, *it);
+		appendSnapshotValue(snapshot, value ? 1 : 0, 1);
+		appendSnapshotString(snapshot, value);
+	}
+
+	// Add the client settings
+	appendSnapshotString(snapshot, _baseDirectory);
+	appendSnapshotValue(snapshot, static_cast<std::uint64_t>(_connectTimeoutMs), 8);
+	appendSnapshotString(snapshot, _agentSocketPath);
+	appendSnapshotValue(snapshot, static_cast<std::uint64_t>(_agentConnections), 8);
+
+	// Add the index (an open addressing hash table containing the offset of each command, or zero for unused entries) followed by the commands
+	std::size_t indexSize = 1;
+
+	while (indexSize < 2 * _commands.size())
+		indexSize <<= 1;
+
+	std::vector<std::uint32_t> index(indexSize);
+	std::string commands;
+
+	appendSnapshotValue(snapshot, indexSize, 4);
+
+	const std::size_t commandsOffset = snapshot.length() + 4 * indexSize;
+
+	for (auto it = _commands.begin(); it != _commands.end(); ++it)
+	{
+		const Command &command = it->second;
+		std::size_t entry = hashData(command.getName()) & (indexSize - 1);
+
+		while (index[entry])
+			entry = (entry + 1) & (indexSize - 1);
+
+		index[entry] = std::uint32_t(commandsOffset + commands.length());
+		appendSnapshotString(commands, command.getName());
+		appendSnapshotValue(commands, command.getHosts().size(), 4);
+
+		for (auto hostIt = command.getHosts().begin(); hostIt != command.getHosts().end(); ++hostIt)
+		{
+			appendSnapshotString(commands, (*hostIt)->getHostname());
+			appendSnapshotValue(commands, (*hostIt)->getPort(), 2);
+			appendSnapshotString(commands, (*hostIt)->getAddress());
+			appendSnapshotString(commands, (*hostIt)->resolveAddress()); // Clients connect using the resolved address, so they never wait on name resolution
+			appendSnapshotString(commands, (*hostIt)->getSocketPath());
+			appendSnapshotValue(commands, ((*hostIt)->shouldPassStdio() ? 1 : 0) | ((*hostIt)->_compress ? 2 : 0) | ((*hostIt)->shouldUseSharedMemory() ? 4 : 0), 1);
+			appendSnapshotValue(commands, (*hostIt)->_bufferSize == Host::AUTO_SIZE ? 0xFFFFFFFF : (*hostIt)->_bufferSize, 4);
+			appendSnapshotValue(commands, (*hostIt)->_socketBufferSize, 4);
+		}
+
+		appendSnapshotValue(commands, command.getExecutable().size(), 4);
+
+		for (auto executableIt = command.getExecutable().begin(); executableIt != command.getExecutable().end(); ++executableIt)
+			appendSnapshotString(commands, *executableIt);
+
+		appendSnapshotValue(commands, command.getEnvironmentVariables().size(), 4);
+
+		for (auto environmentIt = command.getEnvironmentVariables().begin(); environmentIt != command.getEnvironmentVariables().end(); ++environmentIt)
+		{
+			appendSnapshotString(commands, environmentIt->first);
+			appendSnapshotString(commands, environmentIt->second);
+		}
+	}
+
+	for (auto it = index.begin(); it != index.end(); ++it)
+		appendSnapshotValue(snapshot, *it, 4);
+
+	return snapshot + commands;
+}
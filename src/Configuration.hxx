@@ -4,6 +4,8 @@
 #ifndef K8PSH_CONFIGURATION_HXX
 #define K8PSH_CONFIGURATION_HXX
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -22,17 +24,70 @@ public:
 
 		std::string _hostname;
 		unsigned short _port;
+		std::string _address;
+		mutable std::string _resolvedAddress;
+		std::string _bindAddress;
+		std::string _socketPath;
+		std::string _readyPath;
+		bool _passStdio;
+		bool _compress;
+		bool _sharedMemory;
+		std::size_t _bufferSize;
+		std::size_t _pipeSize;
+		std::size_t _socketBufferSize;
 		std::vector<std::string> _options;
 
 	public:
+		// The size of buffers and pipes that grow as they fill and shrink once idle.
+		static constexpr std::size_t AUTO_SIZE = std::size_t(-1);
+
+		// The largest buffer size, which is the largest payload accepted by multiplexed connections.
+		static constexpr std::size_t MAX_BUFFER_SIZE = 1024 * 64;
+
+		// Gets the hostname or numeric address used to connect to the host, or empty if the host uses the loopback address.
+		const std::string &getAddress() const { return _address; }
+
+		// Gets the numeric address the server listens on, or empty to listen on the loopback address.
+		const std::string &getBindAddress() const { return _bindAddress; }
+
+		// Gets the size of the buffers used by each session to relay data (which also limits the size of each payload), or AUTO_SIZE if they are sized automatically.
+		std::size_t getBufferSize() const { return _bufferSize ? _bufferSize : MAX_BUFFER_SIZE; }
+
 		// Gets the name of the host.
 		const std::string &getHostname() const { return _hostname; }
 
 		// Gets the options for the host.
 		const std::vector<std::string> &getOptions() const { return _options; }
 
+		// Gets the capacity of the stdin, stdout, and stderr pipes of the processes run by the host, zero to use the system default, or AUTO_SIZE if they are sized automatically.
+		std::size_t getPipeSize() const { return _pipeSize; }
+
 		// Gets the port of the host.
 		unsigned short getPort() const { return _port; }
+
+		// Gets the path of the file that is created once the server is listening (the Unix domain socket, if the host uses one).
+		const std::string &getReadyPath() const { return _readyPath; }
+
+		// Gets the size of the kernel send and receive buffers of the sockets used by sessions, or zero to use the system default.
+		std::size_t getSocketBufferSize() const { return _socketBufferSize; }
+
+		// Gets the path of the Unix domain socket used to connect to the host, or empty if the host uses TCP.
+		const std::string &getSocketPath() const { return _socketPath; }
+
+		/** Resolves the address of the host to a numeric address, which is kept so the address is only resolved once. (The snapshot stores the resolved address, so clients loading the snapshot never wait on name resolution.)
+		 *
+		 * @return the numeric address (empty if the host uses the loopback address or the address cannot be resolved)
+		 */
+		const std::string &resolveAddress() const;
+
+		// Checks if sessions compress large stdout and stderr data, which is skipped for hosts using the loopback address or a Unix domain socket (where it only costs CPU).
+		bool shouldCompress() const;
+
+		// Checks if clients pass their stdin, stdout, and stderr directly to the host instead of relaying the data over the socket.
+		bool shouldPassStdio() const { return _passStdio; }
+
+		// Checks if sessions relay data through shared memory instead of over the Unix domain socket, once the session is started (only supported on Linux).
+		bool shouldUseSharedMemory() const { return _sharedMemory; }
 	};
 
 	class Command
@@ -40,14 +95,24 @@ public:
 		friend class Configuration;
 
 		std::shared_ptr<Host> _host;
+		std::vector<std::shared_ptr<Host> > _hosts;
 		std::string _name;
 		std::vector<std::string> _executable;
 		std::vector<std::pair<std::string, std::string> > _environmentVariables;
+		bool _cache;
+		long long _maxProcesses;
+		long long _persistentWorkers;
+		long long _maxWorkerRequests;
 
 	public:
+		Command() : _host(), _hosts(), _name(), _executable(), _environmentVariables(), _cache(), _maxProcesses(), _persistentWorkers(), _maxWorkerRequests() { }
+
 		// Gets the host of the command.
 		const Host &getHost() const { return *_host; }
 
+		// Gets all hosts that run the command (the replicas of the command, which always end with the host of the command).
+		const std::vector<std::shared_ptr<Host> > &getHosts() const { return _hosts; }
+
 		// Gets the name of the command.
 		const std::string &getName() const { return _name; }
 
@@ -56,6 +121,18 @@ public:
 
 		// Gets the environment variables used by the command.
 		const std::vector<std::pair<std::string, std::string> > &getEnvironmentVariables() const { return _environmentVariables; }
+
+		// Gets the maximum number of processes of the command that the host runs at once, or zero if only the limit of the host applies.
+		long long getMaxProcesses() const { return _maxProcesses; }
+
+		// Gets the number of requests each persistent worker of the command runs before it is replaced, or zero if workers are only replaced once they exit.
+		long long getMaxWorkerRequests() const { return _maxWorkerRequests; }
+
+		// Gets the number of persistent workers the host keeps running for the command, or zero if each session starts its own process.
+		long long getPersistentWorkers() const { return _persistentWorkers; }
+
+		// Checks if the results of the command are cached by the host, since the command is deterministic.
+		bool shouldCache() const { return _cache; }
 	};
 
 	typedef std::unordered_map<std::string, Command> CommandMap;
@@ -64,13 +141,33 @@ public:
 private:
 	std::string _baseDirectory;
 	long long _connectTimeoutMs;
+	std::string _agentSocketPath;
+	long long _agentConnections;
 	HostCommandsMap _hostCommands;
 	CommandMap _commands;
+	std::uint64_t _hash;
+	std::string _workingPath;
+	std::vector<std::string> _environmentReferences;
 
 public:
 	// Loads the configuration from a string.
 	static Configuration load(const std::string &configurationString, const std::string &workingPath = "");
 
+	/** Loads the configuration for a single command from a snapshot created by createSnapshot(), without parsing the configuration.
+	 *
+	 * @param snapshot the snapshot data
+	 * @param size the size of the snapshot data
+	 * @param configurationString the configuration string that must match the configuration used to create the snapshot
+	 * @param workingPath the working path that must match the working path used to create the snapshot
+	 * @param commandName the name of the command to load
+	 * @param configuration set to the loaded configuration, which only contains the command (if it exists) and does not contain any host options
+	 * @return false if the snapshot is invalid or stale (the configuration or any environment variables it references have changed), otherwise true
+	 */
+	static bool loadSnapshot(const char *snapshot, std::size_t size, const std::string &configurationString, const std::string &workingPath, const std::string &commandName, Configuration &configuration);
+
+	// Creates a snapshot of the configuration that contains an index of all commands, which can be loaded using loadSnapshot(). (The addresses of the hosts are resolved and stored in the snapshot.)
+	std::string createSnapshot() const;
+
 	// Gets the commands for the specified host from the configuration.
 	const CommandMap *getCommands(const std::string &hostname) const
 	{
@@ -80,6 +177,12 @@ public:
 		return it == _hostCommands.end() ? ReturnType() : &it->second;
 	}
 
+	// Gets the maximum number of connections the agent keeps to each host.
+	long long getAgentConnections() const { return _agentConnections; }
+
+	// Gets the path of the Unix domain socket used to connect to the agent, or empty if the agent is not used.
+	const std::string &getAgentSocketPath() const { return _agentSocketPath; }
+
 	// Gets all commands from the configuration.
 	const CommandMap &getCommands() const { return _commands; }
 
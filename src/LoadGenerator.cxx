@@ -0,0 +1,281 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "LoadGenerator.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+	#include <cerrno>
+	#include <csignal>
+
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "Configuration.hxx"
+#include "Process.hxx"
+#include "Socket.hxx"
+#include "Utilities.hxx"
+
+// The names of the scenarios.
+static const char *const SCENARIO_NAMES[k8psh::LoadGenerator::SCENARIO_COUNT] = { "tiny", "bulk", "mixed" };
+
+// Formats a duration as milliseconds.
+static std::string formatMilliseconds(std::chrono::microseconds duration)
+{
+	std::ostringstream text;
+
+	text << std::fixed << std::setprecision(3) << double(duration.count()) / 1000.0 << "ms";
+	return text.str();
+}
+
+#ifndef _WIN32
+// Gets the CPU time of the server from its metrics, or a negative time if the metrics cannot be read
+static std::chrono::microseconds getServerCpuTime(const k8psh::Configuration::Host &host, unsigned short port)
+{
+	static const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+	static const std::string name = "\nprocess_cpu_seconds_total ";
+
+	try
+	{
+		// The metrics are served on the same address as the sessions (hosts using Unix domain sockets serve their metrics on the loopback address)
+		const std::string address = host.getSocketPath().empty() ? host.resolveAddress() : std::string();
+		k8psh::Socket socket = address.empty() ? k8psh::Socket::connect(port, false) : k8psh::Socket::connect(address, port, false);
+		std::vector<std::uint8_t> response(1024 * 64);
+		std::size_t length = 0;
+
+		if (!socket.isValid() || socket.write(std::vector<std::uint8_t>(request.begin(), request.end())) != request.length())
+			return std::chrono::microseconds(-1);
+
+		for (std::size_t received = 1; received; length += received)
+		{
+			if (length == response.size())
+				response.resize(response.size() * 2);
+
+			received = socket.read(response, length);
+		}
+
+		const std::string text(response.begin(), response.begin() + length);
+		const std::size_t value = text.find(name);
+
+		if (value != std::string::npos)
+			return std::chrono::microseconds(std::int64_t(std::stod(text.substr(value + name.length())) * 1e6));
+	}
+	catch (const std::exception &e)
+	{
+		LOG_WARNING << "Failed to read server metrics: " << e.what();
+	}
+
+	return std::chrono::microseconds(-1);
+}
+
+// Writes the specified amount of data to the pipe and then closes it, stopping early if the reading end is closed
+static void writeStdIn(k8psh::Pipe &pipe, std::uint64_t size, std::uint64_t &written)
+{
+	static const std::string data(1024 * 64, 'k');
+
+	while (written < size && pipe.getInput() != k8psh::Pipe::INVALID_HANDLE)
+		written += pipe.write(data.data(), size - written < data.length() ? std::size_t(size - written) : data.length());
+
+	pipe.closeInput();
+}
+
+// Runs a session with the specified amount of stdin, adding its sample to the results
+static void runSession(std::uint64_t stdInSize, int nullHandle, const std::string &workingDirectory, const k8psh::Configuration::Command &command, std::size_t argc, const char *argv[],
+	const k8psh::Configuration &configuration, k8psh::LoadGenerator::Results &results)
+{
+	k8psh::Pipe stdIn;
+	k8psh::Process::RemoteStreams streams(stdIn.getOutput(), nullHandle, nullHandle);
+	std::uint64_t stdInWritten = 0;
+	const auto start = std::chrono::steady_clock::now();
+	std::thread writer(writeStdIn, std::ref(stdIn), stdInSize, std::ref(stdInWritten));
+
+	try
+	{
+		const int exitCode = k8psh::Process::runRemoteCommand(workingDirectory, command, argc, argv, configuration, std::string(), &streams);
+		const auto end = std::chrono::steady_clock::now();
+		const k8psh::LoadGenerator::Sample sample = {
+			std::chrono::duration_cast<std::chrono::microseconds>(streams.connectedTime - start),
+			std::chrono::duration_cast<std::chrono::microseconds>(streams.firstOutputTime - start),
+			std::chrono::duration_cast<std::chrono::microseconds>(end - start) };
+
+		results.samples.push_back(sample);
+		results.nonzeroExits += exitCode != 0;
+		results.bytes += streams.outputSize;
+	}
+	catch (const std::exception &)
+	{
+		results.failures++; // The error has already been logged
+	}
+
+	// The command may exit without reading all of stdin, so the writer is stopped by closing the reading end
+	stdIn.closeOutput();
+	writer.join();
+	results.bytes += stdInWritten;
+}
+#endif
+
+/** Formats the results of a scenario as a report.
+ *
+ * @param scenario the scenario that was run
+ * @param options the options used to run the scenario
+ * @param results the results of the scenario
+ * @return the report, which ends with a newline
+ */
+std::string k8psh::LoadGenerator::formatResults(Scenario scenario, const Options &options, const Results &results)
+{
+	static const char *const LATENCY_NAMES[] = { "connect", "first output", "total" };
+	std::vector<std::chrono::microseconds> latencies[3];
+	std::ostringstream report;
+
+	for (auto it = results.samples.begin(); it != results.samples.end(); ++it)
+	{
+		latencies[0].push_back(it->connect);
+		latencies[1].push_back(it->firstOutput);
+		latencies[2].push_back(it->total);
+	}
+
+	report << getName(scenario) << ": " << (results.samples.size() + std::size_t(results.failures)) << " sessions (" << options.concurrency << " at once) in " << formatMilliseconds(results.elapsed) << ", " <<
+		results.failures << " failed, " << results.nonzeroExits << " nonzero exit codes\n";
+
+	for (std::size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+	{
+		std::sort(latencies[i].begin(), latencies[i].end());
+		report << "  " << std::left << std::setw(14) << LATENCY_NAMES[i] << "p50 " << formatMilliseconds(getPercentile(latencies[i], 50)) << "  p99 " << formatMilliseconds(getPercentile(latencies[i], 99)) <<
+			"  p999 " << formatMilliseconds(getPercentile(latencies[i], 99.9)) << "\n";
+	}
+
+	const double seconds = double(results.elapsed.count()) / 1e6;
+
+	report << "  " << std::setw(14) << "throughput" << std::fixed << std::setprecision(3) << (seconds > 0 ? double(results.bytes) / 1e6 / seconds : 0.0) << " MB/s\n";
+	report << "  " << std::setw(14) << "server CPU" << (results.serverCpuTime.count() < 0 ? std::string("unknown") : formatMilliseconds(results.serverCpuTime)) << "\n";
+	return report.str();
+}
+
+// Gets the name of a scenario.
+const char *k8psh::LoadGenerator::getName(Scenario scenario)
+{
+	return SCENARIO_NAMES[scenario];
+}
+
+/** Gets a percentile of the specified latencies using the nearest rank.
+ *
+ * @param sorted the latencies, sorted in ascending order
+ * @param percentile the percentile, from 0 to 100
+ * @return the latency at the percentile, or zero if there are no latencies
+ */
+std::chrono::microseconds k8psh::LoadGenerator::getPercentile(const std::vector<std::chrono::microseconds> &sorted, double percentile)
+{
+	if (sorted.empty())
+		return std::chrono::microseconds();
+
+	// The rank is rounded up, so the percentile is covered by at least that fraction of the latencies (ignoring rounding errors, like 99.9% of 1000 latencies)
+	const double rank = percentile / 100.0 * double(sorted.size());
+	std::size_t index = std::size_t(rank);
+
+	if (rank - double(index) > 1e-9)
+		index++;
+
+	return sorted[index ? (index < sorted.size() ? index : sorted.size()) - 1 : 0];
+}
+
+// Parses the name of a scenario, returning false if the name is not a scenario.
+bool k8psh::LoadGenerator::parseScenario(const std::string &name, Scenario &scenario)
+{
+	for (int i = 0; i < SCENARIO_COUNT; i++)
+	{
+		if (name == SCENARIO_NAMES[i])
+		{
+			scenario = Scenario(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/** Runs the sessions of a scenario (not supported on Windows).
+ *
+ * @param scenario the scenario to run
+ * @param options the options used to run the scenario
+ * @param workingDirectory the relative working directory used to start the processes
+ * @param command the command run by each session
+ * @param argc the number of additional arguments used to start the processes
+ * @param argv additional arguments used to start the processes
+ * @param configuration the global configuration
+ * @return the results of the scenario
+ */
+k8psh::LoadGenerator::Results k8psh::LoadGenerator::run(Scenario scenario, const Options &options, const std::string &workingDirectory, const Configuration::Command &command, std::size_t argc, const char *argv[], const Configuration &configuration)
+{
+	Results results;
+
+#ifdef _WIN32
+	(void)scenario, (void)options, (void)workingDirectory, (void)command, (void)argc, (void)argv, (void)configuration;
+	LOG_ERROR << "Load generator not supported";
+#else
+	// The stdin of a session is closed once its command exits, which may be before all of it is written
+	signal(SIGPIPE, SIG_IGN);
+
+	const int nullHandle = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	if (nullHandle < 0)
+		LOG_ERROR << "Failed to open /dev/null: " << errno;
+
+	const std::chrono::microseconds startCpuTime = options.metricsPort ? getServerCpuTime(command.getHost(), options.metricsPort) : std::chrono::microseconds(-1);
+	const std::size_t concurrency = std::size_t(options.concurrency > 0 ? options.concurrency : 1);
+	std::atomic<long long> nextSession(0);
+	std::vector<Results> workerResults(concurrency);
+	std::vector<std::thread> workers;
+	const auto start = std::chrono::steady_clock::now();
+
+	// Each worker runs one session at a time until all sessions have started
+	for (std::size_t i = 0; i < concurrency; i++)
+	{
+		workers.emplace_back([&, i]
+			{
+				for (long long session = nextSession++; session < options.sessions; session = nextSession++)
+				{
+					const bool bulk = scenario == BULK || (scenario == MIXED && session % 2);
+
+					runSession(bulk ? options.bulkSize : 0, nullHandle, workingDirectory, command, argc, argv, configuration, workerResults[i]);
+				}
+			});
+	}
+
+	for (auto it = workers.begin(); it != workers.end(); ++it)
+		it->join();
+
+	results.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	(void)close(nullHandle);
+
+	for (auto it = workerResults.begin(); it != workerResults.end(); ++it)
+	{
+		results.samples.insert(results.samples.end(), it->samples.begin(), it->samples.end());
+		results.failures += it->failures;
+		results.nonzeroExits += it->nonzeroExits;
+		results.bytes += it->bytes;
+	}
+
+	if (startCpuTime.count() >= 0)
+	{
+		const std::chrono::microseconds endCpuTime = getServerCpuTime(command.getHost(), options.metricsPort);
+
+		if (endCpuTime.count() >= 0)
+			results.serverCpuTime = endCpuTime - startCpuTime;
+	}
+#endif
+
+	return results;
+}
@@ -0,0 +1,102 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_LOAD_GENERATOR_HXX
+#define K8PSH_LOAD_GENERATOR_HXX
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Configuration.hxx"
+
+namespace k8psh {
+
+// Runs concurrent sessions of a command against a live server and reports their latency and throughput (the sessions run in-process, so the results do not include starting client processes).
+class LoadGenerator
+{
+	// LoadGenerator class cannot be instantiated.
+	LoadGenerator();
+
+public:
+	enum Scenario
+	{
+		TINY = 0, // Sessions without stdin, like many calls of "true"
+		BULK,     // Sessions that relay a large stdin, like piping data through "cat"
+		MIXED,    // Alternating tiny and bulk sessions
+		SCENARIO_COUNT
+	};
+
+	struct Options
+	{
+		long long sessions;    // The number of sessions run by each scenario
+		long long concurrency; // The number of sessions run at once
+		std::uint64_t bulkSize; // The size of the stdin of each bulk session
+		unsigned short metricsPort; // The metrics port of the server, used to measure its CPU time, or zero if the CPU time is not measured
+
+		Options() : sessions(100), concurrency(8), bulkSize(16 * 1024 * 1024), metricsPort() { }
+	};
+
+	// The latencies of a session, measured from the start of the session.
+	struct Sample
+	{
+		std::chrono::microseconds connect;
+		std::chrono::microseconds firstOutput;
+		std::chrono::microseconds total;
+	};
+
+	// The results of running a scenario.
+	struct Results
+	{
+		std::vector<Sample> samples; // Only contains the sessions that did not fail
+		long long failures;          // Sessions that could not connect or were closed without an exit code
+		long long nonzeroExits;      // Sessions that completed with a nonzero exit code
+		std::uint64_t bytes;         // The stdin, stdout, and stderr data relayed by all sessions
+		std::chrono::microseconds elapsed;
+		std::chrono::microseconds serverCpuTime; // Negative if the CPU time of the server is unknown
+
+		Results() : samples(), failures(), nonzeroExits(), bytes(), elapsed(), serverCpuTime(-1) { }
+	};
+
+	/** Formats the results of a scenario as a report.
+	 *
+	 * @param scenario the scenario that was run
+	 * @param options the options used to run the scenario
+	 * @param results the results of the scenario
+	 * @return the report, which ends with a newline
+	 */
+	static std::string formatResults(Scenario scenario, const Options &options, const Results &results);
+
+	// Gets the name of a scenario.
+	static const char *getName(Scenario scenario);
+
+	/** Gets a percentile of the specified latencies using the nearest rank.
+	 *
+	 * @param sorted the latencies, sorted in ascending order
+	 * @param percentile the percentile, from 0 to 100
+	 * @return the latency at the percentile, or zero if there are no latencies
+	 */
+	static std::chrono::microseconds getPercentile(const std::vector<std::chrono::microseconds> &sorted, double percentile);
+
+	// Parses the name of a scenario, returning false if the name is not a scenario.
+	static bool parseScenario(const std::string &name, Scenario &scenario);
+
+	/** Runs the sessions of a scenario (not supported on Windows).
+	 *
+	 * @param scenario the scenario to run
+	 * @param options the options used to run the scenario
+	 * @param workingDirectory the relative working directory used to start the processes
+	 * @param command the command run by each session
+	 * @param argc the number of additional arguments used to start the processes
+	 * @param argv additional arguments used to start the processes
+	 * @param configuration the global configuration
+	 * @return the results of the scenario
+	 */
+	static Results run(Scenario scenario, const Options &options, const std::string &workingDirectory, const Configuration::Command &command, std::size_t argc, const char *argv[], const Configuration &configuration);
+};
+
+} // k8psh
+
+#endif // K8PSH_LOAD_GENERATOR_HXX
@@ -5,18 +5,25 @@
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifdef _WIN32
+	#include <condition_variable>
 	#include <functional>
-	#include <thread>
+	#include <mutex>
 
 	#include <windows.h>
 #else
+	#include <list>
+
 	#include <fcntl.h>
 	#include <poll.h>
+	#include <pthread.h>
 	#include <signal.h>
 	#include <sys/stat.h>
 	#include <sys/wait.h>
@@ -24,12 +31,15 @@
 #endif
 
 #include "Configuration.hxx"
+#include "LoadGenerator.hxx"
 #include "Utilities.hxx"
 #include "Process.hxx"
+#include "ResultCache.hxx"
 
 static const std::string clientName = "k8psh";
 static const std::string serverName = clientName + "d";
 static const std::string environmentPrefix = "K8PSH_";
+static const std::string snapshotFilename = "." + clientName + ".snapshot";
 
 #ifdef GIT_VERSION
 	#define QUOTE_(X) #X
@@ -41,18 +51,37 @@ static const std::string version = QUOTE(GIT_VERSION);
 static const std::string version = "???";
 #endif
 
-// Gets the configuration.
-static k8psh::Configuration getConfiguration(const k8psh::OptionalString &config)
+/** Gets the configuration.
+ *
+ * @param config the configuration file specified on the command line, if any
+ * @param clientExecutable the client executable (found using PATH if it does not contain a directory) used to find the snapshot created by the server
+ * @param commandName the name of the command to load from the snapshot, or empty to always parse the entire configuration
+ * @return the configuration, which only contains the specified command if it was loaded from the snapshot
+ */
+static k8psh::Configuration getConfiguration(const k8psh::OptionalString &config, const std::string &clientExecutable = std::string(), const std::string &commandName = std::string())
 {
 	const auto configurationSpecified = config ? config : k8psh::Utilities::getEnvironmentVariable(environmentPrefix + "CONFIG");
 	const auto configurationFile = configurationSpecified ? static_cast<const std::string &>(configurationSpecified) : (clientName + ".conf");
 	const auto configurationString = k8psh::Utilities::readFile(configurationFile);
+	const auto workingPath = k8psh::Utilities::getParentDirectory(configurationFile);
 
 	if (!configurationString)
 		LOG_ERROR << "Configuration could not be loaded from " << configurationFile;
 
+	// Use the snapshot alongside the client executables, if it is up to date
+	const auto executable = commandName.empty() ? std::string() : k8psh::Utilities::findExecutable(clientExecutable);
+
+	if (!executable.empty())
+	{
+		const k8psh::MappedFile snapshot(k8psh::Utilities::getParentDirectory(executable) + k8psh::Utilities::getPathSeparator() + snapshotFilename);
+		k8psh::Configuration configuration;
+
+		if (snapshot.isValid() && k8psh::Configuration::loadSnapshot(snapshot.getData(), snapshot.getSize(), configurationString, workingPath, commandName, configuration))
+			return configuration;
+	}
+
 	LOG_DEBUG << "Loading configuration from file " << configurationFile;
-	return k8psh::Configuration::load(configurationString, k8psh::Utilities::getParentDirectory(configurationFile));
+	return k8psh::Configuration::load(configurationString, workingPath);
 }
 
 /** Parses a command line option from the arguments provided.
@@ -110,6 +139,12 @@ static void mainClient(int argc, const char *argv[])
 	std::string commandName = k8psh::Utilities::getExecutableBasename(argv[0]);
 	k8psh::OptionalString config;
 	std::string installFilename;
+	std::string benchmarkScenario;
+	std::string benchmarkBytes;
+	std::string benchmarkConcurrency;
+	std::string benchmarkMetricsPort;
+	std::string benchmarkSessions;
+	bool runAgent = false;
 	std::size_t i = 1;
 
 	// Parse command line arguments
@@ -122,12 +157,32 @@ static void mainClient(int argc, const char *argv[])
 
 			if (parseOption(arg, "-c", "--config", "[config]", i, argc, argv, config))
 				config.exists();
+			else if (arg == "-a" || arg == "--agent")
+				runAgent = true;
+			else if (parseOption(arg, "", "--benchmark", "[scenario]", i, argc, argv, benchmarkScenario) ||
+					parseOption(arg, "", "--benchmark-bytes", "[bytes]", i, argc, argv, benchmarkBytes) ||
+					parseOption(arg, "", "--benchmark-concurrency", "[count]", i, argc, argv, benchmarkConcurrency) ||
+					parseOption(arg, "", "--benchmark-metrics-port", "[port]", i, argc, argv, benchmarkMetricsPort) ||
+					parseOption(arg, "", "--benchmark-sessions", "[count]", i, argc, argv, benchmarkSessions))
+				; // Option recognized and parsed
 			else if (arg == "-h" || arg == "--help")
 			{
 				std::cout << "Usage: " << clientName << " [-s | --server] [options] command..." << std::endl;
 				std::cout << "  Executes a " << clientName << " client command" << std::endl;
 				std::cout << std::endl;
 				std::cout << "Options:" << std::endl;
+				std::cout << "  -a, --agent" << std::endl;
+				std::cout << "      Runs the agent, which multiplexes client commands over long-lived connections to each server (see agentSocket)." << std::endl;
+				std::cout << "  --benchmark [scenario]" << std::endl;
+				std::cout << "      Runs concurrent sessions of the command in-process and reports their latency and throughput, then exits. The scenario is tiny (no stdin), bulk (relays stdin), mixed (alternating tiny and bulk), or all." << std::endl;
+				std::cout << "  --benchmark-bytes [bytes]" << std::endl;
+				std::cout << "      The size of the stdin of each bulk benchmark session. Defaults to 16MiB." << std::endl;
+				std::cout << "  --benchmark-concurrency [count]" << std::endl;
+				std::cout << "      The number of benchmark sessions run at once. Defaults to 8." << std::endl;
+				std::cout << "  --benchmark-metrics-port [port]" << std::endl;
+				std::cout << "      The metrics port of the server (see --metrics-port), used to report the CPU time of the server during each benchmark scenario." << std::endl;
+				std::cout << "  --benchmark-sessions [count]" << std::endl;
+				std::cout << "      The number of sessions run by each benchmark scenario. Defaults to 100." << std::endl;
 				std::cout << "  -c, --config [file]" << std::endl;
 				std::cout << "      The configuration file loaded by " << clientName << ". Defaults to $" << environmentPrefix << "CONFIG." << std::endl;
 				std::cout << "  -h, --help" << std::endl;
@@ -138,6 +193,8 @@ static void mainClient(int argc, const char *argv[])
 				std::cout << "      Runs the server, with all options passed to the server." << std::endl;
 				std::cout << "  -v, --version" << std::endl;
 				std::cout << "      Prints the version and exits." << std::endl;
+				std::cout << std::endl;
+				std::cout << "Commands append the phases of their sessions on the client and server to $" << environmentPrefix << "TRACE as Chrome trace events, if it is set." << std::endl;
 				std::exit(0);
 			}
 			else if (parseOption(arg, "", "--install", "[file]", i, argc, argv, installFilename))
@@ -207,21 +264,122 @@ static void mainClient(int argc, const char *argv[])
 		}
 	}
 
-	// Load the configuration and start the process
-	const k8psh::Configuration configuration = getConfiguration(config);
+	// Load the configuration (using the snapshot if invoked as a client executable or as a command found in PATH) and start the process
+	const k8psh::Configuration configuration = runAgent ? getConfiguration(config) : getConfiguration(config, i == 1 ? std::string(argv[0]) : commandName, commandName);
+
+	if (runAgent)
+	{
+		k8psh::Process::runAgent(configuration);
+		std::exit(0);
+	}
+
 	auto commandIt = configuration.getCommands().find(commandName);
 
 	if (commandIt == configuration.getCommands().end())
 		LOG_ERROR << "Failed to find command \"" << commandName << "\" in configuration";
 
+	if (!benchmarkScenario.empty())
+	{
+		k8psh::LoadGenerator::Options options;
+		k8psh::LoadGenerator::Scenario scenario = k8psh::LoadGenerator::TINY;
+		const bool allScenarios = benchmarkScenario == "all";
+
+		if (!allScenarios && !k8psh::LoadGenerator::parseScenario(benchmarkScenario, scenario))
+			LOG_ERROR << "Expecting a benchmark scenario of tiny, bulk, mixed, or all, but found " << benchmarkScenario;
+
+		try
+		{
+			options.bulkSize = benchmarkBytes.empty() ? options.bulkSize : std::uint64_t(std::stoull(benchmarkBytes));
+			options.concurrency = benchmarkConcurrency.empty() ? options.concurrency : std::stoll(benchmarkConcurrency);
+			options.sessions = benchmarkSessions.empty() ? options.sessions : std::stoll(benchmarkSessions);
+		}
+		catch (const std::exception &e) { LOG_ERROR << "Failed to parse benchmark options: " << e.what(); }
+
+		if (options.concurrency <= 0 || options.sessions <= 0)
+			LOG_ERROR << "Expecting a positive number of benchmark sessions and concurrency";
+
+		if (!benchmarkMetricsPort.empty())
+		{
+			long long port = 0;
+
+			try { port = std::stoll(benchmarkMetricsPort); }
+			catch (const std::exception &e) { LOG_ERROR << "Failed to parse benchmark metrics port (" << benchmarkMetricsPort << "): " << e.what(); }
+
+			if (port <= 0 || port > 65535)
+				LOG_ERROR << "Expecting a benchmark metrics port from 1 to 65535, but found " << benchmarkMetricsPort;
+
+			options.metricsPort = static_cast<unsigned short>(port);
+		}
+
+		const std::string workingDirectory = k8psh::Utilities::relativizePath(configuration.getBaseDirectory(), k8psh::Utilities::getWorkingDirectory());
+
+		for (int j = allScenarios ? 0 : int(scenario); j < (allScenarios ? int(k8psh::LoadGenerator::SCENARIO_COUNT) : int(scenario) + 1); j++)
+		{
+			LOG_DEBUG << "Running benchmark scenario " << k8psh::LoadGenerator::getName(k8psh::LoadGenerator::Scenario(j)) << " of command " << commandName;
+
+			const auto results = k8psh::LoadGenerator::run(k8psh::LoadGenerator::Scenario(j), options, workingDirectory, commandIt->second, std::size_t(argc) - i, argv + i, configuration);
+
+			std::cout << k8psh::LoadGenerator::formatResults(k8psh::LoadGenerator::Scenario(j), options, results) << std::flush;
+		}
+
+		std::exit(0);
+	}
+
 	LOG_DEBUG << "Starting command " << commandName;
-	std::exit(k8psh::Process::runRemoteCommand(k8psh::Utilities::relativizePath(configuration.getBaseDirectory(), k8psh::Utilities::getWorkingDirectory()), commandIt->second, std::size_t(argc) - i, argv + i, configuration));
+	std::exit(k8psh::Process::runRemoteCommand(k8psh::Utilities::relativizePath(configuration.getBaseDirectory(), k8psh::Utilities::getWorkingDirectory()), commandIt->second, std::size_t(argc) - i, argv + i, configuration,
+		k8psh::Utilities::getEnvironmentVariable(environmentPrefix + "TRACE")));
 }
 
 #ifdef _WIN32
 static HANDLE exitRequested;
+
+// Sessions run on detached threads, so the server counts the active sessions to wait for them to finish
+static std::mutex activeSessionMutex;
+static std::condition_variable activeSessionFinished;
+static std::size_t activeSessionCount = 0;
 #else
 static k8psh::Pipe exitRequested;
+
+// The write handle of the pipe signaled when a session process exits, once the server forks sessions
+static volatile int sessionExitedHandle = k8psh::Pipe::INVALID_HANDLE;
+
+// Handles SIGCHLD by signaling the session exited pipe.
+extern "C" void handleSessionExited(int)
+{
+	int savedErrno = errno;
+	(void)::write(sessionExitedHandle, "", 1);
+	errno = savedErrno;
+}
+
+// Starts signaling the pipe when a session process exits, so the server reaps the sessions itself.
+static void watchSessionExits(k8psh::Pipe &sessionExited)
+{
+	struct sigaction action = { };
+
+	if (!sessionExited.setInputNonblocking() || fcntl(sessionExited.getOutput(), F_SETFL, fcntl(sessionExited.getOutput(), F_GETFL) | O_NONBLOCK) == -1)
+		LOG_ERROR << "Failed to set session exited pipe as non-blocking";
+
+	sessionExitedHandle = sessionExited.getInput();
+	action.sa_handler = handleSessionExited;
+	action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	(void)sigemptyset(&action.sa_mask);
+
+	if (sigaction(SIGCHLD, &action, NULL) != 0)
+		LOG_ERROR << "Failed to install SIGCHLD handler: " << errno;
+}
+
+// Reaps the session processes that have exited, releasing the process limits held by any that exited without releasing them (like killed sessions).
+static void reapSessions(k8psh::Pipe &sessionExited)
+{
+	char buffer[64];
+	pid_t process;
+
+	while (::read(sessionExited.getOutput(), buffer, sizeof(buffer)) > 0)
+		;
+
+	while ((process = waitpid(-1, NULL, WNOHANG)) > 0)
+		k8psh::Process::releaseProcessLimits(process);
+}
 #endif
 
 // Clamps a value between 0 and some maximum value.
@@ -256,13 +414,447 @@ BOOL WINAPI handleCtrlC(DWORD)
 
 static const std::string defaultPidFilename = "/run/" + serverName + ".pid";
 
+#ifndef _WIN32
+static const char WORKER_BUSY = 'B';
+static const char WORKER_IDLE = 'I';
+static const int WORKER_IDLE_TIMEOUT_MS = 30000;
+static const int WORKER_FULL_RETRY_MS = 10;
+
+// A pre-forked worker process that handles connections
+struct Worker
+{
+	pid_t pid;
+	k8psh::Pipe status;
+	bool busy;
+	bool temporary;
+
+	Worker(bool temporary) : pid(-1), status(), busy(false), temporary(temporary) { }
+};
+#endif
+
+// Runs a client session, guarding the server against any errors (which are logged when they are thrown)
+static void runSession(const k8psh::Configuration &configuration, const k8psh::Configuration::CommandMap &commands, k8psh::Socket &&client, std::chrono::microseconds outputDelay, const k8psh::ResultCache *cache)
+{
+	try { k8psh::Process::run(configuration.getBaseDirectory(), commands, std::move(client), outputDelay, cache); }
+	catch (const std::exception &) { }
+}
+
+#ifndef _WIN32
+// Runs a worker process, which handles connections back-to-back until the server exits (temporary workers also exit once idle)
+// Each connection is claimed from the connections shared by all workers before it is accepted, so the workers never accept more than the maximum number of connections
+static void runWorker(k8psh::Socket &listener, k8psh::Pipe &status, k8psh::SharedCounter &connections, long long maxConnections, const k8psh::Configuration &configuration, const k8psh::Configuration::CommandMap &commands, std::chrono::microseconds outputDelay, const k8psh::ResultCache *cache, bool temporary)
+{
+	const std::string busy(1, WORKER_BUSY);
+	const std::string idle(1, WORKER_IDLE);
+	const long long retirements = k8psh::Process::getPersistentWorkerRetirements(); // The server replaces any retired persistent workers before forking the worker
+	struct pollfd pollSet[2] = { };
+
+	pollSet[0].fd = exitRequested.getOutput();
+	pollSet[0].events = POLLIN;
+	pollSet[1].events = POLLIN;
+
+	LOG_DEBUG << "Entering worker connection listener loop";
+
+	for (bool full = false; ; )
+	{
+		int pollResult;
+
+		// Once all connections are claimed, the worker only waits for the server to exit, checking again in case a claim was for an accept that failed
+		pollSet[1].fd = full ? -1 : listener.createReadEvent();
+
+		do pollResult = poll(pollSet, nfds_t(sizeof(pollSet) / sizeof(pollSet[0])), full ? WORKER_FULL_RETRY_MS : temporary ? WORKER_IDLE_TIMEOUT_MS : -1);
+		while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+
+		if (pollResult < 0 || (pollSet[1].revents & POLLERR) != 0)
+			LOG_ERROR << "Failed to poll for new clients: " << errno;
+		else if ((pollSet[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+			break;
+		else if (pollResult == 0 && !full)
+		{
+			LOG_DEBUG << "Temporary worker is idle, exiting";
+			break;
+		}
+
+		// Workers cannot use the persistent workers replaced after they were forked, so they exit without accepting the connection (and are replaced by workers forked after the replacement)
+		if (k8psh::Process::getPersistentWorkerRetirements() != retirements)
+		{
+			LOG_DEBUG << "Persistent workers were retired, exiting worker";
+			break;
+		}
+
+		if (maxConnections >= 0 && connections.add(1) > maxConnections)
+		{
+			(void)connections.add(-1);
+			full = true;
+			continue;
+		}
+
+		k8psh::Socket client = listener.accept();
+
+		full = false;
+
+		if (!client.isValid())
+		{
+			if (maxConnections >= 0)
+				(void)connections.add(-1);
+
+			continue; // Another worker accepted the connection
+		}
+
+		LOG_DEBUG << "Worker accepted connection from new client";
+
+		if (status.write(busy) != busy.length())
+			break; // The server has exited
+
+		runSession(configuration, commands, std::move(client), outputDelay, cache);
+
+		if (status.write(idle) != idle.length())
+			break;
+	}
+}
+
+/** Runs a pool of pre-forked worker processes that accept connections on the listener, starting temporary workers when all workers are busy.
+ *
+ * @param listener the server socket shared by all workers
+ * @param configuration the global configuration
+ * @param commands the map of commands for this server node
+ * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+ * @param cache the cache used to store the results of cached commands, or null to always run the commands
+ * @param minWorkers the number of workers that are always running
+ * @param maxWorkers the maximum number of workers, or negative for no limit
+ * @param maxConnections the maximum number of connections to accept, or negative for no limit
+ * @param timeoutMs the time in milliseconds before the server exits, or negative to run forever
+ * @param endTime the time that the server exits, if a timeout is specified
+ * @return the number of connections accepted by the workers
+ */
+static long long runWorkerPool(k8psh::Socket &listener, const k8psh::Configuration &configuration, const k8psh::Configuration::CommandMap &commands, std::chrono::microseconds outputDelay, const k8psh::ResultCache *cache, long long minWorkers, long long maxWorkers, long long maxConnections, long long timeoutMs, std::chrono::steady_clock::time_point endTime)
+{
+	std::list<Worker> workers;
+	std::vector<struct pollfd> pollSet;
+	std::string statusData(64, '\0');
+	k8psh::SharedCounter claimedConnections; // Claimed by the workers before each accept (only used if the connections are limited)
+	long long connectionCount = 0;
+
+	if (!listener.setNonblocking())
+		LOG_ERROR << "Failed to set listener to use non-blocking accepts";
+
+	auto startWorker = [&](bool temporary)
+	{
+		k8psh::Process::replacePersistentWorkers(); // Persistent workers replaced by the server can only be used by the workers forked after them
+		workers.emplace_back(temporary);
+		pid_t pid = fork();
+
+		if (pid == 0)
+		{
+			try
+			{
+				signal(SIGCHLD, SIG_DFL);
+				exitRequested.closeInput();
+
+				for (auto it = workers.begin(); it != workers.end(); ++it)
+					it->status.closeOutput();
+
+				runWorker(listener, workers.back().status, claimedConnections, maxConnections, configuration, commands, outputDelay, cache, temporary);
+			}
+			catch (...) { std::exit(-1); }
+
+			std::exit(0);
+		}
+		else if (pid == -1)
+			LOG_ERROR << "Failed to fork worker: " << errno;
+
+		LOG_DEBUG << "Started " << (temporary ? "temporary worker " : "worker ") << pid;
+		workers.back().pid = pid;
+		workers.back().status.closeInput();
+	};
+
+	for (long long i = 0; i < minWorkers; i++)
+		startWorker(false);
+
+	while (connectionCount < maxConnections || maxConnections < 0)
+	{
+		auto remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(endTime -
+			(timeoutMs >= 0 ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point::max())).count();
+		auto waitMs = clampPositive(remainingMs, std::chrono::milliseconds::rep(unsigned(-1) >> 1));
+		int pollResult;
+
+		pollSet.resize(1);
+		pollSet[0].fd = exitRequested.getOutput();
+		pollSet[0].events = POLLIN;
+		pollSet[0].revents = 0;
+
+		for (auto it = workers.begin(); it != workers.end(); ++it)
+		{
+			struct pollfd workerPoll = { };
+
+			workerPoll.fd = it->status.getOutput();
+			workerPoll.events = POLLIN;
+			pollSet.push_back(workerPoll);
+		}
+
+		do pollResult = poll(pollSet.data(), nfds_t(pollSet.size()), timeoutMs >= 0 ? int(waitMs) : -1);
+		while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+
+		if (pollResult < 0)
+			LOG_ERROR << "Failed to poll workers: " << errno;
+		else if ((pollSet[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+			break;
+		else if (pollResult == 0)
+		{
+			if (remainingMs <= waitMs)
+				break;
+			else
+				continue;
+		}
+
+		// Process the status of all workers (each session they finish may have retired a persistent worker)
+		k8psh::Process::replacePersistentWorkers();
+
+		std::size_t idleWorkers = 0;
+		std::size_t exitedWorkers = 0;
+		std::size_t i = 1;
+
+		for (auto it = workers.begin(); it != workers.end(); i++)
+		{
+			if ((pollSet[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+			{
+				std::size_t received = it->status.read(statusData);
+
+				if (!received)
+				{
+					LOG_DEBUG << "Worker " << it->pid << " exited";
+					k8psh::Process::releaseProcessLimits(it->pid); // The sessions of the worker cannot release their limits if it was killed
+					exitedWorkers += it->temporary ? 0 : 1;
+					it = workers.erase(it);
+					continue;
+				}
+
+				for (std::size_t j = 0; j < received; j++)
+				{
+					it->busy = statusData[j] == WORKER_BUSY;
+					connectionCount += it->busy ? 1 : 0;
+				}
+			}
+
+			idleWorkers += it->busy ? 0 : 1;
+			++it;
+		}
+
+		// Replace any workers that exited unexpectedly, and add a temporary worker if all workers are busy
+		if (maxConnections >= 0 && connectionCount >= maxConnections)
+			break;
+
+		for (idleWorkers += exitedWorkers; exitedWorkers; exitedWorkers--)
+			startWorker(false);
+
+		if (!idleWorkers && (maxWorkers < 0 || (long long)workers.size() < maxWorkers))
+			startWorker(true);
+	}
+
+	// Notify all workers that the server is exiting
+	exitRequested.closeInput();
+	return connectionCount;
+}
+
+/** Runs processes that each accept connections on their own listener sharing the port (so the kernel balances the connections among them), with each process handling its connections using an event loop.
+ *
+ * @param listener the first listener, which shares its port
+ * @param bindAddress the address the other listeners are bound to
+ * @param configuration the global configuration
+ * @param commands the map of commands for this server node
+ * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+ * @param cache the cache used to store the results of cached commands, or null to always run the commands
+ * @param listenerCount the number of listener processes
+ * @param maxConnections the maximum number of connections to accept, or negative for no limit
+ * @param endTime the time that the server stops accepting connections
+ * @param waitOnSessions true to continue running the active sessions after a timeout or exit request, false to close them
+ * @return the number of connections accepted by the listeners
+ */
+static long long runListeners(k8psh::Socket &listener, const std::string &bindAddress, const k8psh::Configuration &configuration, const k8psh::Configuration::CommandMap &commands, std::chrono::microseconds outputDelay, const k8psh::ResultCache *cache, long long listenerCount, long long maxConnections, std::chrono::steady_clock::time_point endTime, bool waitOnSessions)
+{
+	const unsigned short port = listener.getPort();
+	k8psh::SharedCounter connectionCount;
+	std::list<Worker> listeners;
+	std::vector<struct pollfd> pollSet;
+	std::string statusData(64, '\0');
+
+	// Starts a process for a listener, which is only open in that process (so the kernel stops sending connections to it once the process exits)
+	auto startListener = [&](k8psh::Socket processListener)
+	{
+		listeners.emplace_back(false);
+		pid_t pid = fork();
+
+		if (pid == 0)
+		{
+			try
+			{
+				exitRequested.closeInput();
+
+				for (auto it = listeners.begin(); it != listeners.end(); ++it)
+					it->status.closeOutput();
+
+				// Each listener has its own persistent workers, since workers can only be replaced by the process that started them
+				k8psh::Process::startPersistentWorkers(configuration.getBaseDirectory(), commands);
+				(void)k8psh::Process::runEventLoop(configuration.getBaseDirectory(), commands, processListener, outputDelay, maxConnections, endTime, exitRequested, waitOnSessions, cache, &connectionCount);
+				k8psh::Process::stopPersistentWorkers();
+			}
+			catch (...) { std::exit(-1); }
+
+			std::exit(0);
+		}
+		else if (pid == -1)
+			LOG_ERROR << "Failed to fork listener: " << errno;
+
+		LOG_DEBUG << "Started listener " << pid << " on port " << port;
+		listeners.back().pid = pid;
+		listeners.back().status.closeInput();
+		(void)close(processListener.abandon()); // Closing the socket would shut it down for the listener process
+	};
+
+	startListener(std::move(listener));
+
+	for (long long i = 1; i < listenerCount; i++)
+		startListener(k8psh::Socket::listen(port, bindAddress, true));
+
+	for (;;)
+	{
+		int pollResult;
+
+		pollSet.resize(1);
+		pollSet[0].fd = exitRequested.getOutput();
+		pollSet[0].events = POLLIN;
+		pollSet[0].revents = 0;
+
+		for (auto it = listeners.begin(); it != listeners.end(); ++it)
+		{
+			struct pollfd listenerPoll = { };
+
+			listenerPoll.fd = it->status.getOutput();
+			listenerPoll.events = POLLIN;
+			pollSet.push_back(listenerPoll);
+		}
+
+		do pollResult = poll(pollSet.data(), nfds_t(pollSet.size()), -1);
+		while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+
+		if (pollResult < 0)
+			LOG_ERROR << "Failed to poll listeners: " << errno;
+		else if ((pollSet[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+			break;
+
+		// The listeners only close their status once they exit
+		std::size_t i = 1;
+
+		for (auto it = listeners.begin(); it != listeners.end(); i++)
+		{
+			if ((pollSet[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0 && !it->status.read(statusData))
+			{
+				LOG_DEBUG << "Listener " << it->pid << " exited";
+				k8psh::Process::releaseProcessLimits(it->pid); // The sessions of the listener cannot release their limits if it was killed
+				it = listeners.erase(it);
+			}
+			else
+				++it;
+		}
+
+		// Listeners exit after the maximum number of connections or the timeout, otherwise they failed and are replaced
+		if ((maxConnections >= 0 && connectionCount.get() >= maxConnections) || std::chrono::steady_clock::now() >= endTime)
+			break;
+
+		while ((long long)listeners.size() < listenerCount)
+		{
+			LOG_WARNING << "Replacing listener that exited unexpectedly";
+			startListener(k8psh::Socket::listen(port, bindAddress, true));
+		}
+	}
+
+	// Notify all listeners that the server is exiting (they also stop once the maximum number of connections are accepted by any listener)
+	exitRequested.closeInput();
+
+	// The listeners finish their active sessions before exiting, so the server waits for them before cleaning up
+	if (waitOnSessions)
+	{
+		LOG_DEBUG << "Waiting for all listeners to exit";
+
+		for (auto it = listeners.begin(); it != listeners.end(); ++it)
+		{
+			while (it->status.read(statusData))
+				; // The listeners only close their status once they exit
+		}
+	}
+
+	return connectionCount.get();
+}
+#endif
+
+// The socket used to serve metrics, which is only used by the metrics thread
+static k8psh::Socket metricsListener;
+
+// The maximum size of a metrics request, larger requests are answered once this much has been read
+static const std::size_t MAX_METRICS_REQUEST_SIZE = 8192;
+
+// The time a metrics client has to send its entire request, so a slow or idle client cannot block the other clients
+static const long long METRICS_REQUEST_TIMEOUT_MS = 2000;
+
+#ifndef _WIN32
+// Closes the metrics socket in forked processes, so the port is released once the server exits (even if sessions are still running)
+extern "C" void closeMetricsListener()
+{
+	(void)close(metricsListener.abandon());
+}
+#endif
+
+// Serves the metrics of the server over HTTP on the metrics socket until the server exits (requests are answered one at a time, regardless of their path)
+static void serveMetrics()
+{
+	for (;;)
+	{
+		k8psh::Socket client;
+
+		try { client = metricsListener.accept(); }
+		catch (const std::exception &) { return; } // The listener is closed once the server exits
+
+		if (!client.isValid())
+			continue;
+
+		try
+		{
+			const auto endTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(METRICS_REQUEST_TIMEOUT_MS);
+			std::vector<std::uint8_t> request(MAX_METRICS_REQUEST_SIZE);
+			std::size_t length = 0;
+
+			// The response is only sent once the whole request has been read, so closing the connection does not reset it (a read that waits past the deadline fails, closing the connection)
+			for (std::size_t received = 1; received && length < request.size() && std::string(request.begin(), request.begin() + length).find("\r\n\r\n") == std::string::npos; length += received)
+			{
+				const auto remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - std::chrono::steady_clock::now()).count();
+
+				if (remainingMs <= 0 || !client.setReceiveTimeout(remainingMs))
+					LOG_ERROR << "Metrics client did not send its request within " << METRICS_REQUEST_TIMEOUT_MS << "ms";
+
+				received = client.read(request, length);
+			}
+
+			const std::string body = k8psh::Process::formatMetrics();
+			const std::string header = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n";
+			const k8psh::Socket::Slice response[] = { { header.data(), header.length() }, { body.data(), body.length() } };
+
+			LOG_DEBUG << "Sending metrics (" << body.length() << " bytes) to client";
+			(void)client.write(response, sizeof(response) / sizeof(response[0]));
+			client.shutdown();
+		}
+		catch (const std::exception &) { }
+	}
+}
+
 // The main() for the server that waits requests to run executables in the configuration
 static void mainServer(int argc, const char *argv[])
 {
 	k8psh::Socket::Initializer socketInit;
 	std::vector<std::string> deferredArgs;
+	bool asyncLogging = false;
 	bool daemonize = false;
 	bool disableClientExecutables = false;
+	bool eventLoop = false;
 	bool generateLocalExecutables = false;
 	bool ignoreInvalidArguments = false;
 	bool keepClientExecutables = false;
@@ -274,6 +866,14 @@ static void mainServer(int argc, const char *argv[])
 	std::string connections = "-1";
 	std::string pidFilename = defaultPidFilename;
 	std::string timeout = "-1";
+	std::string workers = "0";
+	std::string listeners = "1";
+	std::string maxWorkers = "-1";
+	std::string maxProcesses;
+	std::string metricsPort;
+	std::string outputDelay = "200";
+	std::string cacheDirectory;
+	std::string cacheSize = "1024";
 
 	// Parse command line arguments
 	for (std::size_t i = 1; i < std::size_t(argc); i++)
@@ -281,17 +881,27 @@ static void mainServer(int argc, const char *argv[])
 		std::string arg = argv[i];
 		LOG_DEBUG << "Parsing command line argument " << arg;
 
-		if (arg == "-b" || arg == "--background" ||
+		if (arg == "--async-logging" ||
+				arg == "-b" || arg == "--background" ||
 				arg == "-d" || arg == "--disable-client-executables" ||
+				arg == "--event-loop" ||
 				arg == "-k" || arg == "--keep-client-executables" ||
 				arg == "-l" || arg == "--generate-local-executables" ||
 				arg == "-o" || arg == "--overwrite-client-executables" ||
 				arg == "-w" || arg == "--no-wait")
 			deferredArgs.emplace_back(arg);
-		else if (parseOption(arg, "-e", "--executable-directory", "[directory]", i, argc, argv, directory, &deferredArgs) ||
+		else if (parseOption(arg, "", "--cache-directory", "[directory]", i, argc, argv, cacheDirectory, &deferredArgs) ||
+				parseOption(arg, "", "--cache-size", "[MiB]", i, argc, argv, cacheSize, &deferredArgs) ||
+				parseOption(arg, "-e", "--executable-directory", "[directory]", i, argc, argv, directory, &deferredArgs) ||
+				parseOption(arg, "", "--listeners", "[count]", i, argc, argv, listeners, &deferredArgs) ||
 				parseOption(arg, "-m", "--max-connections", "[connections]", i, argc, argv, connections, &deferredArgs) ||
+				parseOption(arg, "", "--max-processes", "[count]", i, argc, argv, maxProcesses, &deferredArgs) ||
+				parseOption(arg, "", "--max-workers", "[count]", i, argc, argv, maxWorkers, &deferredArgs) ||
+				parseOption(arg, "", "--metrics-port", "[port]", i, argc, argv, metricsPort, &deferredArgs) ||
+				parseOption(arg, "", "--output-delay", "[us]", i, argc, argv, outputDelay, &deferredArgs) ||
 				parseOption(arg, "-p", "--pidfile", "[file]", i, argc, argv, pidFilename, &deferredArgs) ||
-				parseOption(arg, "-t", "--timeout", "[ms]", i, argc, argv, timeout, &deferredArgs))
+				parseOption(arg, "-t", "--timeout", "[ms]", i, argc, argv, timeout, &deferredArgs) ||
+				parseOption(arg, "", "--workers", "[count]", i, argc, argv, workers, &deferredArgs))
 			; // Option recognized and deferred
 		else if (parseOption(arg, "-c", "--config", "[file]", i, argc, argv, config))
 			config.exists();
@@ -303,14 +913,22 @@ static void mainServer(int argc, const char *argv[])
 			std::cout << "  Starts the " << serverName << " server" << std::endl;
 			std::cout << std::endl;
 			std::cout << "Options:" << std::endl;
+			std::cout << "  --async-logging" << std::endl;
+			std::cout << "      Writes debug and informational messages to stdout from a background thread, so handling connections never waits for the log. Debug messages are dropped (with a warning) if the log falls behind." << std::endl;
 			std::cout << "  -b, --background" << std::endl;
 			std::cout << "      Daemonize the server by sending it to the background." << std::endl;
+			std::cout << "  --cache-directory [directory]" << std::endl;
+			std::cout << "      The directory used to store the results of commands configured with --cache, relative to the base directory. Defaults to .k8psh-[name].cache. Not supported on Windows." << std::endl;
+			std::cout << "  --cache-size [MiB]" << std::endl;
+			std::cout << "      The maximum size in MiB of the stored results, after which the least recently used results are removed. Defaults to 1024." << std::endl;
 			std::cout << "  -c, --config [file]" << std::endl;
 			std::cout << "      The configuration file loaded by " << serverName << ". Defaults to $" << environmentPrefix << "CONFIG." << std::endl;
 			std::cout << "  -d, --disable-client-executables" << std::endl;
 			std::cout << "      Disables generating client executables so only local executables can be run." << std::endl;
 			std::cout << "  -e, --executable-directory [directory]" << std::endl;
-			std::cout << "      The directory used to create the client executables." << std::endl;
+			std::cout << "      The directory used to create the client executables and the configuration snapshot they use to start without parsing the configuration." << std::endl;
+			std::cout << "  --event-loop" << std::endl;
+			std::cout << "      Handles all connections in the server process using a single event loop rather than forking a process for each connection. Active connections are closed on exit when used with --no-wait. Not supported on Windows." << std::endl;
 			std::cout << "  -h, --help" << std::endl;
 			std::cout << "      Displays usage and exits." << std::endl;
 			std::cout << "  -i, --ignore-invalid-arguments" << std::endl;
@@ -319,12 +937,22 @@ static void mainServer(int argc, const char *argv[])
 			std::cout << "      Keeps client executables instead of removing them on exit." << std::endl;
 			std::cout << "  -l, --generate-local-executables" << std::endl;
 			std::cout << "      Generate client executables for local executables." << std::endl;
+			std::cout << "  --listeners [count]" << std::endl;
+			std::cout << "      The number of processes that each accept connections on their own listener sharing the port (using SO_REUSEPORT, so the kernel balances the connections among them) and handle them using an event loop. Each listener process starts its own persistent workers. Defaults to 1, 0 uses one for each CPU. Not supported with a Unix domain socket or on Windows." << std::endl;
 			std::cout << "  -m, --max-connections [connections]" << std::endl;
 			std::cout << "      The maximum number of connections to accept before the server exits. Defaults to -1 (no limit)." << std::endl;
+			std::cout << "  --max-processes [count]" << std::endl;
+			std::cout << "      The maximum number of processes run at once, after which sessions wait in order to start their processes. Commands configured with --max-processes=[count] are also limited individually. Defaults to the cgroup CPU quota (or no limit), 0 disables." << std::endl;
+			std::cout << "  --max-workers [count]" << std::endl;
+			std::cout << "      The maximum number of worker processes, including temporary workers started when all workers are busy. Defaults to -1 (no limit)." << std::endl;
+			std::cout << "  --metrics-port [port]" << std::endl;
+			std::cout << "      The port used to serve metrics in the Prometheus text format over HTTP, on the bind address of the server. Defaults to no metrics." << std::endl;
 			std::cout << "  -n, --name [name]" << std::endl;
 			std::cout << "      The name used to identify the server. Defaults to $" << environmentPrefix << "NAME or hostname." << std::endl;
 			std::cout << "  -o, --overwrite-client-executables" << std::endl;
 			std::cout << "      Overwrite client executables rather than fail with error." << std::endl;
+			std::cout << "  --output-delay [us]" << std::endl;
+			std::cout << "      The time in microseconds that stdout and stderr data is held so it can be sent with other output (up to 64KiB). Defaults to 200, 0 disables." << std::endl;
 			std::cout << "  -p, --pidfile [file]" << std::endl;
 			std::cout << "      The file to store the PID of the server. Defaults to " << defaultPidFilename << "." << std::endl;
 			std::cout << "  -t, --timeout [ms]" << std::endl;
@@ -333,6 +961,8 @@ static void mainServer(int argc, const char *argv[])
 			std::cout << "      Prints the version and exits." << std::endl;
 			std::cout << "  -w, --no-wait" << std::endl;
 			std::cout << "      Do not wait for client connections to terminate." << std::endl;
+			std::cout << "  --workers [count]" << std::endl;
+			std::cout << "      The number of pre-forked worker processes that accept and handle connections back-to-back. Defaults to 0 (fork a process for each connection)." << std::endl;
 			std::exit(0);
 		}
 		else if (arg == "-i" || arg == "--ignore-invalid-arguments")
@@ -370,6 +1000,11 @@ static void mainServer(int argc, const char *argv[])
 	std::size_t deferredArgc = deferredArgs.size();
 	const auto configuration = getConfiguration(config);
 	const auto serverCommands = configuration.getCommands(name);
+	std::string socketPath;
+	std::string readyPath;
+	std::string bindAddress;
+	unsigned short port = 0;
+	long long listenerCount = 1;
 	k8psh::Socket listener;
 
 	if (!serverCommands || serverCommands->empty())
@@ -384,7 +1019,10 @@ static void mainServer(int argc, const char *argv[])
 		// Update deferred arguments and set limit to prevent overlapping config file and command line arguments (prepend the config file arguments, so command line will be processed last)
 		deferredArgc = host.getOptions().empty() ? deferredArgc : host.getOptions().size();
 		deferredArgs.insert(deferredArgs.begin(), host.getOptions().begin(), host.getOptions().end());
-		listener = k8psh::Socket::listen(host.getPort());
+		socketPath = host.getSocketPath();
+		bindAddress = host.getBindAddress();
+		port = host.getPort();
+		readyPath = socketPath.empty() ? host.getReadyPath() : std::string(); // Unix domain sockets signal that the server is ready when they are created
 	}
 
 	// Parse deferred command line arguments
@@ -393,21 +1031,34 @@ static void mainServer(int argc, const char *argv[])
 		const std::string &arg = deferredArgs[i];
 		LOG_DEBUG << "Parsing deferred command line argument " << arg;
 
-		if (arg == "-b" || arg == "--background")
+		if (arg == "--async-logging")
+			asyncLogging = true;
+		else if (arg == "-b" || arg == "--background")
 			daemonize = true;
 		else if (arg == "-d" || arg == "--disable-client-executables")
 			disableClientExecutables = true;
+		else if (parseOption(arg, "", "--cache-directory", "[directory]", i, deferredArgc, deferredArgs, cacheDirectory) ||
+				parseOption(arg, "", "--cache-size", "[MiB]", i, deferredArgc, deferredArgs, cacheSize))
+			; // Option recognized and parsed
 		else if (parseOption(arg, "-e", "--executable-directory", "[directory]", i, deferredArgc, deferredArgs, directory))
 			directory += '/';
+		else if (arg == "--event-loop")
+			eventLoop = true;
 		else if (arg == "-i" || arg == "--ignore-invalid-arguments")
 			ignoreInvalidArguments = true;
 		else if (arg == "-k" || arg == "--keep-client-executables")
 			keepClientExecutables = true;
 		else if (arg == "-l" || arg == "--generate-local-executables")
 			generateLocalExecutables = true;
-		else if (parseOption(arg, "-m", "--max-connections", "[connections]", i, deferredArgc, deferredArgs, connections) ||
+		else if (parseOption(arg, "", "--listeners", "[count]", i, deferredArgc, deferredArgs, listeners) ||
+				parseOption(arg, "-m", "--max-connections", "[connections]", i, deferredArgc, deferredArgs, connections) ||
+				parseOption(arg, "", "--max-processes", "[count]", i, deferredArgc, deferredArgs, maxProcesses) ||
+				parseOption(arg, "", "--max-workers", "[count]", i, deferredArgc, deferredArgs, maxWorkers) ||
+				parseOption(arg, "", "--metrics-port", "[port]", i, deferredArgc, deferredArgs, metricsPort) ||
+				parseOption(arg, "", "--output-delay", "[us]", i, deferredArgc, deferredArgs, outputDelay) ||
 				parseOption(arg, "-p", "--pidfile", "[file]", i, deferredArgc, deferredArgs, pidFilename) ||
-				parseOption(arg, "-t", "--timeout", "[ms]", i, deferredArgc, deferredArgs, timeout))
+				parseOption(arg, "-t", "--timeout", "[ms]", i, deferredArgc, deferredArgs, timeout) ||
+				parseOption(arg, "", "--workers", "[count]", i, deferredArgc, deferredArgs, workers))
 			; // Option recognized and parsed
 		else if (arg == "-o" || arg == "--overwrite-client-executables")
 			overwriteClientExecutables = true;
@@ -423,6 +1074,28 @@ static void mainServer(int argc, const char *argv[])
 			deferredArgc = deferredArgs.size();
 	}
 
+	// Create the listener (after the deferred arguments, since the port can only be shared by other listeners if the first listener shares it)
+	if (serverCommands && !serverCommands->empty())
+	{
+		try { listenerCount = std::stoll(listeners); }
+		catch (const std::exception &e) { LOG_ERROR << "Failed to parse listeners (" << listeners << "): " << e.what(); }
+
+		if (listenerCount < 0)
+			LOG_ERROR << "Expecting a non-negative number of listeners, but found " << listeners;
+		else if (listenerCount == 0)
+		{
+			listenerCount = k8psh::Utilities::getCpuQuota();
+
+			if (!listenerCount)
+				listenerCount = std::thread::hardware_concurrency() ? (long long)std::thread::hardware_concurrency() : 1;
+		}
+
+		if (!socketPath.empty() && listenerCount > 1)
+			LOG_ERROR << "Multiple listeners not supported with a Unix domain socket";
+
+		listener = socketPath.empty() ? k8psh::Socket::listen(port, bindAddress, listenerCount > 1) : k8psh::Socket::listen(socketPath);
+	}
+
 	// Generate the appropriate client symlinks / executables
 	std::string clientCommand = k8psh::Utilities::getExecutablePath();
 	const auto commands = configuration.getCommands();
@@ -453,6 +1126,14 @@ static void mainServer(int argc, const char *argv[])
 			}
 		}
 
+		// Remove Unix domain socket
+		if (!socketPath.empty() && !k8psh::Utilities::deleteFile(socketPath))
+			LOG_WARNING << "Failed to remove socket " << socketPath;
+
+		// Remove ready file
+		if (!readyPath.empty() && !k8psh::Utilities::deleteFile(readyPath))
+			LOG_WARNING << "Failed to remove ready file " << readyPath;
+
 #ifndef _WIN32
 		// Remove PID file
 		if (pidFile >= 0 && !k8psh::Utilities::deleteFile(pidFilename.c_str()))
@@ -493,6 +1174,20 @@ static void mainServer(int argc, const char *argv[])
 			createdExecutables.emplace_back(filename);
 		}
 
+		// Create the snapshot used by the client executables to find their command without parsing the configuration
+		if (!disableClientExecutables)
+		{
+			const std::string filename = directory + snapshotFilename;
+
+			if (!k8psh::Utilities::writeFile(filename, configuration.createSnapshot()))
+				LOG_WARNING << "Failed to create configuration snapshot " << filename;
+			else
+			{
+				LOG_DEBUG << "Created configuration snapshot " << filename;
+				createdExecutables.emplace_back(filename);
+			}
+		}
+
 		if (listener.isValid())
 		{
 			long long connectionCount = 0;
@@ -505,6 +1200,82 @@ static void mainServer(int argc, const char *argv[])
 			try { timeoutMs = std::stoll(timeout); }
 			catch (const std::exception &e) { LOG_ERROR << "Failed to parse timeout (" << timeout << "): " << e.what(); }
 
+			long long minWorkers = 0;
+			long long maxWorkerCount = 0;
+
+			try { minWorkers = std::stoll(workers); }
+			catch (const std::exception &e) { LOG_ERROR << "Failed to parse workers (" << workers << "): " << e.what(); }
+
+			try { maxWorkerCount = std::stoll(maxWorkers); }
+			catch (const std::exception &e) { LOG_ERROR << "Failed to parse max workers (" << maxWorkers << "): " << e.what(); }
+
+			long long maxProcessCount = 0;
+
+			if (maxProcesses.empty())
+				maxProcessCount = k8psh::Utilities::getCpuQuota();
+			else
+			{
+				try { maxProcessCount = std::stoll(maxProcesses); }
+				catch (const std::exception &e) { LOG_ERROR << "Failed to parse max processes (" << maxProcesses << "): " << e.what(); }
+
+				if (maxProcessCount < 0)
+					LOG_ERROR << "Expecting a non-negative number of max processes, but found " << maxProcesses;
+			}
+
+			long long metricsPortNumber = 0;
+
+			if (!metricsPort.empty())
+			{
+				try { metricsPortNumber = std::stoll(metricsPort); }
+				catch (const std::exception &e) { LOG_ERROR << "Failed to parse metrics port (" << metricsPort << "): " << e.what(); }
+
+				if (metricsPortNumber <= 0 || metricsPortNumber > 65535)
+					LOG_ERROR << "Expecting a metrics port from 1 to 65535, but found " << metricsPort;
+			}
+
+			std::chrono::microseconds outputDelayUs;
+
+			try { outputDelayUs = std::chrono::microseconds(std::stoll(outputDelay)); }
+			catch (const std::exception &e) { LOG_ERROR << "Failed to parse output delay (" << outputDelay << "): " << e.what(); }
+
+#ifdef _WIN32
+			if (minWorkers > 0 || maxWorkerCount >= 0)
+				LOG_ERROR << "Worker processes not supported";
+			else if (eventLoop)
+				LOG_ERROR << "Event loop not supported";
+#endif
+
+			if (eventLoop && minWorkers > 0)
+				LOG_ERROR << "Worker processes cannot be used with the event loop";
+			else if (listenerCount > 1 && minWorkers > 0)
+				LOG_ERROR << "Worker processes cannot be used with multiple listeners";
+
+			// Results are only cached if any commands use the cache
+			std::unique_ptr<k8psh::ResultCache> cache;
+
+			for (auto it = serverCommands->begin(); it != serverCommands->end() && !cache; ++it)
+			{
+				if (!it->second.shouldCache())
+					continue;
+
+#ifdef _WIN32
+				LOG_WARNING << "Result cache not supported, cached commands will always run";
+				break;
+#else
+				long long cacheSizeMiB = 0;
+
+				try { cacheSizeMiB = std::stoll(cacheSize); }
+				catch (const std::exception &e) { LOG_ERROR << "Failed to parse cache size (" << cacheSize << "): " << e.what(); }
+
+				if (cacheSizeMiB <= 0)
+					LOG_ERROR << "Expecting a positive cache size, but found " << cacheSize;
+
+				const std::string relativeDirectory = cacheDirectory.empty() ? ".k8psh-" + name + ".cache" : cacheDirectory;
+
+				cache.reset(new k8psh::ResultCache(k8psh::Utilities::isAbsolutePath(relativeDirectory) ? relativeDirectory : configuration.getBaseDirectory() + '/' + relativeDirectory, std::uint64_t(cacheSizeMiB) * 1024 * 1024));
+#endif
+			}
+
 			auto endTime = timeoutMs >= 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs) : std::chrono::steady_clock::time_point::max();
 
 			// Daemonize, if desired
@@ -568,6 +1339,10 @@ static void mainServer(int argc, const char *argv[])
 			}
 #endif
 
+			// The writer is started after daemonizing, so its thread runs in the server process (forked processes start their own writers)
+			if (asyncLogging)
+				k8psh::Logger::startAsyncWriter();
+
 			signal(SIGTERM, handleSignal);
 			signal(SIGINT, handleSignal);
 
@@ -575,25 +1350,67 @@ static void mainServer(int argc, const char *argv[])
 			(void)SetConsoleCtrlHandler(handleCtrlC, TRUE);
 #endif
 
+			// Signal waiting clients that the server is ready
+			if (!readyPath.empty() && !k8psh::Utilities::writeFile(readyPath, std::to_string(listener.getPort()) + '\n'))
+			{
+				LOG_WARNING << "Failed to create ready file " << readyPath;
+				readyPath.clear();
+			}
+
 			// Main loop
 #ifdef _WIN32
-			std::thread clientThread;
 			HANDLE waitSet[2];
 
 			waitSet[0] = exitRequested = CreateEventA(NULL, FALSE, FALSE, "ServerExit");
 			waitSet[1] = listener.createReadEvent();
 #else
-			struct pollfd pollSet[2] = { };
+			struct pollfd pollSet[3] = { };
+			k8psh::Pipe sessionExited; // Signaled by SIGCHLD once the server forks sessions
 
 			pollSet[0].fd = exitRequested.getOutput();
 			pollSet[0].events = POLLIN;
 
-			pollSet[1].fd = listener.createReadEvent();
+			pollSet[1].fd = sessionExited.getOutput();
 			pollSet[1].events = POLLIN;
+
+			pollSet[2].fd = listener.createReadEvent();
+			pollSet[2].events = POLLIN;
 #endif
 
+			// Sessions are counted and limited by all of the processes they are forked into, so the count and limits are created before any are forked
+			k8psh::Process::countActiveSessions();
+			k8psh::Process::limitProcesses(*serverCommands, maxProcessCount);
+
+			// The environment of each command is resolved once (before the persistent workers start using it), since only the variables provided by clients change between sessions
+			k8psh::Process::prepareEnvironments(*serverCommands);
+
+			// Persistent workers are also shared by the session processes, so they are started before any are forked (or by each listener process, if there are multiple listeners)
+			if (listenerCount == 1)
+				k8psh::Process::startPersistentWorkers(configuration.getBaseDirectory(), *serverCommands);
+
+			// Metrics are served by a separate thread, so the session loops are not affected
+			if (metricsPortNumber)
+			{
+				k8psh::Process::recordMetrics(*serverCommands);
+				metricsListener = k8psh::Socket::listen(static_cast<unsigned short>(metricsPortNumber), bindAddress);
+#ifndef _WIN32
+				(void)pthread_atfork(NULL, NULL, closeMetricsListener);
+#endif
+				std::thread(serveMetrics).detach();
+				LOG_DEBUG << "Serving metrics on port " << metricsListener.getPort();
+			}
+
 			LOG_DEBUG << "Entering server connection listener loop";
 
+#ifndef _WIN32
+			if (listenerCount > 1)
+				connectionCount = runListeners(listener, bindAddress, configuration, *serverCommands, outputDelayUs, cache.get(), listenerCount, maxConnections, endTime, waitOnClientConnections);
+			else if (eventLoop)
+				connectionCount = k8psh::Process::runEventLoop(configuration.getBaseDirectory(), *serverCommands, listener, outputDelayUs, maxConnections, endTime, exitRequested, waitOnClientConnections, cache.get());
+			else if (minWorkers > 0)
+				connectionCount = runWorkerPool(listener, configuration, *serverCommands, outputDelayUs, cache.get(), minWorkers, maxWorkerCount, maxConnections, timeoutMs, endTime);
+			else
+#endif
 			while (connectionCount < maxConnections || maxConnections < 0)
 			{
 				auto remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(endTime -
@@ -614,7 +1431,7 @@ static void mainServer(int argc, const char *argv[])
 				do pollResult = poll(pollSet, nfds_t(sizeof(pollSet) / sizeof(pollSet[0]) - (listener.isValid() ? 0 : 1)), timeoutMs >= 0 ? int(waitMs) : -1);
 				while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
 
-				if (pollResult < 0 || (pollSet[1].revents & POLLERR) != 0)
+				if (pollResult < 0 || (pollSet[2].revents & POLLERR) != 0)
 					LOG_ERROR << "Failed to poll for new clients: " << errno;
 				else if ((pollSet[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
 					break;
@@ -627,6 +1444,14 @@ static void mainServer(int argc, const char *argv[])
 						continue;
 				}
 
+#ifndef _WIN32
+				if ((pollSet[1].revents & POLLIN) != 0)
+					reapSessions(sessionExited);
+
+				if ((pollSet[2].revents & POLLIN) == 0)
+					continue;
+#endif
+
 				if (!listener.isValid())
 					continue;
 
@@ -638,21 +1463,38 @@ static void mainServer(int argc, const char *argv[])
 					LOG_DEBUG << "Accepted connection from new client";
 
 #ifdef _WIN32
-					clientThread = std::thread(std::bind([&](std::thread &chainedThread, k8psh::Socket &client)
 					{
-						k8psh::Process::run(configuration.getBaseDirectory(), *serverCommands, std::move(client));
+						std::lock_guard<std::mutex> lock(activeSessionMutex);
+						activeSessionCount++;
+					}
+
+					std::thread(std::bind([&](k8psh::Socket &client)
+					{
+						runSession(configuration, *serverCommands, std::move(client), outputDelayUs, cache.get());
+
+						std::lock_guard<std::mutex> lock(activeSessionMutex);
 
-						if (chainedThread.joinable())
-							chainedThread.join();
-					}, std::move(clientThread), std::move(client)));
+						if (--activeSessionCount == 0)
+							activeSessionFinished.notify_all();
+					}, std::move(client))).detach();
 #else
+					// Workers replaced by the server can only be used by the sessions forked after them
+					k8psh::Process::replacePersistentWorkers();
+
+					// Sessions are reaped by the server, so the process limits held by a killed session are released
+					if (sessionExitedHandle == k8psh::Pipe::INVALID_HANDLE)
+						watchSessionExits(sessionExited);
+
 					pid_t child = fork();
 
 					if (child == 0)
 					{
 						(void)close(listener.abandon());
 						signal(SIGCHLD, SIG_DFL);
-						k8psh::Process::run(configuration.getBaseDirectory(), *serverCommands, std::move(client));
+						exitRequested.closeInput();
+						sessionExited.closeInput();
+						sessionExited.closeOutput();
+						runSession(configuration, *serverCommands, std::move(client), outputDelayUs, cache.get());
 						std::exit(0);
 					}
 
@@ -673,15 +1515,17 @@ static void mainServer(int argc, const char *argv[])
 			else
 				LOG_DEBUG << "Shutting down the server, handled " << connectionCount << " connection(s)";
 
+			k8psh::Process::stopPersistentWorkers(); // The workers are child processes, so they must exit before all children are reaped
+
 #ifdef _WIN32
 			if (waitOnClientConnections && connectionCount)
 			{
 				LOG_DEBUG << "Waiting for all connections to terminate";
-				clientThread.join();
+
+				std::unique_lock<std::mutex> lock(activeSessionMutex);
+				activeSessionFinished.wait(lock, [] { return activeSessionCount == 0; });
 				LOG_DEBUG << "All connections terminated";
 			}
-			else if (connectionCount)
-				clientThread.detach();
 #else
 			if (waitOnClientConnections && connectionCount)
 			{
@@ -0,0 +1,187 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "Metrics.hxx"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
+
+#include "Utilities.hxx"
+
+// The upper bounds of the histogram buckets, in microseconds.
+static const std::uint64_t BUCKET_BOUNDS[k8psh::Metrics::BUCKET_COUNT] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+
+// The names of the histograms, after the k8psh_ prefix and without the _seconds suffix.
+static const char *const HISTOGRAM_NAMES[k8psh::Metrics::HISTOGRAM_COUNT] = { "handshake", "spawn", "first_output" };
+
+// The descriptions of the histograms.
+static const char *const HISTOGRAM_HELP[k8psh::Metrics::HISTOGRAM_COUNT] = {
+	"Time from accepting a connection to receiving the complete request.",
+	"Time taken to start a process.",
+	"Time from starting a process to relaying its first stdout or stderr data." };
+
+// The names of the streams, used as the stream label.
+static const char *const STREAM_NAMES[k8psh::Metrics::STREAM_COUNT] = { "stdin", "stdout", "stderr" };
+
+// Escapes a label value, so it can be placed in double quotes.
+static std::string escapeLabel(const std::string &value)
+{
+	std::string escaped;
+
+	for (std::size_t i = 0; i < value.length(); i++)
+	{
+		if (value[i] == '\n')
+			escaped += "\\n";
+		else if (value[i] == '\\' || value[i] == '"')
+			(escaped += '\\') += value[i];
+		else
+			escaped += value[i];
+	}
+
+	return escaped;
+}
+
+// Creates zeroed metrics for the specified commands, which are shared with all child processes forked after they are created.
+k8psh::Metrics::Metrics(const std::vector<std::string> &commandNames) : _commandNames(commandNames), _size(sizeof(State) + commandNames.size() * sizeof(CommandData)), _state(), _commands()
+{
+#ifdef _WIN32
+	// Sessions run on threads of the server process, so the metrics do not need to be shared between processes
+	void *memory = ::operator new(_size);
+#else
+	void *memory = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (memory == MAP_FAILED)
+		LOG_ERROR << "Failed to map shared metrics";
+#endif
+
+	_state = new (memory) State();
+	_commands = reinterpret_cast<CommandData *>(static_cast<char *>(memory) + sizeof(State));
+
+	for (std::size_t i = 0; i < commandNames.size(); i++)
+		(void)new (&_commands[i]) CommandData();
+}
+
+k8psh::Metrics::~Metrics()
+{
+	// The state and command data only contain atomic integers, which do not need to be destroyed
+#ifdef _WIN32
+	::operator delete(_state);
+#else
+	(void)munmap(_state, _size);
+#endif
+}
+
+// Finds the index of a command used to update its metrics, or UNKNOWN_COMMAND if it is not known.
+std::size_t k8psh::Metrics::findCommand(const std::string &name) const
+{
+	for (std::size_t i = 0; i < _commandNames.size(); i++)
+	{
+		if (_commandNames[i] == name)
+			return i;
+	}
+
+	return UNKNOWN_COMMAND;
+}
+
+/** Formats the metrics in the Prometheus text exposition format.
+ *
+ * @param gauges additional lines of the exposition (for values that are not kept by the metrics), which are appended
+ * @return the formatted metrics
+ */
+std::string k8psh::Metrics::format(const std::string &gauges) const
+{
+	std::string text = formatValue("k8psh_connections_total", "counter", "Connections (and multiplexed streams) accepted by the server.", std::to_string(_state->connections.load(std::memory_order_relaxed)));
+
+	for (std::size_t i = 0; i < HISTOGRAM_COUNT; i++)
+	{
+		const std::string name = std::string("k8psh_") + HISTOGRAM_NAMES[i] + "_seconds";
+		const HistogramData &histogram = _state->histograms[i];
+		std::uint64_t count = 0;
+
+		text.append("# HELP ").append(name).append(" ").append(HISTOGRAM_HELP[i]).append("\n");
+		text.append("# TYPE ").append(name).append(" histogram\n");
+
+		// The buckets are accumulated as they are formatted, and the total is the count
+		for (std::size_t j = 0; j <= BUCKET_COUNT; j++)
+		{
+			count += histogram.buckets[j].load(std::memory_order_relaxed);
+			text.append(name).append("_bucket{le=\"").append(j < BUCKET_COUNT ? formatSeconds(BUCKET_BOUNDS[j]) : "+Inf").append("\"} ").append(std::to_string(count)).append("\n");
+		}
+
+		text.append(name).append("_sum ").append(formatSeconds(histogram.sum.load(std::memory_order_relaxed))).append("\n");
+		text.append(name).append("_count ").append(std::to_string(count)).append("\n");
+	}
+
+	text.append("# HELP k8psh_stream_bytes_total Bytes relayed on the stdin, stdout, and stderr of processes.\n");
+	text.append("# TYPE k8psh_stream_bytes_total counter\n");
+
+	for (std::size_t i = 0; i < _commandNames.size(); i++)
+	{
+		for (std::size_t j = 0; j < STREAM_COUNT; j++)
+			text.append("k8psh_stream_bytes_total{command=\"").append(escapeLabel(_commandNames[i])).append("\",stream=\"").append(STREAM_NAMES[j]).append("\"} ").append(std::to_string(_commands[i].bytes[j].load(std::memory_order_relaxed))).append("\n");
+	}
+
+	text.append("# HELP k8psh_process_exits_total Processes that exited, by exit code (\"other\" if terminated by a signal).\n");
+	text.append("# TYPE k8psh_process_exits_total counter\n");
+
+	for (std::size_t i = 0; i < _commandNames.size(); i++)
+	{
+		for (int j = 0; j <= OTHER_EXIT_CODE; j++)
+		{
+			const std::uint64_t exits = _commands[i].exitCodes[j].load(std::memory_order_relaxed);
+
+			if (exits)
+				text.append("k8psh_process_exits_total{command=\"").append(escapeLabel(_commandNames[i])).append("\",code=\"").append(j < OTHER_EXIT_CODE ? std::to_string(j) : "other").append("\"} ").append(std::to_string(exits)).append("\n");
+		}
+	}
+
+	return text + gauges;
+}
+
+/** Formats a single value in the Prometheus text exposition format.
+ *
+ * @param name the name of the metric
+ * @param type the type of the metric (gauge or counter)
+ * @param help the description of the metric
+ * @param value the formatted value of the metric
+ * @return the formatted metric
+ */
+std::string k8psh::Metrics::formatValue(const std::string &name, const std::string &type, const std::string &help, const std::string &value)
+{
+	return "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n" + name + " " + value + "\n";
+}
+
+// Formats a number of microseconds as seconds.
+std::string k8psh::Metrics::formatSeconds(std::uint64_t microseconds)
+{
+	std::string fraction = std::to_string(microseconds % 1000000);
+
+	// Trailing zeros of the fraction are removed, so the bucket bounds are formatted like "0.1" rather than "0.100000"
+	fraction.insert(0, 6 - fraction.length(), '0');
+	fraction.erase(fraction.find_last_not_of('0') + 1);
+	return std::to_string(microseconds / 1000000) + (fraction.empty() ? "" : "." + fraction);
+}
+
+// Adds a sample to a histogram.
+void k8psh::Metrics::observe(Histogram histogram, std::chrono::microseconds duration)
+{
+	const std::uint64_t microseconds = duration.count() > 0 ? std::uint64_t(duration.count()) : 0;
+	std::size_t bucket = 0;
+
+	while (bucket < BUCKET_COUNT && microseconds > BUCKET_BOUNDS[bucket])
+		bucket++;
+
+	HistogramData &data = _state->histograms[histogram];
+
+	(void)data.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	(void)data.sum.fetch_add(microseconds, std::memory_order_relaxed);
+}
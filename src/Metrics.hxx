@@ -0,0 +1,124 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_METRICS_HXX
+#define K8PSH_METRICS_HXX
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace k8psh {
+
+// The counters and latency histograms of a server, which are shared with all child processes forked after they are created (updates are lock-free, so they can be made on the relay path).
+class Metrics
+{
+	// Metrics cannot be copied
+	Metrics(const Metrics&);
+	Metrics &operator=(const Metrics&);
+
+public:
+	enum Histogram
+	{
+		HANDSHAKE_TIME = 0, // From accepting the connection to receiving the complete request
+		SPAWN_TIME,         // Starting the process
+		FIRST_OUTPUT_TIME,  // From starting the process to relaying its first stdout or stderr data
+		HISTOGRAM_COUNT
+	};
+
+	enum Stream
+	{
+		STDIN = 0,
+		STDOUT,
+		STDERR,
+		STREAM_COUNT
+	};
+
+	// The number of histogram buckets with an upper bound (the last bucket of each histogram is unbounded).
+	static constexpr std::size_t BUCKET_COUNT = 16;
+
+	// The exit code recorded for processes terminated by a signal (or with an exit code outside of 0 to 255).
+	static constexpr int OTHER_EXIT_CODE = 256;
+
+	// The index used for commands that are not known to the metrics (their updates are ignored).
+	static constexpr std::size_t UNKNOWN_COMMAND = std::size_t(-1);
+
+private:
+	struct HistogramData
+	{
+		std::atomic<std::uint64_t> buckets[BUCKET_COUNT + 1]; // Not cumulative, so each sample only updates one bucket
+		std::atomic<std::uint64_t> sum; // In microseconds
+	};
+
+	struct CommandData
+	{
+		std::atomic<std::uint64_t> bytes[STREAM_COUNT];
+		std::atomic<std::uint64_t> exitCodes[OTHER_EXIT_CODE + 1];
+	};
+
+	struct State
+	{
+		std::atomic<std::uint64_t> connections;
+		HistogramData histograms[HISTOGRAM_COUNT];
+	};
+
+	std::vector<std::string> _commandNames;
+	std::size_t _size;
+	State *_state;
+	CommandData *_commands; // Follows the state, one for each command name
+
+public:
+	// Creates zeroed metrics for the specified commands, which are shared with all child processes forked after they are created.
+	Metrics(const std::vector<std::string> &commandNames);
+	~Metrics();
+
+	// Adds bytes relayed on a stream of a command.
+	void addBytes(std::size_t command, Stream stream, std::uint64_t length)
+	{
+		if (command != UNKNOWN_COMMAND)
+			(void)_commands[command].bytes[stream].fetch_add(length, std::memory_order_relaxed);
+	}
+
+	// Counts an accepted connection.
+	void addConnection() { (void)_state->connections.fetch_add(1, std::memory_order_relaxed); }
+
+	// Counts a process of a command that exited with the specified exit code (or OTHER_EXIT_CODE).
+	void addExit(std::size_t command, int exitCode)
+	{
+		if (command != UNKNOWN_COMMAND)
+			(void)_commands[command].exitCodes[exitCode >= 0 && exitCode < OTHER_EXIT_CODE ? exitCode : OTHER_EXIT_CODE].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Finds the index of a command used to update its metrics, or UNKNOWN_COMMAND if it is not known.
+	std::size_t findCommand(const std::string &name) const;
+
+	/** Formats the metrics in the Prometheus text exposition format.
+	 *
+	 * @param gauges additional lines of the exposition (for values that are not kept by the metrics), which are appended
+	 * @return the formatted metrics
+	 */
+	std::string format(const std::string &gauges = std::string()) const;
+
+	/** Formats a single value in the Prometheus text exposition format.
+	 *
+	 * @param name the name of the metric
+	 * @param type the type of the metric (gauge or counter)
+	 * @param help the description of the metric
+	 * @param value the formatted value of the metric
+	 * @return the formatted metric
+	 */
+	static std::string formatValue(const std::string &name, const std::string &type, const std::string &help, const std::string &value);
+
+	// Formats a number of microseconds as seconds.
+	static std::string formatSeconds(std::uint64_t microseconds);
+
+	// Adds a sample to a histogram.
+	void observe(Histogram histogram, std::chrono::microseconds duration);
+};
+
+} // k8psh
+
+#endif // K8PSH_METRICS_HXX
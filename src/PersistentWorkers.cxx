@@ -0,0 +1,566 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "PersistentWorkers.hxx"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+	#include <cerrno>
+	#include <csignal>
+
+	#include <sys/mman.h>
+	#include <unistd.h>
+
+	#ifdef __APPLE__
+		#include <crt_externs.h>
+
+		#define environ (*_NSGetEnviron())
+	#endif
+#endif
+
+const char *const k8psh::PersistentWorkers::WORKER_ARGUMENT = "--persistent_worker";
+
+// Skips any whitespace in a JSON value.
+static void skipJsonWhitespace(const std::string &json, std::size_t &i)
+{
+	while (i < json.length() && (json[i] == ' ' || json[i] == '\t' || json[i] == '\n' || json[i] == '\r'))
+		i++;
+}
+
+// Parses 4 hexadecimal digits of a JSON escape sequence, returning false if they are invalid.
+static bool parseJsonHex(const std::string &json, std::size_t &i, unsigned &value)
+{
+	value = 0;
+
+	for (std::size_t end = i + 4; i < end; i++)
+	{
+		const char c = i < json.length() ? json[i] : '\0';
+
+		if (c >= '0' && c <= '9')
+			value = value * 16 + unsigned(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			value = value * 16 + unsigned(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			value = value * 16 + unsigned(c - 'A' + 10);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+// Parses a JSON string, which starts at the opening quote, returning false if it is invalid.
+static bool parseJsonString(const std::string &json, std::size_t &i, std::string &value)
+{
+	if (i >= json.length() || json[i] != '"')
+		return false;
+
+	for (i++; i < json.length(); i++)
+	{
+		char c = json[i];
+
+		if (c == '"')
+		{
+			i++;
+			return true;
+		}
+		else if (c != '\\')
+		{
+			value += c;
+			continue;
+		}
+		else if (++i == json.length())
+			return false;
+
+		switch (c = json[i])
+		{
+		case 'b': value += '\b'; break;
+		case 'f': value += '\f'; break;
+		case 'n': value += '\n'; break;
+		case 'r': value += '\r'; break;
+		case 't': value += '\t'; break;
+		case '"': case '\\': case '/': value += c; break;
+
+		case 'u':
+			{
+				unsigned codePoint;
+
+				if (!parseJsonHex(json, ++i, codePoint))
+					return false;
+
+				// Characters outside the basic multilingual plane are encoded as surrogate pairs
+				if (codePoint >= 0xD800 && codePoint < 0xDC00)
+				{
+					unsigned low;
+
+					if (json.compare(i, 2, "\\u") != 0 || !parseJsonHex(json, i += 2, low) || low < 0xDC00 || low >= 0xE000)
+						return false;
+
+					codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+				}
+
+				// Encode the character as UTF-8
+				if (codePoint < 0x80)
+					value += char(codePoint);
+				else if (codePoint < 0x800)
+					(value += char(0xC0 | (codePoint >> 6))) += char(0x80 | (codePoint & 0x3F));
+				else if (codePoint < 0x10000)
+					((value += char(0xE0 | (codePoint >> 12))) += char(0x80 | ((codePoint >> 6) & 0x3F))) += char(0x80 | (codePoint & 0x3F));
+				else
+					(((value += char(0xF0 | (codePoint >> 18))) += char(0x80 | ((codePoint >> 12) & 0x3F))) += char(0x80 | ((codePoint >> 6) & 0x3F))) += char(0x80 | (codePoint & 0x3F));
+
+				i--; // The loop moves past the last digit
+				break;
+			}
+
+		default:
+			return false;
+		}
+	}
+
+	return false;
+}
+
+// Skips a JSON value of any type, returning false if it is invalid.
+static bool skipJsonValue(const std::string &json, std::size_t &i)
+{
+	if (i >= json.length())
+		return false;
+
+	const char c = json[i];
+
+	if (c == '"')
+	{
+		std::string value;
+		return parseJsonString(json, i, value);
+	}
+	else if (c == '[' || c == '{')
+	{
+		const char close = c == '[' ? ']' : '}';
+
+		skipJsonWhitespace(json, ++i);
+
+		if (i < json.length() && json[i] == close)
+		{
+			i++;
+			return true;
+		}
+
+		for (;;)
+		{
+			std::string key;
+
+			if (close == '}' && (!parseJsonString(json, i, key) || (skipJsonWhitespace(json, i), i >= json.length() || json[i++] != ':')))
+				return false;
+
+			skipJsonWhitespace(json, i);
+
+			if (!skipJsonValue(json, i))
+				return false;
+
+			skipJsonWhitespace(json, i);
+
+			if (i < json.length() && json[i] == close)
+			{
+				i++;
+				return true;
+			}
+			else if (i >= json.length() || json[i++] != ',')
+				return false;
+
+			skipJsonWhitespace(json, i);
+		}
+	}
+
+	// Numbers and literals are skipped up to the next delimiter
+	const std::size_t start = i;
+
+	while (i < json.length() && json[i] != ',' && json[i] != ']' && json[i] != '}' && json[i] != ' ' && json[i] != '\t' && json[i] != '\n' && json[i] != '\r')
+		i++;
+
+	return i != start;
+}
+
+// Starts the process of a worker, returning false if it could not be started.
+bool k8psh::PersistentWorkers::start(Worker &worker)
+{
+#ifdef _WIN32
+	(void)worker;
+	LOG_ERROR << "Persistent workers not supported";
+#else
+	std::unique_ptr<Pipe> requests(new Pipe());
+	std::unique_ptr<Pipe> responses(new Pipe());
+	std::vector<const char *> argv;
+	std::vector<const char *> env;
+
+	for (auto it = worker.arguments.begin(); it != worker.arguments.end(); ++it)
+		argv.push_back(it->c_str());
+
+	argv.push_back(NULL);
+
+	for (auto it = worker.environment.begin(); it != worker.environment.end(); ++it)
+		env.push_back(it->c_str());
+
+	env.push_back(NULL);
+
+	const pid_t process = fork();
+
+	if (process == 0)
+	{
+		try
+		{
+			requests->closeInput();
+			responses->closeOutput();
+
+			// Ignored signals are inherited, so restore SIGPIPE and SIGCHLD (ignored by the server) to the default
+			signal(SIGPIPE, SIG_DFL);
+			signal(SIGCHLD, SIG_DFL);
+
+			if (!worker.directory.empty() && !k8psh::Utilities::changeWorkingDirectory(worker.directory))
+				LOG_ERROR << "Failed to change directory to " << worker.directory;
+
+			// The worker writes its diagnostics to stderr, which is shared with the server
+			if (!requests->remapOutput(STDIN_FILENO) || !responses->remapInput(STDOUT_FILENO))
+				LOG_ERROR << "Failed to map stdin and stdout";
+
+			environ = const_cast<char **>(env.data());
+
+			// First, try the working directory (this provides compatibility across different platforms), then try the search path
+			(void)execv(argv[0], (char * const *)argv.data());
+			(void)execvp(argv[0], (char * const *)argv.data());
+
+			LOG_ERROR << "Failed to start " << worker.arguments[0] << ": error " << errno;
+		}
+		catch (...)
+		{
+			std::_Exit(127); // Never return to the server from the child process
+		}
+	}
+	else if (process == -1)
+	{
+		LOG_WARNING << "Failed to fork persistent worker for command " << worker.commandName << ": " << errno;
+		return false;
+	}
+
+	requests->closeOutput();
+	responses->closeInput();
+	worker.requests = std::move(requests);
+	worker.responses = std::move(responses);
+	worker.process = process;
+	LOG_DEBUG << "Started persistent worker " << process << " for command " << worker.commandName;
+#endif
+
+	return true;
+}
+
+// Creates an empty pool that can hold up to the specified number of workers, which is shared with all child processes forked after it is created.
+k8psh::PersistentWorkers::PersistentWorkers(std::size_t capacity) : _states(), _capacity(capacity), _workers()
+{
+#ifdef _WIN32
+	// Sessions run on threads of the server process, so the states do not need to be shared between processes
+	_states = new SharedState[capacity ? capacity : 1];
+#else
+	void *memory = mmap(NULL, sizeof(SharedState) * (capacity ? capacity : 1), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (memory == MAP_FAILED)
+		LOG_ERROR << "Failed to map persistent worker states";
+
+	_states = static_cast<SharedState *>(memory);
+#endif
+
+	// Workers are retired until they are started
+	for (std::size_t i = 0; i < capacity; i++)
+	{
+		(void)new (&_states[i]) SharedState();
+		_states[i].state = RETIRED;
+		_states[i].generation = 0;
+		_states[i].requests = 0;
+		_states[i].retirements = 0;
+	}
+}
+
+k8psh::PersistentWorkers::~PersistentWorkers()
+{
+	// The processes are not stopped, since the pool is also destroyed by forked processes (workers exit once all handles to their stdin are closed)
+#ifdef _WIN32
+	delete[] _states;
+#else
+	(void)munmap(_states, sizeof(SharedState) * (_capacity ? _capacity : 1));
+#endif
+}
+
+/** Acquires an idle worker of a command, so its request can be sent.
+ *
+ * @param commandName the name of the command
+ * @param environment the environment of the session, which must match the environment of the worker
+ * @return the acquired worker, or negative if no matching worker is idle
+ */
+long long k8psh::PersistentWorkers::acquire(const std::string &commandName, const std::vector<std::string> &environment)
+{
+	for (std::size_t i = 0; i < _workers.size(); i++)
+	{
+		const Worker &worker = *_workers[i];
+		SharedState &state = _states[i];
+		long long idle = IDLE;
+
+		if (worker.commandName != commandName || worker.environment != environment || worker.generation != state.generation.load() || !state.state.compare_exchange_strong(idle, BUSY))
+			continue;
+
+		// The worker may have been replaced by a process this process cannot use after the generation was checked
+		if (worker.generation == state.generation.load())
+			return (long long)i;
+
+		state.state = IDLE;
+	}
+
+	return -1;
+}
+
+// Gets the number of times the workers have been retired, so processes forked before a worker was retired can tell that they cannot use its replacement.
+long long k8psh::PersistentWorkers::getRetirements() const
+{
+	long long retirements = 0;
+
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		retirements += _states[i].retirements.load();
+
+	return retirements;
+}
+
+/** Adds workers for a command to the pool and starts them.
+ *
+ * @param commandName the name of the command
+ * @param executable the executable of the command and its arguments (WORKER_ARGUMENT is added after them)
+ * @param environment the environment of the workers
+ * @param directory the working directory of the workers, or empty to use the working directory of the pool
+ * @param workers the number of workers to add
+ * @param maxRequests the number of requests each worker runs before it is replaced, or zero if workers are only replaced once they fail
+ */
+void k8psh::PersistentWorkers::add(const std::string &commandName, const std::vector<std::string> &executable, const std::vector<std::string> &environment, const std::string &directory, long long workers, long long maxRequests)
+{
+	for (long long i = 0; i < workers; i++)
+	{
+		if (_workers.size() == _capacity)
+			LOG_ERROR << "Failed to add persistent worker for command " << commandName << ", pool is full";
+
+		std::unique_ptr<Worker> worker(new Worker());
+
+		worker->commandName = commandName;
+		worker->arguments = executable;
+		worker->arguments.push_back(WORKER_ARGUMENT);
+		worker->environment = environment;
+		worker->directory = directory;
+		worker->maxRequests = maxRequests;
+
+		// Workers that fail to start are retried when the retired workers are replaced
+		if (start(*worker))
+			_states[_workers.size()].state = IDLE;
+
+		_workers.push_back(std::move(worker));
+	}
+}
+
+/** Formats a request, which is sent to a worker as a single line.
+ *
+ * @param arguments the arguments of the request
+ * @param sandboxDirectory the directory the request runs in, relative to the working directory of the worker, or empty if it runs in the working directory of the worker
+ * @return the request, which ends with a newline
+ */
+std::string k8psh::PersistentWorkers::formatRequest(const std::vector<std::string> &arguments, const std::string &sandboxDirectory)
+{
+	std::string request = "{\"arguments\":[";
+
+	for (auto it = arguments.begin(); it != arguments.end(); ++it)
+		request.append(it == arguments.begin() ? "\"" : ",\"").append(Utilities::escapeJson(*it)).append("\"");
+
+	request.append("],\"requestId\":0");
+
+	if (!sandboxDirectory.empty())
+		request.append(",\"sandboxDir\":\"").append(Utilities::escapeJson(sandboxDirectory)).append("\"");
+
+	return request.append("}\n");
+}
+
+/** Parses a response written by a worker.
+ *
+ * @param response the response, without the trailing newline
+ * @param exitCode set to the exit code of the request (zero if the response does not include one)
+ * @param output set to the output of the request
+ * @return true if the response is valid, otherwise false
+ */
+bool k8psh::PersistentWorkers::parseResponse(const std::string &response, int &exitCode, std::string &output)
+{
+	std::size_t i = 0;
+
+	exitCode = 0;
+	output.clear();
+	skipJsonWhitespace(response, i);
+
+	if (i >= response.length() || response[i++] != '{')
+		return false;
+
+	skipJsonWhitespace(response, i);
+
+	if (i < response.length() && response[i] == '}')
+		i++;
+	else
+	{
+		for (bool more = true; more; )
+		{
+			std::string key;
+
+			skipJsonWhitespace(response, i);
+
+			if (!parseJsonString(response, i, key))
+				return false;
+
+			skipJsonWhitespace(response, i);
+
+			if (i >= response.length() || response[i++] != ':')
+				return false;
+
+			skipJsonWhitespace(response, i);
+
+			const std::size_t start = i;
+
+			if (!skipJsonValue(response, i))
+				return false;
+			else if (key == "output")
+			{
+				std::size_t j = start;
+
+				if (!parseJsonString(response, j, output))
+					return false;
+			}
+			else if (key == "exitCode")
+			{
+				const std::string value = response.substr(start, i - start);
+				std::size_t end = 0;
+
+				try { exitCode = std::stoi(value, &end); }
+				catch (const std::exception &) { return false; }
+
+				if (end != value.length())
+					return false;
+			}
+
+			skipJsonWhitespace(response, i);
+
+			if (i >= response.length())
+				return false;
+
+			more = response[i] == ',';
+
+			if (response[i++] != (more ? ',' : '}'))
+				return false;
+		}
+	}
+
+	skipJsonWhitespace(response, i);
+	return i == response.length();
+}
+
+/** Receives the available response data of an acquired worker.
+ *
+ * @param worker the acquired worker
+ * @param buffer the buffer used to read the data
+ * @param response the response, which the data is appended to
+ * @return false if the worker exited, otherwise true
+ */
+bool k8psh::PersistentWorkers::receive(long long worker, std::string &buffer, std::string &response)
+{
+	const std::size_t received = _workers[std::size_t(worker)]->responses->read(buffer);
+
+	response.append(buffer.data(), received);
+	return received != 0;
+}
+
+/** Releases an acquired worker, so it can run the requests of other sessions.
+ *
+ * @param worker the acquired worker
+ * @param failed true if the worker failed, so it must be replaced rather than reused
+ */
+void k8psh::PersistentWorkers::release(long long worker, bool failed)
+{
+	const Worker &acquired = *_workers[std::size_t(worker)];
+	SharedState &state = _states[std::size_t(worker)];
+	const long long requests = state.requests.fetch_add(1) + 1;
+
+	if (failed)
+		LOG_WARNING << "Persistent worker " << acquired.process << " for command " << acquired.commandName << " failed, retiring it";
+	else if (acquired.maxRequests && requests >= acquired.maxRequests)
+		LOG_DEBUG << "Persistent worker " << acquired.process << " for command " << acquired.commandName << " ran " << requests << " requests, retiring it";
+	else
+	{
+		state.state = IDLE;
+		return;
+	}
+
+	// The worker is counted once it is retired, so processes that notice the count also find it retired
+	state.state = RETIRED;
+	(void)state.retirements.fetch_add(1);
+}
+
+/** Replaces the workers that failed or ran the maximum number of requests, stopping their processes. (The workers can only be replaced by the process that started them.)
+ *
+ * @return the processes that were stopped, which must be reaped
+ */
+std::vector<long long> k8psh::PersistentWorkers::replaceRetired()
+{
+	std::vector<long long> stopped;
+
+#ifndef _WIN32
+	for (std::size_t i = 0; i < _workers.size(); i++)
+	{
+		Worker &worker = *_workers[i];
+		SharedState &state = _states[i];
+
+		if (state.state.load() != RETIRED)
+			continue;
+
+		if (worker.process > 0)
+		{
+			(void)kill(pid_t(worker.process), SIGTERM);
+			stopped.push_back(worker.process);
+			worker.process = -1;
+		}
+
+		worker.requests.reset();
+		worker.responses.reset();
+
+		if (!start(worker))
+			continue;
+
+		state.requests = 0;
+		state.generation = ++worker.generation;
+		state.state = IDLE;
+	}
+#endif
+
+	return stopped;
+}
+
+/** Sends a request to an acquired worker.
+ *
+ * @param worker the acquired worker
+ * @param request the request formatted by formatRequest()
+ * @return true if the request was sent, otherwise false if the worker exited
+ */
+bool k8psh::PersistentWorkers::send(long long worker, const std::string &request)
+{
+	Pipe &requests = *_workers[std::size_t(worker)]->requests;
+	std::size_t written = 0;
+
+	while (written < request.length() && requests.getInput() != Pipe::INVALID_HANDLE)
+		written += requests.write(request.data() + written, request.length() - written);
+
+	return written == request.length();
+}
@@ -0,0 +1,154 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_PERSISTENT_WORKERS_HXX
+#define K8PSH_PERSISTENT_WORKERS_HXX
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Utilities.hxx"
+
+namespace k8psh {
+
+/**
+ * A pool of long-running worker processes that each run many requests of a command, so commands with a slow startup (like a JVM) only start once.
+ * Workers are started with WORKER_ARGUMENT and speak the JSON form of the Bazel persistent worker protocol, reading one request per line on stdin and writing one response per line on stdout.
+ * The workers and their states are shared with the session processes forked after the workers are started, but only the process that started the workers can replace them.
+ */
+class PersistentWorkers
+{
+	// Pools cannot be copied
+	PersistentWorkers(const PersistentWorkers&);
+	PersistentWorkers &operator=(const PersistentWorkers&);
+
+public:
+	// The argument added to the executable of each worker, so the command knows to read requests rather than run once.
+	static const char *const WORKER_ARGUMENT;
+
+private:
+	enum State
+	{
+		IDLE = 0, // Waiting for a request
+		BUSY,     // Running the request of a session
+		RETIRED   // Waiting to be replaced, since it failed or ran the maximum number of requests
+	};
+
+	// The state of a worker, which is shared by all processes using the pool
+	struct SharedState
+	{
+		std::atomic<long long> state;
+		std::atomic<long long> generation; // Incremented each time the worker is replaced
+		std::atomic<long long> requests;
+		std::atomic<long long> retirements; // Incremented each time the worker is retired after it was started
+	};
+
+	struct Worker
+	{
+		std::string commandName;
+		std::vector<std::string> arguments;
+		std::vector<std::string> environment;
+		std::string directory;
+		long long maxRequests;
+		long long generation; // The generation known by this process (the handles are only valid while it matches the shared generation)
+		long long process;
+		std::unique_ptr<Pipe> requests;  // Read by the worker as stdin
+		std::unique_ptr<Pipe> responses; // Written by the worker as stdout
+
+		Worker() : commandName(), arguments(), environment(), directory(), maxRequests(), generation(), process(-1), requests(), responses() { }
+	};
+
+	SharedState *_states;
+	std::size_t _capacity;
+	std::vector<std::unique_ptr<Worker>> _workers;
+
+	// Starts the process of a worker, returning false if it could not be started.
+	static bool start(Worker &worker);
+
+public:
+	// Creates an empty pool that can hold up to the specified number of workers, which is shared with all child processes forked after it is created.
+	PersistentWorkers(std::size_t capacity);
+	~PersistentWorkers();
+
+	/** Acquires an idle worker of a command, so its request can be sent.
+	 *
+	 * @param commandName the name of the command
+	 * @param environment the environment of the session, which must match the environment of the worker
+	 * @return the acquired worker, or negative if no matching worker is idle
+	 */
+	long long acquire(const std::string &commandName, const std::vector<std::string> &environment);
+
+	/** Adds workers for a command to the pool and starts them.
+	 *
+	 * @param commandName the name of the command
+	 * @param executable the executable of the command and its arguments (WORKER_ARGUMENT is added after them)
+	 * @param environment the environment of the workers
+	 * @param directory the working directory of the workers, or empty to use the working directory of the pool
+	 * @param workers the number of workers to add
+	 * @param maxRequests the number of requests each worker runs before it is replaced, or zero if workers are only replaced once they fail
+	 */
+	void add(const std::string &commandName, const std::vector<std::string> &executable, const std::vector<std::string> &environment, const std::string &directory, long long workers, long long maxRequests);
+
+	// Gets the number of times the workers have been retired, so processes forked before a worker was retired can tell that they cannot use its replacement.
+	long long getRetirements() const;
+
+	/** Formats a request, which is sent to a worker as a single line.
+	 *
+	 * @param arguments the arguments of the request
+	 * @param sandboxDirectory the directory the request runs in, relative to the working directory of the worker, or empty if it runs in the working directory of the worker
+	 * @return the request, which ends with a newline
+	 */
+	static std::string formatRequest(const std::vector<std::string> &arguments, const std::string &sandboxDirectory);
+
+	// Gets the working directory of a worker.
+	const std::string &getDirectory(long long worker) const { return _workers[std::size_t(worker)]->directory; }
+
+	// Gets the handle that becomes readable once an acquired worker writes its response.
+	Pipe::Handle getResponseHandle(long long worker) const { return _workers[std::size_t(worker)]->responses->getOutput(); }
+
+	/** Parses a response written by a worker.
+	 *
+	 * @param response the response, without the trailing newline
+	 * @param exitCode set to the exit code of the request (zero if the response does not include one)
+	 * @param output set to the output of the request
+	 * @return true if the response is valid, otherwise false
+	 */
+	static bool parseResponse(const std::string &response, int &exitCode, std::string &output);
+
+	/** Receives the available response data of an acquired worker.
+	 *
+	 * @param worker the acquired worker
+	 * @param buffer the buffer used to read the data
+	 * @param response the response, which the data is appended to
+	 * @return false if the worker exited, otherwise true
+	 */
+	bool receive(long long worker, std::string &buffer, std::string &response);
+
+	/** Releases an acquired worker, so it can run the requests of other sessions.
+	 *
+	 * @param worker the acquired worker
+	 * @param failed true if the worker failed, so it must be replaced rather than reused
+	 */
+	void release(long long worker, bool failed);
+
+	/** Replaces the workers that failed or ran the maximum number of requests, stopping their processes. (The workers can only be replaced by the process that started them.)
+	 *
+	 * @return the processes that were stopped, which must be reaped
+	 */
+	std::vector<long long> replaceRetired();
+
+	/** Sends a request to an acquired worker.
+	 *
+	 * @param worker the acquired worker
+	 * @param request the request formatted by formatRequest()
+	 * @return true if the request was sent, otherwise false if the worker exited
+	 */
+	bool send(long long worker, const std::string &request);
+};
+
+} // k8psh
+
+#endif // K8PSH_PERSISTENT_WORKERS_HXX
@@ -3,18 +3,29 @@
 
 #include "Process.hxx"
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <functional>
 #include <ios>
 #include <iostream>
+#include <list>
+#include <memory>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "Compression.hxx"
+#include "Metrics.hxx"
+#include "PersistentWorkers.hxx"
+#include "ResultCache.hxx"
 #include "Socket.hxx"
+#include "Trace.hxx"
 #include "Utilities.hxx"
 
 #ifdef _WIN32
@@ -28,12 +39,27 @@
 	// Due to using events to poll for socket input on Windows (which are susceptible to race conditions), the socket must be checked for new data on the first pass
 	#define K8PSH_SKIP_FIRST_SOCKET_DATA_CHECK false
 #else
+	#include <cerrno>
+	#include <csignal>
 	#include <cstdlib>
+	#include <list>
+	#include <set>
 
+	#include <fcntl.h>
 	#include <poll.h>
+	#include <sys/ioctl.h>
+	#include <sys/stat.h>
 	#include <sys/wait.h>
 	#include <unistd.h>
 
+	#ifdef __linux__
+		#include <sys/syscall.h>
+	#endif
+
+	#ifdef K8PSH_HAVE_POSIX_SPAWN_ADDCHDIR
+		#include <spawn.h>
+	#endif
+
 	#ifdef __APPLE__
 		#include <crt_externs.h>
 
@@ -44,86 +70,518 @@
 #endif
 
 /**
- * Payloads are 5 bytes: 1-byte payload type, and if strings (4 byte little-endian length prefixed), exit code (4 byte little-endian signed int), or 4 byte zeros
+ * Payloads are 5 bytes: 1-byte payload type, and if strings (4 byte little-endian length prefixed), exit code (4 byte little-endian signed int), credit (4 byte little-endian byte count), or 4 byte zeros
  */
 enum PayloadType {
-	WORKING_DIRECTORY = 0, // string, client -> server
-	ENVIRONMENT_VARIABLE,  // string, client -> server
-	COMMAND_ARGUMENT,      // string, client -> server
+	WORKING_DIRECTORY = 0,  // string, client -> server
+	ENVIRONMENT_VARIABLE,   // string, client -> server
+	COMMAND_ARGUMENT,       // string, client -> server
+
+	START_COMMAND,          // string - argv[0], client -> server (nothing above can be sent after this, nothing below can be sent before this)
+
+	STDIN_DATA,             // string, client <-> server (server to client always zeros and indicates close)
+	STDOUT_DATA,            // string, server -> client
+	STDERR_DATA,            // string, server -> client
+	TERMINATE_COMMAND,      // zeros, client -> server
+	EXIT_CODE,              // exit code, server -> client
+
+	STDIN_CREDIT,           // credit - stdin bytes written to the process, server -> client
+	OUTPUT_CREDIT,          // credit - stdout and stderr bytes written by the client, client -> server
+
+	AGENT_HOST,             // string - hostname, client -> agent (sent before everything above, the agent relays the rest of the connection to the host)
+	MULTIPLEX,              // zeros, agent -> server (sent first, the connection then only carries STREAM_DATA)
+	STREAM_DATA,            // string - 4 byte little-endian stream ID followed by part of the stream, agent <-> server (a stream ID without data indicates the sender closed the stream)
+
+	STDIO_HANDLES,          // zeros, client -> server (sent before START_COMMAND with stdin, stdout, and stderr attached over a Unix domain socket, the process then uses them directly and no stdio data is relayed)
+	STATUS_QUERY,           // zeros, client -> server (sent first, the server replies with STATUS_QUERY carrying the number of active sessions, the connection can then be used for a session)
+	TRACE_EVENTS,           // zeros or string, client <-> server (zeros sent before START_COMMAND to request a trace, the server then sends the phases of the session as a string immediately after EXIT_CODE)
+	COMPRESSION,            // zeros, client -> server (sent before START_COMMAND if the client decompresses output, the server may then send large stdout and stderr data compressed)
+	COMPRESSED_STDOUT_DATA, // string - 4 byte little-endian length of the data followed by the data compressed as an LZ4 block, server -> client (never empty, since only STDOUT_DATA closes stdout)
+	COMPRESSED_STDERR_DATA, // string - 4 byte little-endian length of the data followed by the data compressed as an LZ4 block, server -> client (never empty, since only STDERR_DATA closes stderr)
+	STDIN_FILE,             // string - 8 byte little-endian offset followed by the path of a file relative to the base directory, client -> server (sent before START_COMMAND instead of any stdin data, the process then reads stdin directly from the file)
+	SHARED_MEMORY           // zeros, client -> server (sent before START_COMMAND with the handles of a shared memory channel attached over a Unix domain socket, everything after START_COMMAND is then carried by the channel)
+};
+
+static const std::size_t DATA_BUFFER_SIZE = 1024 * 64;
+
+// Each side may only send as much stdin (or stdout and stderr) data as the other side has granted it credit for
+static const std::size_t STDIN_WINDOW_SIZE = 1024 * 256; // Also the size of the server stdin buffer
+static const std::size_t OUTPUT_WINDOW_SIZE = 1024 * 256;
+static const std::size_t CREDIT_WINDOW_DIVISOR = 4; // Credit is granted in pieces of at least this fraction of the window
+
+// Gets the number of sessions of the server that have started their processes, which is shared with the session processes forked after it is first used
+static k8psh::SharedCounter &getActiveSessions()
+{
+	static k8psh::SharedCounter activeSessions;
+	return activeSessions;
+}
+
+// Gets the metrics of the server, which are null unless the server records them (they are shared with the session processes forked after they are created)
+static std::unique_ptr<k8psh::Metrics> &getMetrics()
+{
+	static std::unique_ptr<k8psh::Metrics> metrics;
+	return metrics;
+}
+
+// Gets the persistent workers of the server, which are null unless a command of the server has them (they are shared with the session processes forked after they are started)
+static std::unique_ptr<k8psh::PersistentWorkers> &getPersistentWorkers()
+{
+	static std::unique_ptr<k8psh::PersistentWorkers> persistentWorkers;
+	return persistentWorkers;
+}
 
-	START_COMMAND,         // string - argv[0], client -> server (nothing above can be sent after this, nothing below can be sent before this)
+// The time between attempts of a queued session to start its process, when it cannot be woken once its turn comes (like sessions run on threads, which do not use a reactor)
+static const std::chrono::microseconds QUEUE_POLL_INTERVAL = std::chrono::milliseconds(5);
 
-	STDIN_DATA,            // string, client <-> server (server to client always zeros and indicates close)
-	STDOUT_DATA,           // string, server -> client
-	STDERR_DATA,           // string, server -> client
-	TERMINATE_COMMAND,     // zeros, client -> server
-	EXIT_CODE              // exit code, server -> client
+// The limits on the number of processes of the server, which are shared with the session processes forked after they are created
+struct ProcessLimits
+{
+	std::unique_ptr<k8psh::FifoSemaphore> host; // Limits the processes of all commands, if the host has a limit
+	std::unordered_map<std::string, std::unique_ptr<k8psh::FifoSemaphore>> commands; // Limits the processes of each command that has its own limit
+	k8psh::SharedCounter queuedSessions;
+	k8psh::SharedCounter queueWaitTime; // The total time in microseconds that sessions waited to start their processes
 };
 
-static const std::size_t DATA_BUFFER_SIZE = 1024 * 64;
+// Gets the limits on the number of processes of the server.
+static ProcessLimits &getProcessLimits()
+{
+	static ProcessLimits processLimits;
+	return processLimits;
+}
 
-#ifdef _WIN32
-class SynchronousData
+// A place held by a session in the queues of the process limits, which takes a slot in each queue in order (the command queue, then the host queue) until the process can be started
+class AdmissionTicket
 {
-	// Disable copying synchronous data
-	SynchronousData(const SynchronousData&);
+	// Tickets cannot be copied
+	AdmissionTicket(const AdmissionTicket&);
+	AdmissionTicket &operator=(const AdmissionTicket&);
+
+	k8psh::FifoSemaphore *_queues[2];
+	std::size_t _admitted; // The number of queues that have been acquired
+	long long _ticket; // The ticket in the next queue, or negative if the session has not joined it
+	long long _process; // The process that holds the slots, which are released by the server if it exits without releasing them
+	k8psh::Pipe::Handle _wakeHandle; // Readable (or signaled, on Windows) once the ticket may be able to take its slot, or invalid if the session must retry periodically
+	std::chrono::steady_clock::time_point _queuedTime;
+	bool _counted; // True if the session is included in the queued sessions
+
+	// Closes the wake handle of the ticket, after the ticket leaves its queue.
+	void closeWakeHandle()
+	{
+#ifdef _WIN32
+		if (_wakeHandle != k8psh::Pipe::INVALID_HANDLE)
+			(void)CloseHandle(_wakeHandle);
+#else
+		if (_wakeHandle != k8psh::Pipe::INVALID_HANDLE)
+			(void)close(_wakeHandle);
+#endif
+		_wakeHandle = k8psh::Pipe::INVALID_HANDLE;
+	}
 
 public:
-	std::string _buffer;
-	DWORD _length;
-	HANDLE _dataAvailable;
-	HANDLE _dataRead;
+	// Creates a ticket for a process of the specified command, without joining any queue.
+	AdmissionTicket(const std::string &commandName) : _queues(), _admitted(), _ticket(-1), _process(), _wakeHandle(k8psh::Pipe::INVALID_HANDLE), _queuedTime(), _counted()
+	{
+#ifdef _WIN32
+		_process = static_cast<long long>(GetCurrentProcessId());
+#else
+		_process = static_cast<long long>(getpid());
+#endif
 
-	SynchronousData(const std::string &name) : _dataAvailable(), _dataRead()
+		ProcessLimits &limits = getProcessLimits();
+		auto it = limits.commands.find(commandName);
+		std::size_t queues = 0;
+
+		if (it != limits.commands.end())
+			_queues[queues++] = it->second.get();
+
+		if (limits.host)
+			_queues[queues++] = limits.host.get();
+	}
+
+	~AdmissionTicket()
+	{
+		for (std::size_t i = 0; i < _admitted; i++)
+			(void)_queues[i]->release(_process);
+
+		if (_ticket >= 0)
+			_queues[_admitted]->cancel(_ticket);
+
+		closeWakeHandle();
+
+		if (_counted)
+			(void)getProcessLimits().queuedSessions.add(-1);
+	}
+
+	// Forgets the queues without leaving them, so a forked process does not affect the session.
+	void abandon()
 	{
-		_buffer.resize(DATA_BUFFER_SIZE - 1);
-		_dataAvailable = CreateEventA(NULL, FALSE, FALSE, (name + "Available").c_str());
+		closeWakeHandle();
+		_admitted = 0;
+		_ticket = -1;
+		_counted = false;
+	}
 
-		if (!_dataAvailable)
-			LOG_ERROR << "Failed to create " << (name + "Available") << " event: " << GetLastError();
+	// Gets the handle that becomes readable (or signaled, on Windows) once the session may be able to take its slot in the next queue, or invalid if the session must retry periodically.
+	k8psh::Pipe::Handle getWakeHandle() const { return _wakeHandle; }
 
-		_dataRead = CreateEventA(NULL, FALSE, FALSE, (name + "Read").c_str());
+	// Reads the signals of the wake handle, so it is only readable again once the session is woken again (events on Windows are reset by the wait).
+	void resetWakeHandle()
+	{
+#ifndef _WIN32
+		char signals[16];
 
-		if (!_dataRead)
-			LOG_ERROR << "Failed to create " << (name + "Read") << " event: " << GetLastError();
+		while (_wakeHandle >= 0 && read(_wakeHandle, signals, sizeof(signals)) > 0)
+			continue;
+#endif
 	}
 
-	~SynchronousData()
+	// Takes a slot in each remaining queue in order, returning true once all have been taken (otherwise the session waits for its turn).
+	bool tryAdmit()
 	{
-		(void)CloseHandle(_dataRead);
-		(void)CloseHandle(_dataAvailable);
+		for (; _admitted < sizeof(_queues) / sizeof(_queues[0]) && _queues[_admitted]; _admitted++, _ticket = -1, closeWakeHandle())
+		{
+			// The wake handle is created before the first attempt, so the session is woken if the slot is released after it
+			if (_ticket < 0 && (_ticket = _queues[_admitted]->enqueue(_process)) >= 0)
+				_wakeHandle = _queues[_admitted]->createWakeHandle(_ticket);
+
+			if (_ticket < 0 || !_queues[_admitted]->tryAcquire(_ticket, _process))
+			{
+				// A full queue is joined once it has room
+				if (!_counted)
+				{
+					LOG_DEBUG << "Process limit reached, queuing session";
+					(void)getProcessLimits().queuedSessions.add(1);
+					_queuedTime = std::chrono::steady_clock::now();
+					_counted = true;
+				}
+
+				return false;
+			}
+		}
+
+		if (_counted)
+		{
+			const auto waitTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _queuedTime);
+
+			LOG_DEBUG << "Session waited " << waitTime.count() << "us to start its process";
+			(void)getProcessLimits().queuedSessions.add(-1);
+			(void)getProcessLimits().queueWaitTime.add(waitTime.count());
+			_counted = false;
+		}
+
+		return true;
 	}
 };
 
-// Reads data from a handle
-static void readData(HANDLE handle, SynchronousData &data)
+#ifdef _WIN32
+// Reads a handle into two buffers, so one buffer is filled while the data in the other buffer is sent (reads complete through a completion port)
+class DoubleBufferedReader
 {
-	while (ReadFile(handle, &data._buffer[0], DWORD(data._buffer.length()), &data._length, NULL) != 0 && data._length > 0)
+	// Readers cannot be copied
+	DoubleBufferedReader(const DoubleBufferedReader&);
+	DoubleBufferedReader &operator=(const DoubleBufferedReader&);
+
+	struct Buffer
+	{
+		OVERLAPPED overlapped;
+		std::string data;
+		DWORD length;
+		bool pending;
+		bool complete;
+	};
+
+	HANDLE _handle;
+	k8psh::CompletionPort &_port;
+	ULONG_PTR _key;
+	Buffer _buffers[2];
+	std::size_t _next; // The buffer that is filled with the next data from the handle
+	bool _closed;
+	HANDLE _bufferConsumed; // Signals the reader thread that a buffer can be filled again, if the handle does not support overlapped I/O
+
+	// Reads a handle that does not support overlapped I/O (like a console), posting each filled buffer to the port
+	static void readThread(DoubleBufferedReader *reader)
+	{
+		for (std::size_t i = 0; WaitForSingleObject(reader->_bufferConsumed, INFINITE) == WAIT_OBJECT_0; i ^= 1)
+		{
+			Buffer &buffer = reader->_buffers[i];
+			DWORD length = 0;
+
+			if (ReadFile(reader->_handle, &buffer.data[0], DWORD(buffer.data.length()), &length, NULL) == 0)
+				length = 0;
+
+			reader->_port.post(reader->_key, length, &buffer.overlapped);
+
+			if (!length)
+				return;
+		}
+	}
+
+	// Starts filling a buffer
+	void read(Buffer &buffer)
 	{
-		LOG_DEBUG << "Read " << data._length << " bytes on handle " << handle;
-		SetEvent(data._dataAvailable);
+		buffer.complete = false;
+		buffer.pending = true;
 
-		// Wait until the buffer has been consumed before reading more data
-		if (WaitForSingleObject(data._dataRead, INFINITE) != WAIT_OBJECT_0)
+		if (_bufferConsumed)
+		{
+			(void)ReleaseSemaphore(_bufferConsumed, 1, NULL);
 			return;
+		}
+
+		// The completion is posted to the port even if the read completes immediately
+		if (ReadFile(_handle, &buffer.data[0], DWORD(buffer.data.length()), NULL, &buffer.overlapped) == 0 && GetLastError() != ERROR_IO_PENDING)
+		{
+			buffer.pending = false;
+			buffer.complete = true;
+			buffer.length = 0;
+		}
 	}
 
-	data._length = 0;
-	SetEvent(data._dataAvailable);
-}
+public:
+	/** Creates a reader that starts filling both buffers.
+	 *
+	 * @param handle the handle to read
+	 * @param overlapped true if the handle was opened for overlapped I/O, false to read the handle using a thread (which is never stopped, so the reader must live until the process exits)
+	 * @param port the completion port that receives the completions
+	 * @param key the key of the completions
+	 */
+	DoubleBufferedReader(HANDLE handle, bool overlapped, k8psh::CompletionPort &port, ULONG_PTR key) : _handle(handle), _port(port), _key(key), _buffers(), _next(), _closed(), _bufferConsumed()
+	{
+		for (std::size_t i = 0; i < sizeof(_buffers) / sizeof(_buffers[0]); i++)
+		{
+			_buffers[i].data.resize(DATA_BUFFER_SIZE - 1);
+			_buffers[i].overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL); // Used to wait for cancelled reads
+
+			if (!_buffers[i].overlapped.hEvent)
+				LOG_ERROR << "Failed to create read event: " << GetLastError();
+		}
+
+		if (overlapped)
+			port.associate(handle, key);
+		else
+		{
+			_bufferConsumed = CreateSemaphoreA(NULL, 0, 2, NULL);
+
+			if (!_bufferConsumed)
+				LOG_ERROR << "Failed to create reader semaphore: " << GetLastError();
+
+			std::thread(readThread, this).detach();
+		}
+
+		read(_buffers[0]);
+		read(_buffers[1]);
+	}
+
+	~DoubleBufferedReader()
+	{
+		// Pending reads must finish before their buffers are released
+		for (std::size_t i = 0; i < sizeof(_buffers) / sizeof(_buffers[0]); i++)
+		{
+			DWORD length;
+
+			if (!_bufferConsumed && _buffers[i].pending && (CancelIoEx(_handle, &_buffers[i].overlapped) != 0 || GetLastError() != ERROR_NOT_FOUND))
+				(void)GetOverlappedResult(_handle, &_buffers[i].overlapped, &length, TRUE);
+
+			(void)CloseHandle(_buffers[i].overlapped.hEvent);
+		}
+
+		if (_bufferConsumed)
+			(void)CloseHandle(_bufferConsumed);
+	}
+
+	/** Handles the completion of a read.
+	 *
+	 * @param completion the completion for the reader
+	 */
+	void complete(const k8psh::CompletionPort::Completion &completion)
+	{
+		for (std::size_t i = 0; i < sizeof(_buffers) / sizeof(_buffers[0]); i++)
+		{
+			if (completion.overlapped == &_buffers[i].overlapped)
+			{
+				_buffers[i].pending = false;
+				_buffers[i].complete = true;
+				_buffers[i].length = completion.succeeded ? completion.length : 0; // A broken pipe indicates the end of the data
+				LOG_DEBUG << "Read " << _buffers[i].length << " bytes on handle " << _handle;
+			}
+		}
+	}
+
+	/** Gets the next data read from the handle.
+	 *
+	 * @param length set to the number of bytes of data, which is zero at the end of the data
+	 * @return the data, or null if the next read has not completed
+	 */
+	const char *getData(std::size_t &length) const
+	{
+		const Buffer &buffer = _buffers[_next];
+
+		length = buffer.length;
+		return buffer.complete && !_closed ? buffer.data.data() : nullptr;
+	}
+
+	// Consumes the data returned by getData(), starting to fill the buffer again.
+	void consume()
+	{
+		Buffer &buffer = _buffers[_next];
+
+		if (!buffer.length)
+			_closed = true;
+		else
+		{
+			read(buffer);
+			_next ^= 1;
+		}
+	}
+
+	// Checks if all data has been consumed.
+	bool isClosed() const { return _closed; }
+};
 #endif
 
 static const std::size_t INITIAL_MTU_SIZE = 8192; // The loopback default MTU sizes are usually fairly large
+static const std::size_t COALESCE_SIZE = 1024 * 64; // Delayed payloads are sent once this much data is pending
+
+#ifdef __linux__
+static const std::size_t SPLICE_THRESHOLD = 1024 * 4; // Smaller payloads are cheaper to copy than to splice
+#endif
+
+static const std::size_t COMPRESSION_THRESHOLD = 1024 * 4; // Smaller payloads save too little to be worth compressing
+
+// Automatically sized buffers and pipes grow as data fills them, and shrink once data has not filled them for this long
+static const std::chrono::milliseconds AUTO_SIZE_IDLE_TIME = std::chrono::milliseconds(1000);
+
+#ifndef _WIN32
+static const std::size_t AUTO_PIPE_MIN_SIZE = 1024 * 64;   // The default capacity of pipes on Linux
+static const std::size_t AUTO_PIPE_MAX_SIZE = 1024 * 1024; // The default maximum capacity of pipes created by unprivileged processes on Linux
+#endif
+
+// The size of the buffers (or pipes) of a session, which grows as data fills them and shrinks once data has not filled them for a while if it is sized automatically (otherwise the size never changes)
+class AdaptiveSize
+{
+	std::size_t _size;
+	std::size_t _minSize;
+	std::size_t _maxSize;
+	bool _active; // True if data filled the buffers since the size last shrank
+	std::chrono::steady_clock::time_point _activeTime;
+
+public:
+	AdaptiveSize(std::size_t minSize, std::size_t maxSize) : _size(minSize), _minSize(minSize), _maxSize(maxSize), _active(), _activeTime() { }
+
+	// Gets the current size
+	std::size_t get() const { return _size; }
+
+	// Gets the maximum size
+	std::size_t getMax() const { return _maxSize; }
+
+	// Gets the time until the size shrinks, or a negative value if it will not shrink
+	std::chrono::microseconds getShrinkTimeout(std::chrono::steady_clock::time_point now) const
+	{
+		if (!_active)
+			return std::chrono::microseconds(-1);
+
+		auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(_activeTime + AUTO_SIZE_IDLE_TIME - now);
+		return timeout.count() > 0 ? timeout : std::chrono::microseconds();
+	}
+
+	// Grows the size up to the maximum after data filled the buffers, returning true if the size grew
+	bool grow()
+	{
+		keep();
+
+		if (_size >= _maxSize)
+			return false;
+
+		_size = _size < _maxSize / 2 ? _size * 2 : _maxSize;
+		return true;
+	}
+
+	// Checks if the size grows and shrinks with the data
+	bool isAutomatic() const { return _minSize != _maxSize; }
+
+	// Keeps the current size, since data still fills the buffers
+	void keep()
+	{
+		if (!isAutomatic())
+			return;
+
+		_active = true;
+		_activeTime = std::chrono::steady_clock::now();
+	}
+
+	// Shrinks the size to the minimum once data has not filled the buffers for a while, returning true if the buffers should shrink
+	bool shrink(std::chrono::steady_clock::time_point now)
+	{
+		if (!_active || now - _activeTime < AUTO_SIZE_IDLE_TIME)
+			return false;
+
+		_active = false;
+		_size = _minSize;
+		return true;
+	}
+};
+
+// Gets the size of the buffers used by the sessions of a host to relay data
+static AdaptiveSize getBufferSize(const k8psh::Configuration::Host &host)
+{
+	const std::size_t size = host.getBufferSize();
+
+	return size == k8psh::Configuration::Host::AUTO_SIZE ? AdaptiveSize(INITIAL_MTU_SIZE, DATA_BUFFER_SIZE) : AdaptiveSize(size, size);
+}
+
+#ifndef _WIN32
+// Gets the capacity of the pipes of the processes run by the sessions of a host (zero for the system default)
+static AdaptiveSize getPipeSize(const k8psh::Configuration::Host &host)
+{
+	const std::size_t size = host.getPipeSize();
+
+	return size == k8psh::Configuration::Host::AUTO_SIZE ? AdaptiveSize(AUTO_PIPE_MIN_SIZE, AUTO_PIPE_MAX_SIZE) : AdaptiveSize(size, size);
+}
+#endif
 
 class BufferedReceiveSocket
 {
 	k8psh::Socket &_socket;
 	std::vector<std::uint8_t> _data;
+	std::size_t _maxSize;
 	std::size_t _readOffset;
 	std::size_t _end;
+#ifndef _WIN32
+	std::vector<int> _handles;
+#endif
+
+	// Reads data from the socket into the buffer at the offset, keeping any handles received with the data
+	std::size_t receive(std::size_t offset)
+	{
+#ifdef _WIN32
+		return _socket.read(_data, offset);
+#else
+		return _socket.read(_data, offset, _handles);
+#endif
+	}
 
 public:
-	BufferedReceiveSocket(k8psh::Socket &socket) : _socket(socket), _data(INITIAL_MTU_SIZE), _readOffset(), _end() { }
+	BufferedReceiveSocket(k8psh::Socket &socket) : _socket(socket), _data(INITIAL_MTU_SIZE), _maxSize(DATA_BUFFER_SIZE), _readOffset(), _end() { }
+
+#ifndef _WIN32
+	~BufferedReceiveSocket()
+	{
+		for (auto it = _handles.begin(); it != _handles.end(); ++it)
+			(void)close(*it);
+	}
+
+	// Takes ownership of all handles received so far
+	std::vector<int> takeHandles()
+	{
+		std::vector<int> handles;
+
+		handles.swap(_handles);
+		return handles;
+	}
+#endif
+
+	// Gets the number of bytes in the buffer
+	std::size_t getBufferedSize() const { return _end - _readOffset; }
 
 	// Checks if the buffer has data
 	bool hasBufferedData() const { return _readOffset != _end; }
@@ -131,6 +589,22 @@ public:
 	// Checks if the socket has data
 	bool hasData() const { return hasBufferedData() || _socket.hasData(); }
 
+	// Checks if the buffer grew to receive large payloads
+	bool isGrown() const { return _data.size() > INITIAL_MTU_SIZE; }
+
+	// Sets the size the buffer can grow to
+	void setMaxSize(std::size_t size) { _maxSize = size > INITIAL_MTU_SIZE ? size : INITIAL_MTU_SIZE; }
+
+	// Shrinks a grown buffer to its initial size once it is empty, so idle sessions use less memory
+	void shrink()
+	{
+		if (isGrown() && !hasBufferedData())
+		{
+			std::vector<std::uint8_t>(INITIAL_MTU_SIZE).swap(_data);
+			_readOffset = _end = 0;
+		}
+	}
+
 	// Reads a payload type and value from the socket, returning true if the data was read and false if the socket is closed
 	bool read(PayloadType &type, std::uint32_t &value)
 	{
@@ -144,7 +618,7 @@ public:
 
 			do
 			{
-				std::size_t read = _socket.read(_data, _end);
+				std::size_t read = receive(_end);
 
 				if (!read)
 					return false;
@@ -153,35 +627,103 @@ public:
 			} while (_end < 5);
 		}
 
+		return readBuffered(type, value);
+	}
+
+	// Reads a payload type and value from the buffer without receiving more data, returning false if the buffer does not hold a complete header
+	bool readBuffered(PayloadType &type, std::uint32_t &value)
+	{
+		if (_end - _readOffset < 5)
+			return false;
+
 		type = PayloadType(_data[_readOffset++]);
 		value = std::uint32_t(_data[_readOffset]) + (std::uint32_t(_data[_readOffset + 1]) << 8) + (std::uint32_t(_data[_readOffset + 2]) << 16) + (std::uint32_t(_data[_readOffset + 3]) << 24);
 		_readOffset += 4;
 		return true;
 	}
 
-	// Reads a string from the socket
-	std::string readString(std::size_t length)
+	/** Reads payload data from the buffer without receiving more data, passing the data directly from the receive buffer to the consumer.
+	 *
+	 * @param length the maximum number of bytes to read
+	 * @param consumer the function called with the data (as a const char pointer and length), if any data is buffered
+	 * @return the number of bytes read, which may be less than the length if less data is buffered
+	 */
+	template <typename ConsumerT> std::size_t readBufferedData(std::size_t length, ConsumerT consumer)
 	{
-		std::string string;
-		string.reserve(length);
+		std::size_t available = _end - _readOffset < length ? _end - _readOffset : length;
+
+		if (available)
+			consumer(reinterpret_cast<const char *>(&_data[_readOffset]), available);
+
+		_readOffset += available;
+
+		if (_readOffset == _end)
+			_readOffset = _end = 0;
+
+		return available;
+	}
 
-		while (_end - _readOffset < length - string.length())
+	// Receives the data available on the socket (once the socket is readable) after any buffered data, returning false if the socket is closed
+	bool receiveAvailable()
+	{
+		if (_readOffset)
 		{
-			string.append(reinterpret_cast<const char *>(&_data[_readOffset]), _end - _readOffset);
+			std::memmove(_data.data(), _data.data() + _readOffset, _end - _readOffset);
+			_end -= _readOffset;
 			_readOffset = 0;
-			_end = _socket.read(_data);
-
-			if (!_end)
-				LOG_ERROR << "Socket closed after reading " << string.length() << " of " << length << " bytes";
 		}
 
-		std::size_t remaining = length - string.length();
-		string.append(reinterpret_cast<const char *>(&_data[_readOffset]), remaining);
-		_readOffset += remaining;
+		std::size_t read = receive(_end);
+
+		_end += read;
+
+		// Grow the buffer once it fills, so large payloads are received using fewer, larger reads
+		if (_end == _data.size() && _data.size() < _maxSize)
+			_data.resize(_maxSize);
+
+		return read != 0;
+	}
+
+	/** Reads payload data from the socket, passing each contiguous chunk directly from the receive buffer to the consumer.
+	 *
+	 * @param length the number of bytes to read
+	 * @param consumer the function called with each chunk of data (as a const char pointer and length) in order
+	 */
+	template <typename ConsumerT> void readData(std::size_t length, ConsumerT consumer)
+	{
+		for (std::size_t remaining = length; remaining; )
+		{
+			if (_readOffset == _end)
+			{
+				// Grow the buffer for large payloads, so they are received using fewer, larger reads
+				if (remaining > _data.size() && _data.size() < _maxSize)
+					_data.resize(remaining < _maxSize ? remaining : _maxSize);
+
+				_readOffset = 0;
+				_end = receive(0);
+
+				if (!_end)
+					LOG_ERROR << "Socket closed after reading " << (length - remaining) << " of " << length << " bytes";
+			}
+
+			std::size_t available = _end - _readOffset < remaining ? _end - _readOffset : remaining;
+
+			consumer(reinterpret_cast<const char *>(&_data[_readOffset]), available);
+			_readOffset += available;
+			remaining -= available;
+		}
 
 		if (_readOffset == _end)
 			_readOffset = _end = 0;
+	}
+
+	// Reads a string from the socket
+	std::string readString(std::size_t length)
+	{
+		std::string string;
+		string.reserve(length);
 
+		readData(length, [&string](const char *data, std::size_t size) { string.append(data, size); });
 		return string;
 	}
 };
@@ -191,393 +733,3403 @@ class BufferedSendSocket
 	k8psh::Socket &_socket;
 	std::vector<std::uint8_t> _data;
 	std::size_t _end;
-
-public:
-	BufferedSendSocket(k8psh::Socket &socket) : _socket(socket), _data(INITIAL_MTU_SIZE), _end() { }
-	~BufferedSendSocket() { flush(); }
-
-	// Flushes any pending data to the socket
-	void flush()
+	std::size_t _delayedHeader;
+	std::chrono::microseconds _delay;
+	std::chrono::steady_clock::time_point _flushTime;
+	bool _nonblocking;
+	std::size_t _unsent; // The flushed data at the front of the buffer that is waiting for the socket to become writable
+
+	// Writes a 4 byte little-endian payload length to the buffer at the specified offset
+	void writeLength(std::size_t offset, std::size_t length)
 	{
-		if (_end)
-		{
-			if (_socket.write(_data, 0, _end) != _end)
-				LOG_ERROR << "Failed to write data to socket";
-
-			_end = 0;
-		}
+		_data[offset] = std::uint8_t(length);
+		_data[offset + 1] = std::uint8_t(length >> 8);
+		_data[offset + 2] = std::uint8_t(length >> 16);
+		_data[offset + 3] = std::uint8_t(length >> 24);
 	}
 
-	// Writes a payload to the socket
-	void write(PayloadType type, const std::string &string, std::size_t length, bool flush = true)
+	// Writes a payload header to the buffer
+	void writeHeader(PayloadType type, std::size_t length)
 	{
-		// If there is not enough room in the buffer, then flush and resize the buffer if needed
-		if (5 + length > _data.size() - _end)
-		{
-			this->flush();
+		_delayedHeader = NO_DELAYED_HEADER;
+		_data[_end] = std::uint8_t(type);
+		writeLength(_end + 1, length);
+		_end += 5;
+	}
 
-			if (5 + length > _data.size())
-				_data.resize(5 + length);
-		}
+	static constexpr std::size_t NO_DELAYED_HEADER = std::size_t(-1);
 
-		_data[_end++] = std::uint8_t(type);
-		_data[_end++] = std::uint8_t(length);
-		_data[_end++] = std::uint8_t(length >> 8);
-		_data[_end++] = std::uint8_t(length >> 16);
-		_data[_end++] = std::uint8_t(length >> 24);
+public:
+	BufferedSendSocket(k8psh::Socket &socket, std::chrono::microseconds delay = std::chrono::microseconds()) : _socket(socket), _data(INITIAL_MTU_SIZE), _end(), _delayedHeader(NO_DELAYED_HEADER), _delay(delay), _flushTime(std::chrono::steady_clock::time_point::max()), _nonblocking(), _unsent() { }
+	~BufferedSendSocket() { (void)flush(false); }
 
-		for (std::size_t i = 0; i < length; i++)
-			_data[_end++] = std::uint8_t(string[i]);
+	// Checks if flushed data is waiting for the socket to become writable (only when writes do not wait).
+	bool hasUnsentData() const { return _unsent != 0; }
 
-		if (flush)
-			this->flush();
-	}
+	// Checks if writes only send the data that can be written without waiting.
+	bool isNonblocking() const { return _nonblocking; }
 
-	// Writes a payload to the socket
-	void write(PayloadType type, const std::string &string, bool flush = true) { write(type, string, string.length(), flush); }
-};
+	// Only writes the data that can be written without waiting, keeping the rest buffered until the socket is writable and the data is flushed again.
+	void setNonblocking() { _nonblocking = true; }
 
-// Outputs data from a socket to a standard stream and handles closing the stream when the length is 0
-static void outputStdStreamData(std::ostream &stream, FILE *file, const char *name, BufferedReceiveSocket &receiveSocket, std::size_t length)
-{
-	if (stream.eof() && length)
-		LOG_ERROR << "Unexpected " << name << " data (" << length << " bytes) from server, stream already closed";
-	else if (length)
+	// Shrinks a grown buffer to its initial size once all data is sent, so idle sessions use less memory.
+	void shrink()
 	{
-		LOG_DEBUG << "Received " << name << " data (" << length << " bytes) from server";
-		std::string data = receiveSocket.readString(length);
-
-		if (!std::fwrite(data.data(), data.length(), 1, file))
-			LOG_ERROR << "Failed to write " << name << " data";
+		if (!_end && _data.size() > INITIAL_MTU_SIZE)
+			std::vector<std::uint8_t>(INITIAL_MTU_SIZE).swap(_data);
 	}
-	else if (!stream.eof())
+
+	// Flushes any pending data to the socket, returning false if the connection was closed by the remote side (and failOnClose is false)
+	bool flush(bool failOnClose = true, bool more = false)
 	{
-		LOG_DEBUG << "Received " << name << " close command from server";
+		_delayedHeader = NO_DELAYED_HEADER;
+		_flushTime = std::chrono::steady_clock::time_point::max();
+
+#ifndef _WIN32
+		if (_end && _nonblocking)
+		{
+			std::size_t written = 0;
+			bool open = _socket.writeAvailable(_data.data(), _end, written);
+
+			if (!open)
+			{
+				_end = _unsent = 0;
+
+				if (failOnClose)
+					LOG_ERROR << "Failed to write data to socket";
+
+				return false;
+			}
+
+			std::memmove(_data.data(), _data.data() + written, _end - written);
+			_end -= written;
+			_unsent = _end;
+			return true;
+		}
+#endif
+
+		if (_end)
+		{
+			bool written = _socket.write(_data, 0, _end, more) == _end;
+
+			_end = 0;
+
+			if (!written && failOnClose)
+				LOG_ERROR << "Failed to write data to socket";
+
+			return written;
+		}
+
+		return true;
+	}
+
+	// Flushes any delayed data that has been pending for longer than the coalescing delay
+	void flushExpired()
+	{
+		if (_flushTime != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= _flushTime)
+			(void)flush();
+	}
+
+	// Gets the time until delayed data must be flushed, or a negative value if there is no delayed data
+	std::chrono::microseconds getFlushTimeout() const
+	{
+		if (_flushTime == std::chrono::steady_clock::time_point::max())
+			return std::chrono::microseconds(-1);
+
+		auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(_flushTime - std::chrono::steady_clock::now());
+		return timeout.count() > 0 ? timeout : std::chrono::microseconds();
+	}
+
+	// Writes a payload to the socket (flushed payloads are sent along with any pending data without being copied)
+	void write(PayloadType type, const char *data, std::size_t length, bool flush = true)
+	{
+		if (flush && !_nonblocking)
+		{
+			if (5 > _data.size() - _end)
+				this->flush();
+
+			writeHeader(type, length);
+
+			const k8psh::Socket::Slice slices[] = { { _data.data(), _end }, { data, length } };
+			const std::size_t total = _end + length;
+
+			_end = 0;
+			_flushTime = std::chrono::steady_clock::time_point::max();
+
+			if (_socket.write(slices, sizeof(slices) / sizeof(slices[0])) != total)
+				LOG_ERROR << "Failed to write data to socket";
+
+			return;
+		}
+
+		// Grow the buffer if needed, since the caller will flush the data
+		if (5 + length > _data.size() - _end)
+			_data.resize(_end + 5 + length);
+
+		writeHeader(type, length);
+
+		if (length)
+			std::memcpy(&_data[_end], data, length);
+
+		_end += length;
+
+		if (flush)
+			this->flush();
+	}
+
+	// Writes a payload to the socket
+	void write(PayloadType type, const std::string &string, std::size_t length, bool flush = true) { write(type, string.data(), length, flush); }
+
+	// Writes a payload to the socket
+	void write(PayloadType type, const std::string &string, bool flush = true) { write(type, string.data(), string.length(), flush); }
+
+	// Writes a payload that consists of only a value (a credit) to the socket
+	void writeValue(PayloadType type, std::uint32_t value, bool flush = true)
+	{
+		if (5 > _data.size() - _end)
+			_data.resize(_end + 5);
+
+		writeHeader(type, value);
+
+		if (flush)
+			this->flush();
+	}
+
+	// Writes a payload to the socket, delaying it to coalesce it with other payloads until either the coalescing delay expires or the coalescing size is reached
+	void writeDelayed(PayloadType type, const char *data, std::size_t length)
+	{
+		if (_delay.count() <= 0 || _end + 5 + length > COALESCE_SIZE)
+			return write(type, data, length);
+
+		// Data following a delayed payload of the same type is appended to that payload (empty payloads close the stream, so they are never merged)
+		if (_delayedHeader != NO_DELAYED_HEADER && _data[_delayedHeader] == std::uint8_t(type) && length)
+		{
+			if (length > _data.size() - _end)
+				_data.resize(_end + length);
+
+			std::memcpy(&_data[_end], data, length);
+			_end += length;
+			writeLength(_delayedHeader + 1, _end - _delayedHeader - 5);
+		}
+		else
+		{
+			std::size_t header = _end;
+
+			write(type, data, length, false);
+			_delayedHeader = length ? header : NO_DELAYED_HEADER;
+		}
+
+		if (_flushTime == std::chrono::steady_clock::time_point::max())
+			_flushTime = std::chrono::steady_clock::now() + _delay;
+	}
+
+#ifdef __linux__
+	// Writes a payload to the socket, splicing the data directly from a pipe that has at least the specified number of bytes available
+	void splice(PayloadType type, int pipe, std::size_t length)
+	{
+		if (5 > _data.size() - _end)
+			flush();
+
+		writeHeader(type, length);
+
+		if (!flush(true, true) || _socket.splice(pipe, length) != length)
+			LOG_ERROR << "Failed to splice data to socket";
+	}
+
+	// Writes a payload to the socket, sending the data directly from a file at its current offset, returning false if the connection was closed by the remote side (the file must have at least the specified number of bytes left, since the length is sent first)
+	bool sendFile(PayloadType type, int file, std::size_t length)
+	{
+		if (5 > _data.size() - _end)
+			flush();
+
+		writeHeader(type, length);
+
+		if (!flush(false, true))
+			return false;
+
+		const std::size_t sent = _socket.sendFile(file, length);
+		struct stat status;
+		const off_t offset = lseek(file, 0, SEEK_CUR);
+
+		// The rest of the payload cannot be sent if the file was truncated, so the connection cannot be used without it
+		if (sent != length && fstat(file, &status) == 0 && offset >= status.st_size)
+			LOG_ERROR << "File was truncated while sending it to socket";
+
+		return sent == length;
+	}
+#endif
+};
+
+/** Sends stdout or stderr data to the client, compressing large payloads if the client decompresses output.
+ *
+ * @param sendSocket the socket used to send the data
+ * @param type the type of the payload (STDOUT_DATA or STDERR_DATA)
+ * @param name the name of the stream
+ * @param data the data to send
+ * @param length the length of the data
+ * @param compressedData the buffer used to compress the data, or null if the client does not decompress output
+ */
+static void sendOutputData(BufferedSendSocket &sendSocket, PayloadType type, const char *name, const char *data, std::size_t length, std::string *compressedData)
+{
+	if (compressedData && length >= COMPRESSION_THRESHOLD)
+	{
+		const char header[] = { char(length), char(length >> 8), char(length >> 16), char(length >> 24) };
+
+		compressedData->assign(header, sizeof(header));
+
+		if (k8psh::Compression::compress(data, length, *compressedData))
+		{
+			LOG_DEBUG << "Sending " << name << " data (" << length << " bytes, compressed to " << compressedData->length() << " bytes) to client";
+			sendSocket.write(type == STDOUT_DATA ? COMPRESSED_STDOUT_DATA : COMPRESSED_STDERR_DATA, *compressedData); // Compressed payloads are never coalesced, since their data cannot be appended
+			return;
+		}
+	}
+
+	LOG_DEBUG << "Sending " << name << " data (" << length << " bytes) to client";
+	sendSocket.writeDelayed(type, data, length);
+}
+
+#ifndef _WIN32
+// Appends a payload (a header followed by the data, if any) to a recorded sequence of payloads
+static void appendPayload(std::string &record, PayloadType type, std::uint32_t value, const char *data = nullptr, std::size_t length = 0)
+{
+	const char header[] = { char(type), char(value), char(value >> 8), char(value >> 16), char(value >> 24) };
+
+	record.append(header, sizeof(header));
+
+	if (length)
+		record.append(data, length);
+}
+
+// Sends up to the specified number of bytes of available data from a standard stream pipe to the client, returning the number of bytes sent (zero indicates that the pipe was closed), recording the payload if a record is specified, and compressing the payload if a compression buffer is specified
+static std::size_t sendPipeData(BufferedSendSocket &sendSocket, PayloadType type, const char *name, k8psh::Pipe &pipe, std::string &pipeData, std::size_t maxLength, std::string *record = nullptr, std::string *compressedData = nullptr)
+{
+#ifdef __linux__
+	int available = 0;
+
+	// Large payloads are sized using the data available in the pipe and spliced directly to the socket (unless writes cannot wait for the socket, or the data is recorded or compressed)
+	if (!record && !compressedData && !sendSocket.isNonblocking() && ioctl(pipe.getOutput(), FIONREAD, &available) == 0 && std::size_t(available) >= SPLICE_THRESHOLD && maxLength >= SPLICE_THRESHOLD)
+	{
+		std::size_t length = std::size_t(available) < maxLength ? std::size_t(available) : maxLength;
+
+		LOG_DEBUG << "Splicing " << name << " data (" << length << " bytes) to client";
+		sendSocket.splice(type, pipe.getOutput(), length);
+		return length;
+	}
+#endif
+
+	std::size_t received = pipe.read(&pipeData[0], maxLength < pipeData.size() ? maxLength : pipeData.size());
+
+	sendOutputData(sendSocket, type, name, pipeData.data(), received, compressedData);
+
+	if (record)
+		appendPayload(*record, type, std::uint32_t(received), pipeData.data(), received);
+
+	return received;
+}
+#endif
+
+// Writes all the data to a file descriptor, returning false if the data could not be written
+static bool writeFileDescriptor(int fd, const char *data, std::size_t length)
+{
+	while (length)
+	{
+#ifdef _WIN32
+		int written = _write(fd, data, unsigned(length));
+#else
+		ssize_t written = ::write(fd, data, length);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+#endif
+
+		if (written <= 0)
+			return false;
+
+		data += written;
+		length -= std::size_t(written);
+	}
+
+	return true;
+}
+
+// Compressed stdout or stderr data received from the server, which is output like the data of an uncompressed payload
+class DecompressedData
+{
+	const std::string &_data;
+
+public:
+	/** Receives and decompresses the data of a compressed payload.
+	 *
+	 * @param receiveSocket the socket used to receive the payload
+	 * @param length the length of the payload
+	 * @param data the buffer that holds the decompressed data
+	 */
+	DecompressedData(BufferedReceiveSocket &receiveSocket, std::size_t length, std::string &data) : _data(data)
+	{
+		const std::string payload = receiveSocket.readString(length);
+		const std::size_t decompressedLength = payload.length() < 4 ? 0 : std::size_t(std::uint8_t(payload[0])) | (std::size_t(std::uint8_t(payload[1])) << 8) |
+			(std::size_t(std::uint8_t(payload[2])) << 16) | (std::size_t(std::uint8_t(payload[3])) << 24);
+
+		if (!decompressedLength || !k8psh::Compression::decompress(payload.data() + 4, payload.length() - 4, decompressedLength, data))
+			LOG_ERROR << "Received invalid compressed data (" << length << " bytes) from server";
+	}
+
+	// Gets the length of the decompressed data
+	std::size_t getLength() const { return _data.length(); }
+
+	// Reads the decompressed data, passing it to the consumer (the length is always the length of the decompressed data)
+	template <typename ConsumerT> void readData(std::size_t length, ConsumerT consumer) { consumer(_data.data(), length); }
+};
+
+// Writes stream data from the source (the socket, which passes the data straight from the receive buffer, or decompressed data) to a file descriptor
+template <typename SourceT> static void writeStreamData(int fd, const char *name, SourceT &source, std::size_t length)
+{
+	LOG_DEBUG << "Received " << name << " data (" << length << " bytes) from server";
+
+	source.readData(length, [fd, name](const char *data, std::size_t size)
+		{
+			if (!writeFileDescriptor(fd, data, size))
+				LOG_ERROR << "Failed to write " << name << " data";
+		});
+}
+
+// Outputs stream data from the source to a standard stream and handles closing the stream when the length is 0
+template <typename SourceT> static void outputStdStreamData(std::ostream &stream, FILE *file, const char *name, SourceT &source, std::size_t length)
+{
+	if (stream.eof() && length)
+		LOG_ERROR << "Unexpected " << name << " data (" << length << " bytes) from server, stream already closed";
+	else if (length)
+	{
+#ifdef _WIN32
+		const int fd = _fileno(file);
+#else
+		const int fd = fileno(file);
+#endif
+
+		// The data is written straight from the receive buffer, bypassing the stream buffers (which hold no data, since the stream is only written here)
+		writeStreamData(fd, name, source, length);
+	}
+	else if (!stream.eof())
+	{
+		LOG_DEBUG << "Received " << name << " close command from server";
 		stream.flush();
 		stream.setstate(std::ios_base::eofbit);
 		(void)std::fclose(file);
 	}
 }
 
-/** Runs a process remotely on the configured host.
+#ifndef _WIN32
+// Outputs stream data from the socket to a handle owned by the caller of an in-process command (the handle is left open when the server closes the stream)
+template <typename SourceT> static void outputStreamData(int fd, const char *name, SourceT &source, std::size_t length, std::uint64_t &outputSize)
+{
+	if (length)
+	{
+		writeStreamData(fd, name, source, length);
+		outputSize += length;
+	}
+	else
+		LOG_DEBUG << "Received " << name << " close command from server";
+}
+#endif
+
+// Connects to a host without waiting for it to become ready, returning an invalid socket if the host is not accepting connections
+static k8psh::Socket connectToHost(const k8psh::Configuration::Host &host)
+{
+	if (!host.getSocketPath().empty())
+		return k8psh::Socket::connect(host.getSocketPath(), false);
+	else if (host.getAddress().empty())
+		return k8psh::Socket::connect(host.getPort(), false);
+
+	// The address is usually resolved by the server in the snapshot, otherwise the client resolves it
+	const std::string &address = host.resolveAddress();
+
+	if (address.empty())
+	{
+		LOG_DEBUG << "Failed to resolve the address of host " << host.getHostname() << " (" << host.getAddress() << ")";
+		return k8psh::Socket();
+	}
+
+	return k8psh::Socket::connect(address, host.getPort(), false);
+}
+
+// Starts connecting to a host without waiting for the connection, returning an invalid socket if the host is not accepting connections
+static k8psh::Socket startConnectToHost(const k8psh::Configuration::Host &host)
+{
+	if (!host.getSocketPath().empty())
+		return k8psh::Socket::startConnect(host.getSocketPath(), false);
+	else if (host.getAddress().empty())
+		return k8psh::Socket::startConnect(std::string(), host.getPort(), false);
+
+	const std::string &address = host.resolveAddress();
+
+	if (address.empty())
+	{
+		LOG_DEBUG << "Failed to resolve the address of host " << host.getHostname() << " (" << host.getAddress() << ")";
+		return k8psh::Socket();
+	}
+
+	return k8psh::Socket::startConnect(address, host.getPort(), false);
+}
+
+// The time all replicas have to accept the connection and reply to the status query, so replicas that are down or stalled do not hold up the session
+static const long long REPLICA_STATUS_TIMEOUT_MS = 250;
+
+// A replica whose number of active sessions is being queried
+struct ReplicaQuery
+{
+	std::size_t index;
+	k8psh::Socket socket;
+	bool connected;
+	std::vector<std::uint8_t> reply;
+	std::size_t replyLength;
+
+	ReplicaQuery(std::size_t replicaIndex, k8psh::Socket &&replicaSocket) : index(replicaIndex), socket(std::move(replicaSocket)), connected(), reply(5), replyLength() { }
+};
+
+/** Selects the replica of a command with the fewest active sessions, connecting to it if it is accepting connections. (All replicas are queried at once, and selection stops at the first idle replica or once REPLICA_STATUS_TIMEOUT_MS has passed.)
  *
- * @param workingDirectory the relative working directory used to start the process
- * @param command the command to start
- * @param argc the number of additional arguments used to start the process
- * @param argv additional arguments used to start the process
- * @param configuration the global configuration
- * @return the exit code of the process
+ * @param command the command to run
+ * @param socket set to the connection to the selected replica, or left invalid if the command has a single host or no replica replied
+ * @return the index of the selected replica in the hosts of the command
  */
-int k8psh::Process::runRemoteCommand(const std::string &workingDirectory, const k8psh::Configuration::Command &command, std::size_t argc, const char *argv[], const k8psh::Configuration &configuration)
+static std::size_t selectReplica(const k8psh::Configuration::Command &command, k8psh::Socket &socket)
 {
-	k8psh::Socket::Initializer socketInit;
-	Socket socket;
-	BufferedSendSocket sendSocket(socket);
-	BufferedReceiveSocket receiveSocket(socket);
-	auto endTime = configuration.getConnectTimeoutMs() >= 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(configuration.getConnectTimeoutMs()) : std::chrono::steady_clock::time_point::max();
-	std::chrono::milliseconds backoff = std::chrono::milliseconds(16);
+	const auto &hosts = command.getHosts();
+
+	if (hosts.size() < 2)
+		return 0;
+
+	// Clients start at different replicas, so idle replicas share the load
+#ifdef _WIN32
+	const std::size_t first = std::size_t(GetCurrentProcessId()) % hosts.size();
+#else
+	const std::size_t first = std::size_t(getpid()) % hosts.size();
+#endif
+	const auto endTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(REPLICA_STATUS_TIMEOUT_MS);
+	std::list<ReplicaQuery> queries;
+	std::vector<k8psh::Socket::Wait> waits;
+	std::size_t selected = first;
+	std::uint32_t selectedSessions = 0;
 
-	// Connect to the server
-	while (!(socket = Socket::connect(command.getHost().getPort(), false)).isValid())
+	for (std::size_t i = 0; i < hosts.size(); i++)
 	{
-		auto now = std::chrono::steady_clock::now();
+		k8psh::Socket replica = startConnectToHost(*hosts[(first + i) % hosts.size()]);
+
+		if (replica.isValid())
+			queries.emplace_back((first + i) % hosts.size(), std::move(replica));
+	}
+
+	// Each query is sent once its connection completes, and removed once it replies or fails
+	while (!queries.empty() && (!socket.isValid() || selectedSessions))
+	{
+		const auto now = std::chrono::steady_clock::now();
 
 		if (now >= endTime)
 			break;
 
-		backoff = backoff * 2;
+		waits.clear();
+
+		for (auto it = queries.begin(); it != queries.end(); ++it)
+			waits.push_back({ &it->socket, !it->connected, false });
+
+		if (!k8psh::Socket::wait(waits, std::chrono::duration_cast<std::chrono::milliseconds>(endTime - now).count() + 1))
+			continue;
+
+		auto waitIt = waits.begin();
+
+		for (auto it = queries.begin(); it != queries.end(); ++waitIt)
+		{
+			const std::string &hostname = hosts[it->index]->getHostname();
+			bool failed = false;
+
+			if (!waitIt->ready)
+			{
+				++it;
+				continue;
+			}
+
+			try
+			{
+				if (!it->connected)
+					failed = !(it->connected = it->socket.finishConnect()) || it->socket.write({ std::uint8_t(STATUS_QUERY), 0, 0, 0, 0 }) != 5;
+				else
+				{
+					std::size_t received = it->socket.read(it->reply, it->replyLength);
+
+					failed = !received || it->reply[0] != STATUS_QUERY;
+					it->replyLength += received;
+				}
+			}
+			catch (const std::exception &) { failed = true; }
+
+			if (failed)
+			{
+				LOG_DEBUG << "Failed to query status of " << hostname;
+				it = queries.erase(it);
+				continue;
+			}
+			else if (it->replyLength < it->reply.size())
+			{
+				++it;
+				continue;
+			}
+
+			const std::uint32_t sessions = std::uint32_t(it->reply[1]) | (std::uint32_t(it->reply[2]) << 8) | (std::uint32_t(it->reply[3]) << 16) | (std::uint32_t(it->reply[4]) << 24);
+
+			LOG_DEBUG << "Received status (" << sessions << " active sessions) from " << hostname;
+
+			if (!socket.isValid() || sessions < selectedSessions)
+			{
+				socket = std::move(it->socket);
+				selected = it->index;
+				selectedSessions = sessions;
+			}
+
+			it = queries.erase(it);
+		}
+	}
+
+	return selected;
+}
+
+/** Receives the phases of the session traced by the server, which follow the exit code, and appends the phases of both sides of the session to the trace file.
+ *
+ * @param traceFilename the file that the trace is appended to
+ * @param trace the trace of the client, which started when the client started
+ * @param receiveSocket the socket used to receive the phases traced by the server
+ * @param connectedTime the time that the client connected to the server, which is used as the start of the trace of the server
+ * @param commandName the name of the command
+ */
+static void writeTrace(const std::string &traceFilename, k8psh::Trace &trace, BufferedReceiveSocket &receiveSocket, k8psh::Trace::Clock::time_point connectedTime, const std::string &commandName)
+{
+	PayloadType type;
+	std::uint32_t payloadValue;
+
+	// The clocks of the client and server can differ, so the phases of the server are placed relative to the connection
+	if (!receiveSocket.read(type, payloadValue) || type != TRACE_EVENTS)
+		LOG_WARNING << "Server did not send the trace of the session";
+	else if (!trace.deserialize("server", receiveSocket.readString(payloadValue), connectedTime))
+		LOG_WARNING << "Received invalid trace of the session from server";
+
+#ifdef _WIN32
+	const std::uint64_t processId = GetCurrentProcessId();
+#else
+	const std::uint64_t processId = std::uint64_t(getpid());
+#endif
+
+	if (!k8psh::Trace::append(traceFilename, trace.format("k8psh " + commandName, processId)))
+		LOG_WARNING << "Failed to append trace of the session to " << traceFilename;
+}
+
+#ifdef __linux__
+/** Gets the path of a file relative to the base directory, so a server sharing the base directory can open the file itself.
+ *
+ * @param baseDirectory the base directory of the configuration
+ * @param handle the handle of the file
+ * @return the relative path of the file, or empty if the file is not in the base directory (or has been deleted)
+ */
+static std::string getSharedFilePath(const std::string &baseDirectory, int handle)
+{
+	std::unique_ptr<char, void (*)(void *)> filename(realpath(("/proc/self/fd/" + std::to_string(handle)).c_str(), NULL), &std::free);
+	std::unique_ptr<char, void (*)(void *)> directory(realpath(baseDirectory.c_str(), NULL), &std::free);
+
+	if (!filename || !directory)
+		return std::string();
+
+	const std::string path = filename.get();
+	const std::string prefix = std::string(directory.get()) + (directory.get()[1] ? "/" : "");
+
+	return path.length() > prefix.length() && path.compare(0, prefix.length(), prefix) == 0 ? path.substr(prefix.length()) : std::string();
+}
+#endif
+
+/** Runs a process remotely on the configured host.
+ *
+ * @param workingDirectory the relative working directory used to start the process
+ * @param command the command to start
+ * @param argc the number of additional arguments used to start the process
+ * @param argv additional arguments used to start the process
+ * @param configuration the global configuration
+ * @param traceFilename the file that the phases of the session on the client and the server are appended to as Chrome trace events, or empty to not trace the session
+ * @param streams the stdio used by the process instead of the stdio of the client, or null to use the stdio of the client (not supported on Windows)
+ * @return the exit code of the process
+ */
+int k8psh::Process::runRemoteCommand(const std::string &workingDirectory, const k8psh::Configuration::Command &command, std::size_t argc, const char *argv[], const k8psh::Configuration &configuration, const std::string &traceFilename, RemoteStreams *streams)
+{
+	k8psh::Socket::Initializer socketInit;
+	Trace trace;
+	const bool tracing = !traceFilename.empty();
+	Socket socket;
+	BufferedSendSocket sendSocket(socket);
+	BufferedReceiveSocket receiveSocket(socket);
+	auto endTime = configuration.getConnectTimeoutMs() >= 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(configuration.getConnectTimeoutMs()) : std::chrono::steady_clock::time_point::max();
+	std::chrono::milliseconds backoff = std::chrono::milliseconds(16);
+
+	// Select the replica with the fewest active sessions (the connection used to query its status is then used for the session)
+	const auto &hosts = command.getHosts();
+	std::size_t hostIndex = selectReplica(command, socket);
+
+#ifdef _WIN32
+	if (streams)
+		LOG_ERROR << "Running commands in-process not supported";
+#else
+	const int stdInHandle = streams ? streams->stdIn : STDIN_FILENO;
+	const int stdOutHandle = streams ? streams->stdOut : STDOUT_FILENO;
+	const int stdErrHandle = streams ? streams->stdErr : STDERR_FILENO;
+
+	// Stdio can only be passed to the server if it is open (passed handles cannot be relayed through the agent)
+	const bool stdioOpen = fcntl(stdInHandle, F_GETFD) != -1 && fcntl(stdOutHandle, F_GETFD) != -1 && fcntl(stdErrHandle, F_GETFD) != -1;
+	bool passStdio = stdioOpen && hosts[hostIndex]->shouldPassStdio();
+	Socket agentSocket;
+
+#ifdef __linux__
+	// Data is only relayed through shared memory if the server can attach to the channel (handles cannot be relayed through the agent)
+	bool sharedMemory = !passStdio && hosts[hostIndex]->shouldUseSharedMemory();
+#else
+	const bool sharedMemory = false;
+#endif
+
+	// Connect through the agent if it is running, so the session is multiplexed over one of its existing connections to the server (unless the connection used to query the status of the selected replica is already open)
+	if (!socket.isValid() && !passStdio && !sharedMemory && !configuration.getAgentSocketPath().empty() && (agentSocket = Socket::connect(configuration.getAgentSocketPath(), false)).isValid())
+	{
+		socket = std::move(agentSocket);
+		LOG_DEBUG << "Sending host (\"" << hosts[hostIndex]->getHostname() << "\") to agent";
+		sendSocket.write(AGENT_HOST, hosts[hostIndex]->getHostname(), false);
+	}
+#endif
+
+	// Connect to any replica, retrying as soon as the selected replica signals that it is ready (or after the backoff, in case the signal is missed or another replica becomes ready)
+	std::unique_ptr<FileWatcher> readyWatcher;
+
+	while (!socket.isValid())
+	{
+		for (std::size_t i = 0; i < hosts.size() && !socket.isValid(); i++)
+		{
+			if ((socket = connectToHost(*hosts[(hostIndex + i) % hosts.size()])).isValid())
+				hostIndex = (hostIndex + i) % hosts.size();
+		}
+
+		auto now = std::chrono::steady_clock::now();
+
+		if (socket.isValid() || now >= endTime)
+			break;
+		else if (!readyWatcher)
+		{
+			// Retry immediately after starting the watch, since the server may have become ready before the watch started
+			readyWatcher.reset(new FileWatcher(hosts[hostIndex]->getReadyPath()));
+			continue;
+		}
+
+		backoff = backoff * 2;
+
+		if (backoff > std::chrono::milliseconds(1000))
+			backoff = std::chrono::milliseconds(1000);
+
+		auto waitUntil = now + backoff;
+		(void)readyWatcher->wait(waitUntil < endTime ? waitUntil : endTime);
+	}
+
+	if (!socket.isValid())
+		LOG_ERROR << "Failed to connect to server after " << configuration.getConnectTimeoutMs() << "ms";
+
+	const auto connectedTime = Trace::Clock::now();
+
+	trace.add("client", "connect", trace.getStart(), connectedTime);
+
+	if (streams)
+		streams->connectedTime = connectedTime;
+
+#ifndef _WIN32
+	passStdio = passStdio && hosts[hostIndex]->shouldPassStdio(); // The session may have connected to a replica other than the selected replica
+#endif
+#ifdef __linux__
+	sharedMemory = sharedMemory && hosts[hostIndex]->shouldUseSharedMemory();
+#endif
+
+	// The buffers are sized by the host the session connected to
+	AdaptiveSize bufferSize = getBufferSize(*hosts[hostIndex]);
+	const std::size_t socketBufferSize = hosts[hostIndex]->getSocketBufferSize();
+
+	if (socketBufferSize && !socket.setBufferSize(socketBufferSize))
+		LOG_WARNING << "Failed to set socket buffer size to " << socketBufferSize << " bytes";
+
+	receiveSocket.setMaxSize(bufferSize.getMax());
+
+	// Build the process information (working directory, environment variables, command line)
+	LOG_DEBUG << "Sending working directory (\"" << workingDirectory << "\") to server";
+	sendSocket.write(WORKING_DIRECTORY, workingDirectory, false);
+
+	for (std::size_t i = 0; i < argc; i++)
+	{
+		LOG_DEBUG << "Sending argument (\"" << argv[i] << "\") to server";
+		sendSocket.write(COMMAND_ARGUMENT, std::string(argv[i]), false);
+	}
+
+	for (auto it = command.getEnvironmentVariables().begin(); it != command.getEnvironmentVariables().end(); ++it)
+	{
+		const char first = it->first[0];
+
+		if (first != '=')
+		{
+			const std::string name = first == '?' ? it->first.substr(1) : it->first;
+			const auto value = Utilities::getEnvironmentVariable(name);
+
+			if (value)
+			{
+				LOG_DEBUG << "Sending environment variable (\"" << (name + "=" + value) << "\") to server";
+				sendSocket.write(ENVIRONMENT_VARIABLE, name + "=" + value, false);
+			}
+		}
+	}
+
+#ifndef _WIN32
+	if (passStdio)
+	{
+		static const std::uint8_t header[] = { std::uint8_t(STDIO_HANDLES), 0, 0, 0, 0 };
+		const int handles[] = { stdInHandle, stdOutHandle, stdErrHandle };
+
+		LOG_DEBUG << "Sending stdin, stdout, and stderr handles to server";
+		sendSocket.flush();
+
+		if (socket.write(header, sizeof(header), handles, sizeof(handles) / sizeof(handles[0])) != sizeof(header))
+			LOG_ERROR << "Failed to send stdin, stdout, and stderr handles to server";
+	}
+#endif
+
+	if (tracing)
+	{
+		LOG_DEBUG << "Requesting trace of the session from server";
+		sendSocket.writeValue(TRACE_EVENTS, 0, false);
+	}
+
+#ifndef _WIN32
+	bool stdInShared = false;
+#endif
+
+#ifdef __linux__
+	// Stdin redirected from a regular file is opened by the server itself if the file is in the shared base directory, otherwise it is sent without copying it through user space (cached commands and persistent workers need the data, so it is always sent to them)
+	struct stat stdInStatus;
+	bool stdInFile = false;
+
+	if (!passStdio && fstat(stdInHandle, &stdInStatus) == 0 && S_ISREG(stdInStatus.st_mode) && stdInStatus.st_nlink)
+	{
+		const std::string stdInPath = command.shouldCache() || command.getPersistentWorkers() ? std::string() : getSharedFilePath(configuration.getBaseDirectory(), stdInHandle);
+		const off_t offset = lseek(stdInHandle, 0, SEEK_CUR);
+
+		stdInFile = true;
+
+		if (!stdInPath.empty() && offset >= 0)
+		{
+			const std::uint64_t value = std::uint64_t(offset);
+			const char header[] = { char(value), char(value >> 8), char(value >> 16), char(value >> 24), char(value >> 32), char(value >> 40), char(value >> 48), char(value >> 56) };
+
+			LOG_DEBUG << "Sending stdin file (\"" << stdInPath << "\" at offset " << value << ") to server";
+			sendSocket.write(STDIN_FILE, std::string(header, sizeof(header)) + stdInPath, false);
+			stdInShared = true;
+		}
+	}
+#endif
+
+	// Hosts only compress output for remote connections, since relaying local data is cheaper than compressing it
+#ifdef _WIN32
+	if (hosts[hostIndex]->shouldCompress())
+#else
+	if (!passStdio && hosts[hostIndex]->shouldCompress())
+#endif
+	{
+		LOG_DEBUG << "Requesting compressed output from server";
+		sendSocket.writeValue(COMPRESSION, 0, false);
+	}
+
+#ifdef __linux__
+	SharedMemoryChannel channel;
+
+	if (sharedMemory)
+	{
+		static const std::uint8_t header[] = { std::uint8_t(SHARED_MEMORY), 0, 0, 0, 0 };
+		int handles[SharedMemoryChannel::HANDLE_COUNT];
+
+		channel = SharedMemoryChannel::create(handles);
+
+		LOG_DEBUG << "Sending shared memory channel to server";
+		sendSocket.flush();
+
+		const bool sent = socket.write(header, sizeof(header), handles, SharedMemoryChannel::HANDLE_COUNT) == sizeof(header);
+
+		for (std::size_t i = 0; i < SharedMemoryChannel::HANDLE_COUNT; i++)
+			(void)close(handles[i]);
+
+		if (!sent)
+			LOG_ERROR << "Failed to send shared memory channel to server";
+	}
+#endif
+
+	LOG_DEBUG << "Sending start command (\"" << command.getName() << "\") to server";
+	sendSocket.write(START_COMMAND, command.getName());
+
+#ifdef __linux__
+	// The server attaches the channel once it receives the start command, so everything after it is carried by the channel
+	if (sharedMemory)
+		socket.attachChannel(std::move(channel));
+#endif
+
+	const auto requestedTime = Trace::Clock::now();
+
+	trace.add("client", "request", connectedTime, requestedTime);
+
+#ifndef _WIN32
+	// The process uses stdin, stdout, and stderr directly, so only the exit code is received
+	if (passStdio)
+	{
+		PayloadType type;
+		std::uint32_t payloadValue;
+
+		if (!receiveSocket.read(type, payloadValue)) // Closed socket indicates abnormal termination
+		{
+			LOG_DEBUG << "Socket has been closed without exit code, aborting";
+			std::abort();
+		}
+		else if (type != EXIT_CODE)
+			LOG_ERROR << "Read invalid payload type (" << type << ") from socket";
+
+		LOG_DEBUG << "Received exit code (" << int(payloadValue) << ") from server";
+
+		if (streams)
+			streams->firstOutputTime = std::chrono::steady_clock::now(); // The output is written directly by the process
+
+		if (tracing)
+		{
+			trace.add("client", "command", requestedTime, Trace::Clock::now());
+			writeTrace(traceFilename, trace, receiveSocket, connectedTime, command.getName());
+		}
+
+		return int(payloadValue);
+	}
+#endif
+
+	// Process stdin, socket data, and wait for exit code
+#ifdef _WIN32
+	// Stdin cannot be read using overlapped I/O, so it is read by a thread that cannot be stopped (the port and reader are never destroyed, since the client exits with the command)
+	enum CompletionKey { STDIN_COMPLETION, SOCKET_COMPLETION };
+	CompletionPort &port = *new CompletionPort();
+
+	(void)_setmode(_fileno(stdin), _O_BINARY);
+	(void)_setmode(_fileno(stdout), _O_BINARY);
+	(void)_setmode(_fileno(stderr), _O_BINARY);
+
+	DoubleBufferedReader &stdInReader = *new DoubleBufferedReader(GetStdHandle(STD_INPUT_HANDLE), false, port, STDIN_COMPLETION);
+
+	port.notify(socket.createReadEvent(), SOCKET_COMPLETION, false);
+#else
+	// Markers for the handles watched by the reactor
+	static char stdInEvent;
+	static char socketEvent;
+
+	Reactor reactor;
+	std::vector<Reactor::Event> events;
+
+	reactor.watch(socket.createReadEvent(), Reactor::READABLE, &socketEvent);
+#endif
+
+	std::size_t stdInCredit = STDIN_WINDOW_SIZE;
+	std::size_t outputWritten = 0; // The output written since credit was last granted to the server
+	std::string decompressedData;
+#ifndef _WIN32
+	std::string stdInBuffer(bufferSize.get() - 1, '\0'); // Automatically sized buffers grow after reads fill them
+	bool stdInOpen = !stdInShared; // The server reads a shared stdin file directly
+#endif
+
+	// Wait for and process data from stdin and the socket
+	for (;;)
+	{
+#ifdef _WIN32
+		// Check for new data (stdin data that was held for credit is sent as soon as credit arrives)
+		std::size_t stdInLength = 0;
+		const char *stdInData = stdInReader.getData(stdInLength);
+		CompletionPort::Completion completion = { };
+		bool socketReady = false;
+
+		if (port.wait(completion, receiveSocket.hasBufferedData() || (stdInData && stdInLength <= stdInCredit) ? 0 : INFINITE))
+		{
+			if (completion.key == STDIN_COMPLETION)
+			{
+				stdInReader.complete(completion);
+				stdInData = stdInReader.getData(stdInLength);
+			}
+			else
+				socketReady = true;
+		}
+#else
+		bool stdInReady = false;
+		bool socketReady = false;
+
+		reactor.watch(stdInHandle, stdInOpen && stdInCredit ? Reactor::READABLE : 0, &stdInEvent); // Only read stdin when the server has room for it
+		(void)reactor.wait(events, receiveSocket.hasBufferedData() ? std::chrono::microseconds() : std::chrono::microseconds(-1));
+
+		for (auto it = events.begin(); it != events.end(); ++it)
+			(it->context == &stdInEvent ? stdInReady : socketReady) = true;
+#endif
+
+#ifdef __linux__
+		// Large parts of a stdin file are sent directly from the file, rather than being read into the buffer (the rest of the file is read like any other stdin)
+		const off_t stdInOffset = stdInReady && stdInFile ? lseek(stdInHandle, 0, SEEK_CUR) : off_t(-1);
+		const std::size_t maxStdInLength = stdInCredit < bufferSize.getMax() - 1 ? stdInCredit : bufferSize.getMax() - 1;
+
+		if (stdInOffset >= 0 && maxStdInLength >= SPLICE_THRESHOLD && fstat(stdInHandle, &stdInStatus) == 0 && stdInStatus.st_size - stdInOffset >= off_t(SPLICE_THRESHOLD))
+		{
+			const std::size_t length = std::size_t(stdInStatus.st_size - stdInOffset) < maxStdInLength ? std::size_t(stdInStatus.st_size - stdInOffset) : maxStdInLength;
+
+			LOG_DEBUG << "Sending stdin file data (" << length << " bytes) to server";
+			stdInCredit -= length;
+			stdInReady = false;
+
+			// The server may have already sent the exit code and closed the connection, so stop sending stdin data
+			if (!sendSocket.sendFile(STDIN_DATA, stdInHandle, length))
+			{
+				LOG_DEBUG << "Server closed the connection, discarding stdin data";
+				stdInOpen = false;
+			}
+		}
+#endif
+
+		// Check for stdin data
+#ifdef _WIN32
+		// The reader holds the data until the server has room for it, while it fills its other buffer
+		if (stdInData && stdInLength <= stdInCredit)
+#else
+		if (stdInReady)
+#endif
+		{
+#ifdef _WIN32
+			stdInCredit -= stdInLength;
+
+			LOG_DEBUG << "Sending stdin data (" << stdInLength << " bytes) to server";
+			sendSocket.write(STDIN_DATA, stdInData, stdInLength, false);
+			stdInReader.consume();
+
+			if (!sendSocket.flush(false))
+				LOG_DEBUG << "Server closed the connection, discarding stdin data";
+#else
+			ssize_t received = read(stdInHandle, &stdInBuffer[0], stdInCredit < stdInBuffer.size() ? stdInCredit : stdInBuffer.size());
+
+			if (received < 0)
+				LOG_ERROR << "Failed to read data from stdin: " << errno;
+			else if (received == 0)
+				stdInOpen = false; // No more data, so ignore it from now on
+			else if (std::size_t(received) == stdInBuffer.size() && bufferSize.grow())
+				stdInBuffer.resize(bufferSize.get() - 1);
+
+			stdInCredit -= std::size_t(received);
+
+			LOG_DEBUG << "Sending stdin data (" << received << " bytes) to server";
+			sendSocket.write(STDIN_DATA, stdInBuffer, std::size_t(received), false);
+
+			// The server may have already sent the exit code and closed the connection, so stop sending stdin data
+			if (!sendSocket.flush(false))
+			{
+				LOG_DEBUG << "Server closed the connection, discarding stdin data";
+				stdInOpen = false;
+			}
+#endif
+		}
+
+		// Check for socket data
+		if (socketReady || receiveSocket.hasBufferedData())
+		{
+			for (bool skipCheck = K8PSH_SKIP_FIRST_SOCKET_DATA_CHECK && !socket.hasSpuriousReadEvents(); skipCheck || receiveSocket.hasData(); skipCheck = false)
+			{
+				PayloadType type;
+				std::uint32_t payloadValue;
+
+				if (!receiveSocket.read(type, payloadValue)) // Closed socket indicates abnormal termination
+				{
+					if (streams)
+						LOG_ERROR << "Socket has been closed without exit code";
+
+					LOG_DEBUG << "Socket has been closed without exit code, aborting";
+					std::abort();
+				}
+
+				// The first output of the session is recorded once it arrives (the exit code is used if the process has no output)
+				if (streams && streams->firstOutputTime == std::chrono::steady_clock::time_point() && ((type == STDOUT_DATA || type == STDERR_DATA) ? payloadValue != 0 : (type == EXIT_CODE || type == COMPRESSED_STDOUT_DATA || type == COMPRESSED_STDERR_DATA)))
+					streams->firstOutputTime = std::chrono::steady_clock::now();
+
+				switch (type)
+				{
+				case STDIN_DATA:
+#ifndef _WIN32
+					// The stdin of in-process commands is owned by the caller, so it is only ignored from now on
+					if (streams)
+					{
+						LOG_DEBUG << "Received stdin close command from server";
+						reactor.watch(stdInHandle, 0, &stdInEvent);
+						stdInOpen = false;
+						break;
+					}
+#endif
+
+					if (!std::cin.eof())
+					{
+						LOG_DEBUG << "Received stdin close command from server";
+#ifndef _WIN32
+						reactor.watch(stdInHandle, 0, &stdInEvent);
+						stdInOpen = false;
+#endif
+						std::cin.setstate(std::ios_base::eofbit);
+						(void)std::fclose(stdin);
+					}
+
+					break;
+
+				case STDOUT_DATA:
+#ifndef _WIN32
+					if (streams)
+						outputStreamData(stdOutHandle, "stdout", receiveSocket, payloadValue, streams->outputSize);
+					else
+#endif
+						outputStdStreamData(std::cout, stdout, "stdout", receiveSocket, payloadValue);
+
+					outputWritten += payloadValue;
+					break;
+
+				case STDERR_DATA:
+#ifndef _WIN32
+					if (streams)
+						outputStreamData(stdErrHandle, "stderr", receiveSocket, payloadValue, streams->outputSize);
+					else
+#endif
+						outputStdStreamData(std::cerr, stderr, "stderr", receiveSocket, payloadValue);
+
+					outputWritten += payloadValue;
+					break;
+
+				case COMPRESSED_STDOUT_DATA:
+				case COMPRESSED_STDERR_DATA:
+					{
+						DecompressedData data(receiveSocket, payloadValue, decompressedData);
+						const bool stdOut = type == COMPRESSED_STDOUT_DATA;
+
+#ifndef _WIN32
+						if (streams)
+							outputStreamData(stdOut ? stdOutHandle : stdErrHandle, stdOut ? "stdout" : "stderr", data, data.getLength(), streams->outputSize);
+						else
+#endif
+							outputStdStreamData(stdOut ? std::cout : std::cerr, stdOut ? stdout : stderr, stdOut ? "stdout" : "stderr", data, data.getLength());
+
+						outputWritten += data.getLength(); // Credit is granted for the decompressed data, since the server sent that much output
+					}
+
+					break;
+
+				case STDIN_CREDIT:
+					LOG_DEBUG << "Received stdin credit (" << payloadValue << " bytes) from server";
+					stdInCredit += payloadValue;
+					break;
+
+				case EXIT_CODE:
+					LOG_DEBUG << "Received exit code (" << int(payloadValue) << ") from server";
+
+					if (tracing)
+					{
+						trace.add("client", "command", requestedTime, Trace::Clock::now());
+						writeTrace(traceFilename, trace, receiveSocket, connectedTime, command.getName());
+					}
+
+					return int(payloadValue);
+
+				default:
+					LOG_ERROR << "Read invalid payload type (" << type << ") from socket";
+				}
+
+				// Grant the server more output credit once enough of its output has been written
+				if (outputWritten >= OUTPUT_WINDOW_SIZE / CREDIT_WINDOW_DIVISOR)
+				{
+					LOG_DEBUG << "Sending output credit (" << outputWritten << " bytes) to server";
+					sendSocket.writeValue(OUTPUT_CREDIT, std::uint32_t(outputWritten), false);
+					outputWritten = 0;
+
+					if (!sendSocket.flush(false))
+						LOG_DEBUG << "Server closed the connection, discarding output credit";
+				}
+			}
+		}
+	}
+}
+
+// The environment of a command, with every variable that does not depend on a client resolved when it is created (so each session only resolves the variables a client can provide)
+class EnvironmentTemplate
+{
+	struct Entry
+	{
+		std::string name;
+		std::string value; // The value used to compute the variable (substituted, or empty to use the environment of the server)
+		k8psh::OptionalString resolved; // The variable resolved without a client (the default of variables a client can provide)
+		bool isProvided; // Set if a client can provide the variable
+		bool isOptional;
+		bool isDynamic; // Set if the variable is resolved for each session, since it refers to a variable a client can provide
+
+		Entry() : name(), value(), resolved(), isProvided(), isOptional(), isDynamic() { }
+	};
+
+	std::vector<Entry> _entries;
+	std::vector<std::pair<std::string, std::size_t>> _outputs; // The name of each variable in order, with the index of the last entry that sets it
+
+	/** Resolves the variable of an entry the same way for each session.
+	 *
+	 * @param index the index of the entry
+	 * @param values the variables of the entries before it
+	 * @return the resolved variable
+	 */
+	k8psh::OptionalString resolve(std::size_t index, const std::unordered_map<std::string, k8psh::OptionalString> &values) const
+	{
+		const Entry &entry = _entries[index];
+
+		if (!entry.isProvided)
+			return entry.value.empty() ? k8psh::Utilities::getEnvironmentVariable(entry.name) : k8psh::OptionalString(k8psh::Utilities::substituteEnvironmentVariables(entry.value, values));
+
+		return entry.value.empty() && entry.isOptional ? k8psh::Utilities::getEnvironmentVariable(values, entry.name) : k8psh::OptionalString(k8psh::Utilities::substituteEnvironmentVariables(entry.value, values));
+	}
+
+public:
+	EnvironmentTemplate() : _entries(), _outputs() { }
+
+	// Creates the template for the environment variables of a command.
+	explicit EnvironmentTemplate(const k8psh::Configuration::Command &command) : _entries(), _outputs()
+	{
+		std::unordered_map<std::string, k8psh::OptionalString> values;
+		std::unordered_set<std::string> dynamicNames;
+
+		_entries.reserve(command.getEnvironmentVariables().size());
+
+		for (auto it = command.getEnvironmentVariables().begin(); it != command.getEnvironmentVariables().end(); ++it)
+		{
+			Entry entry;
+
+			entry.isProvided = it->first[0] != '=';
+			entry.isOptional = it->first[0] == '?';
+			entry.name = entry.isProvided && !entry.isOptional ? it->first : it->first.substr(1);
+			entry.value = it->second;
+
+			// Any reference to a variable a client can change makes the variable dynamic (names sharing a prefix are also treated as references, which only costs resolving it for each session)
+			for (auto nameIt = dynamicNames.begin(); nameIt != dynamicNames.end() && !entry.isDynamic; ++nameIt)
+				entry.isDynamic = entry.value.empty() ? entry.isProvided && entry.isOptional && *nameIt == entry.name : entry.value.find("${" + *nameIt) != std::string::npos;
+
+			_entries.push_back(std::move(entry));
+
+			if (!_entries.back().isDynamic)
+				_entries.back().resolved = resolve(_entries.size() - 1, values);
+
+			values[_entries.back().name] = _entries.back().resolved;
+
+			if (_entries.back().isProvided || _entries.back().isDynamic)
+				(void)dynamicNames.insert(_entries.back().name);
+			else
+				(void)dynamicNames.erase(_entries.back().name);
+		}
+
+		// Only one variable is allowed for any name, using the position of its first entry and the value of its last entry
+		std::unordered_map<std::string, std::size_t> outputIndices;
+
+		for (std::size_t i = 0; i < _entries.size(); i++)
+		{
+			auto inserted = outputIndices.emplace(_entries[i].name, _outputs.size());
+
+			if (inserted.second)
+				_outputs.emplace_back(_entries[i].name, i);
+			else
+				_outputs[inserted.first->second].second = i;
+		}
+	}
+
+	/** Builds the environment for a session.
+	 *
+	 * @param receivedEnvironmentVariables the environment variables received from the client
+	 * @return the environment strings
+	 */
+	std::vector<std::string> build(const std::unordered_map<std::string, std::string> &receivedEnvironmentVariables) const
+	{
+		std::vector<const std::string *> values(_entries.size()); // Null for variables that are not set
+		std::list<k8psh::OptionalString> dynamicValues;
+		std::vector<std::string> environment;
+
+		for (std::size_t i = 0; i < _entries.size(); i++)
+		{
+			const Entry &entry = _entries[i];
+			auto valueIt = entry.isProvided ? receivedEnvironmentVariables.find(entry.name) : receivedEnvironmentVariables.end();
+
+			if (valueIt != receivedEnvironmentVariables.end())
+				values[i] = &valueIt->second;
+			else if (!entry.isDynamic)
+				values[i] = entry.resolved ? &entry.resolved : nullptr;
+			else
+			{
+				std::unordered_map<std::string, k8psh::OptionalString> previousValues;
+
+				for (std::size_t j = 0; j < i; j++)
+					previousValues[_entries[j].name] = values[j] ? k8psh::OptionalString(*values[j]) : k8psh::OptionalString();
+
+				dynamicValues.push_back(resolve(i, previousValues));
+				values[i] = dynamicValues.back() ? &dynamicValues.back() : nullptr;
+			}
+		}
+
+		environment.reserve(_outputs.size());
+
+		for (auto it = _outputs.begin(); it != _outputs.end(); ++it)
+		{
+			if (values[it->second])
+				environment.emplace_back(it->first + "=" + *values[it->second]);
+		}
+
+		return environment;
+	}
+};
+
+// Gets the environment templates of the commands of the server, which are empty unless the server prepared them (they are shared with the session processes forked after they are prepared)
+static std::unordered_map<std::string, EnvironmentTemplate> &getEnvironmentTemplates()
+{
+	static std::unordered_map<std::string, EnvironmentTemplate> environmentTemplates;
+	return environmentTemplates;
+}
+
+// The process requested by a client, described by the payloads received before the process is started
+struct ProcessRequest
+{
+	std::string processDirectory;
+	std::unordered_map<std::string, std::string> receivedEnvironmentVariables;
+	std::vector<std::string> arguments;
+	std::string commandName;
+	std::vector<k8psh::Pipe::Handle> clientHandles;
+	k8psh::Pipe::Handle stdInFile; // The file opened for stdin, if the client shared its stdin file
+
+	ProcessRequest() : processDirectory(), receivedEnvironmentVariables(), arguments(), commandName(), clientHandles(), stdInFile(k8psh::Pipe::INVALID_HANDLE) { }
+
+#ifndef _WIN32
+	// Closes any handles received from the client (or opened for it) that were not used to start the process
+	~ProcessRequest()
+	{
+		for (auto it = clientHandles.begin(); it != clientHandles.end(); ++it)
+			(void)close(*it);
+
+		if (stdInFile != k8psh::Pipe::INVALID_HANDLE)
+			(void)close(stdInFile);
+	}
+#endif
+
+	// Checks if any session data has been received.
+	bool isEmpty() const { return processDirectory.empty() && receivedEnvironmentVariables.empty() && arguments.empty(); }
+
+	/** Adds a string payload received from the client to the request.
+	 *
+	 * @param workingDirectory the relative working directory used to start the process
+	 * @param type the type of the payload (WORKING_DIRECTORY, ENVIRONMENT_VARIABLE, COMMAND_ARGUMENT, STDIN_FILE, or START_COMMAND)
+	 * @param value the string received
+	 */
+	void add(const std::string &workingDirectory, PayloadType type, std::string &&value)
+	{
+		switch (type)
+		{
+		case WORKING_DIRECTORY:
+			processDirectory = (workingDirectory.empty() ? std::string() : workingDirectory + "/") + value;
+			LOG_DEBUG << "Received working directory (\"" << value << "\") from client, process directory set to \"" << processDirectory << "\"";
+			break;
+
+		case ENVIRONMENT_VARIABLE:
+			{
+				LOG_DEBUG << "Received environment variable (\"" << value << "\") from client";
+				std::size_t equals = value.find("=");
+
+				if (equals == std::string::npos)
+					receivedEnvironmentVariables.emplace(std::make_pair(value, k8psh::Utilities::getEnvironmentVariable(value)));
+				else
+					receivedEnvironmentVariables[value.substr(0, equals)] = value.substr(equals + 1);
+
+				break;
+			}
+
+		case COMMAND_ARGUMENT:
+			arguments.push_back(std::move(value));
+			LOG_DEBUG << "Received command argument (\"" << arguments.back() << "\") from client";
+			break;
+
+#ifndef _WIN32
+		case STDIN_FILE:
+			{
+				const std::string path = value.length() > 8 ? value.substr(8) : std::string();
+				std::uint64_t offset = 0;
+
+				for (std::size_t i = 8; i > 0 && value.length() > 8; i--)
+					offset = (offset << 8) | std::uint8_t(value[i - 1]);
+
+				LOG_DEBUG << "Received stdin file (\"" << path << "\" at offset " << offset << ") from client";
+
+				// Only files in the base directory are opened, so a client cannot read other files of the server
+				if (path.empty() || k8psh::Utilities::isAbsolutePath(path) || ("/" + path + "/").find("/../") != std::string::npos || stdInFile != k8psh::Pipe::INVALID_HANDLE)
+					LOG_ERROR << "Received invalid stdin file (\"" << path << "\") from client";
+
+				const std::string filename = (workingDirectory.empty() ? std::string() : workingDirectory + "/") + path;
+
+				if ((stdInFile = open(filename.c_str(), O_RDONLY | O_CLOEXEC)) == k8psh::Pipe::INVALID_HANDLE || lseek(stdInFile, off_t(offset), SEEK_SET) != off_t(offset))
+					LOG_ERROR << "Failed to open stdin file " << filename << " at offset " << offset << ": " << errno;
+
+				break;
+			}
+#endif
+
+		default:
+			commandName = std::move(value);
+			LOG_DEBUG << "Received start command (\"" << commandName << "\") from client";
+			break;
+		}
+	}
+
+	/** Builds the process for the requested command, inserting the executable of the command before the arguments.
+	 *
+	 * @param commands the map of commands for this server node
+	 * @return the environment of the process
+	 */
+	std::vector<std::string> build(const k8psh::Configuration::CommandMap &commands)
+	{
+		auto commandIt = commands.find(commandName);
+
+		if (commandIt == commands.end())
+			LOG_ERROR << "Failed to find command \"" << commandName << "\" in configuration";
+
+		const k8psh::Configuration::Command &command = commandIt->second;
+
+		if (!clientHandles.empty() && !command.getHost().shouldPassStdio())
+			LOG_ERROR << "Received stdin, stdout, and stderr handles from client for command \"" << commandName << "\" that does not allow them";
+
+		// Commands without a prepared template (when the server did not prepare them) resolve their entire environment
+		auto templateIt = getEnvironmentTemplates().find(commandName);
+		const std::vector<std::string> environment = templateIt != getEnvironmentTemplates().end() ? templateIt->second.build(receivedEnvironmentVariables) : EnvironmentTemplate(command).build(receivedEnvironmentVariables);
+
+		arguments.insert(arguments.begin(), command.getExecutable().begin(), command.getExecutable().end());
+		return environment;
+	}
+};
+
+// The parts of a server session that do not depend on how its handles are waited on: the handshake, the admission of its process, and its exit code
+class SessionProtocol
+{
+	// Sessions cannot be copied
+	SessionProtocol(const SessionProtocol&);
+	SessionProtocol &operator=(const SessionProtocol&);
+
+public:
+	k8psh::Socket _socket;
+	BufferedSendSocket _sendSocket;
+	BufferedReceiveSocket _receiveSocket;
+	ProcessRequest _request;
+	bool _statusQueried;
+	bool _counted; // True if the session is included in the active sessions
+	bool _compress; // True if the client decompresses output, so large stdout and stderr payloads are compressed
+	std::unique_ptr<AdmissionTicket> _admission; // Held until the process exits
+	bool _queued; // True if the session had to wait for the process limits
+
+	// The metrics of the server (or null if they are not recorded)
+	k8psh::Metrics *_metrics;
+	std::size_t _metricsCommand;
+	std::chrono::steady_clock::time_point _acceptedTime;
+
+	// The phases of the session, if the client requested a trace
+	std::unique_ptr<k8psh::Trace> _trace;
+	std::chrono::steady_clock::time_point _phaseTime; // The start of the current phase
+
+	SessionProtocol(k8psh::Socket &&socket, std::chrono::microseconds outputDelay) :
+		_socket(std::move(socket)), _sendSocket(_socket, outputDelay), _receiveSocket(_socket), _request(), _statusQueried(), _counted(), _compress(), _admission(), _queued(),
+		_metrics(getMetrics().get()), _metricsCommand(k8psh::Metrics::UNKNOWN_COMMAND), _acceptedTime(std::chrono::steady_clock::now()), _trace(), _phaseTime()
+	{
+		if (_metrics)
+			_metrics->addConnection();
+	}
+
+	~SessionProtocol()
+	{
+		if (_counted)
+			(void)getActiveSessions().add(-1);
+	}
+
+	// Ends the current phase of the session, adding it to the trace if the client requested one.
+	void tracePhase(const char *name)
+	{
+		const auto now = std::chrono::steady_clock::now();
+
+		if (_trace)
+			_trace->add("server", name, _phaseTime, now);
+
+		_phaseTime = now;
+	}
+
+	// Checks if the client closing the connection ends the session normally, since it only queried the status and chose another server.
+	bool isStatusQueryFinished() const { return _statusQueried && _request.isEmpty(); }
+
+	/** Handles a payload header of the handshake that is not part of the request (a status query, or a request for a trace of the session or for compressed output).
+	 *
+	 * @param type the type of the payload
+	 * @param value the value of the payload header
+	 * @return true if the header was handled, false if it is not valid at this point of the handshake
+	 */
+	bool handleHandshakeHeader(PayloadType type, std::uint32_t value)
+	{
+		switch (type)
+		{
+		case STATUS_QUERY:
+			if (!_request.isEmpty())
+				return false;
+
+			LOG_DEBUG << "Received status query from client, sending active sessions (" << getActiveSessions().get() << ")";
+			_sendSocket.writeValue(STATUS_QUERY, std::uint32_t(getActiveSessions().get()));
+			_statusQueried = true;
+			return true;
+
+		case TRACE_EVENTS:
+			if (value)
+				return false;
+
+			LOG_DEBUG << "Received trace request from client";
+			_trace.reset(new k8psh::Trace(_acceptedTime));
+			return true;
+
+		case COMPRESSION:
+			if (value)
+				return false;
+
+			LOG_DEBUG << "Received compression request from client";
+			_compress = true;
+			return true;
+
+		default:
+			return false;
+		}
+	}
+
+	// Includes the session in the active sessions once its request is complete, ending the request phase.
+	void finishRequest()
+	{
+		(void)getActiveSessions().add(1);
+		_counted = true;
+		_phaseTime = _acceptedTime;
+		tracePhase("request");
+
+		if (_metrics)
+		{
+			_metricsCommand = _metrics->findCommand(_request.commandName);
+			_metrics->observe(k8psh::Metrics::HANDSHAKE_TIME, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _acceptedTime));
+		}
+	}
+
+	// Takes the slots of the process limits, returning false if the session must wait for its turn (signaled by the wake handle of the admission ticket, if it has one).
+	bool admit()
+	{
+		if (!_admission)
+			_admission.reset(new AdmissionTicket(_request.commandName));
+
+		if (!_admission->tryAdmit())
+		{
+			_queued = true;
+			return false;
+		}
+		else if (_queued)
+			tracePhase("queue");
+		else
+			_phaseTime = std::chrono::steady_clock::now();
+
+		return true;
+	}
+
+	// Counts the exit of the process (or OTHER_EXIT_CODE, if it did not exit normally) in the metrics of the command.
+	void countExit(long long exitCode)
+	{
+		if (_metrics)
+			_metrics->addExit(_metricsCommand, exitCode >= 0 && exitCode < k8psh::Metrics::OTHER_EXIT_CODE ? int(exitCode) : k8psh::Metrics::OTHER_EXIT_CODE);
+	}
+
+	/** Sends the exit code after any delayed output, followed by the phases of the session if the client requested a trace.
+	 *
+	 * @param phase the name of the phase of the session that ends with the exit code
+	 * @param exitCode the exit code of the process
+	 */
+	void writeExitCode(const char *phase, std::uint32_t exitCode)
+	{
+		_sendSocket.flush();
+		tracePhase(phase);
+		LOG_DEBUG << "Sending exit code (" << exitCode << ") to client";
+		_sendSocket.writeValue(EXIT_CODE, exitCode, !_trace);
+
+		if (_trace)
+		{
+			LOG_DEBUG << "Sending trace (" << _trace->getPhases().size() << " phases) to client";
+			_sendSocket.write(TRACE_EVENTS, _trace->serialize());
+		}
+	}
+};
+
+#ifdef _WIN32
+static std::mutex workingDirectoryMutex;
+#else
+// The write handle of the pipe used to signal that a child process has exited (used when process file descriptors are not supported)
+static volatile int childExitedHandle = k8psh::Pipe::INVALID_HANDLE;
+
+// Handles SIGCHLD by signaling the child exited pipe.
+extern "C" void handleChildExited(int)
+{
+	int savedErrno = errno;
+	(void)::write(childExitedHandle, "", 1);
+	errno = savedErrno;
+}
+
+#ifdef K8PSH_HAVE_POSIX_SPAWN_ADDCHDIR
+/** Spawns a process without copying the address space of the server, mapping stdin, stdout, and stderr to the pipes.
+ *
+ * @param directory the working directory of the process
+ * @param argv the null-terminated arguments of the process
+ * @param env the null-terminated environment of the process
+ * @param stdInPipe the pipe used for stdin
+ * @param stdOutPipe the pipe used for stdout
+ * @param stdErrPipe the pipe used for stderr
+ * @return the process ID, or -1 if the process could not be spawned (in which case it should be started by forking, which reports the error)
+ */
+static pid_t spawnProcess(const std::string &directory, const std::vector<const char *> &argv, const std::vector<const char *> &env, const k8psh::Pipe &stdInPipe, const k8psh::Pipe &stdOutPipe, const k8psh::Pipe &stdErrPipe)
+{
+	// Handles that are already stdin, stdout, or stderr must have close-on-exec cleared, which is not portable using file actions
+	if (stdInPipe.getOutput() <= STDERR_FILENO || stdOutPipe.getInput() <= STDERR_FILENO || stdErrPipe.getInput() <= STDERR_FILENO)
+		return -1;
+
+	// Find the executable the same way as execv() followed by execvp() using the PATH of the new environment (relative paths are relative to the working directory)
+	auto isExecutable = [&directory](const std::string &filename) { return access((filename[0] == '/' ? filename : directory + '/' + filename).c_str(), X_OK) == 0; };
+	std::string executable = argv[0];
+
+	if (!isExecutable(executable) && !std::strchr(argv[0], '/'))
+	{
+		const char *path = "/bin:/usr/bin";
+
+		for (auto it = env.begin(); *it; ++it)
+		{
+			if (std::strncmp(*it, "PATH=", 5) == 0)
+				path = *it + 5;
+		}
+
+		for (const char *start = path, *end = path; *end || end == start; start = ++end)
+		{
+			while (*end && *end != ':')
+				end++;
+
+			executable = (end == start ? std::string(".") : std::string(start, end)) + '/' + argv[0];
+
+			if (isExecutable(executable) || !*end)
+				break;
+		}
+	}
+
+	posix_spawn_file_actions_t fileActions;
+	posix_spawnattr_t attributes;
+	sigset_t defaultSignals;
+	pid_t process = -1;
+
+	if (posix_spawn_file_actions_init(&fileActions) != 0)
+		return -1;
+
+	// Ignored signals are inherited, so restore SIGPIPE (ignored by the server) to the default
+	if (posix_spawnattr_init(&attributes) == 0)
+	{
+		(void)sigemptyset(&defaultSignals);
+		(void)sigaddset(&defaultSignals, SIGPIPE);
+
+		if (posix_spawnattr_setsigdefault(&attributes, &defaultSignals) == 0 && posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF) == 0 &&
+				posix_spawn_file_actions_adddup2(&fileActions, stdInPipe.getOutput(), STDIN_FILENO) == 0 &&
+				posix_spawn_file_actions_adddup2(&fileActions, stdOutPipe.getInput(), STDOUT_FILENO) == 0 &&
+				posix_spawn_file_actions_adddup2(&fileActions, stdErrPipe.getInput(), STDERR_FILENO) == 0 &&
+				posix_spawn_file_actions_addchdir_np(&fileActions, directory.c_str()) == 0)
+		{
+			const int result = posix_spawn(&process, executable.c_str(), &fileActions, &attributes, const_cast<char * const *>(argv.data()), const_cast<char * const *>(env.data()));
+
+			if (result != 0)
+			{
+				LOG_DEBUG << "Failed to spawn " << executable << " (" << result << "), falling back to fork";
+				process = -1;
+			}
+		}
+
+		(void)posix_spawnattr_destroy(&attributes);
+	}
+
+	(void)posix_spawn_file_actions_destroy(&fileActions);
+	return process;
+}
+#endif
+
+// An event that becomes readable when a child process exits, so the exit is noticed without polling for it
+class ProcessExitEvent
+{
+	// Exit events cannot be copied
+	ProcessExitEvent(const ProcessExitEvent&);
+	ProcessExitEvent &operator=(const ProcessExitEvent&);
+
+	int _handle;
+	bool _isProcessHandle;
+
+	// Gets the self-pipe signaled by SIGCHLD, creating it once for the lifetime of the process
+	static int getChildExitedHandle()
+	{
+		static k8psh::Pipe childExited;
+		static bool initialized = false;
+
+		if (!initialized)
+		{
+			struct sigaction action = { };
+
+			if (!childExited.setInputNonblocking() || fcntl(childExited.getOutput(), F_SETFL, fcntl(childExited.getOutput(), F_GETFL) | O_NONBLOCK) == -1)
+				LOG_ERROR << "Failed to set child exited pipe as non-blocking";
+
+			childExitedHandle = childExited.getInput();
+			action.sa_handler = handleChildExited;
+			action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+			(void)sigemptyset(&action.sa_mask);
+
+			if (sigaction(SIGCHLD, &action, NULL) != 0)
+				LOG_ERROR << "Failed to install SIGCHLD handler: " << errno;
+
+			initialized = true;
+		}
+
+		return childExited.getOutput();
+	}
+
+public:
+	// Creates a new exit event for the process. The process must be checked for exit after this event is created, as the exit may have already occurred.
+	ProcessExitEvent(pid_t process) : _handle(k8psh::Pipe::INVALID_HANDLE), _isProcessHandle()
+	{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+		// Process file descriptors (Linux 5.3+) are always close-on-exec
+		_handle = int(syscall(SYS_pidfd_open, process, 0));
+
+		if (_handle != k8psh::Pipe::INVALID_HANDLE)
+		{
+			_isProcessHandle = true;
+			return;
+		}
+
+		LOG_DEBUG << "Process file descriptors are not supported (" << errno << "), falling back to SIGCHLD";
+#else
+		(void)process;
+#endif
+
+		// The self-pipe is shared by all exit events, so any exit signals every event
+		_handle = getChildExitedHandle();
+	}
+
+	~ProcessExitEvent()
+	{
+		if (_isProcessHandle)
+			(void)close(_handle);
+	}
+
+	// Gets the handle signaled by the exit of any child process, or an invalid handle if no exit event has used it yet.
+	static int getSignalHandle() { return childExitedHandle == k8psh::Pipe::INVALID_HANDLE ? k8psh::Pipe::INVALID_HANDLE : getChildExitedHandle(); }
+
+	// Resets the handle signaled by the exit of any child process.
+	static void resetSignalHandle()
+	{
+		char buffer[64];
+
+		while (::read(getChildExitedHandle(), buffer, sizeof(buffer)) > 0)
+			;
+	}
+
+	// Gets the handle that can be polled for the process exit.
+	int getHandle() const { return _handle; }
+
+	// Checks if the handle only signals the exit of this process (otherwise it is the handle signaled by the exit of any child process).
+	bool isProcessHandle() const { return _isProcessHandle; }
+
+	// Resets the event after it has been signaled.
+	void reset()
+	{
+		if (!_isProcessHandle)
+			resetSignalHandle();
+	}
+};
+
+// Data waiting to be written to a socket that is not always writable
+class PendingData
+{
+	std::string _data;
+	std::size_t _offset;
+
+public:
+	PendingData() : _data(), _offset() { }
+
+	// Appends data to be written.
+	void append(const char *data, std::size_t length) { _data.append(data, length); }
+
+	// Discards all pending data.
+	void clear() { _data.clear(); _offset = 0; }
+
+	// Gets the number of bytes waiting to be written.
+	std::size_t getSize() const { return _data.size() - _offset; }
+
+	// Checks if there is no data waiting to be written.
+	bool isEmpty() const { return _offset == _data.size(); }
+
+	// Writes as much pending data as possible to the socket, returning false if the connection was closed by the remote side
+	bool write(k8psh::Socket &socket)
+	{
+		std::size_t written = 0;
+		bool open = socket.writeAvailable(_data.data() + _offset, _data.size() - _offset, written);
+
+		_offset += written;
+
+		// The written data is only removed once it makes up most of the buffer, so each byte is moved at most once on average
+		if (_offset == _data.size())
+			clear();
+		else if (_offset > _data.size() / 2)
+		{
+			(void)_data.erase(0, _offset);
+			_offset = 0;
+		}
+
+		return open;
+	}
+};
+
+// Relays streams multiplexed over a single connection, where each stream is a session relayed to and from its own socket
+class StreamMultiplexer
+{
+	// Multiplexers cannot be copied
+	StreamMultiplexer(const StreamMultiplexer&);
+	StreamMultiplexer &operator=(const StreamMultiplexer&);
+
+	static constexpr std::size_t NOT_POLLED = std::size_t(-1);
+	static constexpr std::size_t MAX_PAYLOAD_SIZE = DATA_BUFFER_SIZE + 4;
+	static constexpr std::size_t MAX_PENDING_SIZE = 1024 * 1024; // Streams are not read while this much data is waiting to be written to the connection
+
+	struct Stream
+	{
+		k8psh::Socket socket;
+		PendingData pending; // Data received on the connection that has not been written to the stream socket
+		bool readClosed; // The stream socket has no more data, and the close has been sent on the connection
+		bool writeClosed; // The connection has no more data for the stream socket, so it is shut down once the pending data is written
+		bool isShutdown;
+		std::size_t pollIndex;
+
+		Stream(k8psh::Socket &&socket) : socket(std::move(socket)), pending(), readClosed(), writeClosed(), isShutdown(), pollIndex(NOT_POLLED) { }
+	};
+
+	k8psh::Socket _connection;
+	std::string _received; // Data received on the connection that does not yet form a complete payload
+	PendingData _pending;
+	std::size_t _pollIndex;
+	std::unordered_map<std::uint32_t, std::unique_ptr<Stream> > _streams;
+	std::uint32_t _nextStreamId;
+	std::vector<std::uint8_t> _buffer;
+
+	// Gets a 4 byte little-endian value from the received data
+	std::uint32_t getReceivedValue(std::size_t offset) const
+	{
+		return std::uint32_t(std::uint8_t(_received[offset])) + (std::uint32_t(std::uint8_t(_received[offset + 1])) << 8) + (std::uint32_t(std::uint8_t(_received[offset + 2])) << 16) + (std::uint32_t(std::uint8_t(_received[offset + 3])) << 24);
+	}
+
+	// Queues part of a stream (or the close of a stream if the length is zero) to be written to the connection
+	void queueStreamData(std::uint32_t id, const char *data, std::size_t length)
+	{
+		const char header[] = { char(STREAM_DATA), char(length + 4), char((length + 4) >> 8), char((length + 4) >> 16), char((length + 4) >> 24), char(id), char(id >> 8), char(id >> 16), char(id >> 24) };
+
+		_pending.append(header, sizeof(header));
+		_pending.append(data, length);
+	}
+
+	// Relays all the complete payloads received on the connection to their streams (payloads are only parsed once complete, so a partial payload never blocks the relay)
+	template <typename StreamHandlerT> void relayReceivedPayloads(StreamHandlerT &streamHandler)
+	{
+		std::size_t offset = 0;
+
+		while (_received.size() - offset >= 5)
+		{
+			const std::size_t length = getReceivedValue(offset + 1);
+
+			if (PayloadType(_received[offset]) != STREAM_DATA || length < 4 || length > MAX_PAYLOAD_SIZE)
+				LOG_ERROR << "Read invalid payload (type " << int(_received[offset]) << ", " << length << " bytes) from multiplexed connection";
+			else if (_received.size() - offset < 5 + length)
+				break;
+
+			const std::uint32_t id = getReceivedValue(offset + 5);
+			const char *data = &_received[offset + 9];
+			auto it = _streams.find(id);
+
+			offset += 5 + length;
+
+			// New streams are only started by data, since a close can arrive for a stream that has already finished
+			if (it == _streams.end() && length > 4)
+			{
+				k8psh::Socket socket = streamHandler(id);
+
+				if (socket.isValid())
+					it = _streams.emplace(id, std::unique_ptr<Stream>(new Stream(std::move(socket)))).first;
+			}
+
+			if (it == _streams.end() || it->second->writeClosed)
+				LOG_DEBUG << "Discarding " << (length - 4) << " bytes for closed stream " << id;
+			else if (length == 4)
+			{
+				LOG_DEBUG << "Received close for stream " << id;
+				it->second->writeClosed = true;
+			}
+			else
+				it->second->pending.append(data, length - 4);
+		}
+
+		(void)_received.erase(0, offset);
+	}
+
+public:
+	StreamMultiplexer(k8psh::Socket &&connection, const std::string &received = std::string()) : _connection(std::move(connection)), _received(received), _pending(), _pollIndex(NOT_POLLED), _streams(), _nextStreamId(1), _buffer(DATA_BUFFER_SIZE) { }
+
+	// Closes all handles without shutting them down, so a forked process does not affect the connection or the streams
+	void abandon()
+	{
+		(void)close(_connection.abandon());
+
+		for (auto it = _streams.begin(); it != _streams.end(); ++it)
+			(void)close(it->second->socket.abandon());
+	}
+
+	// Adds a new stream using the specified socket, returning the ID of the new stream
+	std::uint32_t addStream(k8psh::Socket &&socket)
+	{
+		std::uint32_t id = _nextStreamId++;
+
+		LOG_DEBUG << "Adding stream " << id;
+		_streams.emplace(id, std::unique_ptr<Stream>(new Stream(std::move(socket))));
+		return id;
+	}
+
+	// Gets the number of open streams.
+	std::size_t getStreamCount() const { return _streams.size(); }
+
+	// Checks if a complete payload has been received on the connection but not yet relayed.
+	bool hasBufferedData() const { return _received.size() >= 5 && _received.size() >= 5 + getReceivedValue(1); }
+
+	// Adds the handles that must be polled before relaying data to the poll set
+	void preparePoll(std::vector<struct pollfd> &pollSet)
+	{
+		struct pollfd entry = { };
+
+		_pollIndex = pollSet.size();
+		entry.fd = _connection.createReadEvent();
+		entry.events = short(POLLIN | (_pending.isEmpty() ? 0 : POLLOUT));
+		pollSet.push_back(entry);
+
+		for (auto it = _streams.begin(); it != _streams.end(); ++it)
+		{
+			Stream &stream = *it->second;
+
+			entry.events = short((!stream.readClosed && _pending.getSize() < MAX_PENDING_SIZE ? POLLIN : 0) | (stream.pending.isEmpty() ? 0 : POLLOUT));
+			entry.fd = entry.events ? stream.socket.createReadEvent() : k8psh::Socket::INVALID_HANDLE; // Closed sockets report a hang up even when no events are requested
+			stream.pollIndex = pollSet.size();
+			pollSet.push_back(entry);
+		}
+	}
+
+	/** Relays the data that is ready on the connection and the streams after polling.
+	 *
+	 * @param pollSet the poll set containing the handles added by preparePoll
+	 * @param streamHandler the function called with the stream ID to get the socket for a new stream started by the connection (invalid sockets discard the stream)
+	 * @return false if the connection was closed, otherwise true
+	 */
+	template <typename StreamHandlerT> bool relay(const std::vector<struct pollfd> &pollSet, StreamHandlerT streamHandler)
+	{
+		const short connectionEvents = _pollIndex == NOT_POLLED ? 0 : pollSet[_pollIndex].revents;
+
+		_pollIndex = NOT_POLLED;
+
+		// Read the data that is ready on the connection (a reset from the remote side is treated like a close)
+		if ((connectionEvents & (POLLIN | POLLHUP | POLLERR)) != 0)
+		{
+			std::size_t received = 0;
+
+			try { received = _connection.read(_buffer); }
+			catch (const std::exception &) { }
+
+			if (!received)
+				return false;
+
+			_received.append(reinterpret_cast<const char *>(_buffer.data()), received);
+		}
+
+		relayReceivedPayloads(streamHandler);
+
+		for (auto it = _streams.begin(); it != _streams.end(); )
+		{
+			Stream &stream = *it->second;
+			const short events = stream.pollIndex == NOT_POLLED ? 0 : pollSet[stream.pollIndex].revents;
+
+			stream.pollIndex = NOT_POLLED;
+
+			// Read the stream (a reset from the remote side is treated like a close)
+			if (!stream.readClosed && (events & (POLLIN | POLLHUP | POLLERR)) != 0)
+			{
+				std::size_t received = 0;
+
+				try { received = stream.socket.read(_buffer); }
+				catch (const std::exception &) { }
+
+				queueStreamData(it->first, reinterpret_cast<const char *>(_buffer.data()), received);
+				stream.readClosed = !received;
+			}
+
+			// Write the stream, discarding the data if the remote side has closed it
+			if (!stream.pending.isEmpty() && !stream.pending.write(stream.socket))
+			{
+				LOG_DEBUG << "Stream " << it->first << " closed by the remote side, discarding " << stream.pending.getSize() << " bytes";
+				stream.pending.clear();
+				stream.writeClosed = true;
+			}
+
+			if (stream.writeClosed && stream.pending.isEmpty() && !stream.isShutdown)
+			{
+				stream.socket.shutdown();
+				stream.isShutdown = true;
+			}
+
+			if (stream.readClosed && stream.isShutdown)
+			{
+				LOG_DEBUG << "Removing stream " << it->first;
+				it = _streams.erase(it);
+			}
+			else
+				++it;
+		}
+
+		return _pending.isEmpty() || _pending.write(_connection);
+	}
+};
+
+/** Runs the sessions multiplexed over a connection from an agent, each in a separate process.
+ *
+ * @param workingDirectory the relative working directory used to start the processes
+ * @param commands the map of commands for this server node
+ * @param socket the multiplexed connection
+ * @param receiveSocket the buffered data received on the connection
+ * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+ * @param cache the cache used to store the results of cached commands, or null to always run the commands
+ */
+static void runMultiplexedSessions(const std::string &workingDirectory, const k8psh::Configuration::CommandMap &commands, k8psh::Socket &&socket, BufferedReceiveSocket &receiveSocket, std::chrono::microseconds outputDelay, const k8psh::ResultCache *cache)
+{
+	std::string received;
+
+	// Any payloads already received belong to the multiplexed streams
+	receiveSocket.readData(receiveSocket.getBufferedSize(), [&received](const char *data, std::size_t length) { received.append(data, length); });
+
+	StreamMultiplexer multiplexer(std::move(socket), received);
+	std::vector<struct pollfd> pollSet;
+
+	// Each session is a separate process, which is reaped once it exits (releasing the process limits it held, if it was killed before releasing them)
+	std::vector<std::pair<pid_t, std::unique_ptr<ProcessExitEvent>>> sessions;
+
+	auto startSession = [&](std::uint32_t id)
+		{
+			k8psh::Socket session;
+			k8psh::Socket stream;
+
+			k8psh::Socket::createPair(session, stream);
+			LOG_DEBUG << "Starting session for stream " << id;
+
+			pid_t child = fork();
+
+			if (child == 0)
+			{
+				try
+				{
+					signal(SIGCHLD, SIG_DFL);
+					multiplexer.abandon();
+					(void)close(stream.abandon());
+					k8psh::Process::run(workingDirectory, commands, std::move(session), outputDelay, cache);
+				}
+				catch (...) { }
+
+				std::exit(0);
+			}
+
+			(void)close(session.abandon());
+
+			if (child == -1)
+				LOG_ERROR << "Failed to fork session for stream " << id << ": " << errno;
+
+			sessions.emplace_back(child, std::unique_ptr<ProcessExitEvent>(new ProcessExitEvent(child)));
+			return stream;
+		};
+
+	do
+	{
+		int pollResult;
+
+		// Sessions can exit before their exit events are created, so the processes are checked before each poll
+		for (auto it = sessions.begin(); it != sessions.end(); )
+		{
+			if (waitpid(it->first, NULL, WNOHANG) != 0)
+			{
+				k8psh::Process::releaseProcessLimits(it->first);
+				it = sessions.erase(it);
+			}
+			else
+				++it;
+		}
+
+		pollSet.clear();
+		multiplexer.preparePoll(pollSet);
+
+		// The exit events are polled after the handles of the multiplexer (the self-pipe signaled by the exit of any child can be shared by several events)
+		const std::size_t exitIndex = pollSet.size();
+
+		for (auto it = sessions.begin(); it != sessions.end(); ++it)
+		{
+			struct pollfd entry = { };
+
+			entry.fd = it->second->getHandle();
+			entry.events = POLLIN;
+			pollSet.push_back(entry);
+		}
+
+		do pollResult = poll(pollSet.data(), nfds_t(pollSet.size()), multiplexer.hasBufferedData() ? 0 : -1);
+		while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+
+		if (pollResult < 0)
+			LOG_ERROR << "Failed to poll multiplexed connection: " << errno;
+
+		for (std::size_t i = exitIndex; i < pollSet.size(); i++)
+		{
+			if ((pollSet[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+				sessions[i - exitIndex].second->reset();
+		}
+	} while (multiplexer.relay(pollSet, startSession));
+
+	LOG_DEBUG << "Multiplexed connection closed, closing " << multiplexer.getStreamCount() << " remaining streams";
+}
+
+// The processes of sessions that ended before their processes exited, which are reaped once they exit
+static std::vector<pid_t> orphanedProcesses;
+
+// Reaps any orphaned processes that have exited.
+static void reapOrphanedProcesses()
+{
+	for (auto it = orphanedProcesses.begin(); it != orphanedProcesses.end(); )
+	{
+		if (waitpid(*it, NULL, WNOHANG) != 0)
+			it = orphanedProcesses.erase(it);
+		else
+			++it;
+	}
+}
+
+/** Starts the requested process, mapping stdin, stdout, and stderr to the pipes.
+ *
+ * @param request the requested process, which has been built
+ * @param environment the environment of the process
+ * @param stdInPipe the pipe used for stdin
+ * @param stdOutPipe the pipe used for stdout
+ * @param stdErrPipe the pipe used for stderr
+ * @param socket the socket of the session, which is closed in forked processes
+ * @return the process ID
+ */
+static pid_t startProcess(const ProcessRequest &request, const std::vector<std::string> &environment, k8psh::Pipe &stdInPipe, k8psh::Pipe &stdOutPipe, k8psh::Pipe &stdErrPipe, k8psh::Socket &socket)
+{
+	const std::string &processDirectory = request.processDirectory;
+	const std::vector<std::string> &arguments = request.arguments;
+
+	// Setup the environment before starting the process, so the child does as little as possible before executing
+	std::vector<const char *> env;
+	std::vector<const char *> argv;
+
+	for (auto it = environment.begin(); it != environment.end(); ++it)
+		env.push_back(it->c_str());
+
+	env.push_back(NULL);
+
+	for (auto it = arguments.begin(); it != arguments.end(); ++it)
+		argv.push_back(it->c_str());
+
+	argv.push_back(NULL);
+
+	auto concat = [](const std::vector<const char *> &list, bool quotes)
+		{
+			std::string value;
+
+			for (std::size_t i = 0; i < list.size() - 1; i++)
+			{
+				if (i)
+					value.append(quotes ? "\", \"" : " ");
+
+				if (!quotes)
+				{
+					const char *s = list[i];
+
+					while (*s && !k8psh::Utilities::isWhitespace(*s))
+						s++;
+
+					if (*s)
+					{
+						value.append("\"").append(list[i]).append("\"");
+						continue;
+					}
+				}
+
+				value.append(list[i]);
+			}
+
+			return value;
+		};
+	LOG_DEBUG << "Starting " << concat(argv, false) << ",\n" <<
+		"  working directory: \"" << processDirectory << "\",\n" <<
+		"  environment: \"" << concat(env, true) << "\"";
+
+#ifdef K8PSH_HAVE_POSIX_SPAWN_ADDCHDIR
+	// Spawning avoids copying the page tables of the server, but processes that fail to spawn are forked so the error is reported the same way
+	pid_t process = spawnProcess(processDirectory, argv, env, stdInPipe, stdOutPipe, stdErrPipe);
+
+	if (process == -1)
+		process = fork();
+	else
+		LOG_DEBUG << "Spawned process " << process;
+#else
+	pid_t process = fork();
+#endif
+
+	switch (process)
+	{
+	case 0:
+		try
+		{
+			(void)close(socket.abandon());
+			stdInPipe.closeInput();
+			stdOutPipe.closeOutput();
+			stdErrPipe.closeOutput();
+
+			// Ignored signals are inherited, so restore SIGPIPE (ignored by the server) to the default
+			signal(SIGPIPE, SIG_DFL);
+
+			if (!k8psh::Utilities::changeWorkingDirectory(processDirectory))
+				LOG_ERROR << "Failed to change directory to " << processDirectory;
+
+			if (!stdInPipe.remapOutput(STDIN_FILENO) || !stdOutPipe.remapInput(STDOUT_FILENO) || !stdErrPipe.remapInput(STDERR_FILENO))
+				LOG_ERROR << "Failed to map stdin, stdout, and stderr";
+
+			environ = const_cast<char **>(env.data());
+
+			// First, try the working directory (this provides compatibility across different platforms), then try the search path
+			(void)execv(argv[0], (char * const *)argv.data());
+			(void)execvp(argv[0], (char * const *)argv.data());
+
+			LOG_ERROR << "Failed to start " << arguments[0] << ": error " << errno;
+		}
+		catch (...)
+		{
+			std::_Exit(127); // Never return to the server from the child process
+		}
+
+	case -1:
+		LOG_ERROR << "Failed to fork process";
+
+	default:
+		signal(SIGPIPE, SIG_IGN);
+		break;
+	}
+
+	return process;
+}
+
+static const std::size_t MAX_CACHED_RESULT_SIZE = 1024 * 1024 * 64; // Results are held in memory while they are recorded, so larger results are not cached
+
+/**
+ * A session that receives the process requested by a client, runs the process, and relays its stdin, stdout, and stderr.
+ * The session is driven by the events of a reactor, so any number of sessions can be handled by a single thread.
+ * Results of cached commands are replayed from the cache (all of stdin is part of the key, so it is collected before the process is started).
+ */
+class ServerSession : private SessionProtocol
+{
+	// Sessions cannot be copied
+	ServerSession(const ServerSession&);
+	ServerSession &operator=(const ServerSession&);
+
+	enum State
+	{
+		RECEIVING_REQUEST, // Receiving the payloads that describe the process
+		COLLECTING_STDIN,  // Collecting stdin of a cached command until it is closed (the result is then replayed if cached) or fills the stdin window (the process is then started without caching its result)
+		QUEUED,            // Waiting for the process limits to allow the process to start (stdin data is queued until then)
+		REPLAYING,         // Sending the output of a cached result (or the response of a persistent worker) as the client grants credit for it
+		WORKING,           // Waiting for the response of a persistent worker, which runs the request instead of a process (stdin is closed, since workers only receive the arguments)
+		RUNNING,           // Relaying stdin, stdout, and stderr until the process exits and all of its output has been read
+		SENDING_EXIT_CODE, // Waiting for the remaining output and the exit code to be written to the socket
+		DRAINING,          // Discarding any stdin data still in flight until the client closes the connection (closing with unread data resets the connection, which can lose the exit code)
+		MULTIPLEXED,       // The connection carries sessions multiplexed by an agent, which are run by runMultiplexed()
+		FINISHED
+	};
+
+	const std::string &_workingDirectory;
+	const k8psh::Configuration::CommandMap &_commands;
+	std::chrono::microseconds _outputDelay;
+	k8psh::Reactor &_reactor;
+	std::string &_pipeData; // Shared by all sessions driven by the reactor, since the data is copied or written before the next pipe is read (otherwise it is sized by the session)
+	bool _shared;
+	State _state;
+	std::chrono::steady_clock::time_point _startedTime;
+	bool _outputRelayed;
+
+	// The payload being received (requests are collected until complete, while stdin data is written to the process as it arrives)
+	PayloadType _payloadType;
+	std::size_t _payloadRemaining;
+	std::string _payload;
+#ifdef __linux__
+	k8psh::SharedMemoryChannel _channel; // Attached to the socket once the request is complete, if the client sent one
+#endif
+
+	// The running process
+	k8psh::Pipe _stdInPipe;
+	k8psh::Pipe _stdOutPipe;
+	k8psh::Pipe _stdErrPipe;
+	pid_t _process;
+	int _exitStatus;
+	bool _processHasExited;
+	bool _passStdio;
+	std::unique_ptr<ProcessExitEvent> _exitEvent;
+	k8psh::RingBuffer _stdInData;
+	std::size_t _stdInWritten; // The stdin data written to the process since credit was last granted to the client
+	bool _closeStdIn;
+	std::size_t _outputCredit;
+	std::string _compressedData;
+	AdaptiveSize _readSize; // The largest read of an output pipe
+	AdaptiveSize _pipeSize; // The capacity of the pipes of the process (zero for the system default)
+
+	// The cached result (replayed from the cache, or recorded while the process runs so it can be stored once the process exits)
+	const k8psh::ResultCache *_cache;
+	std::vector<std::string> _environment;
+	std::string _stdInCollected;
+	std::string _cacheKey;
+	std::string _result;
+	std::size_t _resultOffset;
+	std::size_t _resultPayloadSent;
+	bool _recording;
+
+	// The persistent worker running the request, or negative if the session does not hold one
+	long long _worker;
+	std::string _workerResponse;
+
+	// Watches a handle of the session for events (or stops watching it if no events are specified), ignoring invalid handles
+	void watch(int handle, unsigned events)
+	{
+		if (handle != k8psh::Pipe::INVALID_HANDLE)
+			_reactor.watch(handle, events, this);
+	}
+
+	// Checks if the session watches the exit event (the handle signaled by the exit of any child process is watched by the owner of the reactor when sessions are shared)
+	bool isExitEventWatched() const { return _exitEvent && (!_shared || _exitEvent->isProcessHandle()); }
+
+	// Releases the persistent worker, if the session holds one
+	void releaseWorker(bool failed)
+	{
+		if (_worker < 0)
+			return;
+
+		watch(getPersistentWorkers()->getResponseHandle(_worker), 0);
+		getPersistentWorkers()->release(_worker, failed);
+		_worker = -1;
+	}
+
+	// Halts the process, if it has been started
+	void terminate()
+	{
+		if (_process > 0)
+			(void)kill(_process, 15); // Send TERM
+
+		releaseWorker(true); // A worker is replaced rather than interrupted, since it may still respond to the request
+	}
+
+	// Stops watching stdin of the process and closes it
+	void closeStdIn()
+	{
+		watch(_stdInPipe.getInput(), 0);
+		_stdInPipe.closeInput();
+	}
+
+	// Stops watching an output pipe and closes it
+	void closeOutput(k8psh::Pipe &pipe)
+	{
+		watch(pipe.getOutput(), 0);
+		pipe.closeOutput();
+	}
+
+	// Writes data to stdin of the process, returning the number of bytes written (the pipe is closed if the process has closed stdin)
+	std::size_t writeStdIn(const char *data, std::size_t length)
+	{
+		const int handle = _stdInPipe.getInput();
+		std::size_t written = _stdInPipe.write(data, length);
+
+		if (_stdInPipe.getInput() == k8psh::Pipe::INVALID_HANDLE)
+			watch(handle, 0);
+
+		_stdInWritten += written;
+
+		if (_metrics)
+			_metrics->addBytes(_metricsCommand, k8psh::Metrics::STDIN, written);
+
+		return written;
+	}
+
+	// Writes stdin data received from the client to the process, writing directly to the pipe when no data is queued and only queuing the data that does not fit in the pipe
+	void writeStdInData(const char *data, std::size_t length)
+	{
+		if (_state == COLLECTING_STDIN)
+		{
+			if (_stdInCollected.length() + length > STDIN_WINDOW_SIZE)
+				LOG_ERROR << "Client exceeded the stdin window of " << STDIN_WINDOW_SIZE << " bytes";
+
+			_stdInCollected.append(data, length);
+			return;
+		}
+		else if (_state != QUEUED && _stdInPipe.getInput() == k8psh::Pipe::INVALID_HANDLE)
+			return; // Ignore data on stdin after close
+
+		std::size_t written = _state != QUEUED && _stdInData.isEmpty() ? writeStdIn(data, length) : 0;
+
+		if (_stdInData.append(data + written, length - written) != length - written)
+			LOG_ERROR << "Client exceeded the stdin window of " << STDIN_WINDOW_SIZE << " bytes";
+	}
+
+	// Writes the queued stdin data to the process, until the pipe is full
+	void writeQueuedStdIn()
+	{
+		for (std::size_t length = 0, written = 0; !_stdInData.isEmpty() && written == length; )
+		{
+			const char *data = _stdInData.getFront(length);
+
+			written = writeStdIn(data, length);
+			_stdInData.consume(written);
+		}
+	}
+
+	// Gets the buffer used to read the pipes, which is sized by the session unless it is shared by all sessions driven by the reactor
+	std::string &getPipeData()
+	{
+		if (!_shared && _pipeData.size() < _readSize.get())
+			_pipeData.resize(_readSize.get());
+
+		return _pipeData;
+	}
+
+	// Relays the available data from an output pipe to the client
+	void relayOutput(k8psh::Pipe &pipe, PayloadType type, const char *name)
+	{
+		if (!_outputCredit)
+			return; // The credit was used by the other output after the events were read
+
+		const std::size_t readSize = _readSize.get();
+		std::size_t received = sendPipeData(_sendSocket, type, name, pipe, getPipeData(), _outputCredit < readSize ? _outputCredit : readSize, _recording ? &_result : nullptr, _compress ? &_compressedData : nullptr);
+
+		// Reads that fill the buffer grow it, then grow the pipes once the buffer is at its largest, so fewer reads are needed to relay the output
+		if (received == readSize && !_readSize.grow() && _pipeSize.grow())
+		{
+			LOG_DEBUG << "Growing pipes to " << _pipeSize.get() << " bytes";
+			(void)_stdOutPipe.setCapacity(_pipeSize.get());
+			(void)_stdErrPipe.setCapacity(_pipeSize.get());
+		}
+
+		_outputCredit -= received;
+
+		if (_metrics && received)
+		{
+			_metrics->addBytes(_metricsCommand, type == STDOUT_DATA ? k8psh::Metrics::STDOUT : k8psh::Metrics::STDERR, received);
+
+			if (!_outputRelayed)
+				_metrics->observe(k8psh::Metrics::FIRST_OUTPUT_TIME, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _startedTime));
+
+			_outputRelayed = true;
+		}
+
+		if (_recording && _result.length() > MAX_CACHED_RESULT_SIZE)
+		{
+			LOG_DEBUG << "Output exceeded " << MAX_CACHED_RESULT_SIZE << " bytes, result will not be cached";
+			_recording = false;
+			_result = std::string();
+		}
+
+		if (!received)
+			closeOutput(pipe);
+	}
+
+	// Sends the request to an idle persistent worker of the command, returning false if no worker can run it (the process is then started instead)
+	bool dispatch()
+	{
+		k8psh::PersistentWorkers *workers = getPersistentWorkers().get();
+		const k8psh::Configuration::Command &command = _commands.at(_request.commandName);
+
+		if (!workers || !command.getPersistentWorkers())
+			return false;
+		else if ((_worker = workers->acquire(_request.commandName, _environment)) < 0)
+		{
+			LOG_DEBUG << "No persistent worker with a matching environment is idle, starting process";
+			return false;
+		}
+
+		// The request runs in the working directory of the session, relative to the working directory of the worker
+		const std::string processDirectory = k8psh::Utilities::normalizePath(_request.processDirectory);
+		const std::string workerDirectory = k8psh::Utilities::normalizePath(workers->getDirectory(_worker));
+		const std::vector<std::string> arguments(_request.arguments.begin() + command.getExecutable().size(), _request.arguments.end());
+
+		try
+		{
+			const std::string sandboxDirectory = processDirectory == workerDirectory ? std::string() : k8psh::Utilities::relativizePath(workerDirectory, processDirectory);
+
+			if (!workers->send(_worker, k8psh::PersistentWorkers::formatRequest(arguments, sandboxDirectory)))
+			{
+				LOG_DEBUG << "Failed to send request to persistent worker, starting process";
+				releaseWorker(true);
+				return false;
+			}
+		}
+		catch (const std::exception &)
+		{
+			releaseWorker(false); // The working directory is outside of the working directory of the worker
+			return false;
+		}
+
+		LOG_DEBUG << "Sent request to persistent worker, closing stdin";
+		tracePhase("dispatch");
+		_startedTime = _phaseTime;
+		_sendSocket.write(STDIN_DATA, std::string());
+		_state = WORKING;
+		return true;
+	}
+
+	// Receives the response of the persistent worker, replaying it like a cached result once it is complete
+	void receiveResponse()
+	{
+		if (!getPersistentWorkers()->receive(_worker, getPipeData(), _workerResponse))
+		{
+			releaseWorker(true);
+			LOG_ERROR << "Persistent worker exited before sending its response";
+		}
+
+		const std::size_t end = _workerResponse.find('\n');
+		int exitCode;
+		std::string output;
+
+		if (end == std::string::npos)
+			return; // The rest of the response has not arrived yet
+		else if (!k8psh::PersistentWorkers::parseResponse(_workerResponse.substr(0, end), exitCode, output) || end + 1 != _workerResponse.length())
+		{
+			releaseWorker(true);
+			LOG_ERROR << "Received invalid response from persistent worker: " << _workerResponse.substr(0, end);
+		}
+
+		releaseWorker(false);
+		tracePhase("run");
+		_admission.reset(); // The next queued process can start
+		_workerResponse = std::string();
+		LOG_DEBUG << "Received response from persistent worker (" << output.length() << " bytes of output, exit code " << exitCode << ")";
+
+		// The output of a worker is diagnostic output, so it is replayed on stderr
+		_result = std::string();
+
+		if (!output.empty())
+			appendPayload(_result, STDERR_DATA, std::uint32_t(output.length()), output.data(), output.length());
+
+		appendPayload(_result, EXIT_CODE, std::uint32_t(exitCode));
+
+		if (_recording && exitCode == 0 && _result.length() <= MAX_CACHED_RESULT_SIZE)
+			(void)_cache->store(_cacheKey, _result);
+
+		if (_metrics)
+			_metrics->addBytes(_metricsCommand, k8psh::Metrics::STDERR, output.length());
+
+		countExit(exitCode);
+
+		_recording = false;
+		_state = REPLAYING;
+	}
+
+	// Starts the process once the process limits allow it, otherwise queues the session
+	void launch()
+	{
+		// The wake handle is replaced when the session moves to the next queue (and closed once it is admitted)
+		if (_admission)
+			watch(_admission->getWakeHandle(), 0);
+
+		if (!admit())
+		{
+			watch(_admission->getWakeHandle(), k8psh::Reactor::READABLE);
+			_state = QUEUED;
+			return;
+		}
+
+		// Persistent workers send their output over the socket, so they are not used when the client passes its handles (or its stdin file)
+		if (_request.clientHandles.empty() && _request.stdInFile == k8psh::Pipe::INVALID_HANDLE && dispatch())
+			return;
+
+		// The process uses the stdin, stdout, and stderr of the client directly when they are passed, rather than having the data relayed through pipes
+		if (!_request.clientHandles.empty())
+		{
+			_stdInPipe.assign(k8psh::Pipe::INVALID_HANDLE, _request.clientHandles[0]);
+			_stdOutPipe.assign(_request.clientHandles[1], k8psh::Pipe::INVALID_HANDLE);
+			_stdErrPipe.assign(_request.clientHandles[2], k8psh::Pipe::INVALID_HANDLE);
+			_request.clientHandles.clear();
+			_passStdio = true;
+		}
+
+		// The process reads a stdin file shared by the client directly, so only its stdout and stderr are relayed
+		if (_request.stdInFile != k8psh::Pipe::INVALID_HANDLE)
+		{
+			_stdInPipe.assign(k8psh::Pipe::INVALID_HANDLE, _request.stdInFile);
+			_request.stdInFile = k8psh::Pipe::INVALID_HANDLE;
+		}
+
+		const auto spawnTime = _phaseTime;
+
+		// Automatically sized pipes start with the system default capacity, and are only resized once the output fills them
+		if (!_passStdio && _pipeSize.get() && !_pipeSize.isAutomatic())
+		{
+			for (k8psh::Pipe *pipe : { &_stdInPipe, &_stdOutPipe, &_stdErrPipe })
+			{
+				if (pipe->getInput() != k8psh::Pipe::INVALID_HANDLE && !pipe->setCapacity(_pipeSize.get()))
+					LOG_WARNING << "Failed to set pipe capacity to " << _pipeSize.get() << " bytes";
+			}
+		}
+
+		_process = startProcess(_request, _environment, _stdInPipe, _stdOutPipe, _stdErrPipe, _socket);
+		tracePhase("spawn");
+		_startedTime = _phaseTime;
+
+		if (_metrics)
+			_metrics->observe(k8psh::Metrics::SPAWN_TIME, std::chrono::duration_cast<std::chrono::microseconds>(_startedTime - spawnTime));
+
+		_stdInPipe.closeOutput();
+		_stdOutPipe.closeInput();
+		_stdErrPipe.closeInput();
+
+		if (_stdInPipe.getInput() != k8psh::Pipe::INVALID_HANDLE && !_stdInPipe.setInputNonblocking())
+			LOG_ERROR << "Failed to set stdin to use non-blocking writes";
+
+		_exitEvent.reset(new ProcessExitEvent(_process));
+		_state = RUNNING;
+		checkExited();
+	}
+
+	// Starts the process once the request is complete, first collecting stdin if the result of the command can be cached
+	void start()
+	{
+		_environment = _request.build(_commands);
+		finishRequest();
+
+		if (_cache && _request.clientHandles.empty() && _request.stdInFile == k8psh::Pipe::INVALID_HANDLE && _commands.at(_request.commandName).shouldCache())
+		{
+			LOG_DEBUG << "Collecting stdin to find cached result";
+			_state = COLLECTING_STDIN;
+		}
+		else
+			launch();
+	}
+
+	// Replays the cached result once all of stdin has been collected, otherwise starts the process with the collected stdin (recording the result if it can be stored)
+	void finishCollectingStdIn()
+	{
+		tracePhase("collect stdin");
+
+		if (_closeStdIn)
+		{
+			_cacheKey = k8psh::ResultCache::createKey(_request.commandName, _request.arguments, _environment, _request.processDirectory, _stdInCollected);
+
+			if (_cache->load(_cacheKey, _result))
+			{
+				LOG_DEBUG << "Replaying cached result (" << _result.length() << " bytes) to client";
+				_closeStdIn = false;
+				_state = REPLAYING;
+				return;
+			}
+
+			_recording = true;
+		}
+		else
+			LOG_DEBUG << "Stdin filled the stdin window, result will not be cached";
+
+		launch();
+		writeStdInData(_stdInCollected.data(), _stdInCollected.length());
+		_stdInCollected = std::string();
+	}
+
+	// Sends the output of the cached result that fits in the output credit, sending the exit code once all of the output has been sent
+	void replay()
+	{
+		while (_state == REPLAYING)
+		{
+			if (_result.length() - _resultOffset < 5)
+				LOG_ERROR << "Cached result is missing the exit code";
+
+			const PayloadType type = PayloadType(std::uint8_t(_result[_resultOffset]));
+			const std::size_t value = std::size_t(std::uint8_t(_result[_resultOffset + 1])) | (std::size_t(std::uint8_t(_result[_resultOffset + 2])) << 8) |
+				(std::size_t(std::uint8_t(_result[_resultOffset + 3])) << 16) | (std::size_t(std::uint8_t(_result[_resultOffset + 4])) << 24);
+
+			if (type == EXIT_CODE)
+			{
+				writeExitCode("replay", std::uint32_t(value));
+				_state = SENDING_EXIT_CODE;
+			}
+			else if ((type != STDOUT_DATA && type != STDERR_DATA) || _result.length() - _resultOffset - 5 < value)
+				LOG_ERROR << "Cached result is invalid";
+			else if (value && !_outputCredit)
+				break; // Wait for the client to grant more credit
+			else
+			{
+				const std::size_t length = value - _resultPayloadSent < _outputCredit ? value - _resultPayloadSent : _outputCredit;
+
+				sendOutputData(_sendSocket, type, type == STDOUT_DATA ? "stdout" : "stderr", &_result[_resultOffset + 5 + _resultPayloadSent], length, _compress ? &_compressedData : nullptr);
+				_outputCredit -= length;
+				_resultPayloadSent += length;
+
+				if (_resultPayloadSent == value)
+				{
+					_resultOffset += 5 + value;
+					_resultPayloadSent = 0;
+				}
+			}
+		}
+	}
+
+	// Handles a complete string payload of the request
+	void handleRequestPayload()
+	{
+		_request.add(_workingDirectory, _payloadType, std::move(_payload));
+		_payload.clear();
+
+		if (_payloadType == START_COMMAND)
+		{
+#ifdef __linux__
+			// The client sends everything after the start command through the channel, which is watched instead of the socket
+			if (_channel.isValid())
+			{
+				watch(_socket.createReadEvent(), 0);
+				(void)_sendSocket.flush();
+				_socket.attachChannel(std::move(_channel));
+			}
+#endif
+
+			start();
+		}
+	}
+
+	// Handles a payload header received from the client (any payload data is handled as it arrives)
+	void handleHeader(PayloadType type, std::uint32_t value)
+	{
+		const bool requesting = _state == RECEIVING_REQUEST;
+
+		switch (type)
+		{
+		case WORKING_DIRECTORY:
+		case ENVIRONMENT_VARIABLE:
+		case COMMAND_ARGUMENT:
+		case STDIN_FILE:
+		case START_COMMAND:
+			if (!requesting)
+				break;
+
+			_payloadType = type;
+			_payloadRemaining = value;
+
+			if (!value)
+				handleRequestPayload();
+
+			return;
+
+		case STDIO_HANDLES:
+			if (!requesting)
+				break;
+
+			_request.clientHandles = _receiveSocket.takeHandles();
+
+			if (_request.clientHandles.size() != 3)
+				LOG_ERROR << "Received " << _request.clientHandles.size() << " handles from client, expecting stdin, stdout, and stderr";
+
+			LOG_DEBUG << "Received stdin, stdout, and stderr handles (" << _request.clientHandles[0] << ", " << _request.clientHandles[1] << ", " << _request.clientHandles[2] << ") from client";
+			return;
+
+#ifdef __linux__
+		case SHARED_MEMORY:
+			{
+				if (!requesting || value)
+					break;
+				else if (_commands.empty() || !_commands.begin()->second.getHost().shouldUseSharedMemory())
+					LOG_ERROR << "Received shared memory channel from client for a host that does not use shared memory";
+
+				const std::vector<int> handles = _receiveSocket.takeHandles();
+
+				_channel = k8psh::SharedMemoryChannel::attach(handles.data(), handles.size());
+				LOG_DEBUG << "Received shared memory channel (waiting on " << _channel.getWaitHandle() << ") from client";
+				return;
+			}
+#endif
+
+		case MULTIPLEX:
+			if (!requesting)
+				break;
+			else if (!_request.isEmpty())
+				LOG_ERROR << "Received multiplex command after session data from client";
+
+			LOG_DEBUG << "Received multiplex command from agent";
+			_state = MULTIPLEXED;
+			return;
+
+		case TRACE_EVENTS:
+		case COMPRESSION:
+		case STATUS_QUERY:
+			if (!requesting || !handleHandshakeHeader(type, value))
+				break;
+
+			return;
+
+		case STDIN_DATA:
+			if (requesting)
+				break;
+
+			LOG_DEBUG << "Received stdin data (" << value << " bytes) from client";
+
+			if (_state != COLLECTING_STDIN && _state != QUEUED && _stdInPipe.getInput() == k8psh::Pipe::INVALID_HANDLE)
+				LOG_DEBUG << "Ignoring " << value << " received bytes due to closed stdin";
+			else if (!value)
+				_closeStdIn = true;
+
+			_payloadType = type;
+			_payloadRemaining = value;
+			return;
+
+		case OUTPUT_CREDIT:
+			if (requesting)
+				break;
+
+			LOG_DEBUG << "Received output credit (" << value << " bytes) from client";
+			_outputCredit += value;
+			return;
+
+		case TERMINATE_COMMAND:
+			if (requesting)
+				break;
+
+			terminate();
+			LOG_DEBUG << "Received terminate command from client, halting process";
+			_state = FINISHED;
+			return;
+
+		default:
+			break;
+		}
+
+		terminate();
+		LOG_ERROR << "Read invalid payload type (" << type << ") from socket";
+	}
+
+	// Receives the data available on the socket, handling each payload as it arrives
+	void receive()
+	{
+		// The read event of a socket carried by a shared memory channel is only signaled once the channel becomes non-empty, so it is read until it is empty
+		if (!_socket.hasSpuriousReadEvents())
+			receiveAvailable();
+		else
+		{
+			while (_state != MULTIPLEXED && _state != FINISHED && _socket.hasData())
+				receiveAvailable();
+		}
+	}
+
+	// Receives the data that can be read from the socket without waiting, handling each payload as it arrives
+	void receiveAvailable()
+	{
+		if (!_receiveSocket.receiveAvailable())
+		{
+			// Closed socket indicates abnormal termination, unless the exit code has been sent (or the client only queried the status and chose another server)
+			if (_state == RECEIVING_REQUEST && isStatusQueryFinished() && !_payloadRemaining)
+				LOG_DEBUG << "Client closed the connection after the status query";
+			else if (_state == RECEIVING_REQUEST)
+				LOG_ERROR << "Failed to read data from socket";
+			else if (_state == COLLECTING_STDIN || _state == QUEUED || _state == REPLAYING || _state == WORKING || _state == RUNNING)
+			{
+				terminate();
+				LOG_ERROR << "Socket was closed unexpectedly";
+			}
+
+			_state = FINISHED;
+			return;
+		}
+
+		while (_state == RECEIVING_REQUEST || _state == COLLECTING_STDIN || _state == QUEUED || _state == REPLAYING || _state == WORKING || _state == RUNNING)
+		{
+			PayloadType type;
+			std::uint32_t value;
+
+			if (!_payloadRemaining)
+			{
+				if (!_receiveSocket.readBuffered(type, value))
+					break;
+
+				handleHeader(type, value);
+				continue;
+			}
+
+			std::size_t received = _payloadType == STDIN_DATA ?
+				_receiveSocket.readBufferedData(_payloadRemaining, [this](const char *data, std::size_t length) { writeStdInData(data, length); }) :
+				_receiveSocket.readBufferedData(_payloadRemaining, [this](const char *data, std::size_t length) { _payload.append(data, length); });
+
+			if (!received)
+				break; // The rest of the payload has not arrived yet
+
+			_payloadRemaining -= received;
+
+			if (!_payloadRemaining && _payloadType != STDIN_DATA)
+				handleRequestPayload();
+		}
+
+		// Data received after the exit code is discarded (the data of multiplexed connections is kept for the sessions they carry)
+		if (_state == SENDING_EXIT_CODE || _state == DRAINING)
+			(void)_receiveSocket.readBufferedData(_receiveSocket.getBufferedSize(), [](const char *, std::size_t) { });
+	}
+
+	// Sends the exit code (along with any delayed output) once the process has exited and all of its output has been sent
+	void sendExitCode()
+	{
+		if (WIFEXITED(_exitStatus)) // Only send exit code on normal termination
+		{
+			int exitCode = WEXITSTATUS(_exitStatus);
+
+			// Failures can be caused by the environment of the server (like a full disk), so only successful results are stored (before the exit code is sent, so the result is found by any command the client runs next)
+			if (_recording && exitCode == 0)
+			{
+				appendPayload(_result, EXIT_CODE, std::uint32_t(exitCode));
+				(void)_cache->store(_cacheKey, _result);
+			}
+
+			writeExitCode("drain", std::uint32_t(exitCode));
+			countExit(exitCode);
+		}
+		else
+		{
+			_sendSocket.flush();
+			countExit(k8psh::Metrics::OTHER_EXIT_CODE);
+		}
+
+		_recording = false;
+		_result = std::string();
+
+		_state = SENDING_EXIT_CODE;
+	}
+
+	// Updates the session after its handles have been handled, sending any messages that are due and watching the handles that are needed
+	void update()
+	{
+		if (_state == COLLECTING_STDIN && (_closeStdIn || _stdInCollected.length() >= STDIN_WINDOW_SIZE))
+			finishCollectingStdIn();
+
+		if (_state == REPLAYING)
+			replay();
+
+		if (_state == RUNNING)
+		{
+			// Check if the pipe has been closed
+			if (!_stdInData.isEmpty() && _stdInPipe.getInput() == k8psh::Pipe::INVALID_HANDLE)
+			{
+				LOG_DEBUG << "Process has closed stdin, lost " << _stdInData.getSize() << " bytes";
+				_stdInData.clear();
+				_sendSocket.write(STDIN_DATA, std::string());
+			}
+
+			// Grant the client more stdin credit once enough of its data has been written to the process
+			if (_stdInWritten >= STDIN_WINDOW_SIZE / CREDIT_WINDOW_DIVISOR && _stdInPipe.getInput() != k8psh::Pipe::INVALID_HANDLE)
+			{
+				LOG_DEBUG << "Sending stdin credit (" << _stdInWritten << " bytes) to client";
+				_sendSocket.writeValue(STDIN_CREDIT, std::uint32_t(_stdInWritten));
+				_stdInWritten = 0;
+			}
+
+			if (_closeStdIn && _stdInData.isEmpty())
+			{
+				LOG_DEBUG << "Closing stdin";
+				_closeStdIn = false;
+				closeStdIn();
+			}
+
+			// Without any pipes to relay, the socket is still watched until the process exits (so a terminate command or a closed connection can halt the process)
+			if (_stdInPipe.getInput() == k8psh::Pipe::INVALID_HANDLE && _stdOutPipe.getOutput() == k8psh::Pipe::INVALID_HANDLE && _stdErrPipe.getOutput() == k8psh::Pipe::INVALID_HANDLE && _processHasExited)
+				sendExitCode();
+		}
+
+		if (_state == SENDING_EXIT_CODE && !_sendSocket.hasUnsentData())
+		{
+			_socket.shutdown();
+			_state = DRAINING;
+		}
+
+		const bool running = _state == RUNNING;
+
+		watch(_socket.createReadEvent(), _state == MULTIPLEXED || _state == FINISHED ? 0 : k8psh::Reactor::READABLE | (_sendSocket.hasUnsentData() ? k8psh::Reactor::WRITABLE : 0));
+		watch(_stdInPipe.getInput(), running && !_stdInData.isEmpty() ? k8psh::Reactor::WRITABLE : 0); // Only wait on the stdin pipe if there is data ready to be sent to it
+		watch(_stdOutPipe.getOutput(), running && _outputCredit ? k8psh::Reactor::READABLE : 0); // Only read output when the client has room for it
+		watch(_stdErrPipe.getOutput(), running && _outputCredit ? k8psh::Reactor::READABLE : 0);
+
+		if (_worker >= 0)
+			watch(getPersistentWorkers()->getResponseHandle(_worker), _state == WORKING ? k8psh::Reactor::READABLE : 0);
+
+		if (isExitEventWatched())
+			watch(_exitEvent->getHandle(), running ? k8psh::Reactor::READABLE : 0);
+	}
+
+public:
+	/** Creates a session for a client, watching the socket for the request.
+	 *
+	 * @param workingDirectory the relative working directory used to start the process
+	 * @param commands the map of commands for this server node
+	 * @param socket the open socket used to communicate with the client
+	 * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+	 * @param reactor the reactor that drives the session
+	 * @param pipeData the buffer used to read data from the pipes
+	 * @param shared true if other sessions share the reactor, so the socket is never written without waiting for it to become writable (and the owner of the reactor checks for process exits signaled by SIGCHLD)
+	 * @param cache the cache used to store the results of cached commands, or null to always run the commands
+	 */
+	ServerSession(const std::string &workingDirectory, const k8psh::Configuration::CommandMap &commands, k8psh::Socket &&socket, std::chrono::microseconds outputDelay, k8psh::Reactor &reactor, std::string &pipeData, bool shared, const k8psh::ResultCache *cache) :
+		SessionProtocol(std::move(socket), outputDelay),
+		_workingDirectory(workingDirectory), _commands(commands), _outputDelay(outputDelay), _reactor(reactor), _pipeData(pipeData), _shared(shared), _state(RECEIVING_REQUEST), _startedTime(), _outputRelayed(),
+		_payloadType(), _payloadRemaining(), _payload(), _stdInPipe(), _stdOutPipe(), _stdErrPipe(), _process(-1), _exitStatus(), _processHasExited(), _passStdio(), _exitEvent(), _stdInData(STDIN_WINDOW_SIZE), _stdInWritten(), _closeStdIn(), _outputCredit(OUTPUT_WINDOW_SIZE), _compressedData(),
+		_readSize(commands.empty() ? AdaptiveSize(DATA_BUFFER_SIZE, DATA_BUFFER_SIZE) : getBufferSize(commands.begin()->second.getHost())), _pipeSize(commands.empty() ? AdaptiveSize(0, 0) : getPipeSize(commands.begin()->second.getHost())),
+		_cache(cache), _environment(), _stdInCollected(), _cacheKey(), _result(), _resultOffset(), _resultPayloadSent(), _recording(), _worker(-1), _workerResponse()
+	{
+		if (shared)
+			_sendSocket.setNonblocking();
+
+		// All commands of the server run on the same host, which configures the sizes of the buffers
+		if (!commands.empty())
+		{
+			const std::size_t socketBufferSize = commands.begin()->second.getHost().getSocketBufferSize();
+
+			if (socketBufferSize && !_socket.setBufferSize(socketBufferSize))
+				LOG_WARNING << "Failed to set socket buffer size to " << socketBufferSize << " bytes";
+		}
+
+		_receiveSocket.setMaxSize(_readSize.getMax());
+		update();
+	}
+
+	~ServerSession()
+	{
+		unwatch();
+
+		// The process can outlive the session (if the session failed), so it is reaped once it exits
+		if (_process > 0 && !_processHasExited)
+			orphanedProcesses.push_back(_process);
+
+		releaseWorker(true); // The session failed while the worker was running its request
+	}
+
+	// Closes all handles without stopping watching them or shutting them down, so a forked process does not affect the session.
+	void abandon()
+	{
+		(void)close(_socket.abandon());
+#ifdef __linux__
+		_channel.abandon();
+#endif
+		_stdInPipe.assign(k8psh::Pipe::INVALID_HANDLE, k8psh::Pipe::INVALID_HANDLE);
+		_stdOutPipe.assign(k8psh::Pipe::INVALID_HANDLE, k8psh::Pipe::INVALID_HANDLE);
+		_stdErrPipe.assign(k8psh::Pipe::INVALID_HANDLE, k8psh::Pipe::INVALID_HANDLE);
+		_exitEvent.reset();
+		_process = -1;
+		_worker = -1;
+		_counted = false;
+
+		if (_admission)
+			_admission->abandon();
+
+		_state = FINISHED;
+	}
+
+	// Checks if the process has exited, closing its stdin so only its remaining output is relayed.
+	void checkExited()
+	{
+		if (_state != RUNNING || _processHasExited || waitpid(_process, &_exitStatus, WNOHANG) <= 0 || !(WIFEXITED(_exitStatus) || WIFSIGNALED(_exitStatus)))
+			return;
+
+		LOG_DEBUG << "Process terminated, closing stdin, transfering remaining stdout and stderr data";
+		tracePhase("run");
+
+		_stdInData.clear();
+		closeStdIn();
+		_processHasExited = true;
+
+		if (isExitEventWatched())
+			watch(_exitEvent->getHandle(), 0);
+
+		_exitEvent.reset();
+		_admission.reset(); // The next queued process can start
+		update();
+	}
+
+	// Flushes any delayed output that is due, retries starting a queued process, and shrinks idle buffers, returning the time until any is due again (or negative if none is pending).
+	std::chrono::microseconds checkTimers()
+	{
+		auto timeout = _sendSocket.getFlushTimeout();
+		const auto now = std::chrono::steady_clock::now();
+
+		if (_readSize.shrink(now))
+		{
+			LOG_DEBUG << "Shrinking idle buffers to " << _readSize.get() << " bytes";
+			_sendSocket.shrink();
+			_receiveSocket.shrink();
+
+			if (!_shared)
+				std::string().swap(_pipeData);
+		}
+
+		if (_pipeSize.shrink(now))
+		{
+			LOG_DEBUG << "Shrinking idle pipes to " << _pipeSize.get() << " bytes";
+			(void)_stdOutPipe.setCapacity(_pipeSize.get());
+			(void)_stdErrPipe.setCapacity(_pipeSize.get());
+		}
+
+		for (const auto shrinkTimeout : { _readSize.getShrinkTimeout(now), _pipeSize.getShrinkTimeout(now) })
+		{
+			if (shrinkTimeout.count() >= 0 && (timeout.count() < 0 || shrinkTimeout < timeout))
+				timeout = shrinkTimeout;
+		}
+
+		if (timeout.count() == 0)
+		{
+			(void)_sendSocket.flush();
+			update();
+			timeout = _sendSocket.getFlushTimeout();
+		}
+
+		// Queued sessions are woken by their wake handle once their turn comes, unless they have none
+		if (_state == QUEUED && _admission->getWakeHandle() == k8psh::Pipe::INVALID_HANDLE)
+		{
+			launch();
+			update();
+
+			if (_state == QUEUED && _admission->getWakeHandle() == k8psh::Pipe::INVALID_HANDLE && (timeout.count() < 0 || timeout > QUEUE_POLL_INTERVAL))
+				timeout = QUEUE_POLL_INTERVAL;
+		}
+
+		return timeout;
+	}
+
+	// Handles an event for one of the handles of the session.
+	void handle(const k8psh::Reactor::Event &event)
+	{
+		if (event.handle == _socket.createReadEvent())
+		{
+			if ((event.events & k8psh::Reactor::WRITABLE) != 0)
+				(void)_sendSocket.flush();
 
-		if (backoff > std::chrono::milliseconds(1000))
-			backoff = std::chrono::milliseconds(1000);
+			if ((event.events & k8psh::Reactor::READABLE) != 0)
+				receive();
+
+			// Large payloads from the client keep the buffers from shrinking
+			if (_receiveSocket.isGrown())
+				_readSize.keep();
+		}
+		else if (event.handle == _stdOutPipe.getOutput())
+			relayOutput(_stdOutPipe, STDOUT_DATA, "stdout");
+		else if (event.handle == _stdErrPipe.getOutput())
+			relayOutput(_stdErrPipe, STDERR_DATA, "stderr");
+		else if (event.handle == _stdInPipe.getInput())
+			writeQueuedStdIn();
+		else if (_worker >= 0 && event.handle == getPersistentWorkers()->getResponseHandle(_worker))
+			receiveResponse();
+		else if (_exitEvent && event.handle == _exitEvent->getHandle())
+		{
+			_exitEvent->reset();
+			checkExited();
+		}
+		else if (_state == QUEUED && event.handle == _admission->getWakeHandle())
+		{
+			_admission->resetWakeHandle();
+			launch();
+		}
 
-		auto sleepUntil = now + backoff;
-		std::this_thread::sleep_until(sleepUntil < endTime ? sleepUntil : endTime);
+		update();
 	}
 
-	if (!socket.isValid())
-		LOG_ERROR << "Failed to connect to server after " << configuration.getConnectTimeoutMs() << "ms";
+	// Checks if the session is finished.
+	bool isFinished() const { return _state == FINISHED || (_state == DRAINING && !_socket.isValid()); }
 
-	// Build the process information (working directory, environment variables, command line)
-	LOG_DEBUG << "Sending working directory (\"" << workingDirectory << "\") to server";
-	sendSocket.write(WORKING_DIRECTORY, workingDirectory, false);
+	// Checks if the connection carries sessions multiplexed by an agent, which must be run using runMultiplexed().
+	bool isMultiplexed() const { return _state == MULTIPLEXED; }
 
-	for (std::size_t i = 0; i < argc; i++)
+	// Runs the sessions multiplexed over the connection, returning once the connection is closed (the reactor is no longer used by the session).
+	void runMultiplexed()
 	{
-		LOG_DEBUG << "Sending argument (\"" << argv[i] << "\") to server";
-		sendSocket.write(COMMAND_ARGUMENT, argv[i], false);
+		runMultiplexedSessions(_workingDirectory, _commands, std::move(_socket), _receiveSocket, _outputDelay, _cache);
+		_state = FINISHED;
 	}
 
-	for (auto it = command.getEnvironmentVariables().begin(); it != command.getEnvironmentVariables().end(); ++it)
+	// Stops watching all handles of the session.
+	void unwatch()
 	{
-		const char first = it->first[0];
+		watch(_socket.createReadEvent(), 0);
+		watch(_stdInPipe.getInput(), 0);
+		watch(_stdOutPipe.getOutput(), 0);
+		watch(_stdErrPipe.getOutput(), 0);
 
-		if (first != '=')
-		{
-			const std::string name = first == '?' ? it->first.substr(1) : it->first;
-			const auto value = Utilities::getEnvironmentVariable(name);
+		if (_worker >= 0)
+			watch(getPersistentWorkers()->getResponseHandle(_worker), 0);
 
-			if (value)
-			{
-				LOG_DEBUG << "Sending environment variable (\"" << (name + "=" + value) << "\") to server";
-				sendSocket.write(ENVIRONMENT_VARIABLE, name + "=" + value, false);
-			}
-		}
+		if (isExitEventWatched())
+			watch(_exitEvent->getHandle(), 0);
+
+		if (_admission)
+			watch(_admission->getWakeHandle(), 0);
 	}
+};
+#endif
 
-	LOG_DEBUG << "Sending start command (\"" << command.getName() << "\") to server";
-	sendSocket.write(START_COMMAND, command.getName());
+// Creates the count of server sessions that have started their processes, which is shared with the session processes forked after it is created (this must be called before any sessions are forked).
+void k8psh::Process::countActiveSessions()
+{
+	(void)getActiveSessions();
+}
 
-	// Process stdin, socket data, and wait for exit code
-#ifdef _WIN32
-	HANDLE waitSet[2];
-	SynchronousData stdInData("StdInData");
+// Gets the number of server sessions that have started their processes.
+long long k8psh::Process::getActiveSessionCount()
+{
+	return getActiveSessions().get();
+}
 
-	waitSet[0] = stdInData._dataAvailable;
+// Formats the metrics of the server in the Prometheus text exposition format.
+std::string k8psh::Process::formatMetrics()
+{
+	const std::unique_ptr<k8psh::Metrics> &metrics = getMetrics();
+	const std::string gauges = k8psh::Metrics::formatValue("k8psh_active_sessions", "gauge", "Sessions that have started their processes.", std::to_string(getActiveSessionCount())) +
+		k8psh::Metrics::formatValue("k8psh_queued_sessions", "gauge", "Sessions waiting for the process limits to start their processes.", std::to_string(getQueuedSessionCount())) +
+		k8psh::Metrics::formatValue("k8psh_queue_wait_seconds_total", "counter", "Time that sessions waited to start their processes.", k8psh::Metrics::formatSeconds(std::uint64_t(getTotalQueueWaitTime().count()))) +
+		k8psh::Metrics::formatValue("process_cpu_seconds_total", "counter", "CPU time used by the server and its exited child processes.", k8psh::Metrics::formatSeconds(std::uint64_t(Utilities::getCpuTime().count())));
 
-	(void)_setmode(_fileno(stdin), _O_BINARY);
-	(void)_setmode(_fileno(stdout), _O_BINARY);
-	(void)_setmode(_fileno(stderr), _O_BINARY);
-	std::thread(readData, GetStdHandle(STD_INPUT_HANDLE), std::ref(stdInData)).detach();
+	return metrics ? metrics->format(gauges) : gauges;
+}
 
-	waitSet[1] = socket.createReadEvent();
-#else
-	struct pollfd pollSet[2] = { };
+// Gets the number of sessions waiting to start their processes.
+long long k8psh::Process::getQueuedSessionCount()
+{
+	return getProcessLimits().queuedSessions.get();
+}
 
-	pollSet[0].fd = STDIN_FILENO;
-	pollSet[0].events = POLLIN;
+// Gets the total time that sessions have waited to start their processes.
+std::chrono::microseconds k8psh::Process::getTotalQueueWaitTime()
+{
+	return std::chrono::microseconds(getProcessLimits().queueWaitTime.get());
+}
 
-	pollSet[1].fd = socket.createReadEvent();
-	pollSet[1].events = POLLIN;
-#endif
+// Starts recording the metrics of the server for the specified commands (this must be called before any sessions are forked).
+void k8psh::Process::recordMetrics(const k8psh::Configuration::CommandMap &commands)
+{
+	std::vector<std::string> commandNames;
 
-	std::string stdInBuffer(DATA_BUFFER_SIZE - 1, '\0');
+	for (auto it = commands.begin(); it != commands.end(); ++it)
+		commandNames.push_back(it->first);
 
-	// Wait for and process data from stdin and the socket
-	for (;;)
+	std::sort(commandNames.begin(), commandNames.end());
+	getMetrics().reset(new k8psh::Metrics(commandNames));
+}
+
+/** Limits the number of processes the server runs at once, so sessions wait in order to start their processes beyond the limit (this must be called before any sessions are forked).
+ *
+ * @param commands the map of commands for this server node (commands with their own limit are also limited individually)
+ * @param maxProcesses the maximum number of processes of all commands run at once, or zero for no limit
+ */
+void k8psh::Process::limitProcesses(const k8psh::Configuration::CommandMap &commands, long long maxProcesses)
+{
+	ProcessLimits &limits = getProcessLimits();
+
+	if (maxProcesses > 0)
 	{
-#ifdef _WIN32
-		// Check for new data
-		DWORD waitResult = WaitForMultipleObjects(DWORD(sizeof(waitSet) / sizeof(waitSet[0])), waitSet, FALSE, receiveSocket.hasBufferedData() ? 0 : INFINITE);
+		LOG_DEBUG << "Limiting server to " << maxProcesses << " processes at once";
+		limits.host.reset(new k8psh::FifoSemaphore(maxProcesses));
+	}
 
-		if (waitResult == WAIT_FAILED)
-			LOG_ERROR << "Failed to wait on multiple objects for new data: " << GetLastError();
-#else
-		int pollResult;
+	for (auto it = commands.begin(); it != commands.end(); ++it)
+	{
+		if (it->second.getMaxProcesses() > 0)
+		{
+			LOG_DEBUG << "Limiting command " << it->first << " to " << it->second.getMaxProcesses() << " processes at once";
+			limits.commands[it->first].reset(new k8psh::FifoSemaphore(it->second.getMaxProcesses()));
+		}
+	}
+}
 
-		do pollResult = poll(pollSet, nfds_t(sizeof(pollSet) / sizeof(pollSet[0])), receiveSocket.hasBufferedData() ? 0 : -1);
-		while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+// Releases the process limits held by a session process that exited without releasing them (like a killed process), so the next queued sessions can start their processes.
+void k8psh::Process::releaseProcessLimits(long long process)
+{
+	ProcessLimits &limits = getProcessLimits();
+	long long released = limits.host ? limits.host->releaseAll(process) : 0;
 
-		if (pollResult < 0)
-			LOG_ERROR << "Failed to poll for new data: " << errno;
-#endif
+	for (auto it = limits.commands.begin(); it != limits.commands.end(); ++it)
+		released += it->second->releaseAll(process);
 
-		// Check for stdin data
-#ifdef _WIN32
-		else if (waitResult == WAIT_OBJECT_0)
-#else
-		if ((pollSet[0].revents & POLLERR) != 0)
-			LOG_ERROR << "Failed to poll data from stdin";
-		else if ((pollSet[0].revents & (POLLIN | POLLHUP)) != 0)
-#endif
-		{
-#ifdef _WIN32
-			std::size_t received = stdInData._length;
+	if (released)
+		LOG_WARNING << "Released " << released << " process limit(s) held by exited process " << process;
+}
 
-			stdInBuffer.swap(stdInData._buffer);
-			SetEvent(stdInData._dataRead);
+// Prepares the environment of each command, so sessions only resolve the environment variables provided by their clients (this must be called before any sessions are forked).
+void k8psh::Process::prepareEnvironments(const k8psh::Configuration::CommandMap &commands)
+{
+	auto &environmentTemplates = getEnvironmentTemplates();
 
-			LOG_DEBUG << "Sending stdin data (" << received << " bytes) to server";
-			sendSocket.write(STDIN_DATA, stdInBuffer, received);
-#else
-			ssize_t received = read(pollSet[0].fd, &stdInBuffer[0], stdInBuffer.size());
+	environmentTemplates.clear();
 
-			if (received < 0)
-				LOG_ERROR << "Failed to read data from stdin: " << errno;
-			else if (received == 0)
-				pollSet[0].fd = -1; // No more data, so ignore it from now on
+	for (auto it = commands.begin(); it != commands.end(); ++it)
+		environmentTemplates[it->first] = EnvironmentTemplate(it->second);
+}
 
-			LOG_DEBUG << "Sending stdin data (" << received << " bytes) to server";
-			sendSocket.write(STDIN_DATA, stdInBuffer, std::size_t(received));
-#endif
-		}
+// Gets the number of times persistent workers have been retired, so processes forked before a worker was retired can tell that they cannot use its replacement.
+long long k8psh::Process::getPersistentWorkerRetirements()
+{
+	return getPersistentWorkers() ? getPersistentWorkers()->getRetirements() : 0;
+}
 
-		// Check for socket data
-#ifdef _WIN32
-		if (waitResult == WAIT_OBJECT_0 + 1 || receiveSocket.hasBufferedData())
-#else
-		if ((pollSet[1].revents & POLLERR) != 0)
-			LOG_ERROR << "Failed to poll data from socket";
-		else if ((pollSet[1].revents & (POLLIN | POLLHUP)) != 0 || receiveSocket.hasBufferedData())
+// Replaces the persistent workers that failed or ran their maximum number of requests (this must be called by the process that started the workers, and only the sessions forked after the workers are replaced can use the new workers).
+void k8psh::Process::replacePersistentWorkers()
+{
+#ifndef _WIN32
+	if (!getPersistentWorkers())
+		return;
+
+	const std::vector<long long> stopped = getPersistentWorkers()->replaceRetired();
+
+	for (auto it = stopped.begin(); it != stopped.end(); ++it)
+		orphanedProcesses.push_back(pid_t(*it));
+
+	reapOrphanedProcesses();
 #endif
-		{
-			for (bool skipCheck = K8PSH_SKIP_FIRST_SOCKET_DATA_CHECK; skipCheck || receiveSocket.hasData(); skipCheck = false)
-			{
-				PayloadType type;
-				std::uint32_t payloadValue;
+}
 
-				if (!receiveSocket.read(type, payloadValue)) // Closed socket indicates abnormal termination
-				{
-					LOG_DEBUG << "Socket has been closed without exit code, aborting";
-					std::abort();
-				}
+/** Starts the persistent workers of the commands that have them, which run the requests of sessions instead of starting a process for each session (this must be called before any sessions are forked, and is not supported on Windows).
+ *
+ * @param workingDirectory the relative working directory used to start the workers
+ * @param commands the map of commands for this server node
+ */
+void k8psh::Process::startPersistentWorkers(const std::string &workingDirectory, const k8psh::Configuration::CommandMap &commands)
+{
+	std::size_t capacity = 0;
 
-				switch (type)
-				{
-				case STDIN_DATA:
-					if (!std::cin.eof())
-					{
-						LOG_DEBUG << "Received stdin close command from server";
-						std::cin.setstate(std::ios_base::eofbit);
-						(void)std::fclose(stdin);
-					}
+	for (auto it = commands.begin(); it != commands.end(); ++it)
+		capacity += std::size_t(it->second.getPersistentWorkers());
 
-					break;
+	if (!capacity)
+		return;
 
-				case STDOUT_DATA:
-					outputStdStreamData(std::cout, stdout, "stdout", receiveSocket, payloadValue);
-					break;
+#ifdef _WIN32
+	(void)workingDirectory;
+	LOG_WARNING << "Persistent workers are not supported, starting a process for each session";
+#else
+	getPersistentWorkers().reset(new PersistentWorkers(capacity));
 
-				case STDERR_DATA:
-					outputStdStreamData(std::cerr, stderr, "stderr", receiveSocket, payloadValue);
-					break;
+	// The workers start before any client connects, so they use the environment of the command without any variables from a client (only sessions with the same environment use them)
+	for (auto it = commands.begin(); it != commands.end(); ++it)
+	{
+		if (!it->second.getPersistentWorkers())
+			continue;
 
-				case EXIT_CODE:
-					LOG_DEBUG << "Received exit code (" << int(payloadValue) << ") from server";
-					return int(payloadValue);
+		ProcessRequest request;
 
-				default:
-					LOG_ERROR << "Read invalid payload type (" << type << ") from socket";
-				}
-			}
-		}
+		request.commandName = it->first;
+
+		const std::vector<std::string> environment = request.build(commands);
+
+		LOG_DEBUG << "Starting " << it->second.getPersistentWorkers() << " persistent worker(s) for command " << it->first;
+		getPersistentWorkers()->add(it->first, request.arguments, environment, workingDirectory, it->second.getPersistentWorkers(), it->second.getMaxWorkerRequests());
 	}
+#endif
 }
 
-#ifdef _WIN32
-static std::mutex workingDirectoryMutex;
-#endif
+// Stops using the persistent workers, closing their handles so each worker exits once the sessions that share it finish (this must be called by the process that started the workers before waiting on its child processes).
+void k8psh::Process::stopPersistentWorkers()
+{
+	getPersistentWorkers().reset();
+}
 
 /** Runs the process requested by the remote socket channel.
  *
  * @param workingDirectory the relative working directory used to start the process
  * @param commands the map of commands for this server node
  * @param socket the open socket used to communicate with the client
+ * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+ * @param cache the cache used to store the results of cached commands, or null to always run the commands (not supported on Windows)
  */
-void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Configuration::CommandMap &commands, k8psh::Socket &&socket)
+void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Configuration::CommandMap &commands, k8psh::Socket &&socket, std::chrono::microseconds outputDelay, const k8psh::ResultCache *cache)
 {
-	BufferedSendSocket sendSocket(socket);
-	BufferedReceiveSocket receiveSocket(socket);
 #ifdef _WIN32
+	(void)cache; // Results are never cached on Windows, so cached commands are always run
+
+	// The handshake, admission, and exit code are handled like the sessions driven by a reactor, while the handles of the session are waited on here
+	SessionProtocol session(std::move(socket), outputDelay);
+	BufferedSendSocket &sendSocket = session._sendSocket;
+	BufferedReceiveSocket &receiveSocket = session._receiveSocket;
 	HANDLE process = HANDLE();
 
 	try
-#endif
 	{
 		// Read all the data for the command to execute
-		std::string processDirectory;
-		std::unordered_map<std::string, std::string> receivedEnvironmentVariables;
-		std::unordered_map<std::string, OptionalString> environmentVariables;
-		std::vector<std::string> arguments;
-		std::string commandName;
 		PayloadType type;
 		std::uint32_t payloadValue;
 
 		do
 		{
-			if (!receiveSocket.read(type, payloadValue)) // Closed socket indicates abnormal termination
+			if (!receiveSocket.read(type, payloadValue)) // Closed socket indicates abnormal termination (unless the client only queried the status and chose another server)
+			{
+				if (session.isStatusQueryFinished())
+				{
+					LOG_DEBUG << "Client closed the connection after the status query";
+					return;
+				}
+
 				LOG_ERROR << "Failed to read data from socket";
+			}
 
 			switch (type)
 			{
 			case WORKING_DIRECTORY:
-				{
-					std::string newDirectory = receiveSocket.readString(payloadValue);
-					processDirectory = (workingDirectory.empty() ? std::string() : workingDirectory + "/") + newDirectory;
-					LOG_DEBUG << "Received working directory (\"" << newDirectory << "\") from client, process directory set to \"" << processDirectory << "\"";
-					break;
-				}
-
 			case ENVIRONMENT_VARIABLE:
-				{
-					std::string environmentVariable = receiveSocket.readString(payloadValue);
-					LOG_DEBUG << "Received environment variable (\"" << environmentVariable << "\") from client";
-					std::size_t equals = environmentVariable.find("=");
-
-					if (equals == std::string::npos)
-						receivedEnvironmentVariables.emplace(std::make_pair(environmentVariable, Utilities::getEnvironmentVariable(environmentVariable)));
-					else
-						receivedEnvironmentVariables[environmentVariable.substr(0, equals)] = environmentVariable.substr(equals + 1);
-
-					break;
-				}
-
 			case COMMAND_ARGUMENT:
-				arguments.push_back(receiveSocket.readString(payloadValue));
-				LOG_DEBUG << "Received command argument (\"" << arguments.back() << "\") from client";
-				break;
-
 			case START_COMMAND:
-				commandName = receiveSocket.readString(payloadValue);
-				LOG_DEBUG << "Received start command (\"" << commandName << "\") from client";
+				session._request.add(workingDirectory, type, receiveSocket.readString(payloadValue));
 				break;
 
+			case STDIO_HANDLES:
+				LOG_ERROR << "Passing stdin, stdout, and stderr is not supported on Windows";
+
+			case MULTIPLEX:
+				LOG_ERROR << "Multiplexed connections are not supported on Windows";
+
 			default:
-				LOG_ERROR << "Read invalid payload type (" << type << ") from socket";
+				if (!session.handleHandshakeHeader(type, payloadValue))
+					LOG_ERROR << "Read invalid payload type (" << type << ") from socket";
 			}
 		} while (type != START_COMMAND);
 
-		auto commandIt = commands.find(commandName);
-
-		if (commandIt == commands.end())
-			LOG_ERROR << "Failed to find command \"" << commandName << "\" in configuration";
-
 		// Build the process
-		auto command = commandIt->second;
-		std::vector<std::string> environment;
-
-		for (auto it = command.getEnvironmentVariables().begin(); it != command.getEnvironmentVariables().end(); ++it)
-		{
-			// Inherited environment variable
-			if (it->first[0] == '=')
-			{
-				const std::string name = it->first.substr(1);
-				environmentVariables[name] = it->second.empty() ? Utilities::getEnvironmentVariable(name) : OptionalString(Utilities::substituteEnvironmentVariables(it->second, environmentVariables));
-			}
+		std::vector<std::string> environment = session._request.build(commands);
+		const ProcessRequest &request = session._request;
+		const std::vector<std::string> &arguments = request.arguments;
 
-			// User-provided environment variable
-			else
-			{
-				const bool isOptional = it->first[0] == '?';
-				const std::string name = isOptional ? it->first.substr(1) : it->first;
-				auto valueIt = receivedEnvironmentVariables.find(name);
-
-				if (valueIt != receivedEnvironmentVariables.end())
-					environmentVariables[name] = valueIt->second;
-				else
-					environmentVariables[name] = it->second.empty() && isOptional ? Utilities::getEnvironmentVariable(environmentVariables, name) : OptionalString(Utilities::substituteEnvironmentVariables(it->second, environmentVariables));
-			}
-		}
+		session.finishRequest();
 
-		// Build the environment strings, only allowing one for any key
-		for (auto it = command.getEnvironmentVariables().begin(); it != command.getEnvironmentVariables().end(); ++it)
+		// Wait in the queues of the process limits for the process to start (the wake handle is signaled once the session may be able to take its slot)
+		while (!session.admit())
 		{
-			const std::string name = it->first[0] == '=' || it->first[0] == '?' ? it->first.substr(1) : it->first;
-			auto valueIt = environmentVariables.find(name);
+			const Pipe::Handle wakeHandle = session._admission->getWakeHandle();
 
-			if (valueIt != environmentVariables.end() && valueIt->second)
-			{
-				environment.emplace_back(name + "=" + valueIt->second.c_str());
-				environmentVariables.erase(valueIt);
-			}
+			if (wakeHandle == Pipe::INVALID_HANDLE)
+				std::this_thread::sleep_for(QUEUE_POLL_INTERVAL); // The queue is full, so the session retries until it can join it
+			else if (WaitForSingleObject(wakeHandle, INFINITE) == WAIT_FAILED)
+				LOG_ERROR << "Failed to wait for the turn of the session: " << GetLastError();
 		}
 
-		arguments.insert(arguments.begin(), command.getExecutable().begin(), command.getExecutable().end());
-
 		Pipe stdInPipe;
-		Pipe stdOutPipe;
-		Pipe stdErrPipe;
+		Pipe stdOutPipe(true);
+		Pipe stdErrPipe(true);
 
-#ifdef _WIN32
 		{
 			std::string env;
 			std::string cmd;
@@ -653,8 +4205,8 @@ void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Confi
 			std::unique_lock<std::mutex> lock(workingDirectoryMutex);
 			std::string oldDirectory = Utilities::getWorkingDirectory();
 
-			if (!Utilities::changeWorkingDirectory(processDirectory))
-				LOG_ERROR << "Failed to change directory to " << processDirectory;
+			if (!Utilities::changeWorkingDirectory(request.processDirectory))
+				LOG_ERROR << "Failed to change directory to " << request.processDirectory;
 
 			LOG_DEBUG << "Starting " << cmd << ",\n" <<
 				"  working directory: \"" << Utilities::getWorkingDirectory() << "\",\n" <<
@@ -670,95 +4222,23 @@ void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Confi
 						return value;
 					}(env) << "\"";
 
+			const auto spawnTime = std::chrono::steady_clock::now();
+
+			session._phaseTime = spawnTime;
+
 			if (CreateProcessA(NULL, &cmd[0], NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP, &env[0], NULL, &si, &pi) == 0)
 				LOG_ERROR << "Failed to start " << arguments[0] << ": error " << GetLastError();
 
+			session.tracePhase("spawn");
+
+			if (session._metrics)
+				session._metrics->observe(Metrics::SPAWN_TIME, std::chrono::duration_cast<std::chrono::microseconds>(session._phaseTime - spawnTime));
+
 			(void)Utilities::changeWorkingDirectory(oldDirectory);
 			lock.unlock();
 			process = pi.hProcess;
 			(void)CloseHandle(pi.hThread);
 		}
-#else
-		int process = fork();
-
-		switch (process)
-		{
-		case 0:
-			{
-				// Setup the environment
-				std::vector<const char *> env;
-				std::vector<const char *> argv;
-
-				for (auto it = environment.begin(); it != environment.end(); ++it)
-					env.push_back(it->c_str());
-
-				env.push_back(NULL);
-
-				for (auto it = arguments.begin(); it != arguments.end(); ++it)
-					argv.push_back(it->c_str());
-
-				argv.push_back(NULL);
-
-				(void)close(socket.abandon());
-				stdInPipe.closeInput();
-				stdOutPipe.closeOutput();
-				stdErrPipe.closeOutput();
-
-				if (!Utilities::changeWorkingDirectory(processDirectory))
-					LOG_ERROR << "Failed to change directory to " << processDirectory;
-
-				auto concat = [](const std::vector<const char *> &list, bool quotes)
-					{
-						std::string value;
-
-						for (std::size_t i = 0; i < list.size() - 1; i++)
-						{
-							if (i)
-								value.append(quotes ? "\", \"" : " ");
-
-							if (!quotes)
-							{
-								const char *s = list[i];
-
-								while (*s && !Utilities::isWhitespace(*s))
-									s++;
-
-								if (*s)
-								{
-									value.append("\"").append(list[i]).append("\"");
-									continue;
-								}
-							}
-
-							value.append(list[i]);
-						}
-
-						return value;
-					};
-				LOG_DEBUG << "Starting " << concat(argv, false) << ",\n" <<
-					"  working directory: \"" << Utilities::getWorkingDirectory() << "\",\n" <<
-					"  environment: \"" << concat(env, true) << "\"";
-
-				if (!stdInPipe.remapOutput(STDIN_FILENO) || !stdOutPipe.remapInput(STDOUT_FILENO) || !stdErrPipe.remapInput(STDERR_FILENO))
-					LOG_ERROR << "Failed to map stdin, stdout, and stderr";
-
-				environ = const_cast<char **>(env.data());
-
-				// First, try the working directory (this provides compatibility across different platforms), then try the search path
-				(void)execv(argv[0], (char * const *)argv.data());
-				(void)execvp(argv[0], (char * const *)argv.data());
-
-				LOG_ERROR << "Failed to start " << arguments[0] << ": error " << errno;
-			}
-
-		case -1:
-			LOG_ERROR << "Failed to fork process";
-
-		default:
-			signal(SIGPIPE, SIG_IGN);
-			break;
-		}
-#endif
 
 		stdInPipe.closeOutput();
 		stdOutPipe.closeInput();
@@ -766,130 +4246,95 @@ void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Confi
 
 		// Process stdin, stdout, stderr
 		bool processHasExited = false;
-		std::string stdInData;
+		RingBuffer stdInData(STDIN_WINDOW_SIZE);
+		std::size_t stdInWritten = 0; // The stdin data written to the process since credit was last granted to the client
 		bool closeStdIn = false;
-		std::string pipeData(DATA_BUFFER_SIZE, '\0');
+		std::size_t outputCredit = OUTPUT_WINDOW_SIZE;
+		std::string compressedData;
 
 		if (!stdInPipe.setInputNonblocking())
 			LOG_ERROR << "Failed to set stdin to use non-blocking writes";
 
-#ifdef _WIN32
-		HANDLE waitSet[4];
-		SynchronousData stdOutData("StdOutData");
-		SynchronousData stdErrData("StdErrData");
-
-		waitSet[0] = stdOutData._dataAvailable;
-		std::thread(readData, stdOutPipe.getOutput(), std::ref(stdOutData)).detach();
-
-		waitSet[1] = stdErrData._dataAvailable;
-		std::thread(readData, stdErrPipe.getOutput(), std::ref(stdErrData)).detach();
-
-		waitSet[2] = socket.createReadEvent();
-		waitSet[3] = process;
-#else
-		int exitStatus = 0;
-		struct pollfd pollSet[4] = { };
-
-		pollSet[0].events = POLLOUT;
-		pollSet[1].events = POLLIN;
-		pollSet[2].events = POLLIN;
-
-		pollSet[3].fd = socket.createReadEvent();
-		pollSet[3].events = POLLIN;
-#endif
+		// All reads and events complete on the port, so the session waits on a single handle
+		enum CompletionKey { STDOUT_COMPLETION, STDERR_COMPLETION, SOCKET_COMPLETION, PROCESS_COMPLETION };
+		CompletionPort port;
+		DoubleBufferedReader stdOutReader(stdOutPipe.getOutput(), true, port, STDOUT_COMPLETION);
+		DoubleBufferedReader stdErrReader(stdErrPipe.getOutput(), true, port, STDERR_COMPLETION);
 
-		while (stdInPipe.getInput() != Pipe::INVALID_HANDLE || stdOutPipe.getOutput() != Pipe::INVALID_HANDLE || stdErrPipe.getOutput() != Pipe::INVALID_HANDLE)
-		{
-			// Check for new data
-#ifdef _WIN32
-			DWORD waitResult = WaitForMultipleObjects(DWORD(sizeof(waitSet) / sizeof(waitSet[0])), waitSet, FALSE, receiveSocket.hasBufferedData() ? 0 : stdInData.empty() ? INFINITE : 16);
+		port.notify(session._socket.createReadEvent(), SOCKET_COMPLETION, false);
+		port.notify(process, PROCESS_COMPLETION, true);
 
-			if (waitResult == WAIT_FAILED)
-				LOG_ERROR << "Failed to wait on multiple objects for new data: " << GetLastError();
-			else if (waitResult == WAIT_OBJECT_0 + 3)
-#else
-			if (!processHasExited && waitpid(process, &exitStatus, WNOHANG) > 0 && (WIFEXITED(exitStatus) || WIFSIGNALED(exitStatus)))
-#endif
+		// Sends the data read from an output pipe, as long as the client has room for it
+		auto relayOutput = [&sendSocket, &outputCredit, &compressedData, &session](DoubleBufferedReader &reader, PayloadType payloadType, const char *name)
 			{
-				LOG_DEBUG << "Process terminated, closing stdin, transfering remaining stdout and stderr data";
-
-				stdInData.clear();
-				stdInPipe.closeInput();
-				processHasExited = true;
-			}
-
-#ifndef _WIN32
-			int pollResult;
-
-			pollSet[0].fd = stdInData.empty() ? Pipe::INVALID_HANDLE : stdInPipe.getInput(); // Only wait on the stdin pipe if there is data ready to be sent to it
-			pollSet[1].fd = stdOutPipe.getOutput();
-			pollSet[2].fd = stdErrPipe.getOutput();
-
-			do pollResult = poll(pollSet, nfds_t(sizeof(pollSet) / sizeof(pollSet[0])), receiveSocket.hasBufferedData() ? 0 : 250);
-			while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+				std::size_t received = 0;
 
-			if (pollResult < 0)
-				LOG_ERROR << "Failed to poll for new data: " << errno;
-#endif
+				for (const char *data; (data = reader.getData(received)) != nullptr && received <= outputCredit; reader.consume())
+				{
+					if (received)
+					{
+						sendOutputData(sendSocket, payloadType, name, data, received, session._compress ? &compressedData : nullptr);
+						outputCredit -= received;
+					}
+				}
+			};
 
-			// Check for stdout data
-#ifdef _WIN32
-			else if (waitResult == WAIT_OBJECT_0)
-#else
-			if ((pollSet[1].revents & POLLERR) != 0)
-				LOG_ERROR << "Failed to poll data from stdout";
-			else if ((pollSet[1].revents & (POLLIN | POLLHUP)) != 0)
-#endif
+		// Checks if output is ready to be sent
+		auto isOutputReady = [&outputCredit](const DoubleBufferedReader &reader)
 			{
-#ifdef _WIN32
-				std::size_t received = stdOutData._length;
+				std::size_t length = 0;
 
-				pipeData.swap(stdOutData._buffer);
-				SetEvent(stdOutData._dataRead);
-#else
-				std::size_t received = stdOutPipe.read(pipeData);
-#endif
+				return reader.getData(length) && length <= outputCredit;
+			};
 
-				LOG_DEBUG << "Sending stdout data (" << received << " bytes) to client";
-				sendSocket.write(STDOUT_DATA, pipeData, received);
+		while (stdInPipe.getInput() != Pipe::INVALID_HANDLE || !stdOutReader.isClosed() || !stdErrReader.isClosed())
+		{
+			// Check for new data
+			// Output that was held for credit is sent as soon as credit arrives
+			auto flushTimeout = sendSocket.getFlushTimeout();
+			const bool outputReady = isOutputReady(stdOutReader) || isOutputReady(stdErrReader);
+			DWORD waitMs = receiveSocket.hasBufferedData() || outputReady ? 0 : stdInData.isEmpty() ? INFINITE : 16;
 
-				if (!received)
-					stdOutPipe.closeOutput();
-			}
+			if (flushTimeout.count() >= 0 && DWORD((flushTimeout.count() + 999) / 1000) < waitMs)
+				waitMs = DWORD((flushTimeout.count() + 999) / 1000);
 
-			// Check for stderr data
-#ifdef _WIN32
-			else if (waitResult == WAIT_OBJECT_0 + 1)
-#else
-			if ((pollSet[2].revents & POLLERR) != 0)
-				LOG_ERROR << "Failed to poll data from stderr";
-			else if ((pollSet[2].revents & (POLLIN | POLLHUP)) != 0)
-#endif
+			CompletionPort::Completion completion = { };
+			bool socketReady = false;
+
+			if (port.wait(completion, waitMs))
 			{
-#ifdef _WIN32
-				std::size_t received = stdErrData._length;
+				switch (completion.key)
+				{
+				case PROCESS_COMPLETION:
+					LOG_DEBUG << "Process terminated, closing stdin, transfering remaining stdout and stderr data";
+					session.tracePhase("run");
+					session._admission.reset(); // The next queued process can start
 
-				pipeData.swap(stdErrData._buffer);
-				SetEvent(stdErrData._dataRead);
-#else
-				std::size_t received = stdErrPipe.read(pipeData);
-#endif
+					stdInData.clear();
+					stdInPipe.closeInput();
+					processHasExited = true;
+					continue; // The output may have already been drained, so check if there is anything left to relay before waiting again
+
+				case STDOUT_COMPLETION:
+					stdOutReader.complete(completion);
+					break;
 
-				LOG_DEBUG << "Sending stderr data (" << received << " bytes) to client";
-				sendSocket.write(STDERR_DATA, pipeData, received);
+				case STDERR_COMPLETION:
+					stdErrReader.complete(completion);
+					break;
 
-				if (!received)
-					stdErrPipe.closeOutput();
+				default:
+					socketReady = true;
+					break;
+				}
 			}
 
+			// The readers fill their other buffer while the data is sent, and hold the data until the client has room for it
+			relayOutput(stdOutReader, STDOUT_DATA, "stdout");
+			relayOutput(stdErrReader, STDERR_DATA, "stderr");
+
 			// Check for socket data
-#ifdef _WIN32
-			if (waitResult == WAIT_OBJECT_0 + 2 || receiveSocket.hasBufferedData())
-#else
-			if ((pollSet[3].revents & POLLERR) != 0)
-				LOG_ERROR << "Failed to poll data from socket";
-			else if ((pollSet[3].revents & (POLLIN | POLLHUP)) != 0 || receiveSocket.hasBufferedData())
-#endif
+			if (socketReady || receiveSocket.hasBufferedData())
 			{
 				for (bool skipCheck = K8PSH_SKIP_FIRST_SOCKET_DATA_CHECK; skipCheck || receiveSocket.hasData(); skipCheck = false)
 				{
@@ -905,21 +4350,36 @@ void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Confi
 							LOG_DEBUG << "Received stdin data (" << payloadValue << " bytes) from client";
 
 							if (stdInPipe.getInput() == Pipe::INVALID_HANDLE)
+							{
 								LOG_DEBUG << "Ignoring " << payloadValue << " received bytes due to closed stdin"; // Ignore data on stdin after close
+								receiveSocket.readData(payloadValue, [](const char *, std::size_t) { });
+							}
 							else if (!payloadValue)
 								closeStdIn = true;
 							else
-								stdInData += receiveSocket.readString(payloadValue);
+							{
+								// Write directly to the pipe when no data is queued, only queuing the data that does not fit in the pipe
+								receiveSocket.readData(payloadValue, [&stdInData, &stdInWritten, &stdInPipe](const char *data, std::size_t length)
+									{
+										std::size_t written = stdInData.isEmpty() ? stdInPipe.write(data, length) : 0;
+
+										stdInWritten += written;
+
+										if (stdInData.append(data + written, length - written) != length - written)
+											LOG_ERROR << "Client exceeded the stdin window of " << STDIN_WINDOW_SIZE << " bytes";
+									});
+							}
 
 							break;
 						}
 
+					case OUTPUT_CREDIT:
+						LOG_DEBUG << "Received output credit (" << payloadValue << " bytes) from client";
+						outputCredit += payloadValue;
+						break;
+
 					default:
-#ifdef _WIN32
 						(void)TerminateProcess(process, UINT(-1));
-#else
-						(void)kill(process, 15); // Send TERM
-#endif
 
 						if (!dataReceived)
 							LOG_ERROR << "Socket was closed unexpectedly";
@@ -934,72 +4394,568 @@ void k8psh::Process::run(const std::string &workingDirectory, const k8psh::Confi
 			}
 
 			// Handle stdin data out-of-band, so we don't end up in a pipe-write deadlock
-			if (!stdInData.empty())
+			if (!stdInData.isEmpty())
 			{
-				(void)stdInData.erase(0, stdInPipe.write(stdInData));
+				for (std::size_t length = 0, written = 0; !stdInData.isEmpty() && written == length; )
+				{
+					const char *data = stdInData.getFront(length);
+
+					written = stdInPipe.write(data, length);
+					stdInWritten += written;
+					stdInData.consume(written);
+				}
 
 				// Check if the pipe has been closed
 				if (stdInPipe.getInput() == Pipe::INVALID_HANDLE)
 				{
-					LOG_DEBUG << "Process has closed stdin, lost " << stdInData.length() << " bytes";
+					LOG_DEBUG << "Process has closed stdin, lost " << stdInData.getSize() << " bytes";
 					stdInData.clear();
-					sendSocket.write(STDIN_DATA, stdInData, std::size_t());
+					sendSocket.write(STDIN_DATA, std::string());
 				}
 			}
 
-			if (closeStdIn && stdInData.empty())
+			// Grant the client more stdin credit once enough of its data has been written to the process
+			if (stdInWritten >= STDIN_WINDOW_SIZE / CREDIT_WINDOW_DIVISOR && stdInPipe.getInput() != Pipe::INVALID_HANDLE)
+			{
+				LOG_DEBUG << "Sending stdin credit (" << stdInWritten << " bytes) to client";
+				sendSocket.writeValue(STDIN_CREDIT, std::uint32_t(stdInWritten));
+				stdInWritten = 0;
+			}
+
+			if (closeStdIn && stdInData.isEmpty())
 			{
 				LOG_DEBUG << "Closing stdin";
 				closeStdIn = false;
 				stdInPipe.closeInput();
 			}
+
+			sendSocket.flushExpired();
 		}
 
+		// Send any delayed output before the exit code
+		sendSocket.flush();
+
 		// Wait for application to exit
 		if (!processHasExited)
 			LOG_DEBUG << "Waiting for process to terminate";
 
-#ifdef _WIN32
 		if (processHasExited || WaitForSingleObject(process, INFINITE) == WAIT_OBJECT_0)
 		{
 			DWORD exitCode = 0;
 
 			if (GetExitCodeProcess(process, &exitCode) != 0)
 			{
-				LOG_DEBUG << "Sending exit code (" << exitCode << ") to client";
-				socket.write({ std::uint8_t(EXIT_CODE), std::uint8_t(exitCode), std::uint8_t(exitCode >> 8), std::uint8_t(exitCode >> 16), std::uint8_t(exitCode >> 24) });
+				session.writeExitCode("drain", std::uint32_t(exitCode));
+				session.countExit(exitCode);
 			}
 		}
+
+		// Discard any stdin data still in flight until the client closes the connection (closing with unread data resets the connection, which can lose the exit code)
+		session._socket.shutdown();
+
+		for (std::vector<std::uint8_t> discardBuffer(INITIAL_MTU_SIZE); session._socket.read(discardBuffer); )
+			;
+
+terminateServer:
+		;
+	}
+	catch (...) { }
+
+	// Clean up all resources, since we are part of the long-running server process
+	(void)CloseHandle(process);
 #else
-		if (!processHasExited)
+	// The session is the only one driven by the reactor, so it writes to the socket without waiting for it to become writable
+	Reactor reactor;
+	std::string pipeData;
+	ServerSession session(workingDirectory, commands, std::move(socket), outputDelay, reactor, pipeData, false, cache);
+	std::vector<Reactor::Event> events;
+
+	while (!session.isFinished())
+	{
+		if (session.isMultiplexed())
+		{
+			session.runMultiplexed();
+			break;
+		}
+
+		(void)reactor.wait(events, session.checkTimers());
+
+		for (auto it = events.begin(); it != events.end(); ++it)
+			session.handle(*it);
+	}
+
+	reapOrphanedProcesses();
+#endif
+}
+
+#ifndef _WIN32
+/** Runs all client sessions in a single process, using a reactor to wait on the sockets, pipes, and processes of every session.
+ *
+ * @param workingDirectory the relative working directory used to start the processes
+ * @param commands the map of commands for this server node
+ * @param listener the server socket used to accept clients
+ * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+ * @param maxConnections the maximum number of connections to accept, or negative for no limit
+ * @param endTime the time that the server stops accepting connections
+ * @param exitRequested the pipe that is closed when the server is requested to exit
+ * @param waitOnSessions true to continue running the active sessions after a timeout or exit request, false to close them (the sessions of the maximum number of connections always run to completion)
+ * @param cache the cache used to store the results of cached commands, or null to always run the commands
+ * @param sharedConnections the number of connections accepted by all event loops sharing the port of the listener, which the maximum number of connections applies to (or null if the port is not shared)
+ * @return the number of connections accepted
+ */
+long long k8psh::Process::runEventLoop(const std::string &workingDirectory, const k8psh::Configuration::CommandMap &commands, k8psh::Socket &listener, std::chrono::microseconds outputDelay, long long maxConnections, std::chrono::steady_clock::time_point endTime, k8psh::Pipe &exitRequested, bool waitOnSessions, const k8psh::ResultCache *cache, k8psh::SharedCounter *sharedConnections)
+{
+	// Markers for the handles that are not owned by a session
+	static char listenerEvent;
+	static char exitRequestedEvent;
+	static char childExitedEvent;
+
+	Reactor reactor;
+	std::string pipeData(DATA_BUFFER_SIZE, '\0');
+	std::list<std::unique_ptr<ServerSession>> sessions;
+	std::vector<Reactor::Event> events;
+	std::set<ServerSession *> failedSessions;
+	long long connectionCount = 0;
+	bool accepting = true;
+	bool closeSessions = false;
+
+	// Stops accepting connections, optionally closing the active sessions
+	auto stopAccepting = [&](bool close)
+		{
+			LOG_DEBUG << "Stopping accepting connections, " << sessions.size() << " session(s) active";
+			reactor.watch(listener.createReadEvent(), 0, &listenerEvent);
+			reactor.watch(exitRequested.getOutput(), 0, &exitRequestedEvent);
+			accepting = false;
+			closeSessions = close;
+		};
+
+	// Checks if the maximum number of connections have been accepted (by any event loop sharing the port)
+	auto isFull = [&]
+		{
+			return maxConnections >= 0 && (sharedConnections ? sharedConnections->get() : connectionCount) >= maxConnections;
+		};
+
+	// Claims a connection before it is accepted, returning false if the maximum number of connections have already been claimed
+	auto claimConnection = [&]
+		{
+			if (!sharedConnections)
+				return maxConnections < 0 || connectionCount < maxConnections;
+			else if (sharedConnections->add(1) <= maxConnections || maxConnections < 0)
+				return true;
+
+			(void)sharedConnections->add(-1);
+			return false;
+		};
+
+	// Processes are reaped by the sessions (or as orphans), and writes to closed sockets are reported as errors rather than signals
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!listener.setNonblocking())
+		LOG_ERROR << "Failed to set listener to use non-blocking accepts";
+
+	reactor.watch(listener.createReadEvent(), Reactor::READABLE, &listenerEvent);
+	reactor.watch(exitRequested.getOutput(), Reactor::READABLE, &exitRequestedEvent);
+
+	do
+	{
+		if (accepting && isFull())
+			stopAccepting(false); // The sessions of the accepted connections always run to completion
+		else if (accepting && std::chrono::steady_clock::now() >= endTime)
+			stopAccepting(!waitOnSessions);
+
+		// The loop stops before waiting once nothing is left to wait for (the server could stop accepting with no active sessions)
+		if (closeSessions || (!accepting && sessions.empty()))
+			break;
+
+		// Wait until the next delayed output is due (or the server stops accepting connections)
+		std::chrono::microseconds timeout(-1);
+
+		for (auto it = sessions.begin(); it != sessions.end(); ++it)
+		{
+			try
+			{
+				auto sessionTimeout = (*it)->checkTimers();
+
+				if (sessionTimeout.count() >= 0 && (timeout.count() < 0 || sessionTimeout < timeout))
+					timeout = sessionTimeout;
+			}
+			catch (const std::exception &) { failedSessions.insert(it->get()); }
+		}
+
+		if (accepting && endTime != std::chrono::steady_clock::time_point::max())
+		{
+			auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(endTime - std::chrono::steady_clock::now()) + std::chrono::microseconds(1);
+
+			if (timeout.count() < 0 || remaining < timeout)
+				timeout = remaining < std::chrono::microseconds() ? std::chrono::microseconds() : remaining;
+		}
+
+		// Process exits are signaled by the shared exit handle when process handles are not supported
+		const int signalHandle = ProcessExitEvent::getSignalHandle();
+
+		if (signalHandle != Pipe::INVALID_HANDLE)
+			reactor.watch(signalHandle, Reactor::READABLE, &childExitedEvent);
+
+		if (failedSessions.empty())
+			(void)reactor.wait(events, timeout);
+		else
+			events.clear();
+
+		for (auto it = events.begin(); it != events.end(); ++it)
 		{
-			pid_t pid = 0;
+			if (it->context == &listenerEvent)
+			{
+				while (accepting && claimConnection())
+				{
+					k8psh::Socket client = listener.accept();
+
+					if (!client.isValid())
+					{
+						if (sharedConnections)
+							(void)sharedConnections->add(-1);
+
+						break;
+					}
+
+					LOG_DEBUG << "Accepted connection from new client";
+					connectionCount++;
+
+					try { sessions.emplace_back(new ServerSession(workingDirectory, commands, std::move(client), outputDelay, reactor, pipeData, true, cache)); }
+					catch (const std::exception &) { }
+
+					// Each listener sharing a port has its own queue, so one connection is accepted per event (the listener stays readable until its queue is empty), rather than claiming a connection for an accept that fails
+					if (sharedConnections)
+						break;
+				}
+			}
+			else if (it->context == &exitRequestedEvent)
+			{
+				LOG_DEBUG << "Exit requested";
+				stopAccepting(!waitOnSessions && !isFull()); // Event loops sharing the port are requested to exit once any of them accepts the maximum number of connections
+			}
+			else if (it->context == &childExitedEvent)
+			{
+				ProcessExitEvent::resetSignalHandle();
 
-			while (pid <= 0 || !(WIFEXITED(exitStatus) || WIFSIGNALED(exitStatus)))
+				for (auto sessionIt = sessions.begin(); sessionIt != sessions.end(); ++sessionIt)
+				{
+					try { (*sessionIt)->checkExited(); }
+					catch (const std::exception &) { failedSessions.insert(sessionIt->get()); }
+				}
+			}
+			else
 			{
-				pid = waitpid(process, &exitStatus, 0);
+				ServerSession *session = static_cast<ServerSession *>(it->context);
+
+				// Sessions that failed are only destroyed after all events have been handled, so later events can still refer to them
+				if (failedSessions.count(session))
+					continue;
 
-				if (pid < 0 && errno != EINTR)
-					LOG_ERROR << "Failed to get exit code of process: " << errno;
+				try { session->handle(*it); }
+				catch (const std::exception &) { failedSessions.insert(session); }
 			}
 		}
 
-		if (WIFEXITED(exitStatus)) // Only send exit code on normal termination
+		// Destroy the finished sessions, and run multiplexed connections in a forked process (they are driven by their own loop)
+		for (auto it = sessions.begin(); it != sessions.end(); )
 		{
-			int exitCode = WEXITSTATUS(exitStatus);
+			ServerSession &session = **it;
+
+			if (session.isMultiplexed() && !failedSessions.count(&session))
+			{
+				pid_t child = fork();
+
+				if (child == 0)
+				{
+					// The reactor is shared with the server, so the child never changes it
+					(void)close(listener.abandon());
+					exitRequested.closeInput();
+
+					for (auto sessionIt = sessions.begin(); sessionIt != sessions.end(); ++sessionIt)
+					{
+						if (sessionIt != it)
+							(*sessionIt)->abandon();
+					}
+
+					try { session.runMultiplexed(); }
+					catch (const std::exception &) { }
+
+					std::exit(0);
+				}
+				else if (child == -1)
+					LOG_WARNING << "Failed to fork multiplexed connection: " << errno;
+				else
+					orphanedProcesses.push_back(child);
+
+				session.unwatch();
+				session.abandon();
+			}
 
-			LOG_DEBUG << "Sending exit code (" << exitCode << ") to client";
-			socket.write({ std::uint8_t(EXIT_CODE), std::uint8_t(exitCode), std::uint8_t(exitCode >> 8), std::uint8_t(exitCode >> 16), std::uint8_t(exitCode >> 24) });
+			if (session.isFinished() || failedSessions.count(&session))
+				it = sessions.erase(it);
+			else
+				++it;
 		}
+
+		failedSessions.clear();
+		reapOrphanedProcesses();
+		k8psh::Process::replacePersistentWorkers();
+	} while (accepting || (!closeSessions && !sessions.empty()));
+
+	LOG_DEBUG << "Closing " << sessions.size() << " remaining session(s)";
+	return connectionCount;
+}
 #endif
 
-terminateServer:
-		;
+#ifndef _WIN32
+// A client connected to the agent, whose requested host is read as it arrives (so a slow client does not hold up the sessions of the other clients)
+struct AgentClient
+{
+	static const std::size_t HEADER_SIZE = 5;
+	static const std::size_t MAX_HOSTNAME_LENGTH = 1024;
+
+	k8psh::Socket socket;
+	std::vector<std::uint8_t> data; // The header of the host payload, followed by the hostname once the header is received
+	std::size_t received;
+
+	AgentClient(k8psh::Socket &&socket) : socket(std::move(socket)), data(HEADER_SIZE), received() { }
+
+	/** Reads the host requested by the client once the socket is readable (only the host payload is read, so the rest of the client data is relayed to the server).
+	 *
+	 * @param hostname set to the requested host once all of it has been received
+	 * @return false if the client closed the connection or did not send a valid host, otherwise true
+	 */
+	bool readHost(std::string &hostname)
+	{
+		std::size_t length = 0;
+
+		try { length = socket.read(data, received); }
+		catch (const std::exception &) { }
+
+		if (!length)
+			return false;
+		else if ((received += length) < data.size())
+			return true;
+		else if (data.size() == HEADER_SIZE)
+		{
+			const std::size_t hostnameLength = std::size_t(data[1]) + (std::size_t(data[2]) << 8) + (std::size_t(data[3]) << 16) + (std::size_t(data[4]) << 24);
+
+			if (data[0] != AGENT_HOST || !hostnameLength || hostnameLength > MAX_HOSTNAME_LENGTH)
+				return false;
+
+			data.resize(HEADER_SIZE + hostnameLength);
+			return true;
+		}
+
+		hostname.assign(data.begin() + HEADER_SIZE, data.end());
+		return true;
 	}
+};
+
+// A connection being opened by the agent to a host, along with the clients waiting for it (clients only wait if the host has no open connections)
+struct AgentConnection
+{
+	k8psh::Socket socket;
+	std::vector<k8psh::Socket> clients;
+};
+#endif
+
+/** Runs the agent, which relays client sessions to the servers over a small number of long-lived multiplexed connections.
+ *
+ * @param configuration the global configuration
+ */
+void k8psh::Process::runAgent(const k8psh::Configuration &configuration)
+{
 #ifdef _WIN32
-	catch (...) { }
+	(void)configuration;
+	LOG_ERROR << "The agent is not supported on Windows";
+#else
+	if (configuration.getAgentSocketPath().empty())
+		LOG_ERROR << "No agentSocket found in configuration";
 
-	// Clean up all resources, since we are part of the long-running server process
-	(void)CloseHandle(process);
+	Socket listener = Socket::listen(configuration.getAgentSocketPath());
+	std::unordered_map<std::string, std::vector<std::unique_ptr<StreamMultiplexer> > > hostConnections;
+	std::unordered_map<std::string, AgentConnection> openingConnections; // At most one connection to each host is opened at a time
+	std::list<AgentClient> clients; // The clients that have not sent their host yet
+	std::vector<struct pollfd> pollSet;
+
+	// Gets the connection to a host with the fewest streams, or null if there are none
+	auto getLeastBusy = [&hostConnections](const std::string &hostname)
+	{
+		auto &connections = hostConnections[hostname];
+		StreamMultiplexer *selected = nullptr;
+
+		for (auto it = connections.begin(); it != connections.end(); ++it)
+		{
+			if (!selected || (*it)->getStreamCount() < selected->getStreamCount())
+				selected = it->get();
+		}
+
+		return selected;
+	};
+
+	// Adds a client to the least busy connection to its host (new connections are opened until each connection is busy or the limit is reached, and clients only wait for them if there are no other connections)
+	auto addClient = [&](Socket &&client, const std::string &hostname)
+	{
+		const auto commands = configuration.getCommands(hostname);
+
+		if (!commands || commands->empty())
+		{
+			LOG_WARNING << "Closing client that requested unknown host \"" << hostname << '"';
+			return;
+		}
+
+		StreamMultiplexer *selected = getLeastBusy(hostname);
+		auto opening = openingConnections.find(hostname);
+
+		if (opening == openingConnections.end() && (!selected || (selected->getStreamCount() && hostConnections[hostname].size() < std::size_t(configuration.getAgentConnections()))))
+		{
+			Socket socket = startConnectToHost(commands->begin()->second.getHost());
+
+			if (socket.isValid())
+			{
+				opening = openingConnections.emplace(hostname, AgentConnection()).first;
+				opening->second.socket = std::move(socket);
+			}
+			else if (!selected)
+			{
+				LOG_WARNING << "Failed to connect to " << hostname << ", closing client";
+				return;
+			}
+		}
+
+		if (selected)
+			(void)selected->addStream(std::move(client));
+		else
+			opening->second.clients.push_back(std::move(client));
+	};
+
+	LOG_DEBUG << "Agent listening on " << configuration.getAgentSocketPath();
+
+	for (;;)
+	{
+		struct pollfd entry = { };
+		bool hasBufferedData = false;
+		int pollResult;
+
+		entry.fd = listener.createReadEvent();
+		entry.events = POLLIN;
+		pollSet.assign(1, entry);
+
+		for (auto it = hostConnections.begin(); it != hostConnections.end(); ++it)
+		{
+			for (auto connectionIt = it->second.begin(); connectionIt != it->second.end(); ++connectionIt)
+			{
+				(*connectionIt)->preparePoll(pollSet);
+				hasBufferedData |= (*connectionIt)->hasBufferedData();
+			}
+		}
+
+		// The connections being opened are complete once they are writable
+		const std::size_t openingIndex = pollSet.size();
+
+		for (auto it = openingConnections.begin(); it != openingConnections.end(); ++it)
+		{
+			entry.fd = it->second.socket.createReadEvent();
+			entry.events = POLLOUT;
+			pollSet.push_back(entry);
+		}
+
+		const std::size_t clientIndex = pollSet.size();
+
+		for (auto it = clients.begin(); it != clients.end(); ++it)
+		{
+			entry.fd = it->socket.createReadEvent();
+			entry.events = POLLIN;
+			pollSet.push_back(entry);
+		}
+
+		do pollResult = poll(pollSet.data(), nfds_t(pollSet.size()), hasBufferedData ? 0 : -1);
+		while (pollResult < 0 && (errno == EAGAIN || errno == EINTR));
+
+		if (pollResult < 0)
+			LOG_ERROR << "Failed to poll agent connections: " << errno;
+
+		// Relay data on all connections (servers never start streams, and losing a connection closes all its clients)
+		for (auto it = hostConnections.begin(); it != hostConnections.end(); ++it)
+		{
+			for (auto connectionIt = it->second.begin(); connectionIt != it->second.end(); )
+			{
+				if ((*connectionIt)->relay(pollSet, [](std::uint32_t) { return Socket(); }))
+					++connectionIt;
+				else
+				{
+					LOG_WARNING << "Lost connection to " << it->first << ", closing " << (*connectionIt)->getStreamCount() << " sessions";
+					connectionIt = it->second.erase(connectionIt);
+				}
+			}
+		}
+
+		// Finish opening the connections that completed, moving their waiting clients to the least busy connection to the host (the clients are closed if there are none)
+		std::size_t i = openingIndex;
+
+		for (auto it = openingConnections.begin(); it != openingConnections.end(); i++)
+		{
+			if ((pollSet[i].revents & (POLLOUT | POLLHUP | POLLERR)) == 0)
+			{
+				++it;
+				continue;
+			}
+
+			auto &connections = hostConnections[it->first];
+			bool opened = false;
+
+			try { opened = it->second.socket.finishConnect() && it->second.socket.write({ std::uint8_t(MULTIPLEX), 0, 0, 0, 0 }) == 5; }
+			catch (const std::exception &) { }
+
+			if (opened)
+			{
+				LOG_DEBUG << "Opened multiplexed connection " << (connections.size() + 1) << " to " << it->first;
+				connections.emplace_back(new StreamMultiplexer(std::move(it->second.socket)));
+			}
+			else if (connections.empty())
+				LOG_WARNING << "Failed to connect to " << it->first << ", closing " << it->second.clients.size() << " clients";
+
+			StreamMultiplexer *selected = getLeastBusy(it->first);
+
+			for (auto clientIt = it->second.clients.begin(); selected && clientIt != it->second.clients.end(); ++clientIt)
+				(void)selected->addStream(std::move(*clientIt));
+
+			it = openingConnections.erase(it);
+		}
+
+		// Read the hosts sent by the clients, adding each client to a connection once its host has been received
+		i = clientIndex;
+
+		for (auto it = clients.begin(); it != clients.end(); i++)
+		{
+			std::string hostname;
+
+			if ((pollSet[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+				++it;
+			else if (!it->readHost(hostname))
+			{
+				LOG_WARNING << "Closing client that did not send a valid host";
+				it = clients.erase(it);
+			}
+			else if (hostname.empty())
+				++it;
+			else
+			{
+				addClient(std::move(it->socket), hostname);
+				it = clients.erase(it);
+			}
+		}
+
+		// Accept a new client, which is added to a connection once it sends its host
+		if ((pollSet[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+		{
+			Socket client = listener.accept();
+
+			if (client.isValid())
+				clients.emplace_back(std::move(client));
+		}
+	}
 #endif
 }
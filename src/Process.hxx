@@ -4,10 +4,14 @@
 #ifndef K8PSH_PROCESS_HXX
 #define K8PSH_PROCESS_HXX
 
+#include <chrono>
+#include <cstdint>
 #include <string>
 
 #include "Configuration.hxx"
+#include "ResultCache.hxx"
 #include "Socket.hxx"
+#include "Utilities.hxx"
 
 namespace k8psh {
 
@@ -17,6 +21,19 @@ class Process
 	Process();
 
 public:
+	// The stdio used by a remote command that runs in-process (so many commands can run at once, like in a benchmark), and the times of its session.
+	struct RemoteStreams
+	{
+		int stdIn;  // Read until the end of the stream (the handles are owned by the caller, so they are never closed)
+		int stdOut;
+		int stdErr;
+		std::chrono::steady_clock::time_point connectedTime;   // Set once connected to the server
+		std::chrono::steady_clock::time_point firstOutputTime; // Set once the first stdout or stderr data (or the exit code, if there is no output) is received
+		std::uint64_t outputSize;                              // The number of bytes of stdout and stderr data received
+
+		RemoteStreams(int in, int out, int err) : stdIn(in), stdOut(out), stdErr(err), connectedTime(), firstOutputTime(), outputSize() { }
+	};
+
 	/** Runs a process remotely on the configured host.
 	 *
 	 * @param workingDirectory the relative working directory used to start the process
@@ -24,17 +41,92 @@ public:
 	 * @param argc the number of additional arguments used to start the process
 	 * @param argv additional arguments used to start the process
 	 * @param configuration the global configuration
+	 * @param traceFilename the file that the phases of the session on the client and the server are appended to as Chrome trace events, or empty to not trace the session
+	 * @param streams the stdio used by the process instead of the stdio of the client, or null to use the stdio of the client (not supported on Windows)
 	 * @return the exit code of the process
 	 */
-	static int runRemoteCommand(const std::string &workingDirectory, const Configuration::Command &command, std::size_t argc, const char *argv[], const Configuration &configuration);
+	static int runRemoteCommand(const std::string &workingDirectory, const Configuration::Command &command, std::size_t argc, const char *argv[], const Configuration &configuration, const std::string &traceFilename = std::string(), RemoteStreams *streams = nullptr);
+
+	// Creates the count of server sessions that have started their processes, which is shared with the session processes forked after it is created (this must be called before any sessions are forked).
+	static void countActiveSessions();
+
+	// Gets the number of server sessions that have started their processes.
+	static long long getActiveSessionCount();
+
+	// Formats the metrics of the server in the Prometheus text exposition format.
+	static std::string formatMetrics();
+
+	// Gets the number of sessions waiting to start their processes.
+	static long long getQueuedSessionCount();
+
+	// Gets the total time that sessions have waited to start their processes.
+	static std::chrono::microseconds getTotalQueueWaitTime();
+
+	// Starts recording the metrics of the server for the specified commands (this must be called before any sessions are forked).
+	static void recordMetrics(const Configuration::CommandMap &commands);
+
+	/** Limits the number of processes the server runs at once, so sessions wait in order to start their processes beyond the limit (this must be called before any sessions are forked).
+	 *
+	 * @param commands the map of commands for this server node (commands with their own limit are also limited individually)
+	 * @param maxProcesses the maximum number of processes of all commands run at once, or zero for no limit
+	 */
+	static void limitProcesses(const Configuration::CommandMap &commands, long long maxProcesses);
+
+	// Releases the process limits held by a session process that exited without releasing them (like a killed process), so the next queued sessions can start their processes.
+	static void releaseProcessLimits(long long process);
+
+	// Prepares the environment of each command, so sessions only resolve the environment variables provided by their clients (this must be called before any sessions are forked).
+	static void prepareEnvironments(const Configuration::CommandMap &commands);
+
+	// Gets the number of times persistent workers have been retired, so processes forked before a worker was retired can tell that they cannot use its replacement.
+	static long long getPersistentWorkerRetirements();
+
+	// Replaces the persistent workers that failed or ran their maximum number of requests (this must be called by the process that started the workers, and only the sessions forked after the workers are replaced can use the new workers).
+	static void replacePersistentWorkers();
 
 	/** Runs the process requested by the remote socket channel.
 	 *
 	 * @param workingDirectory the relative working directory used to start the process
 	 * @param commands the map of commands for this server node
 	 * @param socket the open socket used to communicate with the client
+	 * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+	 * @param cache the cache used to store the results of cached commands, or null to always run the commands (not supported on Windows)
+	 */
+	static void run(const std::string &workingDirectory, const Configuration::CommandMap &commands, Socket &&socket, std::chrono::microseconds outputDelay = std::chrono::microseconds(), const ResultCache *cache = nullptr);
+
+	/** Starts the persistent workers of the commands that have them, which run the requests of sessions instead of starting a process for each session (this must be called before any sessions are forked, and is not supported on Windows).
+	 *
+	 * @param workingDirectory the relative working directory used to start the workers
+	 * @param commands the map of commands for this server node
+	 */
+	static void startPersistentWorkers(const std::string &workingDirectory, const Configuration::CommandMap &commands);
+
+	// Stops using the persistent workers, closing their handles so each worker exits once the sessions that share it finish (this must be called by the process that started the workers before waiting on its child processes).
+	static void stopPersistentWorkers();
+
+#ifndef _WIN32
+	/** Runs all client sessions in a single process, using a reactor to wait on the sockets, pipes, and processes of every session.
+	 *
+	 * @param workingDirectory the relative working directory used to start the processes
+	 * @param commands the map of commands for this server node
+	 * @param listener the server socket used to accept clients
+	 * @param outputDelay the maximum time that stdout and stderr data is delayed so it can be coalesced with other output
+	 * @param maxConnections the maximum number of connections to accept, or negative for no limit
+	 * @param endTime the time that the server stops accepting connections
+	 * @param exitRequested the pipe that is closed when the server is requested to exit
+	 * @param waitOnSessions true to continue running the active sessions after a timeout or exit request, false to close them (the sessions of the maximum number of connections always run to completion)
+	 * @param cache the cache used to store the results of cached commands, or null to always run the commands
+	 * @param sharedConnections the number of connections accepted by all event loops sharing the port of the listener, which the maximum number of connections applies to (or null if the port is not shared)
+	 * @return the number of connections accepted
+	 */
+	static long long runEventLoop(const std::string &workingDirectory, const Configuration::CommandMap &commands, Socket &listener, std::chrono::microseconds outputDelay, long long maxConnections, std::chrono::steady_clock::time_point endTime, Pipe &exitRequested, bool waitOnSessions, const ResultCache *cache = nullptr, SharedCounter *sharedConnections = nullptr);
+#endif
+
+	/** Runs the agent, which relays client sessions to the servers over a small number of long-lived multiplexed connections.
+	 *
+	 * @param configuration the global configuration
 	 */
-	static void run(const std::string &workingDirectory, const Configuration::CommandMap &commands, Socket &&socket);
+	static void runAgent(const Configuration &configuration);
 };
 
 } // k8psh
@@ -0,0 +1,277 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "ResultCache.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <dirent.h>
+	#include <sys/stat.h>
+	#include <sys/time.h>
+#endif
+
+#include "Utilities.hxx"
+
+// The identifier at the start of all stored results (the last 2 characters are the version).
+static const char RESULT_MAGIC[] = { 'K', '8', 'P', 'S', 'H', 'R', '0', '1' };
+
+// The extension of the files used to store results.
+static const std::string RESULT_EXTENSION = ".result";
+
+// Hashes a key using 64-bit FNV-1a with the specified offset basis.
+static std::uint64_t hashKey(const std::string &key, std::uint64_t hash)
+{
+	for (std::size_t i = 0; i < key.length(); i++)
+		hash = (hash ^ std::uint8_t(key[i])) * 0x100000001B3;
+
+	return hash;
+}
+
+// Appends a little-endian 4 byte value to a key or result file.
+static void appendKeyValue(std::string &data, std::uint64_t value)
+{
+	for (std::size_t i = 0; i < 4; i++)
+		data += char(value >> (8 * i));
+}
+
+// Appends a length-prefixed string to a key or result file.
+static void appendKeyString(std::string &data, const std::string &value)
+{
+	appendKeyValue(data, value.length());
+	data += value;
+}
+
+// A stored result, used to find the least recently used results.
+struct StoredResult
+{
+	std::uint64_t lastUsed;
+	std::uint64_t size;
+	std::string filename;
+
+	bool operator<(const StoredResult &other) const { return std::tie(lastUsed, filename) < std::tie(other.lastUsed, other.filename); }
+};
+
+// Finds all results stored in the directory.
+static std::vector<StoredResult> findStoredResults(const std::string &directory)
+{
+	std::vector<StoredResult> results;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((directory + "\\*" + RESULT_EXTENSION).c_str(), &findData);
+
+	if (find == INVALID_HANDLE_VALUE)
+		return results;
+
+	do
+	{
+		StoredResult result;
+
+		result.lastUsed = (std::uint64_t(findData.ftLastWriteTime.dwHighDateTime) << 32) | findData.ftLastWriteTime.dwLowDateTime;
+		result.size = (std::uint64_t(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+		result.filename = directory + '\\' + findData.cFileName;
+		results.emplace_back(std::move(result));
+	} while (FindNextFileA(find, &findData));
+
+	(void)FindClose(find);
+#else
+	DIR *dir = opendir(directory.c_str());
+
+	if (!dir)
+		return results;
+
+	for (struct dirent *entry; (entry = readdir(dir)) != NULL; )
+	{
+		const std::size_t length = std::strlen(entry->d_name);
+		struct stat status;
+		StoredResult result;
+
+		if (length <= RESULT_EXTENSION.length() || RESULT_EXTENSION.compare(0, std::string::npos, entry->d_name + length - RESULT_EXTENSION.length()) != 0)
+			continue;
+
+		result.filename = directory + '/' + entry->d_name;
+
+		if (stat(result.filename.c_str(), &status) != 0 || !S_ISREG(status.st_mode))
+			continue;
+
+#ifdef __APPLE__
+		result.lastUsed = std::uint64_t(status.st_mtimespec.tv_sec) * 1000000000 + std::uint64_t(status.st_mtimespec.tv_nsec);
+#else
+		result.lastUsed = std::uint64_t(status.st_mtim.tv_sec) * 1000000000 + std::uint64_t(status.st_mtim.tv_nsec);
+#endif
+		result.size = std::uint64_t(status.st_size);
+		results.emplace_back(std::move(result));
+	}
+
+	(void)closedir(dir);
+#endif
+
+	return results;
+}
+
+// Marks a file as recently used by updating its modification time.
+static void touchFile(const std::string &filename)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		FILETIME now;
+
+		GetSystemTimeAsFileTime(&now);
+		(void)SetFileTime(file, NULL, NULL, &now);
+		(void)CloseHandle(file);
+	}
+#else
+	(void)utimes(filename.c_str(), NULL);
+#endif
+}
+
+// Gets the filename used to store the result for a key.
+std::string k8psh::ResultCache::getFilename(const std::string &key) const
+{
+	static const char HEX_DIGITS[] = "0123456789abcdef";
+	const std::uint64_t hashes[] = { hashKey(key, 0xCBF29CE484222325), hashKey(key, 0x84222325CBF29CE4) };
+	std::string filename = _directory + Utilities::getPathSeparator();
+
+	for (std::size_t i = 0; i < sizeof(hashes) / sizeof(hashes[0]); i++)
+	{
+		for (int shift = 60; shift >= 0; shift -= 4)
+			filename += HEX_DIGITS[(hashes[i] >> shift) & 0xF];
+	}
+
+	return filename + RESULT_EXTENSION;
+}
+
+// Evicts the least recently used results until the size of the cache is within the limit.
+void k8psh::ResultCache::evict() const
+{
+	std::vector<StoredResult> results = findStoredResults(_directory);
+	std::uint64_t size = 0;
+
+	for (auto it = results.begin(); it != results.end(); ++it)
+		size += it->size;
+
+	std::sort(results.begin(), results.end());
+
+	for (auto it = results.begin(); it != results.end() && size > _maxSize; ++it)
+	{
+		if (Utilities::deleteFile(it->filename))
+		{
+			LOG_DEBUG << "Evicted cached result " << it->filename << " (" << it->size << " bytes)";
+			size -= it->size;
+		}
+	}
+}
+
+/** Creates a cache that stores results in a directory, creating the directory if it does not exist.
+ *
+ * @param directory the directory used to store the results
+ * @param maxSize the maximum total size in bytes of the stored results
+ */
+k8psh::ResultCache::ResultCache(const std::string &directory, std::uint64_t maxSize) : _directory(Utilities::normalizePath(directory)), _maxSize(maxSize)
+{
+#ifdef _WIN32
+	if (CreateDirectoryA(_directory.c_str(), NULL) == 0 && GetLastError() != ERROR_ALREADY_EXISTS)
+#else
+	if (mkdir(_directory.c_str(), 0755) != 0 && errno != EEXIST)
+#endif
+		LOG_ERROR << "Failed to create result cache directory " << _directory;
+
+	LOG_DEBUG << "Using result cache " << _directory << " (up to " << _maxSize << " bytes)";
+}
+
+/** Creates the key used to find the result of a process.
+ *
+ * @param commandName the name of the command
+ * @param arguments the arguments of the process, including the executable
+ * @param environment the environment of the process
+ * @param processDirectory the working directory of the process
+ * @param stdInData all data written to stdin of the process
+ * @return the key of the result
+ */
+std::string k8psh::ResultCache::createKey(const std::string &commandName, const std::vector<std::string> &arguments, const std::vector<std::string> &environment, const std::string &processDirectory, const std::string &stdInData)
+{
+	std::string key;
+
+	appendKeyString(key, commandName);
+	appendKeyValue(key, arguments.size());
+
+	for (auto it = arguments.begin(); it != arguments.end(); ++it)
+		appendKeyString(key, *it);
+
+	appendKeyValue(key, environment.size());
+
+	for (auto it = environment.begin(); it != environment.end(); ++it)
+		appendKeyString(key, *it);
+
+	appendKeyString(key, processDirectory);
+	appendKeyString(key, stdInData);
+	return key;
+}
+
+/** Loads a result, marking it as the most recently used result.
+ *
+ * @param key the key of the result, created by createKey()
+ * @param result set to the stored result
+ * @return true if the result was found, otherwise false
+ */
+bool k8psh::ResultCache::load(const std::string &key, std::string &result) const
+{
+	const std::string filename = getFilename(key);
+	const MappedFile file(filename);
+	std::string header(RESULT_MAGIC, sizeof(RESULT_MAGIC));
+
+	appendKeyString(header, key);
+
+	// The whole key is stored with the result, so a result is never used for a different key with the same hash
+	if (!file.isValid() || file.getSize() < header.length() || std::memcmp(file.getData(), header.data(), header.length()) != 0)
+	{
+		LOG_DEBUG << "Cached result " << filename << " not found";
+		return false;
+	}
+
+	result.assign(file.getData() + header.length(), file.getSize() - header.length());
+	touchFile(filename);
+	LOG_DEBUG << "Loaded cached result " << filename << " (" << result.length() << " bytes)";
+	return true;
+}
+
+/** Stores a result, evicting the least recently used results until the size of the cache is within the limit.
+ *
+ * @param key the key of the result, created by createKey()
+ * @param result the result to store
+ * @return true if the result was stored, otherwise false
+ */
+bool k8psh::ResultCache::store(const std::string &key, const std::string &result) const
+{
+	const std::string filename = getFilename(key);
+	std::string contents(RESULT_MAGIC, sizeof(RESULT_MAGIC));
+
+	appendKeyString(contents, key);
+
+	if (contents.length() + result.length() > _maxSize)
+	{
+		LOG_DEBUG << "Not caching result " << filename << ", since it is larger than the cache (" << contents.length() + result.length() << " bytes)";
+		return false;
+	}
+	else if (!Utilities::writeFile(filename, contents + result))
+	{
+		LOG_WARNING << "Failed to store cached result " << filename;
+		return false;
+	}
+
+	LOG_DEBUG << "Stored cached result " << filename << " (" << contents.length() + result.length() << " bytes)";
+	evict();
+	return true;
+}
@@ -0,0 +1,69 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_RESULTCACHE_HXX
+#define K8PSH_RESULTCACHE_HXX
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace k8psh {
+
+// An on-disk store of the results of deterministic commands, which is bounded by evicting the least recently used results.
+class ResultCache
+{
+	std::string _directory;
+	std::uint64_t _maxSize;
+
+	// Gets the filename used to store the result for a key.
+	std::string getFilename(const std::string &key) const;
+
+	// Evicts the least recently used results until the size of the cache is within the limit.
+	void evict() const;
+
+public:
+	/** Creates a cache that stores results in a directory, creating the directory if it does not exist.
+	 *
+	 * @param directory the directory used to store the results
+	 * @param maxSize the maximum total size in bytes of the stored results
+	 */
+	ResultCache(const std::string &directory, std::uint64_t maxSize);
+
+	/** Creates the key used to find the result of a process.
+	 *
+	 * @param commandName the name of the command
+	 * @param arguments the arguments of the process, including the executable
+	 * @param environment the environment of the process
+	 * @param processDirectory the working directory of the process
+	 * @param stdInData all data written to stdin of the process
+	 * @return the key of the result
+	 */
+	static std::string createKey(const std::string &commandName, const std::vector<std::string> &arguments, const std::vector<std::string> &environment, const std::string &processDirectory, const std::string &stdInData);
+
+	// Gets the directory used to store the results.
+	const std::string &getDirectory() const { return _directory; }
+
+	// Gets the maximum total size in bytes of the stored results.
+	std::uint64_t getMaxSize() const { return _maxSize; }
+
+	/** Loads a result, marking it as the most recently used result.
+	 *
+	 * @param key the key of the result, created by createKey()
+	 * @param result set to the stored result
+	 * @return true if the result was found, otherwise false
+	 */
+	bool load(const std::string &key, std::string &result) const;
+
+	/** Stores a result, evicting the least recently used results until the size of the cache is within the limit.
+	 *
+	 * @param key the key of the result, created by createKey()
+	 * @param result the result to store
+	 * @return true if the result was stored, otherwise false
+	 */
+	bool store(const std::string &key, const std::string &result) const;
+};
+
+} // k8psh
+
+#endif // K8PSH_RESULTCACHE_HXX
@@ -0,0 +1,422 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifdef __linux__
+
+#include "SharedMemoryChannel.hxx"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include "Utilities.hxx"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared memory channels require lock-free atomics, which can be shared between processes");
+
+// The positions of the producer and consumer are on separate cache lines, so each side only writes its own line
+struct k8psh::SharedMemoryChannel::Ring
+{
+	alignas(64) std::atomic<std::uint64_t> head;   // The total number of bytes written by the producer
+	alignas(64) std::atomic<std::uint64_t> tail;   // The total number of bytes read by the consumer
+	alignas(64) std::atomic<std::uint32_t> closed; // Set once the producer will write no more data
+	std::atomic<std::uint32_t> detached;           // Set once the consumer will read no more data
+
+	Ring() : head(0), tail(0), closed(0), detached(0) { }
+};
+
+// The headers of both rings share the first page, followed by the data of the ring sent by the creator of the channel and then the data of the ring it receives
+static const std::size_t HEADER_SIZE = 4096;
+static const std::size_t MEMORY_SIZE = HEADER_SIZE + 2 * k8psh::SharedMemoryChannel::RING_SIZE;
+
+// Closes the handles that are valid
+static void closeHandles(const int *handles, std::size_t count)
+{
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (handles[i] != -1)
+			(void)::close(handles[i]);
+	}
+}
+
+// Maps the shared memory of a channel, returning null if it cannot be mapped
+static char *mapMemory(int handle)
+{
+	void *memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+
+	return memory == MAP_FAILED ? nullptr : static_cast<char *>(memory);
+}
+
+// Gets the data of a ring
+static char *getRingData(char *memory, const void *ring)
+{
+	return memory + HEADER_SIZE + (ring == memory ? 0 : k8psh::SharedMemoryChannel::RING_SIZE);
+}
+
+/** Creates a channel, along with the handles the remote side uses to attach to it.
+ *
+ * @param handles set to the handles used to attach to the channel, which are owned by the caller (and should be closed once they are sent to the remote side)
+ * @return the new channel
+ */
+k8psh::SharedMemoryChannel k8psh::SharedMemoryChannel::create(int (&handles)[HANDLE_COUNT])
+{
+	SharedMemoryChannel channel;
+	int waitPipe[2] = { -1, -1 };
+	int remotePipe[2] = { -1, -1 };
+	const int memory = memfd_create("k8psh", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (memory == -1 || pipe2(waitPipe, O_CLOEXEC | O_NONBLOCK) != 0 || pipe2(remotePipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		const int error = errno;
+		const int created[] = { memory, waitPipe[0], waitPipe[1], remotePipe[0], remotePipe[1] };
+
+		closeHandles(created, sizeof(created) / sizeof(created[0]));
+		LOG_ERROR << "Failed to create shared memory channel: " << error;
+	}
+
+	channel._waitHandle = waitPipe[0];
+	channel._signalHandle = remotePipe[1];
+	channel._remoteWaitHandle = remotePipe[0];
+
+	// The remote side waits on the other pipe, signals this side, and keeps the pipe of this side open for the same reason as this side
+	handles[0] = memory;
+	handles[1] = waitPipe[1];
+	handles[2] = fcntl(remotePipe[0], F_DUPFD_CLOEXEC, 0);
+	handles[3] = fcntl(waitPipe[0], F_DUPFD_CLOEXEC, 0);
+
+	// The size is sealed, so the remote side can trust that the mapped memory always exists
+	if (handles[2] == -1 || handles[3] == -1 || ftruncate(memory, off_t(MEMORY_SIZE)) != 0 || fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 || !(channel._memory = mapMemory(memory)))
+	{
+		const int error = errno;
+
+		closeHandles(handles, HANDLE_COUNT);
+		LOG_ERROR << "Failed to create shared memory channel: " << error;
+	}
+
+	channel._sendRing = new (channel._memory) Ring();
+	channel._receiveRing = new (channel._memory + sizeof(Ring)) Ring();
+	LOG_DEBUG << "Created shared memory channel (" << RING_SIZE << " byte rings) waiting on " << channel._waitHandle;
+	return channel;
+}
+
+/** Attaches to a channel created by the remote side.
+ *
+ * @param handles the handles received from the remote side, which are owned by the channel (and closed if the channel cannot be attached)
+ * @param count the number of handles, which must be HANDLE_COUNT
+ * @return the attached channel
+ */
+k8psh::SharedMemoryChannel k8psh::SharedMemoryChannel::attach(const int *handles, std::size_t count)
+{
+	SharedMemoryChannel channel;
+
+	if (count != HANDLE_COUNT)
+	{
+		closeHandles(handles, count);
+		LOG_ERROR << "Received " << count << " handles for shared memory channel, expecting " << HANDLE_COUNT;
+	}
+
+	channel._signalHandle = handles[1];
+	channel._waitHandle = handles[2];
+	channel._remoteWaitHandle = handles[3];
+
+	// Only memory that cannot be resized by the remote side is mapped, since accessing memory beyond the end of a shrunk file would fault (the pipes must never block)
+	struct stat status;
+	const int seals = fcntl(handles[0], F_GET_SEALS);
+	const bool valid = fstat(handles[0], &status) == 0 && status.st_size == off_t(MEMORY_SIZE) && seals != -1 && (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW) &&
+		fcntl(channel._signalHandle, F_SETFL, O_NONBLOCK) == 0 && fcntl(channel._waitHandle, F_SETFL, O_NONBLOCK) == 0 && (channel._memory = mapMemory(handles[0])) != nullptr;
+
+	(void)::close(handles[0]);
+
+	if (!valid)
+		LOG_ERROR << "Received invalid shared memory channel";
+
+	channel._sendRing = reinterpret_cast<Ring *>(channel._memory + sizeof(Ring));
+	channel._receiveRing = reinterpret_cast<Ring *>(channel._memory);
+	LOG_DEBUG << "Attached to shared memory channel waiting on " << channel._waitHandle;
+	return channel;
+}
+
+k8psh::SharedMemoryChannel::SharedMemoryChannel(SharedMemoryChannel &&other) :
+	_memory(other._memory), _sendRing(other._sendRing), _receiveRing(other._receiveRing), _waitHandle(other._waitHandle), _signalHandle(other._signalHandle), _remoteWaitHandle(other._remoteWaitHandle), _remoteClosed(other._remoteClosed)
+{
+	other._memory = nullptr;
+	other._waitHandle = other._signalHandle = other._remoteWaitHandle = -1;
+	other.release();
+}
+
+k8psh::SharedMemoryChannel &k8psh::SharedMemoryChannel::operator=(SharedMemoryChannel &&other)
+{
+	close();
+	_memory = other._memory;
+	_sendRing = other._sendRing;
+	_receiveRing = other._receiveRing;
+	_waitHandle = other._waitHandle;
+	_signalHandle = other._signalHandle;
+	_remoteWaitHandle = other._remoteWaitHandle;
+	_remoteClosed = other._remoteClosed;
+
+	other._memory = nullptr;
+	other._waitHandle = other._signalHandle = other._remoteWaitHandle = -1;
+	other.release();
+
+	return *this;
+}
+
+// Reads all signals from the pipe, noting if the remote side closed it
+void k8psh::SharedMemoryChannel::drainSignals() const
+{
+	char signals[64];
+
+	for (;;)
+	{
+		ssize_t received = ::read(_waitHandle, signals, sizeof(signals));
+
+		if (received == 0)
+		{
+			_remoteClosed = true;
+			break;
+		}
+		else if (received < 0 && errno == EINTR)
+			continue;
+		else if (received < ssize_t(sizeof(signals)))
+			break; // The pipe is empty
+	}
+}
+
+// Publishes data written to the send ring, signaling the remote side if the ring was empty
+void k8psh::SharedMemoryChannel::publish(std::uint64_t head, std::size_t length)
+{
+	_sendRing->head.store(head + length);
+
+	// The remote side only waits once the ring is empty (checking the head after it stores the tail), so it is only signaled for the first data it has not seen
+	if (_sendRing->tail.load() == head)
+		signal();
+}
+
+// Releases the shared memory and closes the handles, without notifying the remote side
+void k8psh::SharedMemoryChannel::release()
+{
+	const int handles[] = { _waitHandle, _signalHandle, _remoteWaitHandle };
+
+	closeHandles(handles, sizeof(handles) / sizeof(handles[0]));
+
+	if (_memory)
+		(void)munmap(_memory, MEMORY_SIZE);
+
+	_memory = nullptr;
+	_sendRing = _receiveRing = nullptr;
+	_waitHandle = _signalHandle = _remoteWaitHandle = -1;
+	_remoteClosed = false;
+}
+
+// Signals the remote side
+void k8psh::SharedMemoryChannel::signal()
+{
+	const char signal = 0;
+
+	// A full pipe (which fails with EAGAIN) already wakes the remote side
+	while (::write(_signalHandle, &signal, 1) == -1 && errno == EINTR)
+		continue;
+}
+
+// Waits for the send ring to have space, returning false if the remote side closed the channel
+bool k8psh::SharedMemoryChannel::waitForSpace()
+{
+	// The remote side never signals that it read data, since the rings only fill if it stops following the flow control windows, so this side polls (returning early if the remote side exits)
+	struct pollfd pollSet = { };
+
+	pollSet.fd = _waitHandle;
+	(void)poll(&pollSet, 1, 1);
+
+	return (pollSet.revents & POLLHUP) == 0 && !isRemoteClosed();
+}
+
+// Closes the channel, notifying the remote side that no more data will be written or read.
+void k8psh::SharedMemoryChannel::close()
+{
+	if (_memory)
+	{
+		LOG_DEBUG << "Closing shared memory channel waiting on " << _waitHandle;
+		_receiveRing->detached.store(1);
+		shutdown();
+	}
+
+	release();
+}
+
+// Checks if the channel has data to read (or the remote side closed it), clearing any signals once the channel is empty.
+bool k8psh::SharedMemoryChannel::hasData() const
+{
+	const std::uint64_t tail = _receiveRing->tail.load(std::memory_order_relaxed);
+
+	if (_receiveRing->head.load() != tail || _receiveRing->closed.load() || _remoteClosed)
+		return true;
+
+	// Signals are only cleared once the ring is empty, so any signal for data written after the check below remains
+	drainSignals();
+	return _receiveRing->head.load() != tail || _receiveRing->closed.load() || _remoteClosed;
+}
+
+// Checks if the remote side closed the channel, so written data is never read.
+bool k8psh::SharedMemoryChannel::isRemoteClosed() const
+{
+	return _remoteClosed || _sendRing->detached.load(std::memory_order_relaxed);
+}
+
+/** Reads data from the channel, waiting for data if the channel is empty.
+ *
+ * @param data the buffer to fill with data from the channel
+ * @param length the size of the buffer
+ * @return the number of bytes read from the channel, or zero if the remote side closed the channel
+ */
+std::size_t k8psh::SharedMemoryChannel::read(void *data, std::size_t length)
+{
+	const char *ringData = getRingData(_memory, _receiveRing);
+
+	while (length)
+	{
+		const std::uint64_t tail = _receiveRing->tail.load(std::memory_order_relaxed);
+		const std::uint64_t available = _receiveRing->head.load() - tail;
+
+		if (available > RING_SIZE)
+			LOG_ERROR << "Read invalid position from shared memory channel";
+		else if (available)
+		{
+			const std::size_t offset = std::size_t(tail % RING_SIZE);
+			const std::size_t received = available < length ? std::size_t(available) : length;
+			const std::size_t first = received < RING_SIZE - offset ? received : RING_SIZE - offset;
+
+			std::memcpy(data, ringData + offset, first);
+			std::memcpy(static_cast<char *>(data) + first, ringData, received - first);
+			_receiveRing->tail.store(tail + received);
+
+			LOG_DEBUG << "Read " << received << " bytes from shared memory channel waiting on " << _waitHandle;
+			return received;
+		}
+		else if (_receiveRing->closed.load() || _remoteClosed)
+		{
+			// Data written before the remote side closed the channel is read first
+			if (_receiveRing->head.load() == tail)
+				break;
+
+			continue;
+		}
+
+		struct pollfd pollSet = { };
+
+		pollSet.fd = _waitHandle;
+		pollSet.events = POLLIN;
+
+		if (poll(&pollSet, 1, -1) == -1 && errno != EINTR)
+			LOG_ERROR << "Failed to wait for data from shared memory channel: " << errno;
+
+		drainSignals();
+	}
+
+	return 0;
+}
+
+/** Writes data to the channel directly from a pipe or file (at its current offset), without copying it through another buffer.
+ *
+ * @param handle the handle to read data from
+ * @param length the number of bytes to transfer from the handle
+ * @return the number of bytes written to the channel, which may be less than requested if the handle ended or the remote side closed the channel
+ */
+std::size_t k8psh::SharedMemoryChannel::readFrom(int handle, std::size_t length)
+{
+	char *ringData = getRingData(_memory, _sendRing);
+	std::size_t totalSent = 0;
+
+	while (totalSent < length && !isRemoteClosed())
+	{
+		const std::uint64_t head = _sendRing->head.load(std::memory_order_relaxed);
+		const std::uint64_t used = head - _sendRing->tail.load(std::memory_order_acquire);
+
+		if (used > RING_SIZE)
+			LOG_ERROR << "Read invalid position from shared memory channel";
+		else if (used == RING_SIZE)
+		{
+			if (!waitForSpace())
+				break;
+
+			continue;
+		}
+
+		// Data is read directly into the free part of the ring that does not wrap around
+		const std::size_t offset = std::size_t(head % RING_SIZE);
+		const std::size_t space = std::size_t(RING_SIZE - used) < RING_SIZE - offset ? std::size_t(RING_SIZE - used) : RING_SIZE - offset;
+		const ssize_t sent = ::read(handle, ringData + offset, length - totalSent < space ? length - totalSent : space);
+
+		if (sent == 0)
+			break; // Pipe closed or end of file
+		else if (sent < 0)
+		{
+			if (errno != EINTR)
+				LOG_ERROR << "Failed to read data into shared memory channel: " << errno;
+
+			continue;
+		}
+
+		publish(head, std::size_t(sent));
+		totalSent += std::size_t(sent);
+	}
+
+	LOG_DEBUG << "Transferred " << totalSent << " bytes from " << handle << " to shared memory channel waiting on " << _waitHandle;
+	return totalSent;
+}
+
+// Shuts down sending on the channel, indicating to the remote side that no more data will be written.
+void k8psh::SharedMemoryChannel::shutdown()
+{
+	_sendRing->closed.store(1);
+	signal();
+}
+
+/** Writes data to the channel.
+ *
+ * @param data the data to write to the channel
+ * @param length the number of bytes to write
+ * @param wait true to wait for space in the channel until all of the data is written, false to only write the data that fits
+ * @return the number of bytes written to the channel, which may be less than requested if the remote side closed the channel (or the channel is full and wait is false)
+ */
+std::size_t k8psh::SharedMemoryChannel::write(const void *data, std::size_t length, bool wait)
+{
+	char *ringData = getRingData(_memory, _sendRing);
+	std::size_t totalSent = 0;
+
+	while (totalSent < length && !isRemoteClosed())
+	{
+		const std::uint64_t head = _sendRing->head.load(std::memory_order_relaxed);
+		const std::uint64_t used = head - _sendRing->tail.load(std::memory_order_acquire);
+
+		if (used > RING_SIZE)
+			LOG_ERROR << "Read invalid position from shared memory channel";
+		else if (used == RING_SIZE)
+		{
+			if (!wait || !waitForSpace())
+				break;
+
+			continue;
+		}
+
+		const std::size_t offset = std::size_t(head % RING_SIZE);
+		const std::size_t sent = std::size_t(RING_SIZE - used) < length - totalSent ? std::size_t(RING_SIZE - used) : length - totalSent;
+		const std::size_t first = sent < RING_SIZE - offset ? sent : RING_SIZE - offset;
+
+		std::memcpy(ringData + offset, static_cast<const char *>(data) + totalSent, first);
+		std::memcpy(ringData, static_cast<const char *>(data) + totalSent + first, sent - first);
+		publish(head, sent);
+		totalSent += sent;
+	}
+
+	LOG_DEBUG << "Wrote " << totalSent << " of " << length << " bytes to shared memory channel waiting on " << _waitHandle;
+	return totalSent;
+}
+
+#endif
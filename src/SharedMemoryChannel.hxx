@@ -0,0 +1,122 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_SHARED_MEMORY_CHANNEL_HXX
+#define K8PSH_SHARED_MEMORY_CHANNEL_HXX
+
+#include <cstddef>
+#include <cstdint>
+
+namespace k8psh {
+
+// Carries the data of a connection between processes on the same host using a pair of lock-free single-producer, single-consumer rings in shared memory (one for each direction), so data is written and read without system calls.
+// Each side has a pipe that the other side signals only when a ring becomes non-empty (or is closed), which is the handle used to wait for data. (Only supported on Linux.)
+class SharedMemoryChannel
+{
+	// Shared memory channels cannot be copied
+	SharedMemoryChannel(const SharedMemoryChannel&);
+	SharedMemoryChannel &operator=(const SharedMemoryChannel&);
+
+	struct Ring;
+
+	char *_memory;
+	Ring *_sendRing;
+	Ring *_receiveRing;
+	int _waitHandle;       // The read handle of the pipe signaled by the remote side
+	int _signalHandle;     // The write handle of the pipe the remote side waits on
+	int _remoteWaitHandle; // The read handle of the pipe the remote side waits on, which is kept open so signaling it never fails
+	mutable bool _remoteClosed; // The remote side closed its end of the pipe this side waits on (or exited)
+
+	// Reads all signals from the pipe, noting if the remote side closed it
+	void drainSignals() const;
+
+	// Publishes data written to the send ring, signaling the remote side if the ring was empty
+	void publish(std::uint64_t head, std::size_t length);
+
+	// Releases the shared memory and closes the handles, without notifying the remote side
+	void release();
+
+	// Signals the remote side
+	void signal();
+
+	// Waits for the send ring to have space, returning false if the remote side closed the channel
+	bool waitForSpace();
+
+public:
+	// The size of each ring, which is larger than the data that can be in flight in either direction of a session (including the payload headers), so writes only wait for space if the remote side stops reading.
+	static constexpr std::size_t RING_SIZE = 1024 * 1024 * 2;
+
+	// The number of handles that attach the remote side to a channel.
+	static constexpr std::size_t HANDLE_COUNT = 4;
+
+	/** Creates a channel, along with the handles the remote side uses to attach to it.
+	 *
+	 * @param handles set to the handles used to attach to the channel, which are owned by the caller (and should be closed once they are sent to the remote side)
+	 * @return the new channel
+	 */
+	static SharedMemoryChannel create(int (&handles)[HANDLE_COUNT]);
+
+	/** Attaches to a channel created by the remote side.
+	 *
+	 * @param handles the handles received from the remote side, which are owned by the channel (and closed if the channel cannot be attached)
+	 * @param count the number of handles, which must be HANDLE_COUNT
+	 * @return the attached channel
+	 */
+	static SharedMemoryChannel attach(const int *handles, std::size_t count);
+
+	SharedMemoryChannel() : _memory(), _sendRing(), _receiveRing(), _waitHandle(-1), _signalHandle(-1), _remoteWaitHandle(-1), _remoteClosed() { }
+	SharedMemoryChannel(SharedMemoryChannel &&other);
+	~SharedMemoryChannel() { close(); }
+
+	SharedMemoryChannel &operator=(SharedMemoryChannel &&other);
+
+	// Abandons the channel without notifying the remote side, so a forked process does not affect the channel.
+	void abandon() { release(); }
+
+	// Closes the channel, notifying the remote side that no more data will be written or read.
+	void close();
+
+	// Gets the handle that becomes readable once the remote side signals new data (it can also be signaled for data that was already read).
+	int getWaitHandle() const { return _waitHandle; }
+
+	// Checks if the channel has data to read (or the remote side closed it), clearing any signals once the channel is empty.
+	bool hasData() const;
+
+	// Checks if the remote side closed the channel, so written data is never read.
+	bool isRemoteClosed() const;
+
+	// Checks if the channel is valid.
+	bool isValid() const { return _memory != nullptr; }
+
+	/** Reads data from the channel, waiting for data if the channel is empty.
+	 *
+	 * @param data the buffer to fill with data from the channel
+	 * @param length the size of the buffer
+	 * @return the number of bytes read from the channel, or zero if the remote side closed the channel
+	 */
+	std::size_t read(void *data, std::size_t length);
+
+	/** Writes data to the channel directly from a pipe or file (at its current offset), without copying it through another buffer.
+	 *
+	 * @param handle the handle to read data from
+	 * @param length the number of bytes to transfer from the handle
+	 * @return the number of bytes written to the channel, which may be less than requested if the handle ended or the remote side closed the channel
+	 */
+	std::size_t readFrom(int handle, std::size_t length);
+
+	// Shuts down sending on the channel, indicating to the remote side that no more data will be written.
+	void shutdown();
+
+	/** Writes data to the channel.
+	 *
+	 * @param data the data to write to the channel
+	 * @param length the number of bytes to write
+	 * @param wait true to wait for space in the channel until all of the data is written, false to only write the data that fits
+	 * @return the number of bytes written to the channel, which may be less than requested if the remote side closed the channel (or the channel is full and wait is false)
+	 */
+	std::size_t write(const void *data, std::size_t length, bool wait = true);
+};
+
+} // k8psh
+
+#endif // K8PSH_SHARED_MEMORY_CHANNEL_HXX
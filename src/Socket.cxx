@@ -8,15 +8,29 @@
 	#include <fcntl.h>
 	#include <io.h>
 	#include <ws2ipdef.h>
+	#include <ws2tcpip.h>
 #else
 	#include <arpa/inet.h>
+	#include <fcntl.h>
+	#include <netdb.h>
 	#include <netinet/in.h>
 	#include <netinet/tcp.h>
 	#include <poll.h>
 	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/time.h>
+	#include <sys/uio.h>
+	#include <sys/un.h>
 	#include <unistd.h>
+
+	#ifdef __linux__
+		#include <sys/sendfile.h>
+	#endif
 #endif
 
+#include <climits>
+#include <cstring>
+
 #include "Utilities.hxx"
 
 k8psh::Socket::Initializer::Initializer()
@@ -63,22 +77,32 @@ k8psh::Socket::Event k8psh::Socket::createReadEvent()
 
 	return _readEvent;
 #else
+#ifdef __linux__
+	if (_channel.isValid())
+		return _channel.getWaitHandle();
+#endif
+
 	return _handle;
 #endif
 }
 
 // Creates a new socket.
-static k8psh::Socket::Handle createSocketHandle()
+static k8psh::Socket::Handle createSocketHandle(int family = AF_INET)
 {
 #ifdef _WIN32
-	k8psh::Socket::Handle handle = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, 0);
+	k8psh::Socket::Handle handle = WSASocketW(family, SOCK_STREAM, IPPROTO_TCP, NULL, 0, 0);
 #else
-	k8psh::Socket::Handle handle = socket(AF_INET, SOCK_STREAM, 0);
+	k8psh::Socket::Handle handle = socket(family, SOCK_STREAM, 0);
 #endif
 
 	if (handle == k8psh::Socket::INVALID_HANDLE)
 		LOG_ERROR << "Failed to create socket: " << getSocketErrorCode();
 
+#ifndef _WIN32
+	// Prevent the socket from leaking into executed processes
+	(void)fcntl(handle, F_SETFD, FD_CLOEXEC);
+#endif
+
 	return handle;
 }
 
@@ -88,6 +112,49 @@ static k8psh::Socket::Handle createSocketHandle()
 	#define IF_WINSOCK(X, Y) Y
 #endif
 
+// Writing to a socket closed by the remote side should report an error rather than raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static constexpr int SEND_FLAGS = 0;
+#endif
+
+// Indicates that more data will follow immediately, so the kernel can hold back a partial packet
+#ifdef MSG_MORE
+static constexpr int SEND_MORE_FLAGS = SEND_FLAGS | MSG_MORE;
+#else
+static constexpr int SEND_MORE_FLAGS = SEND_FLAGS;
+#endif
+
+// Handles an error sending data on a socket, returning false if the connection was closed by the remote side and true if the send should be retried
+static bool handleSendError(k8psh::Socket::Handle handle)
+{
+	int error = getSocketErrorCode();
+
+#ifdef _WIN32
+	if (error == WSAECONNRESET || error == WSAECONNABORTED || error == WSAESHUTDOWN)
+		return false;
+	else if (error != WSAEWOULDBLOCK)
+		LOG_ERROR << "Failed to write data to socket: " << error;
+
+	fd_set fdSet;
+
+	FD_ZERO(&fdSet);
+	FD_SET(handle, &fdSet);
+
+	(void)select(0, NULL, &fdSet, NULL, NULL);
+#else
+	(void)handle;
+
+	if (error == EPIPE || error == ECONNRESET)
+		return false;
+	else if (error != EINTR)
+		LOG_ERROR << "Failed to write data to socket: " << error;
+#endif
+
+	return true;
+}
+
 // Sets the specified option on a socket
 template <typename OptionT, typename T> static bool setSocketOption(k8psh::Socket::Handle handle, int level, int name, const T &value)
 {
@@ -107,27 +174,60 @@ static void setSocketOptions(k8psh::Socket::Handle handle)
 	(void)setSocketOption<IF_WINSOCK(BOOL, int)>(handle, IPPROTO_TCP, TCP_NODELAY, 1);
 }
 
-// Creates a new server socket listening on the specified port.
-k8psh::Socket k8psh::Socket::listen(unsigned short port)
+// The address used by sockets that do not specify an address.
+static const char LOOPBACK_ADDRESS[] = "127.0.0.1";
+
+// Creates a TCP address for a port of a numeric IPv4 or IPv6 address (the loopback address if empty), returning the length of the address.
+static int createInetAddress(const std::string &address, unsigned short port, sockaddr_storage &storage)
 {
-	k8psh::Socket socket = createSocketHandle();
-	sockaddr_in ipv4 = sockaddr_in();
+	const char *numericAddress = address.empty() ? LOOPBACK_ADDRESS : address.c_str();
+	sockaddr_in &ipv4 = reinterpret_cast<sockaddr_in &>(storage);
+	sockaddr_in6 &ipv6 = reinterpret_cast<sockaddr_in6 &>(storage);
+
+	storage = sockaddr_storage();
+
+	if (inet_pton(AF_INET, numericAddress, &ipv4.sin_addr) == 1)
+	{
+		ipv4.sin_family = AF_INET;
+		ipv4.sin_port = htons(port);
+		return int(sizeof(ipv4));
+	}
+	else if (inet_pton(AF_INET6, numericAddress, &ipv6.sin6_addr) == 1)
+	{
+		ipv6.sin6_family = AF_INET6;
+		ipv6.sin6_port = htons(port);
+		return int(sizeof(ipv6));
+	}
 
-	ipv4.sin_family = AF_INET;
-	ipv4.sin_port = htons(port);
+	LOG_ERROR << "Invalid numeric address \"" << address << '"';
+	return 0;
+}
 
-	char *addr = reinterpret_cast<char *>(&ipv4.sin_addr);
-	addr[0] = 127;
-	addr[3] = 1;
+// Creates a new server socket listening on the specified port of a numeric IPv4 or IPv6 address (the loopback address if empty), optionally sharing the port with other sockets created the same way (the kernel balances the connections among them).
+k8psh::Socket k8psh::Socket::listen(unsigned short port, const std::string &address, bool sharePort)
+{
+	sockaddr_storage storage;
+	const int length = createInetAddress(address, port, storage);
+	k8psh::Socket socket = createSocketHandle(storage.ss_family);
 
-	LOG_DEBUG << "Binding to port " << port << " on socket " << socket._handle;
+	LOG_DEBUG << "Binding to port " << port << " of " << (address.empty() ? LOOPBACK_ADDRESS : address) << " on socket " << socket._handle;
 
 #ifndef _WIN32
 	if (!setSocketOption<IF_WINSOCK(BOOL, int)>(socket._handle, SOL_SOCKET, SO_REUSEADDR, 1))
 		LOG_ERROR << "Failed to set SO_REUSEADDR socket option: " << getSocketErrorCode();
 #endif
 
-	if (::bind(socket._handle, reinterpret_cast<sockaddr *>(&ipv4), int(sizeof(ipv4))) != 0)
+	if (sharePort)
+	{
+#ifdef SO_REUSEPORT
+		if (!setSocketOption<int>(socket._handle, SOL_SOCKET, SO_REUSEPORT, 1))
+			LOG_ERROR << "Failed to set SO_REUSEPORT socket option: " << getSocketErrorCode();
+#else
+		LOG_ERROR << "Sharing a port between listeners not supported";
+#endif
+	}
+
+	if (::bind(socket._handle, reinterpret_cast<sockaddr *>(&storage), length) != 0)
 		LOG_ERROR << "Failed to bind to port " << port << ": " << getSocketErrorCode();
 
 	if (::listen(socket._handle, SOMAXCONN) != 0)
@@ -137,25 +237,142 @@ k8psh::Socket k8psh::Socket::listen(unsigned short port)
 	return socket;
 }
 
-// Creates a new socket by connecting to the specified port. This call may return an invalid socket if a recoverable error is encountered.
-k8psh::Socket k8psh::Socket::connect(unsigned short port, bool failOnError)
+#ifndef _WIN32
+// Creates a Unix domain socket address for the specified path.
+static sockaddr_un createUnixAddress(const std::string &path)
 {
-	k8psh::Socket socket = createSocketHandle();
-	sockaddr_in ipv4 = sockaddr_in();
+	sockaddr_un address = sockaddr_un();
 
-	ipv4.sin_family = AF_INET;
-	ipv4.sin_port = htons(port);
+	if (path.empty() || path.length() >= sizeof(address.sun_path))
+		LOG_ERROR << "Invalid Unix domain socket path \"" << path << "\" (must be 1 - " << (sizeof(address.sun_path) - 1) << " characters)";
 
-	char *addr = reinterpret_cast<char *>(&ipv4.sin_addr);
-	addr[0] = 127;
-	addr[3] = 1;
+	address.sun_family = AF_UNIX;
+	path.copy(address.sun_path, path.length());
+	return address;
+}
+#endif
 
-	LOG_DEBUG << "Connecting to port " << port << " on socket " << socket._handle;
+// Creates a new server socket listening on the Unix domain socket at the specified path, replacing any stale socket at that path.
+k8psh::Socket k8psh::Socket::listen(const std::string &path)
+{
+#ifdef _WIN32
+	LOG_ERROR << "Unix domain sockets not supported (" << path << ")";
+	return INVALID_HANDLE;
+#else
+	sockaddr_un address = createUnixAddress(path);
+	k8psh::Socket socket = createSocketHandle(AF_UNIX);
+	struct stat info;
 
-	if (::connect(socket._handle, reinterpret_cast<sockaddr *>(&ipv4), int(sizeof(ipv4))) != 0)
+	LOG_DEBUG << "Binding to " << path << " on socket " << socket._handle;
+
+	// Remove any socket left behind by a previous server (other files and sockets with an active listener are never removed)
+	if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
 	{
-		int error = getSocketErrorCode();
+		k8psh::Socket probe = createSocketHandle(AF_UNIX);
+
+		if (::connect(probe._handle, reinterpret_cast<sockaddr *>(&address), socklen_t(sizeof(address))) != 0 && getSocketErrorCode() == ECONNREFUSED)
+			(void)unlink(path.c_str());
+	}
+
+	if (::bind(socket._handle, reinterpret_cast<sockaddr *>(&address), socklen_t(sizeof(address))) != 0)
+		LOG_ERROR << "Failed to bind to " << path << ": " << getSocketErrorCode();
 
+	if (::listen(socket._handle, SOMAXCONN) != 0)
+		LOG_ERROR << "Failed to listen on " << path << ": " << getSocketErrorCode();
+
+	LOG_DEBUG << "Bound to " << path << " on socket " << socket._handle << ", listening for new connections";
+	return socket;
+#endif
+}
+
+// Gets the error of a non-blocking connect once the socket is writable (zero if it connected)
+static int getConnectError(k8psh::Socket::Handle handle)
+{
+	IF_WINSOCK(int, socklen_t) length = IF_WINSOCK(int, socklen_t)(sizeof(int));
+	int error = 0;
+
+	return getsockopt(handle, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &length) == 0 ? error : getSocketErrorCode();
+}
+
+// Waits for a non-blocking connect to complete, returning the error of the connection (zero if it connected)
+static int waitForConnect(k8psh::Socket::Handle handle, long long timeoutMs)
+{
+#ifdef _WIN32
+	fd_set writeSet;
+	fd_set exceptSet;
+	struct timeval timeout = { long(timeoutMs / 1000), long(timeoutMs % 1000 * 1000) };
+
+	FD_ZERO(&writeSet);
+	FD_SET(handle, &writeSet);
+	FD_ZERO(&exceptSet);
+	FD_SET(handle, &exceptSet);
+
+	int result = select(0, NULL, &writeSet, &exceptSet, &timeout);
+
+	if (result == 0)
+		return WSAETIMEDOUT;
+	else if (result < 0)
+		return getSocketErrorCode();
+#else
+	struct pollfd pollSet = { };
+	int result;
+
+	pollSet.fd = handle;
+	pollSet.events = POLLOUT;
+
+	do result = poll(&pollSet, 1, timeoutMs > INT_MAX ? INT_MAX : int(timeoutMs));
+	while (result < 0 && errno == EINTR);
+
+	if (result == 0)
+		return ETIMEDOUT;
+	else if (result < 0)
+		return getSocketErrorCode();
+#endif
+
+	return getConnectError(handle);
+}
+
+// Sets a socket as blocking or non-blocking, returning false if the mode could not be set
+static bool setNonblockingMode(k8psh::Socket::Handle handle, bool nonblocking)
+{
+#ifdef _WIN32
+	u_long mode = nonblocking ? 1 : 0;
+
+	return ioctlsocket(handle, FIONBIO, &mode) == 0;
+#else
+	int flags = fcntl(handle, F_GETFL);
+
+	return flags != -1 && fcntl(handle, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) != -1;
+#endif
+}
+
+// Creates a new socket by connecting to the specified port of a numeric IPv4 or IPv6 address (the loopback address if empty), giving up once the connection takes longer than the timeout in milliseconds (if not negative). This call may return an invalid socket if a recoverable error is encountered.
+k8psh::Socket k8psh::Socket::connect(const std::string &address, unsigned short port, bool failOnError, long long timeoutMs)
+{
+	sockaddr_storage storage;
+	const int length = createInetAddress(address, port, storage);
+	k8psh::Socket socket = createSocketHandle(storage.ss_family);
+
+	LOG_DEBUG << "Connecting to port " << port << " of " << (address.empty() ? LOOPBACK_ADDRESS : address) << " on socket " << socket._handle;
+
+	// Connections with a timeout are started without blocking, then wait for the connection to complete (the socket is blocking again once connected)
+	if (timeoutMs >= 0 && !setNonblockingMode(socket._handle, true))
+		LOG_ERROR << "Failed to set socket " << socket._handle << " to use a non-blocking connect: " << getSocketErrorCode();
+
+	int error = ::connect(socket._handle, reinterpret_cast<sockaddr *>(&storage), length) == 0 ? 0 : getSocketErrorCode();
+
+#ifdef _WIN32
+	if (timeoutMs >= 0 && error == WSAEWOULDBLOCK)
+#else
+	if (timeoutMs >= 0 && error == EINPROGRESS)
+#endif
+		error = waitForConnect(socket._handle, timeoutMs);
+
+	if (!error && timeoutMs >= 0 && !setNonblockingMode(socket._handle, false))
+		error = getSocketErrorCode();
+
+	if (error)
+	{
 #ifdef _WIN32
 		if (failOnError && error != WSAEINTR && error != WSAENOBUFS)
 #else
@@ -172,11 +389,264 @@ k8psh::Socket k8psh::Socket::connect(unsigned short port, bool failOnError)
 	return socket;
 }
 
+// Creates a new socket by connecting to the Unix domain socket at the specified path. This call may return an invalid socket if a recoverable error is encountered.
+k8psh::Socket k8psh::Socket::connect(const std::string &path, bool failOnError)
+{
+#ifdef _WIN32
+	(void)failOnError;
+	LOG_ERROR << "Unix domain sockets not supported (" << path << ")";
+	return INVALID_HANDLE;
+#else
+	sockaddr_un address = createUnixAddress(path);
+	k8psh::Socket socket = createSocketHandle(AF_UNIX);
+
+	LOG_DEBUG << "Connecting to " << path << " on socket " << socket._handle;
+
+	if (::connect(socket._handle, reinterpret_cast<sockaddr *>(&address), socklen_t(sizeof(address))) != 0)
+	{
+		int error = getSocketErrorCode();
+
+		// Unix domain sockets report a full backlog using EAGAIN
+		if (failOnError && error != EINTR && error != ENOBUFS && error != EAGAIN)
+			LOG_ERROR << "Failed to connect to " << path << ": " << error;
+
+		LOG_DEBUG << "Failed to connect to " << path << " on socket " << socket._handle;
+		return INVALID_HANDLE;
+	}
+
+	LOG_DEBUG << "Connected to " << path << " on socket " << socket._handle;
+	return socket;
+#endif
+}
+
+// Starts connecting a new socket to the specified port of a numeric IPv4 or IPv6 address (the loopback address if empty) without waiting for the connection, which can be finished once the socket is writable. This call may return an invalid socket if a recoverable error is encountered.
+k8psh::Socket k8psh::Socket::startConnect(const std::string &address, unsigned short port, bool failOnError)
+{
+	sockaddr_storage storage;
+	const int length = createInetAddress(address, port, storage);
+	k8psh::Socket socket = createSocketHandle(storage.ss_family);
+
+	LOG_DEBUG << "Starting connection to port " << port << " of " << (address.empty() ? LOOPBACK_ADDRESS : address) << " on socket " << socket._handle;
+
+	if (!setNonblockingMode(socket._handle, true))
+		LOG_ERROR << "Failed to set socket " << socket._handle << " to use a non-blocking connect: " << getSocketErrorCode();
+
+	if (::connect(socket._handle, reinterpret_cast<sockaddr *>(&storage), length) != 0)
+	{
+		int error = getSocketErrorCode();
+
+		// Interrupted connections continue in the background, like connections in progress
+#ifdef _WIN32
+		if (error != WSAEWOULDBLOCK)
+		{
+			if (failOnError && error != WSAEINTR && error != WSAENOBUFS)
+#else
+		if (error != EINPROGRESS && error != EINTR)
+		{
+			if (failOnError && error != ENOBUFS)
+#endif
+				LOG_ERROR << "Failed to connect to port " << port << ": " << error;
+
+			LOG_DEBUG << "Failed to connect to port " << port << " on socket " << socket._handle;
+			return INVALID_HANDLE;
+		}
+	}
+
+	return socket;
+}
+
+// Starts connecting a new socket to the Unix domain socket at the specified path without waiting for the connection, which can be finished once the socket is writable. This call may return an invalid socket if a recoverable error is encountered.
+k8psh::Socket k8psh::Socket::startConnect(const std::string &path, bool failOnError)
+{
+#ifdef _WIN32
+	(void)failOnError;
+	LOG_ERROR << "Unix domain sockets not supported (" << path << ")";
+	return INVALID_HANDLE;
+#else
+	sockaddr_un address = createUnixAddress(path);
+	k8psh::Socket socket = createSocketHandle(AF_UNIX);
+
+	LOG_DEBUG << "Starting connection to " << path << " on socket " << socket._handle;
+
+	if (!setNonblockingMode(socket._handle, true))
+		LOG_ERROR << "Failed to set socket " << socket._handle << " to use a non-blocking connect: " << getSocketErrorCode();
+
+	if (::connect(socket._handle, reinterpret_cast<sockaddr *>(&address), socklen_t(sizeof(address))) != 0)
+	{
+		int error = getSocketErrorCode();
+
+		// Unix domain sockets report a full backlog using EAGAIN, rather than waiting for room
+		if (error != EINPROGRESS && error != EINTR)
+		{
+			if (failOnError && error != ENOBUFS && error != EAGAIN)
+				LOG_ERROR << "Failed to connect to " << path << ": " << error;
+
+			LOG_DEBUG << "Failed to connect to " << path << " on socket " << socket._handle;
+			return INVALID_HANDLE;
+		}
+	}
+
+	return socket;
+#endif
+}
+
+// Finishes a connection started by startConnect() once the socket is writable, returning false if the connection failed (the socket is blocking once connected).
+bool k8psh::Socket::finishConnect()
+{
+	int error = getConnectError(_handle);
+
+	if (!error && !setNonblockingMode(_handle, false))
+		error = getSocketErrorCode();
+
+	if (error)
+	{
+		LOG_DEBUG << "Failed to connect on socket " << _handle << ": " << error;
+		return false;
+	}
+
+	setSocketOptions(_handle);
+	LOG_DEBUG << "Connected on socket " << _handle;
+	return true;
+}
+
+// Waits until any of the sockets are ready, returning the number of ready sockets (zero if none are ready within the timeout in milliseconds, if not negative).
+std::size_t k8psh::Socket::wait(std::vector<Wait> &waits, long long timeoutMs)
+{
+	std::size_t readyCount = 0;
+	int result;
+
+	if (waits.empty())
+		return 0;
+
+#ifdef _WIN32
+	fd_set readSet;
+	fd_set writeSet;
+	fd_set exceptSet;
+	struct timeval timeout = { long(timeoutMs / 1000), long(timeoutMs % 1000 * 1000) };
+
+	FD_ZERO(&readSet);
+	FD_ZERO(&writeSet);
+	FD_ZERO(&exceptSet);
+
+	// Failed connections are only reported in the exception set
+	for (auto it = waits.begin(); it != waits.end(); ++it)
+	{
+		if (it->connecting)
+		{
+			FD_SET(it->socket->_handle, &writeSet);
+			FD_SET(it->socket->_handle, &exceptSet);
+		}
+		else
+			FD_SET(it->socket->_handle, &readSet);
+	}
+
+	if ((result = select(0, &readSet, &writeSet, &exceptSet, timeoutMs < 0 ? NULL : &timeout)) < 0)
+		LOG_ERROR << "Failed to wait on sockets: " << getSocketErrorCode();
+
+	for (auto it = waits.begin(); it != waits.end(); ++it)
+	{
+		it->ready = it->connecting ? FD_ISSET(it->socket->_handle, &writeSet) || FD_ISSET(it->socket->_handle, &exceptSet) : FD_ISSET(it->socket->_handle, &readSet);
+		readyCount += it->ready ? 1 : 0;
+	}
+#else
+	std::vector<struct pollfd> pollSet(waits.size());
+
+	for (std::size_t i = 0; i < waits.size(); i++)
+	{
+		pollSet[i].fd = waits[i].socket->_handle;
+		pollSet[i].events = waits[i].connecting ? POLLOUT : POLLIN;
+	}
+
+	do result = poll(pollSet.data(), nfds_t(pollSet.size()), timeoutMs < 0 ? -1 : timeoutMs > INT_MAX ? INT_MAX : int(timeoutMs));
+	while (result < 0 && errno == EINTR);
+
+	if (result < 0)
+		LOG_ERROR << "Failed to wait on sockets: " << getSocketErrorCode();
+
+	for (std::size_t i = 0; i < waits.size(); i++)
+	{
+		waits[i].ready = pollSet[i].revents != 0;
+		readyCount += waits[i].ready ? 1 : 0;
+	}
+#endif
+
+	return readyCount;
+}
+
+// Resolves a hostname (or numeric address) to a numeric address, returning an empty string if it cannot be resolved. Numeric addresses never use the system resolver, and hostnames cannot be resolved by the statically-linked executable.
+std::string k8psh::Socket::resolve(const std::string &hostname)
+{
+	char numericAddress[INET6_ADDRSTRLEN] = { };
+	in_addr ipv4;
+	in6_addr ipv6;
+
+	// Numeric addresses are only converted to their canonical form
+	if (inet_pton(AF_INET, hostname.c_str(), &ipv4) == 1 && inet_ntop(AF_INET, &ipv4, numericAddress, IF_WINSOCK(std::size_t, socklen_t)(sizeof(numericAddress))))
+		return numericAddress;
+	else if (inet_pton(AF_INET6, hostname.c_str(), &ipv6) == 1 && inet_ntop(AF_INET6, &ipv6, numericAddress, IF_WINSOCK(std::size_t, socklen_t)(sizeof(numericAddress))))
+		return numericAddress;
+
+#ifdef K8PSH_STATIC
+	LOG_DEBUG << "Failed to resolve " << hostname << ": hostnames cannot be resolved by the statically-linked executable";
+	return std::string();
+#else
+	addrinfo hints = addrinfo();
+	addrinfo *results = nullptr;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	int error = getaddrinfo(hostname.c_str(), NULL, &hints, &results);
+
+	if (error != 0 || !results)
+	{
+		LOG_DEBUG << "Failed to resolve " << hostname << ": " << error;
+		return std::string();
+	}
+
+	// The first address is preferred by the resolver
+	error = getnameinfo(results->ai_addr, IF_WINSOCK(int, socklen_t)(results->ai_addrlen), numericAddress, IF_WINSOCK(DWORD, socklen_t)(sizeof(numericAddress)), NULL, 0, NI_NUMERICHOST);
+	freeaddrinfo(results);
+
+	if (error != 0)
+	{
+		LOG_DEBUG << "Failed to convert the address of " << hostname << " to a numeric address: " << error;
+		return std::string();
+	}
+
+	LOG_DEBUG << "Resolved " << hostname << " to " << numericAddress;
+	return numericAddress;
+#endif
+}
+
+#ifndef _WIN32
+// Creates a pair of connected sockets.
+void k8psh::Socket::createPair(Socket &first, Socket &second)
+{
+	Handle handles[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, handles) != 0)
+		LOG_ERROR << "Failed to create socket pair: " << getSocketErrorCode();
+
+	// Prevent the sockets from leaking into executed processes
+	(void)fcntl(handles[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(handles[1], F_SETFD, FD_CLOEXEC);
+
+	LOG_DEBUG << "Created socket pair " << handles[0] << ", " << handles[1];
+	first = Socket(handles[0]);
+	second = Socket(handles[1]);
+}
+#endif
+
 // Abandons the socket, returning the abandoned handle.
 k8psh::Socket::Handle k8psh::Socket::abandon()
 {
 	Handle handle = _handle;
 
+#ifdef __linux__
+	_channel.abandon();
+#endif
 	_handle = INVALID_HANDLE;
 	return handle;
 }
@@ -201,6 +671,14 @@ k8psh::Socket k8psh::Socket::accept()
 		return INVALID_HANDLE;
 	}
 
+#if !defined(_WIN32) && !defined(__linux__)
+	// Some platforms propagate the non-blocking flag from the server socket
+	int flags = fcntl(handle, F_GETFL);
+
+	if (flags != -1 && (flags & O_NONBLOCK) != 0)
+		(void)fcntl(handle, F_SETFL, flags & ~O_NONBLOCK);
+#endif
+
 	setSocketOptions(handle);
 	LOG_DEBUG << "Accepted new connection (" << handle << ") on socket " << _handle;
 	return Socket(handle);
@@ -209,6 +687,10 @@ k8psh::Socket k8psh::Socket::accept()
 // Closes the socket.
 void k8psh::Socket::close()
 {
+#ifdef __linux__
+	_channel.close();
+#endif
+
 	if (_handle != INVALID_HANDLE)
 	{
 		Handle handle = _handle;
@@ -220,26 +702,33 @@ void k8psh::Socket::close()
 		if (_readEvent)
 			(void)CloseHandle(_readEvent);
 
-		(void)shutdown(handle, SD_BOTH);
+		(void)::shutdown(handle, SD_BOTH);
 		(void)closesocket(handle);
 #else
-		(void)shutdown(handle, SHUT_RDWR);
+		(void)::shutdown(handle, SHUT_RDWR);
 		(void)::close(handle);
 #endif
 	}
 }
 
-// Gets the bound port of the socket, or zero if the socket is not valid.
+// Gets the bound port of the socket, or zero if the socket is not valid or is not a TCP socket.
 unsigned short k8psh::Socket::getPort() const
 {
-	sockaddr_in ipv4;
+	sockaddr_storage address;
 #ifdef _WIN32
-	int length = int(sizeof(ipv4));
+	int length = int(sizeof(address));
 #else
-	socklen_t length = socklen_t(sizeof(ipv4));
+	socklen_t length = socklen_t(sizeof(address));
 #endif
 
-	return getsockname(_handle, reinterpret_cast<sockaddr *>(&ipv4), &length) == 0 ? ntohs(ipv4.sin_port) : 0;
+	if (getsockname(_handle, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+		return 0;
+	else if (address.ss_family == AF_INET6)
+		return ntohs(reinterpret_cast<const sockaddr_in6 *>(&address)->sin6_port);
+	else if (address.ss_family != AF_INET)
+		return 0;
+
+	return ntohs(reinterpret_cast<const sockaddr_in *>(&address)->sin_port);
 }
 
 // Checks if the socket has data to read.
@@ -254,6 +743,11 @@ bool k8psh::Socket::hasData() const
 
 	return select(0, &fdSet, NULL, NULL, &timeout) == 1;
 #else
+#ifdef __linux__
+	if (_channel.isValid())
+		return _channel.hasData();
+#endif
+
 	struct pollfd pollSet = { };
 
 	pollSet.fd = _handle;
@@ -263,6 +757,59 @@ bool k8psh::Socket::hasData() const
 #endif
 }
 
+// Sets the size in bytes of the kernel send and receive buffers of the socket, returning false if either could not be set.
+bool k8psh::Socket::setBufferSize(std::size_t size)
+{
+	if (size > std::size_t(INT_MAX))
+		return false;
+
+	return setSocketOption<int>(_handle, SOL_SOCKET, SO_SNDBUF, int(size)) && setSocketOption<int>(_handle, SOL_SOCKET, SO_RCVBUF, int(size));
+}
+
+// Sets the time in milliseconds that reads wait for data before failing, or zero to wait forever, returning false if it could not be set.
+bool k8psh::Socket::setReceiveTimeout(long long timeoutMs)
+{
+	if (timeoutMs < 0)
+		return false;
+
+#ifdef _WIN32
+	return setSocketOption<DWORD>(_handle, SOL_SOCKET, SO_RCVTIMEO, timeoutMs > (long long)MAXDWORD ? MAXDWORD : DWORD(timeoutMs));
+#else
+	struct timeval timeout = { };
+
+	timeout.tv_sec = time_t(timeoutMs / 1000);
+	timeout.tv_usec = suseconds_t(timeoutMs % 1000 * 1000);
+
+	return setsockopt(_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, socklen_t(sizeof(timeout))) == 0;
+#endif
+}
+
+// Sets the socket as non-blocking. (On POSIX platforms, sockets accepted from a non-blocking server socket are always blocking.)
+bool k8psh::Socket::setNonblocking()
+{
+	return setNonblockingMode(_handle, true);
+}
+
+// Shuts down sending on the socket, indicating to the remote side that no more data will be written.
+void k8psh::Socket::shutdown()
+{
+	LOG_DEBUG << "Shutting down sending on socket " << _handle;
+
+#ifdef __linux__
+	if (_channel.isValid())
+	{
+		_channel.shutdown();
+		return;
+	}
+#endif
+
+#ifdef _WIN32
+	(void)::shutdown(_handle, SD_SEND);
+#else
+	(void)::shutdown(_handle, SHUT_WR);
+#endif
+}
+
 /** Reads data from the socket.
  *
  * @param handle the socket handle
@@ -334,6 +881,22 @@ std::size_t k8psh::Socket::read(std::vector<std::uint8_t> &data, std::size_t off
 	if (offset >= data.size())
 		return 0;
 
+#ifdef __linux__
+	if (_channel.isValid())
+	{
+		std::size_t totalReceived = 0;
+		std::size_t received;
+
+		do
+		{
+			received = _channel.read(&data[offset + totalReceived], data.size() - offset - totalReceived);
+			totalReceived += received;
+		} while (waitAll && received && offset + totalReceived < data.size());
+
+		return totalReceived;
+	}
+#endif
+
 	return socketRead(_handle, &data[offset], data.size() - offset, waitAll);
 }
 
@@ -342,13 +905,19 @@ std::size_t k8psh::Socket::read(std::vector<std::uint8_t> &data, std::size_t off
  * @param data a vector of data to write to the socket
  * @param offset the offset into the vector to write data from
  * @param end the ending index (exclusive) of the data to write
- * @return the number of bytes written to the socket
+ * @param more true if more data will be written immediately after this data, allowing it to be coalesced into fewer packets where supported
+ * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
  */
-std::size_t k8psh::Socket::write(const std::vector<std::uint8_t> &data, std::size_t offset, std::size_t end)
+std::size_t k8psh::Socket::write(const std::vector<std::uint8_t> &data, std::size_t offset, std::size_t end, bool more)
 {
 	LOG_DEBUG << "Writing bytes " << offset << " - " << end << " on socket " << _handle;
 	std::size_t totalSent = 0;
 
+#ifdef __linux__
+	if (_channel.isValid())
+		return offset < end ? _channel.write(data.data() + offset, end - offset) : 0;
+#endif
+
 	while (offset < end)
 	{
 #ifdef _WIN32
@@ -356,32 +925,367 @@ std::size_t k8psh::Socket::write(const std::vector<std::uint8_t> &data, std::siz
 #else
 		std::size_t length = end - offset;
 #endif
-		auto sent = send(_handle, reinterpret_cast<const char *>(data.data() + offset), length, 0);
+		auto sent = send(_handle, reinterpret_cast<const char *>(data.data() + offset), length, more ? SEND_MORE_FLAGS : SEND_FLAGS);
 
 		if (sent == -1)
+		{
+			if (!handleSendError(_handle))
+				break; // Connection closed by the remote side
+
+			continue;
+		}
+
+		totalSent += sent;
+		offset += sent;
+	}
+
+	LOG_DEBUG << "Wrote " << totalSent << " bytes on socket " << _handle;
+	return totalSent;
+}
+
+/** Writes multiple slices of data to the socket, without first copying them into a contiguous buffer.
+ *
+ * @param slices the slices of data to write to the socket, in order
+ * @param count the number of slices, up to MAX_SLICES
+ * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
+ */
+std::size_t k8psh::Socket::write(const Slice *slices, std::size_t count)
+{
 #ifdef _WIN32
+	WSABUF buffers[MAX_SLICES];
+#else
+	struct iovec buffers[MAX_SLICES];
+#endif
+	std::size_t bufferCount = 0;
+	std::size_t length = 0;
+	std::size_t totalSent = 0;
+
+	if (count > MAX_SLICES)
+		LOG_ERROR << "Failed to write " << count << " slices to socket, maximum is " << MAX_SLICES;
+
+#ifdef __linux__
+	if (_channel.isValid())
+	{
+		for (std::size_t i = 0; i < count; i++)
 		{
-			int error = getSocketErrorCode();
+			const std::size_t sent = _channel.write(slices[i].data, slices[i].length);
 
-			if (error != WSAEWOULDBLOCK)
-				LOG_ERROR << "Failed to write data to socket: " << error;
+			totalSent += sent;
 
-			fd_set fdSet;
+			if (sent != slices[i].length)
+				break; // Channel closed by the remote side
+		}
 
-			FD_ZERO(&fdSet);
-			FD_SET(_handle, &fdSet);
+		return totalSent;
+	}
+#endif
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (!slices[i].length)
+			continue;
+
+#ifdef _WIN32
+		buffers[bufferCount].buf = reinterpret_cast<CHAR *>(const_cast<void *>(slices[i].data));
+		buffers[bufferCount].len = ULONG(slices[i].length);
+#else
+		buffers[bufferCount].iov_base = const_cast<void *>(slices[i].data);
+		buffers[bufferCount].iov_len = slices[i].length;
+#endif
+		length += slices[i].length;
+		bufferCount++;
+	}
+
+	LOG_DEBUG << "Writing " << length << " bytes from " << bufferCount << " slices on socket " << _handle;
+
+	for (std::size_t first = 0; first < bufferCount; )
+	{
+#ifdef _WIN32
+		DWORD sent = 0;
+
+		if (WSASend(_handle, buffers + first, DWORD(bufferCount - first), &sent, 0, NULL, NULL) != 0)
+#else
+		struct msghdr message = { };
+
+		message.msg_iov = buffers + first;
+		message.msg_iovlen = decltype(message.msg_iovlen)(bufferCount - first);
+
+		ssize_t sent = sendmsg(_handle, &message, SEND_FLAGS);
+
+		if (sent == -1)
+#endif
+		{
+			if (!handleSendError(_handle))
+				break; // Connection closed by the remote side
 
-			(void)select(0, NULL, &fdSet, NULL, NULL);
 			continue;
 		}
+
+		totalSent += std::size_t(sent);
+
+		// Skip the slices that have been completely sent and adjust the slice that was partially sent
+		for (std::size_t remaining = std::size_t(sent); remaining; )
+		{
+			std::size_t bufferLength = buffers[first].IF_WINSOCK(len, iov_len);
+
+			if (remaining >= bufferLength)
+			{
+				remaining -= bufferLength;
+				first++;
+			}
+			else
+			{
+#ifdef _WIN32
+				buffers[first].buf += remaining;
+				buffers[first].len -= ULONG(remaining);
 #else
-			LOG_ERROR << "Failed to write data to socket: " << getSocketErrorCode();
+				buffers[first].iov_base = static_cast<char *>(buffers[first].iov_base) + remaining;
+				buffers[first].iov_len -= remaining;
 #endif
+				remaining = 0;
+			}
+		}
+	}
+
+	LOG_DEBUG << "Wrote " << totalSent << " bytes on socket " << _handle;
+	return totalSent;
+}
+
+#ifndef _WIN32
+/** Writes as much data to the socket as possible without waiting for the socket to become writable.
+ *
+ * @param data the data to write to the socket
+ * @param length the number of bytes to write
+ * @param written set to the number of bytes written to the socket, which may be less than the length if the socket is not writable
+ * @return false if the connection was closed by the remote side, otherwise true
+ */
+bool k8psh::Socket::writeAvailable(const void *data, std::size_t length, std::size_t &written)
+{
+	written = 0;
+
+#ifdef __linux__
+	if (_channel.isValid())
+	{
+		written = _channel.write(data, length, false);
+		return written == length || !_channel.isRemoteClosed();
+	}
+#endif
+
+	while (written < length)
+	{
+		ssize_t sent = send(_handle, static_cast<const char *>(data) + written, length - written, SEND_FLAGS | MSG_DONTWAIT);
+
+		if (sent == -1)
+		{
+			if (getSocketErrorCode() == EAGAIN || getSocketErrorCode() == EWOULDBLOCK)
+				break;
+			else if (!handleSendError(_handle))
+				return false; // Connection closed by the remote side
+
+			continue;
+		}
+
+		written += std::size_t(sent);
+	}
+
+	LOG_DEBUG << "Wrote " << written << " of " << length << " bytes on socket " << _handle;
+	return true;
+}
+
+/** Reads data from the socket, up to the size of the vector, receiving any handles sent with the data (Unix domain sockets only).
+ *
+ * @param data a vector to fill with data from the socket
+ * @param offset the offset into the vector to read data into
+ * @param handles the vector that received handles are appended to, which are owned by the caller and are not inherited by child processes
+ * @return the number of bytes read from the socket
+ */
+std::size_t k8psh::Socket::read(std::vector<std::uint8_t> &data, std::size_t offset, std::vector<int> &handles)
+{
+	if (offset >= data.size())
+		return 0;
+
+	LOG_DEBUG << "Reading up to " << (data.size() - offset) << " bytes and handles on socket " << _handle;
+
+#ifdef __linux__
+	// Handles are only sent before the channel is attached
+	if (_channel.isValid())
+		return _channel.read(&data[offset], data.size() - offset);
+#endif
+
+	union
+	{
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int) * MAX_HANDLES)];
+	} control;
+
+	struct iovec buffer = { &data[offset], data.size() - offset };
+	struct msghdr message = { };
+
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+#ifdef MSG_CMSG_CLOEXEC
+	ssize_t received = recvmsg(_handle, &message, MSG_CMSG_CLOEXEC);
+#else
+	ssize_t received = recvmsg(_handle, &message, 0);
+#endif
+
+	if (received < 0)
+		LOG_ERROR << "Failed to read data from socket: " << getSocketErrorCode();
+
+	for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		for (std::size_t i = 0; i < (header->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+		{
+			int handle;
+
+			std::memcpy(&handle, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+			(void)fcntl(handle, F_SETFD, FD_CLOEXEC);
+#endif
+			handles.push_back(handle);
+		}
+	}
+
+	LOG_DEBUG << "Read " << received << " bytes and " << handles.size() << " handles on socket " << _handle;
+	return std::size_t(received);
+}
+
+/** Writes data to the socket along with handles, which are duplicated into the process that receives the data (Unix domain sockets only).
+ *
+ * @param data the data to write to the socket
+ * @param length the number of bytes to write, which must be non-zero
+ * @param handles the handles to send with the first byte of the data
+ * @param count the number of handles, up to MAX_HANDLES
+ * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
+ */
+std::size_t k8psh::Socket::write(const void *data, std::size_t length, const int *handles, std::size_t count)
+{
+	if (count > MAX_HANDLES)
+		LOG_ERROR << "Failed to write " << count << " handles to socket, maximum is " << MAX_HANDLES;
+#ifdef __linux__
+	else if (_channel.isValid())
+		LOG_ERROR << "Failed to write handles to socket with a shared memory channel";
+#endif
+
+	LOG_DEBUG << "Writing " << length << " bytes and " << count << " handles on socket " << _handle;
+
+	union
+	{
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int) * MAX_HANDLES)];
+	} control = { };
+
+	struct iovec buffer = { const_cast<void *>(data), length };
+	struct msghdr message = { };
+
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	std::memcpy(CMSG_DATA(header), handles, sizeof(int) * count);
+
+	ssize_t sent;
+
+	while ((sent = sendmsg(_handle, &message, SEND_FLAGS)) == -1)
+	{
+		if (!handleSendError(_handle))
+			return 0; // Connection closed by the remote side
+	}
+
+	// The handles are attached to the first byte, so any remaining data is written normally
+	const Slice remaining = { static_cast<const char *>(data) + sent, length - std::size_t(sent) };
+	return std::size_t(sent) + (remaining.length ? write(&remaining, 1) : 0);
+}
+#endif
+
+#ifdef __linux__
+/** Writes data to the socket directly from a pipe, without copying the data through user space.
+ *
+ * @param pipe the pipe handle to read data from
+ * @param length the number of bytes to transfer from the pipe
+ * @return the number of bytes written to the socket, which may be less than requested if the pipe was closed or the connection was closed by the remote side
+ */
+std::size_t k8psh::Socket::splice(int pipe, std::size_t length)
+{
+	LOG_DEBUG << "Splicing " << length << " bytes from pipe " << pipe << " on socket " << _handle;
+	std::size_t totalSent = 0;
+
+	if (_channel.isValid())
+		return _channel.readFrom(pipe, length);
+
+	while (totalSent < length)
+	{
+		ssize_t sent = ::splice(pipe, NULL, _handle, NULL, length - totalSent, SPLICE_F_MOVE);
+
+		if (sent == 0)
+			break; // Pipe closed
+		else if (sent == -1)
+		{
+			int error = getSocketErrorCode();
+
+			if (error == EPIPE || error == ECONNRESET)
+				break; // Connection closed by the remote side
+			else if (error != EINTR)
+				LOG_ERROR << "Failed to splice data to socket: " << error;
+
+			continue;
+		}
 
 		totalSent += sent;
-		offset += sent;
 	}
 
-	LOG_DEBUG << "Wrote " << totalSent << " bytes on socket " << _handle;
+	LOG_DEBUG << "Spliced " << totalSent << " bytes on socket " << _handle;
+	return totalSent;
+}
+
+/** Writes data to the socket directly from a file at its current offset (advancing the offset), without copying the data through user space.
+ *
+ * @param file the file handle to read data from
+ * @param length the number of bytes to transfer from the file
+ * @return the number of bytes written to the socket, which may be less than requested if the file ended or the connection was closed by the remote side
+ */
+std::size_t k8psh::Socket::sendFile(int file, std::size_t length)
+{
+	LOG_DEBUG << "Sending " << length << " bytes from file " << file << " on socket " << _handle;
+	std::size_t totalSent = 0;
+
+	if (_channel.isValid())
+		return _channel.readFrom(file, length);
+
+	while (totalSent < length)
+	{
+		ssize_t sent = ::sendfile(_handle, file, NULL, length - totalSent);
+
+		if (sent == 0)
+			break; // End of file
+		else if (sent == -1)
+		{
+			int error = getSocketErrorCode();
+
+			if (error == EPIPE || error == ECONNRESET)
+				break; // Connection closed by the remote side
+			else if (error != EINTR)
+				LOG_ERROR << "Failed to send file data to socket: " << error;
+
+			continue;
+		}
+
+		totalSent += sent;
+	}
+
+	LOG_DEBUG << "Sent " << totalSent << " bytes from file on socket " << _handle;
 	return totalSent;
 }
+#endif
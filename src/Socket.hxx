@@ -10,6 +10,8 @@
 
 #ifdef _WIN32
 	#include <winsock2.h>
+#elif defined(__linux__)
+	#include "SharedMemoryChannel.hxx"
 #endif
 
 namespace k8psh {
@@ -37,11 +39,30 @@ public:
 
 	static constexpr Handle INVALID_HANDLE = Handle(-1);
 	static constexpr unsigned short RANDOM_PORT = 0;
+	static constexpr std::size_t MAX_SLICES = 8;
+	static constexpr std::size_t MAX_HANDLES = 8;
+
+	// A contiguous range of data used for scatter-gather writes.
+	struct Slice
+	{
+		const void *data;
+		std::size_t length;
+	};
+
+	// A socket waited on by wait(), either to finish connecting (if started by startConnect()) or to have data to read.
+	struct Wait
+	{
+		Socket *socket;
+		bool connecting;
+		bool ready; // Set by wait() if the socket finished connecting (or failed to connect) or has data to read (or was closed)
+	};
 
 private:
 	Handle _handle;
 #ifdef _WIN32
 	Event _readEvent;
+#elif defined(__linux__)
+	SharedMemoryChannel _channel; // Carries the data of the socket once it is attached
 #endif
 
 #ifdef _WIN32
@@ -51,15 +72,43 @@ private:
 #endif
 
 public:
-	// Creates a new server socket listening on the specified port.
-	static Socket listen(unsigned short port);
+	// Creates a new server socket listening on the specified port of a numeric IPv4 or IPv6 address (the loopback address if empty), optionally sharing the port with other sockets created the same way (the kernel balances the connections among them).
+	static Socket listen(unsigned short port, const std::string &address = std::string(), bool sharePort = false);
+
+	// Creates a new server socket listening on the Unix domain socket at the specified path, replacing any stale socket at that path.
+	static Socket listen(const std::string &path);
+
+	// Creates a new socket by connecting to the specified port on the loopback address. This call may return an invalid socket if a recoverable error is encountered.
+	static Socket connect(unsigned short port, bool failOnError = true) { return connect(std::string(), port, failOnError); }
+
+	// Creates a new socket by connecting to the specified port of a numeric IPv4 or IPv6 address (the loopback address if empty), giving up once the connection takes longer than the timeout in milliseconds (if not negative). This call may return an invalid socket if a recoverable error is encountered.
+	static Socket connect(const std::string &address, unsigned short port, bool failOnError = true, long long timeoutMs = -1);
+
+	// Creates a new socket by connecting to the Unix domain socket at the specified path. This call may return an invalid socket if a recoverable error is encountered.
+	static Socket connect(const std::string &path, bool failOnError = true);
+
+	// Starts connecting a new socket to the specified port of a numeric IPv4 or IPv6 address (the loopback address if empty) without waiting for the connection, which can be finished once the socket is writable. This call may return an invalid socket if a recoverable error is encountered.
+	static Socket startConnect(const std::string &address, unsigned short port, bool failOnError = true);
+
+	// Starts connecting a new socket to the Unix domain socket at the specified path without waiting for the connection, which can be finished once the socket is writable. This call may return an invalid socket if a recoverable error is encountered.
+	static Socket startConnect(const std::string &path, bool failOnError = true);
 
-	// Creates a new socket by connecting to the specified port. This call may return an invalid socket if a recoverable error is encountered.
-	static Socket connect(unsigned short port, bool failOnError = true);
+	// Waits until any of the sockets are ready, returning the number of ready sockets (zero if none are ready within the timeout in milliseconds, if not negative).
+	static std::size_t wait(std::vector<Wait> &waits, long long timeoutMs);
+
+	// Resolves a hostname (or numeric address) to a numeric address, returning an empty string if it cannot be resolved. Numeric addresses never use the system resolver, and hostnames cannot be resolved by the statically-linked executable.
+	static std::string resolve(const std::string &hostname);
+
+#ifndef _WIN32
+	// Creates a pair of connected sockets.
+	static void createPair(Socket &first, Socket &second);
+#endif
 
 	Socket() : _handle(INVALID_HANDLE) { }
 #ifdef _WIN32
 	Socket(Socket &&other) : _handle(other._handle), _readEvent(other._readEvent) { other._handle = INVALID_HANDLE; }
+#elif defined(__linux__)
+	Socket(Socket &&other) : _handle(other._handle), _channel(std::move(other._channel)) { other._handle = INVALID_HANDLE; }
 #else
 	Socket(Socket &&other) : _handle(other._handle) { other._handle = INVALID_HANDLE; }
 #endif
@@ -71,6 +120,8 @@ public:
 		_handle = other._handle;
 #ifdef _WIN32
 		_readEvent = other._readEvent;
+#elif defined(__linux__)
+		_channel = std::move(other._channel);
 #endif
 		other._handle = INVALID_HANDLE;
 
@@ -83,22 +134,49 @@ public:
 	// Accepts a new socket on a server socket. This call may return an invalid socket if a recoverable error is encountered.
 	Socket accept();
 
+#ifdef __linux__
+	// Attaches a shared memory channel, which then carries all data written to and read from the socket (the remote side attaches the other side of the channel at the same point in the data). The socket stays connected until it is closed, which also closes the channel.
+	void attachChannel(SharedMemoryChannel &&channel) { _channel = std::move(channel); }
+#endif
+
 	// Closes the socket.
 	void close();
 
+	// Finishes a connection started by startConnect() once the socket is writable, returning false if the connection failed (the socket is blocking once connected).
+	bool finishConnect();
+
 	// Creates a read event, if it does not already exist, that can be used to poll the socket for new data.
 	// (On Windows the socket will automatically be placed in non-blocking mode, and the event is subject to spurious wake-ups since it is reset after a wait rather than after a read.)
 	Event createReadEvent();
 
-	// Gets the bound port of the socket, or zero if the socket is not valid.
+	// Gets the bound port of the socket, or zero if the socket is not valid or is not a TCP socket.
 	unsigned short getPort() const;
 
 	// Checks if the socket has data to read.
 	bool hasData() const;
 
+	// Checks if the read event can be signaled for data that was already read (and is not signaled again for data left unread), in which case hasData() must be checked before each read until it returns false.
+#ifdef __linux__
+	bool hasSpuriousReadEvents() const { return _channel.isValid(); }
+#else
+	bool hasSpuriousReadEvents() const { return false; }
+#endif
+
 	// Checks if the socket is valid.
 	bool isValid() const { return _handle != INVALID_HANDLE; }
 
+	// Shuts down sending on the socket, indicating to the remote side that no more data will be written.
+	void shutdown();
+
+	// Sets the size in bytes of the kernel send and receive buffers of the socket, returning false if either could not be set.
+	bool setBufferSize(std::size_t size);
+
+	// Sets the time in milliseconds that reads wait for data before failing, or zero to wait forever, returning false if it could not be set.
+	bool setReceiveTimeout(long long timeoutMs);
+
+	// Sets the socket as non-blocking. (On POSIX platforms, sockets accepted from a non-blocking server socket are always blocking.)
+	bool setNonblocking();
+
 	/** Reads data from the socket, up to the size of the vector.
 	 *
 	 * @param data a vector to fill with data from the socket
@@ -112,7 +190,7 @@ public:
 	 *
 	 * @param data a vector of data to write to the socket
 	 * @param offset the offset into the vector to write data from
-	 * @return the number of bytes written to the socket
+	 * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
 	 */
 	std::size_t write(const std::vector<std::uint8_t> &data, std::size_t offset = 0) { return write(data, offset, data.size()); }
 
@@ -121,9 +199,66 @@ public:
 	 * @param data a vector of data to write to the socket
 	 * @param offset the offset into the vector to write data from
 	 * @param end the ending index (exclusive) of the data to write
-	 * @return the number of bytes written to the socket
+	 * @param more true if more data will be written immediately after this data, allowing it to be coalesced into fewer packets where supported
+	 * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
+	 */
+	std::size_t write(const std::vector<std::uint8_t> &data, std::size_t offset, std::size_t end, bool more = false);
+
+	/** Writes multiple slices of data to the socket, without first copying them into a contiguous buffer.
+	 *
+	 * @param slices the slices of data to write to the socket, in order
+	 * @param count the number of slices, up to MAX_SLICES
+	 * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
+	 */
+	std::size_t write(const Slice *slices, std::size_t count);
+
+#ifndef _WIN32
+	/** Writes as much data to the socket as possible without waiting for the socket to become writable.
+	 *
+	 * @param data the data to write to the socket
+	 * @param length the number of bytes to write
+	 * @param written set to the number of bytes written to the socket, which may be less than the length if the socket is not writable
+	 * @return false if the connection was closed by the remote side, otherwise true
+	 */
+	bool writeAvailable(const void *data, std::size_t length, std::size_t &written);
+
+	/** Reads data from the socket, up to the size of the vector, receiving any handles sent with the data (Unix domain sockets only).
+	 *
+	 * @param data a vector to fill with data from the socket
+	 * @param offset the offset into the vector to read data into
+	 * @param handles the vector that received handles are appended to, which are owned by the caller and are not inherited by child processes
+	 * @return the number of bytes read from the socket
+	 */
+	std::size_t read(std::vector<std::uint8_t> &data, std::size_t offset, std::vector<int> &handles);
+
+	/** Writes data to the socket along with handles, which are duplicated into the process that receives the data (Unix domain sockets only).
+	 *
+	 * @param data the data to write to the socket
+	 * @param length the number of bytes to write, which must be non-zero
+	 * @param handles the handles to send with the first byte of the data
+	 * @param count the number of handles, up to MAX_HANDLES
+	 * @return the number of bytes written to the socket, which may be less than requested if the connection was closed by the remote side
+	 */
+	std::size_t write(const void *data, std::size_t length, const int *handles, std::size_t count);
+#endif
+
+#ifdef __linux__
+	/** Writes data to the socket directly from a pipe, without copying the data through user space.
+	 *
+	 * @param pipe the pipe handle to read data from
+	 * @param length the number of bytes to transfer from the pipe
+	 * @return the number of bytes written to the socket, which may be less than requested if the pipe was closed or the connection was closed by the remote side
+	 */
+	std::size_t splice(int pipe, std::size_t length);
+
+	/** Writes data to the socket directly from a file at its current offset (advancing the offset), without copying the data through user space.
+	 *
+	 * @param file the file handle to read data from
+	 * @param length the number of bytes to transfer from the file
+	 * @return the number of bytes written to the socket, which may be less than requested if the file ended or the connection was closed by the remote side
 	 */
-	std::size_t write(const std::vector<std::uint8_t> &data, std::size_t offset, std::size_t end);
+	std::size_t sendFile(int file, std::size_t length);
+#endif
 };
 
 } // k8psh
@@ -0,0 +1,174 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "Trace.hxx"
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include "Utilities.hxx"
+
+/** Adds a phase to the trace.
+ *
+ * @param track the side of the session that the phase belongs to
+ * @param name the name of the phase
+ * @param start the time that the phase started
+ * @param end the time that the phase ended
+ */
+void k8psh::Trace::add(const std::string &track, const std::string &name, Clock::time_point start, Clock::time_point end)
+{
+	Phase phase;
+
+	phase.track = track;
+	phase.name = name;
+	phase.start = std::chrono::duration_cast<std::chrono::microseconds>(start - _start);
+	phase.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+	_phases.emplace_back(std::move(phase));
+}
+
+/** Appends events to a trace file, creating it if it does not exist. The file uses the JSON array format, which allows the closing bracket to be omitted, so any number of clients can append to it.
+ *
+ * @param filename the name of the trace file
+ * @param events the events formatted by format()
+ * @return true if the events were appended, otherwise false
+ */
+bool k8psh::Trace::append(const std::string &filename, const std::string &events)
+{
+	// The file is locked while it is appended, so only the client that finds it empty writes the opening bracket
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	OVERLAPPED overlapped = { };
+	LARGE_INTEGER size = { };
+	bool appended = false;
+
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped) != 0)
+	{
+		if (GetFileSizeEx(file, &size) != 0 && SetFilePointerEx(file, LARGE_INTEGER(), NULL, FILE_END) != 0)
+		{
+			const std::string data = (size.QuadPart == 0 ? "[\n" : "") + events;
+			DWORD written = 0;
+
+			appended = WriteFile(file, data.data(), DWORD(data.length()), &written, NULL) != 0 && written == data.length();
+		}
+
+		(void)UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &overlapped);
+	}
+
+	(void)CloseHandle(file);
+	return appended;
+#else
+	int file = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	struct stat status;
+	bool appended = false;
+
+	if (file < 0)
+		return false;
+
+	if (flock(file, LOCK_EX) == 0 && fstat(file, &status) == 0)
+	{
+		const std::string data = (status.st_size == 0 ? "[\n" : "") + events;
+
+		appended = write(file, data.data(), data.length()) == ssize_t(data.length());
+	}
+
+	(void)close(file); // Also releases the lock
+	return appended;
+#endif
+}
+
+/** Adds the phases of a serialized trace, which started at the specified time.
+ *
+ * @param track the side of the session that the phases belong to
+ * @param data the phases serialized by serialize()
+ * @param start the time that the serialized trace started, relative to the clock of this trace
+ * @return true if the phases were added, otherwise false if the data is invalid
+ */
+bool k8psh::Trace::deserialize(const std::string &track, const std::string &data, Clock::time_point start)
+{
+	const auto offset = std::chrono::duration_cast<std::chrono::microseconds>(start - _start);
+	std::istringstream input(data);
+	std::vector<Phase> phases;
+	Phase phase;
+	long long phaseStart;
+	long long duration;
+
+	// Each phase is serialized on its own line as the start and duration in microseconds followed by the name
+	phase.track = track;
+
+	while (input >> phaseStart >> duration && std::getline(input >> std::ws, phase.name))
+	{
+		phase.start = offset + std::chrono::microseconds(phaseStart);
+		phase.duration = std::chrono::microseconds(duration);
+		phases.push_back(phase);
+	}
+
+	if (!input.eof())
+		return false;
+
+	_phases.insert(_phases.end(), phases.begin(), phases.end());
+	return true;
+}
+
+/** Formats the phases as Chrome trace events, with timestamps in microseconds since the Unix epoch so they line up with the traces of other build tools.
+ *
+ * @param processName the name of the process shown in the trace
+ * @param processId the ID of the process shown in the trace
+ * @return the events, each followed by a comma and a newline
+ */
+std::string k8psh::Trace::format(const std::string &processName, std::uint64_t processId) const
+{
+	// The start of the trace is converted from the steady clock to the system clock once, so the phases keep their monotonic timing
+	const auto epochStart = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()) -
+		std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - _start);
+	const std::string pid = std::to_string(processId);
+	std::vector<std::string> tracks;
+	std::ostringstream events;
+
+	events << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"" << k8psh::Utilities::escapeJson(processName) << "\"}},\n";
+
+	for (auto it = _phases.begin(); it != _phases.end(); ++it)
+	{
+		std::size_t tid = 0;
+
+		while (tid < tracks.size() && tracks[tid] != it->track)
+			tid++;
+
+		// Each track is named as it is first used
+		if (tid == tracks.size())
+		{
+			tracks.push_back(it->track);
+			events << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"args\":{\"name\":\"" << k8psh::Utilities::escapeJson(it->track) << "\"}},\n";
+		}
+
+		events << "{\"name\":\"" << k8psh::Utilities::escapeJson(it->name) << "\",\"cat\":\"k8psh\",\"ph\":\"X\",\"ts\":" << (epochStart + it->start).count() <<
+			",\"dur\":" << it->duration.count() << ",\"pid\":" << pid << ",\"tid\":" << tid << "},\n";
+	}
+
+	return events.str();
+}
+
+// Serializes the phases, so they can be sent to the other side of the session.
+std::string k8psh::Trace::serialize() const
+{
+	std::ostringstream data;
+
+	for (auto it = _phases.begin(); it != _phases.end(); ++it)
+		data << it->start.count() << ' ' << it->duration.count() << ' ' << it->name << '\n';
+
+	return data.str();
+}
@@ -0,0 +1,83 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#ifndef K8PSH_TRACE_HXX
+#define K8PSH_TRACE_HXX
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace k8psh {
+
+// The phases of a session on the client and the server, which are written to a file as Chrome trace events.
+class Trace
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// A span of time spent in one phase of a session.
+	struct Phase
+	{
+		std::string track; // The side of the session (like "client" or "server"), shown as a separate thread of the trace
+		std::string name;
+		std::chrono::microseconds start; // Since the start of the trace
+		std::chrono::microseconds duration;
+	};
+
+private:
+	Clock::time_point _start;
+	std::vector<Phase> _phases;
+
+public:
+	// Creates an empty trace starting at the specified time.
+	Trace(Clock::time_point start = Clock::now()) : _start(start), _phases() { }
+
+	/** Adds a phase to the trace.
+	 *
+	 * @param track the side of the session that the phase belongs to
+	 * @param name the name of the phase
+	 * @param start the time that the phase started
+	 * @param end the time that the phase ended
+	 */
+	void add(const std::string &track, const std::string &name, Clock::time_point start, Clock::time_point end);
+
+	/** Appends events to a trace file, creating it if it does not exist. The file uses the JSON array format, which allows the closing bracket to be omitted, so any number of clients can append to it.
+	 *
+	 * @param filename the name of the trace file
+	 * @param events the events formatted by format()
+	 * @return true if the events were appended, otherwise false
+	 */
+	static bool append(const std::string &filename, const std::string &events);
+
+	/** Adds the phases of a serialized trace, which started at the specified time.
+	 *
+	 * @param track the side of the session that the phases belong to
+	 * @param data the phases serialized by serialize()
+	 * @param start the time that the serialized trace started, relative to the clock of this trace
+	 * @return true if the phases were added, otherwise false if the data is invalid
+	 */
+	bool deserialize(const std::string &track, const std::string &data, Clock::time_point start);
+
+	/** Formats the phases as Chrome trace events, with timestamps in microseconds since the Unix epoch so they line up with the traces of other build tools.
+	 *
+	 * @param processName the name of the process shown in the trace
+	 * @param processId the ID of the process shown in the trace
+	 * @return the events, each followed by a comma and a newline
+	 */
+	std::string format(const std::string &processName, std::uint64_t processId) const;
+
+	// Gets the start of the trace.
+	Clock::time_point getStart() const { return _start; }
+
+	// Gets the phases of the trace.
+	const std::vector<Phase> &getPhases() const { return _phases; }
+
+	// Serializes the phases, so they can be sent to the other side of the session.
+	std::string serialize() const;
+};
+
+} // k8psh
+
+#endif // K8PSH_TRACE_HXX
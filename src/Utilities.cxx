@@ -6,12 +6,18 @@
 #include <algorithm>
 #include <cctype>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <stdexcept>
 #include <thread>
 #include <utility>
@@ -25,17 +31,36 @@
 
 	#define K8PSH_PATH_MAX MAX_PATH
 	#define FILE_READ_MODE "rb"
+	#define FILE_WRITE_MODE "wb"
 #else
 	#include <fcntl.h>
+	#include <poll.h>
+	#include <pthread.h>
 	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/resource.h>
 	#include <sys/stat.h>
 
 	#ifdef __APPLE__
 		#include <mach-o/dyld.h>
 	#endif
 
+	#ifdef __linux__
+		#include <sys/epoll.h>
+		#include <sys/inotify.h>
+		#include <sys/socket.h>
+		#include <sys/un.h>
+
+		#define K8PSH_REACTOR_EPOLL
+	#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+		#include <sys/event.h>
+
+		#define K8PSH_REACTOR_KQUEUE
+	#endif
+
 	#define K8PSH_PATH_MAX 4096
 	#define FILE_READ_MODE "r"
+	#define FILE_WRITE_MODE "w"
 #endif
 
 // Gets the name of the file.
@@ -108,29 +133,281 @@ static std::string getDebugName(const char *filename)
 	return dotIndex == std::string::npos ? basename : basename.substr(0, dotIndex);
 }
 
-// Checks if debug logging is enabled for the specified filename.
+// The categories enabled for debug logging, which are read from the environment the first time they are needed (the first thread to store them wins, so no lock is held that a forked child could inherit)
+static std::atomic<const std::string *> debugCategories(nullptr);
+
+// Checks if debug logging is enabled for the specified filename (the categories are read from the environment once).
 bool k8psh::Logger::shouldLogDebug(const char *filename)
 {
-	auto toDebug = Utilities::getEnvironmentVariable("K8PSH_DEBUG");
+	const std::string *categories = debugCategories.load(std::memory_order_acquire);
+
+	if (!categories)
+	{
+		auto toDebug = Utilities::getEnvironmentVariable("K8PSH_DEBUG");
 
 #ifdef K8PSH_DEBUG
 	#define K8PSH_QUOTE_(X) #X
 	#define K8PSH_QUOTE(X) K8PSH_QUOTE_(X)
-	if (!toDebug)
-		toDebug = K8PSH_QUOTE(K8PSH_DEBUG);
+		if (!toDebug)
+			toDebug = K8PSH_QUOTE(K8PSH_DEBUG);
 	#undef K8PSH_QUOTE_
 	#undef K8PSH_QUOTE
 #endif
 
-	return !toDebug.empty() && (listContainsCaseInsensitive(toDebug, getDebugName(filename)) || listContainsCaseInsensitive(toDebug, "all"));
+		std::unique_ptr<const std::string> parsed(new std::string(toDebug));
+
+		if (debugCategories.compare_exchange_strong(categories, parsed.get(), std::memory_order_acq_rel))
+			categories = parsed.release();
+	}
+
+	return !categories->empty() && (listContainsCaseInsensitive(*categories, getDebugName(filename)) || listContainsCaseInsensitive(*categories, "all"));
+}
+
+// A bounded queue of log messages that any thread can add to without locking, which is emptied by a single writer thread
+class AsyncLogQueue
+{
+	struct Slot
+	{
+		std::atomic<std::size_t> sequence; // The position of the message in the queue, plus one once the message can be removed
+		std::string message;
+	};
+
+	std::unique_ptr<Slot[]> _slots;
+	const std::size_t _mask;
+	std::atomic<std::size_t> _writePosition;
+	std::size_t _readPosition;
+
+public:
+	// Creates a queue with the specified capacity, which must be a power of two
+	AsyncLogQueue(std::size_t capacity) : _slots(new Slot[capacity]), _mask(capacity - 1), _writePosition(), _readPosition()
+	{
+		for (std::size_t i = 0; i < capacity; i++)
+			_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// Checks if the queue is empty (only called by the writer thread)
+	bool isEmpty() const { return _slots[_readPosition & _mask].sequence.load(std::memory_order_acquire) != _readPosition + 1; }
+
+	// Removes the next message, returning false if the queue is empty (only called by the writer thread)
+	bool pop(std::string &message)
+	{
+		Slot &slot = _slots[_readPosition & _mask];
+
+		if (slot.sequence.load(std::memory_order_acquire) != _readPosition + 1)
+			return false;
+
+		message = std::move(slot.message);
+		slot.sequence.store(_readPosition + _mask + 1, std::memory_order_release);
+		_readPosition++;
+		return true;
+	}
+
+	// Adds a message, returning false if the queue is full
+	bool push(std::string &message)
+	{
+		std::size_t position = _writePosition.load(std::memory_order_relaxed);
+
+		for (;;)
+		{
+			Slot &slot = _slots[position & _mask];
+			const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+			if (sequence == position)
+			{
+				if (_writePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					slot.message.swap(message);
+					slot.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (std::ptrdiff_t(sequence - position) < 0)
+				return false; // The slot still holds the message from the previous pass through the queue
+			else
+				position = _writePosition.load(std::memory_order_relaxed);
+		}
+	}
+};
+
+// Writes the messages queued by all threads to stdout from a background thread
+class AsyncLogWriter
+{
+	AsyncLogQueue _queue;
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	std::atomic<bool> _sleeping; // True if the writer thread may be waiting for messages, so it needs to be notified
+	std::atomic<bool> _stopping;
+	std::atomic<std::size_t> _dropped;
+	std::thread _thread;
+
+	// Writes a batch of messages, flushing it so a forked process never inherits the messages buffered by stdout
+	static void writeBatch(const std::string &batch)
+	{
+#ifndef _WIN32
+		flockfile(stdout);
+#endif
+		(void)std::fwrite(batch.data(), batch.length(), 1, stdout);
+		(void)std::fflush(stdout);
+#ifndef _WIN32
+		funlockfile(stdout);
+#endif
+	}
+
+	// Writes the queued messages, returning true if any were written
+	bool writeQueued()
+	{
+		std::string batch;
+		std::string message;
+
+		while (_queue.pop(message))
+		{
+			batch += message;
+
+			if (batch.length() >= 1024 * 64)
+			{
+				writeBatch(batch);
+				batch.clear();
+			}
+		}
+
+		if (!batch.empty())
+			writeBatch(batch);
+
+		const std::size_t dropped = _dropped.exchange(0);
+
+		if (dropped)
+			LOG_WARNING << "Dropped " << dropped << " debug messages, since the log writer fell behind";
+
+		return !batch.empty() || dropped;
+	}
+
+	// Writes messages until the writer is stopped
+	void run()
+	{
+		while (writeQueued() || !_stopping.load())
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			_sleeping.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			if (_queue.isEmpty() && !_stopping.load())
+				(void)_condition.wait_for(lock, std::chrono::milliseconds(100));
+
+			_sleeping.store(false);
+		}
+	}
+
+public:
+	AsyncLogWriter(std::size_t capacity) : _queue(capacity), _mutex(), _condition(), _sleeping(), _stopping(), _dropped(), _thread([this] { run(); }) { }
+
+	// Stops the writer thread, writing any messages that are still queued.
+	void stop()
+	{
+		_stopping.store(true);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_condition.notify_one();
+		}
+
+		_thread.join();
+		(void)writeQueued();
+	}
+
+	// Queues a message, returning false if it must be written directly (debug messages are dropped instead if the queue is full).
+	bool write(std::string &message, bool debug)
+	{
+		if (!_queue.push(message))
+		{
+			if (!debug)
+				return false;
+
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (_sleeping.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_condition.notify_one();
+		}
+
+		return true;
+	}
+};
+
+// The writers are never destroyed, since other threads can log messages at any time until the process exits
+static std::atomic<AsyncLogWriter *> asyncLogWriter(nullptr);
+static std::atomic<bool> asyncLogForked(false); // True once the process forks, since the writer thread does not exist in the child (a new writer is started by the next message)
+static std::size_t asyncLogCapacity = 0;
+
+// Queues a message for the background writer, returning false if the message must be written directly.
+static bool writeAsync(std::string &message, bool debug)
+{
+	AsyncLogWriter *writer = asyncLogWriter.load(std::memory_order_acquire);
+
+	if (!writer)
+		return false;
+	else if (asyncLogForked.load(std::memory_order_relaxed) && asyncLogForked.exchange(false))
+	{
+		writer = new AsyncLogWriter(asyncLogCapacity);
+		asyncLogWriter.store(writer, std::memory_order_release);
+	}
+
+	return writer->write(message, debug);
+}
+
+/** Starts writing debug and informational messages from a background thread, so logging never waits for stdout.
+ *
+ * @param capacity the number of messages that can be queued (rounded up to a power of two). Debug messages are dropped if the queue is full, while other messages are written directly.
+ */
+void k8psh::Logger::startAsyncWriter(std::size_t capacity)
+{
+	if (asyncLogWriter.load())
+		return;
+
+	for (asyncLogCapacity = 1; asyncLogCapacity < capacity; asyncLogCapacity *= 2)
+		;
+
+	static bool registered = false;
+
+	if (!registered)
+	{
+#ifndef _WIN32
+		// Stdout is flushed and locked while forking, so the child never inherits buffered messages (which the child would write again)
+		(void)pthread_atfork([] { flockfile(stdout); (void)std::fflush(stdout); }, [] { funlockfile(stdout); }, [] { funlockfile(stdout); asyncLogForked.store(asyncLogWriter.load() != nullptr); });
+#endif
+		(void)std::atexit([] { stopAsyncWriter(); });
+		registered = true;
+	}
+
+	asyncLogForked.store(false);
+	asyncLogWriter.store(new AsyncLogWriter(asyncLogCapacity));
+}
+
+// Stops the background writer, writing any queued messages first.
+void k8psh::Logger::stopAsyncWriter()
+{
+	AsyncLogWriter *writer = asyncLogWriter.exchange(nullptr);
+
+	// The thread of a writer inherited by a forked child does not exist, and the messages it queued are written by the parent
+	if (writer && !asyncLogForked.exchange(false))
+		writer->stop();
 }
 
 k8psh::Logger::~Logger()
 {
 	static auto atomicWrite = [](std::FILE *stream, const std::string &content) { return std::fwrite(&content[0], content.length(), 1, stream); };
 
+	// The date and time are only formatted once per second by each thread
+	static thread_local std::time_t formattedTime = std::time_t(-1);
+	static thread_local char dateTime[64];
+
 	std::string message = _logger.str();
-	std::string level5Chars;
+	const char *level5Chars;
 
 	switch (_level)
 	{
@@ -140,44 +417,54 @@ k8psh::Logger::~Logger()
 	default:            level5Chars = "ERROR, "; break;
 	}
 
-	std::ostringstream ss;
 #ifdef _WIN32
-	auto id = std::this_thread::get_id();
+	auto id = std::uint32_t(GetCurrentThreadId());
 #else
 	auto id = std::uint32_t(getpid() * 16777619U + std::hash<std::thread::id>()(std::this_thread::get_id()));
 #endif
 	auto now = std::chrono::system_clock::now();
 	auto time = std::chrono::system_clock::to_time_t(now);
-	::tm gmTime = ::tm();
 	auto seconds = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch());
 
+	if (time != formattedTime)
+	{
+		::tm gmTime = ::tm();
+
 #ifdef _WIN32
-	(void)gmtime_s(&gmTime, &time);
+		(void)gmtime_s(&gmTime, &time);
 #else
-	(void)gmtime_r(&time, &gmTime);
+		(void)gmtime_r(&time, &gmTime);
 #endif
 
-	ss << "[" << std::setfill('0') << std::setw(4) << (gmTime.tm_year + 1900) << '-' << std::setw(2) << (gmTime.tm_mon + 1) << '-' << std::setw(2) << gmTime.tm_mday << ' ' <<
-		std::setw(2) << gmTime.tm_hour << ':' << std::setw(2) << gmTime.tm_min << ':' << std::setw(2) << gmTime.tm_sec << '.' <<
-		std::setw(6) << std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch() - seconds).count() << std::setfill(' ') << ", " <<
-		level5Chars <<
-		id << "] ";
+		(void)std::snprintf(dateTime, sizeof(dateTime), "%04d-%02d-%02d %02d:%02d:%02d", gmTime.tm_year + 1900, gmTime.tm_mon + 1, gmTime.tm_mday, gmTime.tm_hour, gmTime.tm_min, gmTime.tm_sec);
+		formattedTime = time;
+	}
+
+	char header[128];
+	const int headerLength = std::snprintf(header, sizeof(header), "[%s.%06ld, %s%lu] ", dateTime, long(std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch() - seconds).count()), level5Chars, static_cast<unsigned long>(id));
+	std::string line(header, headerLength > 0 ? std::size_t(headerLength) : 0);
 
 	switch (_level)
 	{
 	case LEVEL_DEBUG:
-		ss << "(" << getDebugName(getFilename()) << ") " << message << std::endl;
-		atomicWrite(stdout, ss.str());
+		line += "(" + getDebugName(getFilename()) + ") " + message + '\n';
+
+		if (!writeAsync(line, true))
+			atomicWrite(stdout, line);
+
 		break;
 
 	case LEVEL_INFO:
-		ss << message << std::endl;
-		atomicWrite(stdout, ss.str());
+		line += message + '\n';
+
+		if (!writeAsync(line, false))
+			atomicWrite(stdout, line);
+
 		break;
 
 	case LEVEL_WARNING:
-		ss << message << std::endl;
-		atomicWrite(stderr, ss.str());
+		line += message + '\n';
+		atomicWrite(stderr, line);
 		break;
 
 	default: // Error
@@ -188,181 +475,1024 @@ k8psh::Logger::~Logger()
 #else
 			std::size_t filenameIndex = filename.rfind("/src/") + 1;
 #endif
-			ss << message << " (" << filename.substr(filenameIndex) << ":" << getLine() << ")" << std::endl;
-			atomicWrite(stderr, ss.str());
-			break;
-		}
+			line += message + " (" + filename.substr(filenameIndex) + ":" + std::to_string(getLine()) + ")\n";
+			atomicWrite(stderr, line);
+			break;
+		}
+	}
+
+	if (_finalMessage)
+		*_finalMessage = std::move(message);
+}
+
+// Gets the stream used to log the message
+std::ostringstream &k8psh::Logger::getStream() const
+{
+	return const_cast<std::ostringstream &>(_logger);
+}
+
+#ifdef _WIN32
+static const DWORD OVERLAPPED_PIPE_BUFFER_SIZE = 1024 * 64;
+static std::atomic<unsigned long> overlappedPipeCount(0); // Names the pipes created for overlapped reads
+#endif
+
+// Creates a pipe. On Windows, the output can be created for overlapped reads (it can then only be read using overlapped I/O).
+k8psh::Pipe::Pipe(bool overlappedOutput) : _input(INVALID_HANDLE), _output(INVALID_HANDLE)
+{
+#ifdef _WIN32
+	SECURITY_ATTRIBUTES sa = { };
+
+	sa.nLength = DWORD(sizeof(sa));
+	sa.bInheritHandle = TRUE;
+
+	if (!overlappedOutput)
+	{
+		if (CreatePipe(&_output, &_input, &sa, 0) == 0)
+			LOG_ERROR << "Failed to create pipe: " << GetLastError();
+
+		return;
+	}
+
+	// Anonymous pipes do not support overlapped I/O, so a uniquely named pipe is used instead
+	const std::string name = "\\\\.\\pipe\\k8psh-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(++overlappedPipeCount);
+	HANDLE output = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 0, OVERLAPPED_PIPE_BUFFER_SIZE, 0, &sa);
+
+	if (output == INVALID_HANDLE_VALUE)
+		LOG_ERROR << "Failed to create pipe " << name << ": " << GetLastError();
+
+	HANDLE input = CreateFileA(name.c_str(), GENERIC_WRITE, 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (input == INVALID_HANDLE_VALUE)
+	{
+		const DWORD error = GetLastError();
+
+		(void)CloseHandle(output);
+		LOG_ERROR << "Failed to open pipe " << name << ": " << error;
+	}
+
+	_input = input;
+	_output = output;
+#else
+	(void)overlappedOutput;
+
+	Handle fds[2];
+
+	if (pipe(fds) != 0)
+		LOG_ERROR << "Failed to create pipe: " << errno;
+
+	// Prevent the pipe from leaking into executed processes (remapped handles are still inherited)
+	(void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	_input = fds[1];
+	_output = fds[0];
+#endif
+}
+
+// Closes the specified pipe handle
+static void closePipeHandle(k8psh::Pipe::Handle handle)
+{
+#ifdef _WIN32
+	if (handle)
+		(void)CloseHandle(handle);
+#else
+	if (handle >= 0)
+		(void)close(handle);
+#endif
+}
+
+// Destructs the anonymous pipe
+k8psh::Pipe::~Pipe()
+{
+	closePipeHandle(_input);
+	closePipeHandle(_output);
+}
+
+// Closes the current handles and takes ownership of the specified handles.
+void k8psh::Pipe::assign(Handle input, Handle output)
+{
+	closePipeHandle(_input);
+	closePipeHandle(_output);
+	_input = input;
+	_output = output;
+}
+
+// Closes the input handle.
+void k8psh::Pipe::closeInput()
+{
+	closePipeHandle(_input);
+	_input = INVALID_HANDLE;
+}
+
+// Closes the output handle.
+void k8psh::Pipe::closeOutput()
+{
+	closePipeHandle(_output);
+	_output = INVALID_HANDLE;
+}
+
+/** Reads data from the pipe.
+ *
+ * @param data the buffer to fill with data from the pipe
+ * @param length the maximum number of bytes to read
+ * @return the number of bytes read from the pipe
+ */
+std::size_t k8psh::Pipe::read(char *data, std::size_t length)
+{
+#ifdef _WIN32
+	DWORD read = 0;
+
+	if (ReadFile(_output, data, DWORD(length), &read, NULL) == 0 && GetLastError() != ERROR_BROKEN_PIPE)
+		LOG_ERROR << "Failed to read data from pipe: " << GetLastError();
+#else
+	ssize_t read = -1;
+
+	while (read == -1)
+	{
+		read = ::read(_output, data, length);
+
+		if (read == -1 && errno != EINTR)
+			LOG_ERROR << "Failed to read data from pipe: " << errno;
+	}
+#endif
+
+	return read;
+}
+
+// Remaps the specified pipe handle to the new handle
+static bool remapPipeHandle(k8psh::Pipe::Handle &handle, k8psh::Pipe::Handle newHandle)
+{
+	if (newHandle == k8psh::Pipe::INVALID_HANDLE)
+	{
+		closePipeHandle(handle);
+		handle = newHandle;
+		return true;
+	}
+
+#ifdef _WIN32
+	return handle == newHandle;
+#else
+	if (handle == newHandle)
+		return fcntl(handle, F_SETFD, 0) != -1;
+	else if (handle == k8psh::Pipe::INVALID_HANDLE || dup2(handle, newHandle) < 0)
+		return false;
+
+	(void)close(handle);
+	handle = newHandle;
+	return true;
+#endif
+}
+
+// Remaps the input to the specified handle.
+bool k8psh::Pipe::remapInput(k8psh::Pipe::Handle handle)
+{
+	return remapPipeHandle(_input, handle);
+}
+
+// Remaps the output to the specified handle.
+bool k8psh::Pipe::remapOutput(k8psh::Pipe::Handle handle)
+{
+	return remapPipeHandle(_output, handle);
+}
+
+// Sets the capacity of the pipe in bytes, returning false if the capacity could not be set (only supported on Linux).
+bool k8psh::Pipe::setCapacity(std::size_t capacity)
+{
+#ifdef F_SETPIPE_SZ
+	const Handle handle = _output != INVALID_HANDLE ? _output : _input;
+
+	return handle != INVALID_HANDLE && capacity <= std::size_t(INT_MAX) && fcntl(handle, F_SETPIPE_SZ, int(capacity)) != -1;
+#else
+	(void)capacity;
+	return false;
+#endif
+}
+
+// Sets the input as non-blocking.
+bool k8psh::Pipe::setInputNonblocking()
+{
+#ifdef _WIN32
+	DWORD mode = PIPE_NOWAIT;
+
+	return SetNamedPipeHandleState(_input, &mode, NULL, NULL) != 0;
+#else
+	int flags = fcntl(_input, F_GETFL);
+
+	return flags != -1 && fcntl(_input, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+/** Writes data to the pipe.
+ *
+ * @param data the data to write to the pipe
+ * @param length the number of bytes to write
+ * @return the number of bytes written to the pipe, which may be less than the length if the pipe is full or the reading end of the pipe is closed
+ */
+std::size_t k8psh::Pipe::write(const char *data, std::size_t length)
+{
+	if (_input == INVALID_HANDLE)
+		return 0;
+
+#ifdef _WIN32
+	DWORD bytesWritten = 0;
+
+	if (WriteFile(_input, data, DWORD(length), &bytesWritten, NULL) != 0)
+		return bytesWritten;
+#else
+	auto wrote = ::write(_input, data, length);
+
+	if (wrote >= 0)
+		return wrote;
+	else if (errno == EINTR || errno == EAGAIN)
+		return 0;
+#endif
+
+	closeInput();
+	return 0;
+}
+
+/** Appends data to the end of the buffer.
+ *
+ * @param data the data to append
+ * @param length the number of bytes to append
+ * @return the number of bytes appended, which may be less than the length if the buffer is full
+ */
+std::size_t k8psh::RingBuffer::append(const char *data, std::size_t length)
+{
+	if (_data.empty() && length)
+		_data.resize(_capacity);
+
+	if (length > _data.size() - _size)
+		length = _data.size() - _size;
+
+	// Copy the data in up to two pieces, wrapping around to the start of the storage
+	std::size_t end = (_start + _size) % (_data.empty() ? 1 : _data.size());
+	std::size_t first = _data.size() - end < length ? _data.size() - end : length;
+
+	if (first)
+		std::memcpy(&_data[end], data, first);
+
+	if (length - first)
+		std::memcpy(&_data[0], data + first, length - first);
+
+	_size += length;
+	return length;
+}
+
+// Removes the specified number of bytes from the front of the buffer.
+void k8psh::RingBuffer::consume(std::size_t length)
+{
+	if (length >= _size)
+		_start = _size = 0;
+	else
+	{
+		_start = (_start + length) % _data.size();
+		_size -= length;
+	}
+}
+
+// Maps the file into memory for reading, creating an invalid mapping if the file does not exist or cannot be mapped.
+k8psh::MappedFile::MappedFile(const std::string &filename) : _data(), _size()
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	if (GetFileSizeEx(file, &size) != 0 && size.QuadPart > 0)
+	{
+		// The view keeps the mapping open after the handles are closed
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (mapping)
+		{
+			_data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			_size = _data ? std::size_t(size.QuadPart) : 0;
+			(void)CloseHandle(mapping);
+		}
+	}
+
+	(void)CloseHandle(file);
+#else
+	int file = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat fileStat;
+
+	if (file < 0)
+		return;
+
+	if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+	{
+		void *data = mmap(NULL, std::size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+
+		if (data != MAP_FAILED)
+		{
+			_data = static_cast<const char *>(data);
+			_size = std::size_t(fileStat.st_size);
+		}
+	}
+
+	(void)close(file);
+#endif
+}
+
+k8psh::MappedFile::~MappedFile()
+{
+	if (_data)
+	{
+#ifdef _WIN32
+		(void)UnmapViewOfFile(_data);
+#else
+		(void)munmap(const_cast<char *>(_data), _size);
+#endif
+	}
+}
+
+// Creates a counter starting at zero, which is shared with all child processes forked after it is created.
+k8psh::SharedCounter::SharedCounter() : _value()
+{
+#ifdef _WIN32
+	// Sessions run on threads of the server process, so the counter does not need to be shared between processes
+	_value = new std::atomic<long long>(0);
+#else
+	void *memory = mmap(NULL, sizeof(std::atomic<long long>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (memory == MAP_FAILED)
+		LOG_ERROR << "Failed to map shared counter";
+
+	_value = new (memory) std::atomic<long long>(0);
+#endif
+}
+
+k8psh::SharedCounter::~SharedCounter()
+{
+#ifdef _WIN32
+	delete _value;
+#else
+	_value->~atomic();
+	(void)munmap(_value, sizeof(std::atomic<long long>));
+#endif
+}
+
+// Creates a semaphore that can be acquired up to the specified number of times at once (at most MAX_HOLDERS), which is shared with all child processes forked after it is created.
+k8psh::FifoSemaphore::FifoSemaphore(long long limit) : _state(), _limit(limit < MAX_HOLDERS ? limit : MAX_HOLDERS)
+{
+#ifdef _WIN32
+	// Sessions run on threads of the server process, so the semaphore does not need to be shared between processes
+	_state = new State();
+	_state->creator = static_cast<long long>(GetCurrentProcessId());
+#else
+	void *memory = mmap(NULL, sizeof(State), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (memory == MAP_FAILED)
+		LOG_ERROR << "Failed to map shared semaphore";
+
+	_state = new (memory) State();
+	_state->creator = static_cast<long long>(getpid());
+#endif
+
+	for (long long i = 0; i < MAX_WAITERS; i++)
+		_state->cancelled[i].store(-1);
+}
+
+k8psh::FifoSemaphore::~FifoSemaphore()
+{
+#ifdef _WIN32
+	delete _state;
+#else
+	_state->~State();
+	(void)munmap(_state, sizeof(State));
+#endif
+}
+
+// Gets the name of the wake handle of a ticket.
+std::string k8psh::FifoSemaphore::getWakeName(long long ticket) const
+{
+	std::ostringstream name;
+
+	name << "k8psh-queue-" << _state->creator << '-' << static_cast<const void *>(_state) << '-' << ticket;
+	return name.str();
+}
+
+// Skips the cancelled tickets at the front of the queue, returning the ticket now at the front.
+long long k8psh::FifoSemaphore::skipCancelled()
+{
+	long long serving = _state->serving.load();
+
+	while (serving < _state->nextTicket.load() && _state->cancelled[serving % MAX_WAITERS].load() == serving)
+	{
+		if (_state->serving.compare_exchange_strong(serving, serving + 1))
+			serving++;
+	}
+
+	return serving;
+}
+
+// Signals the wake handle of a ticket, if the ticket is waiting, so it tries to acquire the semaphore again.
+void k8psh::FifoSemaphore::wake(long long ticket) const
+{
+#ifdef __linux__
+	static const int sender = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (sender < 0 || ticket >= _state->nextTicket.load() || !_state->waiters[ticket % MAX_WAITERS].load())
+		return;
+
+	// The handles are bound in the abstract namespace, so they are removed once the waiter closes them (a waiter that has not created its handle yet tries again after creating it)
+	const std::string name = getWakeName(ticket);
+	const char signal = 0;
+	sockaddr_un address = { };
+
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path + 1, name.data(), name.length());
+	(void)sendto(sender, &signal, sizeof(signal), MSG_DONTWAIT | MSG_NOSIGNAL, reinterpret_cast<sockaddr *>(&address), socklen_t(offsetof(sockaddr_un, sun_path) + 1 + name.length()));
+#elif defined(_WIN32)
+	if (ticket >= _state->nextTicket.load() || !_state->waiters[ticket % MAX_WAITERS].load())
+		return;
+
+	// A waiter that has not created its event yet tries again after creating it
+	HANDLE handle = OpenEventA(EVENT_MODIFY_STATE, FALSE, getWakeName(ticket).c_str());
+
+	if (handle)
+	{
+		(void)SetEvent(handle);
+		(void)CloseHandle(handle);
+	}
+#else
+	(void)ticket;
+#endif
+}
+
+/** Leaves the queue without acquiring the semaphore.
+ *
+ * @param ticket a ticket from enqueue() that has not acquired the semaphore
+ */
+void k8psh::FifoSemaphore::cancel(long long ticket)
+{
+	// The ticket is skipped once it reaches the front of the queue, so the waiter behind it is woken in case it is now at the front
+	_state->waiters[ticket % MAX_WAITERS].store(0);
+	_state->cancelled[ticket % MAX_WAITERS].store(ticket);
+	wake(skipCancelled());
+}
+
+/** Creates a handle that becomes readable once a ticket may be able to acquire the semaphore, so the waiter can wait for it in a reactor (the handle is closed by the caller, and can be read to reset it). On Windows the handle is an event that is reset once a wait for it returns.
+ *
+ * @param ticket a ticket from enqueue(), which must be waited for using the handle before it is first tried (so no wake ups are missed)
+ * @return the handle, or Pipe::INVALID_HANDLE if waking waiters is not supported (the ticket must then be retried periodically)
+ */
+k8psh::Pipe::Handle k8psh::FifoSemaphore::createWakeHandle(long long ticket) const
+{
+#ifdef _WIN32
+	// The events are named, so the semaphore can signal the event of a waiter without holding it (the name is released once the waiter closes the event)
+	HANDLE handle = CreateEventA(NULL, FALSE, FALSE, getWakeName(ticket).c_str());
+
+	if (!handle)
+	{
+		LOG_DEBUG << "Failed to create wake handle " << getWakeName(ticket) << ": " << GetLastError();
+		return Pipe::INVALID_HANDLE;
+	}
+
+	return handle;
+#elif defined(__linux__)
+	const std::string name = getWakeName(ticket);
+	sockaddr_un address = { };
+	int handle = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path + 1, name.data(), name.length());
+
+	if (handle >= 0 && bind(handle, reinterpret_cast<sockaddr *>(&address), socklen_t(offsetof(sockaddr_un, sun_path) + 1 + name.length())) != 0)
+	{
+		LOG_DEBUG << "Failed to bind wake handle " << name << ": " << errno;
+		(void)close(handle);
+		handle = -1;
+	}
+
+	return handle;
+#else
+	(void)ticket;
+	return Pipe::INVALID_HANDLE;
+#endif
+}
+
+/** Joins the back of the queue.
+ *
+ * @param waiter the process waiting with the ticket, so the queue can be left if it exits while waiting
+ * @return the ticket used to acquire the semaphore, or negative if the queue is full
+ */
+long long k8psh::FifoSemaphore::enqueue(long long waiter)
+{
+	long long ticket = _state->nextTicket.load();
+
+	// A ticket is only issued when its cancellation slot is free, so cancellations are never overwritten before they reach the front
+	do
+	{
+		if (ticket - _state->serving.load() >= MAX_WAITERS)
+			return -1;
+	} while (!_state->nextTicket.compare_exchange_weak(ticket, ticket + 1));
+
+	_state->waiters[ticket % MAX_WAITERS].store(waiter);
+	return ticket;
+}
+
+/** Releases the semaphore after it was acquired, waking the waiter at the front of the queue.
+ *
+ * @param holder the process that acquired the semaphore
+ * @return true if the process held the semaphore, otherwise false
+ */
+bool k8psh::FifoSemaphore::release(long long holder)
+{
+	for (long long i = 0; i < _limit; i++)
+	{
+		long long expected = holder;
+
+		if (_state->holders[i].compare_exchange_strong(expected, 0))
+		{
+			(void)_state->acquired.fetch_sub(1);
+			wake(skipCancelled());
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/** Releases the semaphore as many times as a process acquired it, and leaves the queue for each ticket it is waiting with (used once a process exits without releasing the semaphore, like a killed process).
+ *
+ * @param process the process that exited
+ * @return the number of times the semaphore was released
+ */
+long long k8psh::FifoSemaphore::releaseAll(long long process)
+{
+	long long released = 0;
+
+	while (release(process))
+		released++;
+
+	// Each slot is used by a single ticket in the queue, which is found from the front of the queue (the tickets of an exited process stay in the queue until they are cancelled)
+	const long long serving = _state->serving.load();
+
+	for (long long i = 0; i < MAX_WAITERS; i++)
+	{
+		if (_state->waiters[i].load() == process)
+			cancel(serving + (i - serving % MAX_WAITERS + MAX_WAITERS) % MAX_WAITERS);
+	}
+
+	return released;
+}
+
+/** Acquires the semaphore if the ticket is at the front of the queue and the semaphore is available, without waiting.
+ *
+ * @param ticket a ticket from enqueue()
+ * @param holder the process acquiring the semaphore, which releases it
+ * @return true if the semaphore was acquired, otherwise false
+ */
+bool k8psh::FifoSemaphore::tryAcquire(long long ticket, long long holder)
+{
+	long long serving = _state->serving.load();
+
+	// Skip the cancelled tickets at the front of the queue
+	while (serving < ticket)
+	{
+		if (_state->cancelled[serving % MAX_WAITERS].load() != serving)
+			return false;
+
+		if (_state->serving.compare_exchange_strong(serving, serving + 1))
+			serving++;
+	}
+
+	if (serving != ticket)
+		return false;
+
+	for (long long acquired = _state->acquired.load(); acquired < _limit; )
+	{
+		if (_state->acquired.compare_exchange_weak(acquired, acquired + 1))
+		{
+			// The holders never outnumber the acquisitions, so there is always a free slot (although another holder may take it first)
+			for (long long i = 0; ; i = (i + 1) % _limit)
+			{
+				long long expected = 0;
+
+				if (_state->holders[i].compare_exchange_strong(expected, holder))
+					break;
+			}
+
+			_state->waiters[ticket % MAX_WAITERS].store(0);
+			_state->serving.store(ticket + 1);
+
+			// The next waiter can also acquire the semaphore if it is still available
+			if (acquired + 1 < _limit)
+				wake(skipCancelled());
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Starts watching for the file to be created or replaced. Changes cannot be detected if the parent directory does not exist or the platform does not support watching files.
+k8psh::FileWatcher::FileWatcher(const std::string &filename) : _name(Utilities::getBasename(filename))
+{
+	std::string directory = Utilities::getParentDirectory(filename);
+
+	if (directory.empty())
+		directory = ".";
+
+#if defined(_WIN32)
+	// Windows only reports that something changed in the directory
+	_handle = FindFirstChangeNotificationA(directory.c_str(), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+#elif defined(__linux__)
+	_handle = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+	if (_handle >= 0 && inotify_add_watch(_handle, directory.c_str(), IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+	{
+		(void)close(_handle);
+		_handle = -1;
+	}
+#else
+	_handle = -1;
+#endif
+
+	LOG_DEBUG << (isValid() ? "Watching for changes to " : "Cannot watch for changes to ") << filename;
+}
+
+k8psh::FileWatcher::~FileWatcher()
+{
+	if (isValid())
+	{
+#ifdef _WIN32
+		(void)FindCloseChangeNotification(_handle);
+#else
+		(void)close(_handle);
+#endif
 	}
-
-	if (_finalMessage)
-		*_finalMessage = std::move(message);
 }
 
-// Gets the stream used to log the message
-std::ostringstream &k8psh::Logger::getStream() const
+// Checks if changes to the file can be detected.
+bool k8psh::FileWatcher::isValid() const
 {
-	return const_cast<std::ostringstream &>(_logger);
+#ifdef _WIN32
+	return _handle != INVALID_HANDLE_VALUE;
+#else
+	return _handle >= 0;
+#endif
 }
 
-// Constructs a new anonymous pipe
-k8psh::Pipe::Pipe()
+/** Waits for the file to be created or replaced after the watcher was created or last waited.
+ *
+ * @param until the time to stop waiting
+ * @return true if the file (or possibly another file in the same directory) was created or replaced, false if the time expired
+ */
+bool k8psh::FileWatcher::wait(std::chrono::steady_clock::time_point until)
 {
-#ifdef _WIN32
-	SECURITY_ATTRIBUTES sa = { };
+	if (!isValid())
+	{
+		std::this_thread::sleep_until(until);
+		return false;
+	}
 
-	sa.nLength = DWORD(sizeof(sa));
-	sa.bInheritHandle = TRUE;
+	for (auto now = std::chrono::steady_clock::now(); now < until; now = std::chrono::steady_clock::now())
+	{
+		const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(until - now + std::chrono::microseconds(999)).count();
+		const int timeoutMs = remaining > 60000 ? 60000 : int(remaining);
+
+#ifdef _WIN32
+		const DWORD result = WaitForSingleObject(_handle, DWORD(timeoutMs));
 
-	if (CreatePipe(&_output, &_input, &sa, 0) == 0)
-		LOG_ERROR << "Failed to create pipe: " << GetLastError();
+		if (result == WAIT_OBJECT_0)
+		{
+			(void)FindNextChangeNotification(_handle);
+			return true;
+		}
+		else if (result != WAIT_TIMEOUT)
+			LOG_ERROR << "Failed to wait for changes to " << _name << ": " << GetLastError();
 #else
-	Handle fds[2];
+		struct pollfd pollSet = { };
 
-	if (pipe(fds) != 0)
-		LOG_ERROR << "Failed to create pipe: " << errno;
+		pollSet.fd = _handle;
+		pollSet.events = POLLIN;
 
-	_input = fds[1];
-	_output = fds[0];
+		if (poll(&pollSet, 1, timeoutMs) < 0 && errno != EINTR)
+			LOG_ERROR << "Failed to wait for changes to " << _name << ": " << errno;
+
+	#ifdef __linux__
+		// Check all queued events for the file
+		alignas(struct inotify_event) char buffer[4096];
+		bool changed = false;
+		ssize_t size;
+
+		while ((size = read(_handle, buffer, sizeof(buffer))) > 0)
+		{
+			for (ssize_t offset = 0; offset < size; )
+			{
+				const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buffer + offset);
+
+				changed |= event->len && _name == event->name;
+				offset += ssize_t(sizeof(struct inotify_event) + event->len);
+			}
+		}
+
+		if (changed)
+			return true;
+	#endif
 #endif
+	}
+
+	return false;
 }
 
-// Closes the specified pipe handle
-static void closePipeHandle(k8psh::Pipe::Handle handle)
-{
 #ifdef _WIN32
-	if (handle)
-		(void)CloseHandle(handle);
-#else
-	if (handle >= 0)
-		(void)close(handle);
-#endif
+// Creates a completion port.
+k8psh::CompletionPort::CompletionPort() : _handle(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1)), _notifications()
+{
+	if (!_handle)
+		LOG_ERROR << "Failed to create completion port: " << GetLastError();
 }
 
-// Destructs the anonymous pipe
-k8psh::Pipe::~Pipe()
+k8psh::CompletionPort::~CompletionPort()
 {
-	closePipeHandle(_input);
-	closePipeHandle(_output);
+	// Waits are unregistered before the port is closed, blocking until any running callbacks complete
+	for (auto it = _notifications.begin(); it != _notifications.end(); ++it)
+		(void)UnregisterWaitEx((*it)->wait, INVALID_HANDLE_VALUE);
+
+	(void)CloseHandle(_handle);
 }
 
-// Closes the input handle.
-void k8psh::Pipe::closeInput()
+// Posts the completion of a signaled notification.
+VOID CALLBACK k8psh::CompletionPort::postNotification(PVOID context, BOOLEAN)
 {
-	closePipeHandle(_input);
-	_input = INVALID_HANDLE;
+	const Notification *notification = static_cast<const Notification *>(context);
+
+	(void)PostQueuedCompletionStatus(notification->port, 0, notification->key, NULL);
 }
 
-// Closes the output handle.
-void k8psh::Pipe::closeOutput()
+/** Associates a handle opened for overlapped I/O with the port, so all of its operations complete on the port.
+ *
+ * @param handle the handle to associate with the port
+ * @param key the key of the completions for the handle
+ */
+void k8psh::CompletionPort::associate(HANDLE handle, ULONG_PTR key)
 {
-	closePipeHandle(_output);
-	_output = INVALID_HANDLE;
+	if (CreateIoCompletionPort(handle, _handle, key, 0) != _handle)
+		LOG_ERROR << "Failed to associate handle with completion port: " << GetLastError();
 }
 
-/** Reads data from the pipe.
+/** Posts a completion to the port each time a waitable handle (like an event or a process) is signaled, using the thread pool to wait on the handle.
  *
- * @param buffer the buffer to fill with data from the pipe
- * @return the number of bytes read from the pipe
+ * @param handle the handle to wait on, which must stay open for the lifetime of the port
+ * @param key the key of the completions for the handle
+ * @param once true to only post a completion the first time the handle is signaled (for handles that stay signaled)
  */
-std::size_t k8psh::Pipe::read(std::string &buffer)
+void k8psh::CompletionPort::notify(HANDLE handle, ULONG_PTR key, bool once)
 {
-#ifdef _WIN32
-	DWORD read = 0;
+	std::unique_ptr<Notification> notification(new Notification());
 
-	if (ReadFile(_output, &buffer[0], DWORD(buffer.length()), &read, NULL) == 0 && GetLastError() != ERROR_BROKEN_PIPE)
-		LOG_ERROR << "Failed to read data from pipe: " << GetLastError();
-#else
-	ssize_t read = -1;
+	notification->port = _handle;
+	notification->key = key;
 
-	while (read == -1)
-	{
-		read = ::read(_output, &buffer[0], buffer.length());
+	if (RegisterWaitForSingleObject(&notification->wait, handle, postNotification, notification.get(), INFINITE, WT_EXECUTEINWAITTHREAD | (once ? WT_EXECUTEONLYONCE : 0)) == 0)
+		LOG_ERROR << "Failed to wait on handle for completion port: " << GetLastError();
 
-		if (read == -1 && errno != EINTR)
-			LOG_ERROR << "Failed to read data from pipe: " << errno;
-	}
-#endif
+	_notifications.push_back(std::move(notification));
+}
 
-	return read;
+/** Posts a completion to the port.
+ *
+ * @param key the key of the completion
+ * @param length the number of bytes transferred
+ * @param overlapped the overlapped operation that completed
+ */
+void k8psh::CompletionPort::post(ULONG_PTR key, DWORD length, OVERLAPPED *overlapped)
+{
+	if (PostQueuedCompletionStatus(_handle, length, key, overlapped) == 0)
+		LOG_ERROR << "Failed to post completion: " << GetLastError();
 }
 
-// Remaps the specified pipe handle to the new handle
-static bool remapPipeHandle(k8psh::Pipe::Handle &handle, k8psh::Pipe::Handle newHandle)
+/** Waits for a completion.
+ *
+ * @param completion set to the completion
+ * @param timeoutMs the maximum time to wait in milliseconds, or INFINITE to wait forever
+ * @return true if a completion was received, false if the timeout expired
+ */
+bool k8psh::CompletionPort::wait(Completion &completion, DWORD timeoutMs)
 {
-	if (newHandle == k8psh::Pipe::INVALID_HANDLE)
+	DWORD length = 0;
+	ULONG_PTR key = 0;
+	OVERLAPPED *overlapped = NULL;
+	const BOOL result = GetQueuedCompletionStatus(_handle, &length, &key, &overlapped, timeoutMs);
+
+	// Failed operations still dequeue a completion (with the overlapped operation set)
+	if (result == 0 && !overlapped)
 	{
-		closePipeHandle(handle);
-		handle = newHandle;
-		return true;
-	}
+		const DWORD error = GetLastError();
 
-#ifdef _WIN32
-	return handle == newHandle;
-#else
-	if (handle == newHandle)
-		return true;
-	else if (handle == k8psh::Pipe::INVALID_HANDLE || dup2(handle, newHandle) < 0)
-		return false;
+		if (error == WAIT_TIMEOUT)
+			return false;
 
-	(void)close(handle);
-	handle = newHandle;
+		LOG_ERROR << "Failed to wait for completion: " << error;
+	}
+
+	completion.key = key;
+	completion.overlapped = overlapped;
+	completion.length = length;
+	completion.succeeded = result != 0;
 	return true;
-#endif
 }
+#else
+static constexpr int MAX_REACTOR_EVENTS = 256; // The maximum number of events returned by each wait
 
-// Remaps the input to the specified handle.
-bool k8psh::Pipe::remapInput(k8psh::Pipe::Handle handle)
+// Creates a reactor, which uses epoll on Linux, kqueue on macOS and BSD, and poll on other platforms.
+k8psh::Reactor::Reactor() : _handle(-1), _watches(), _alwaysReadyCount(), _generation()
 {
-	return remapPipeHandle(_input, handle);
+#if defined(K8PSH_REACTOR_EPOLL)
+	_handle = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(K8PSH_REACTOR_KQUEUE)
+	_handle = kqueue();
+
+	if (_handle >= 0)
+		(void)fcntl(_handle, F_SETFD, FD_CLOEXEC);
+#else
+	return;
+#endif
+
+	if (_handle < 0)
+		LOG_ERROR << "Failed to create reactor: " << errno;
 }
 
-// Remaps the output to the specified handle.
-bool k8psh::Pipe::remapOutput(k8psh::Pipe::Handle handle)
+k8psh::Reactor::~Reactor()
 {
-	return remapPipeHandle(_output, handle);
+	if (_handle >= 0)
+		(void)close(_handle);
 }
 
-// Sets the input as non-blocking.
-bool k8psh::Pipe::setInputNonblocking()
+/** Watches a handle for events, replacing any events it was previously watched for. Handles must stop being watched before they are closed.
+ *
+ * @param handle the handle to watch
+ * @param events the events to watch for (READABLE and / or WRITABLE), or 0 to stop watching the handle
+ * @param context the context returned with events for the handle
+ */
+void k8psh::Reactor::watch(int handle, unsigned events, void *context)
 {
-#ifdef _WIN32
-	DWORD mode = PIPE_NOWAIT;
+	auto it = _watches.find(handle);
+	const unsigned previous = it == _watches.end() ? 0 : it->second.events;
+	bool alwaysReady = it != _watches.end() && it->second.alwaysReady;
+	std::uint32_t generation = it == _watches.end() ? 0 : it->second.generation;
 
-	return SetNamedPipeHandleState(_input, &mode, NULL, NULL) != 0;
-#else
-	int flags = fcntl(_input, F_GETFL);
+	if (it != _watches.end() && previous == events)
+	{
+		it->second.context = context;
+		return;
+	}
+	else if (previous == events)
+		return;
+
+#if defined(K8PSH_REACTOR_EPOLL)
+	struct epoll_event event = { };
+
+	event.events = ((events & READABLE) ? unsigned(EPOLLIN) : 0) | ((events & WRITABLE) ? unsigned(EPOLLOUT) : 0);
+	event.data.u64 = std::uint64_t(generation) << 32 | std::uint32_t(handle);
+
+	// Handles that were closed while watched are no longer registered, so they are added again as a new registration
+	// (A registration outlives the handle if a child process still has a copy of it, so its events are identified by the generation)
+	if (alwaysReady)
+		;
+	else if (!events)
+		(void)epoll_ctl(_handle, EPOLL_CTL_DEL, handle, &event);
+	else if (!(previous && epoll_ctl(_handle, EPOLL_CTL_MOD, handle, &event) == 0))
+	{
+		generation = ++_generation;
+		event.data.u64 = std::uint64_t(generation) << 32 | std::uint32_t(handle);
 
-	return flags != -1 && fcntl(_input, F_SETFL, flags | O_NONBLOCK) != -1;
+		if (epoll_ctl(_handle, EPOLL_CTL_ADD, handle, &event) != 0 && !(errno == EEXIST && epoll_ctl(_handle, EPOLL_CTL_MOD, handle, &event) == 0))
+		{
+			if (errno != EPERM)
+				LOG_ERROR << "Failed to watch handle " << handle << ": " << errno;
+
+			alwaysReady = true;
+		}
+	}
+#elif defined(K8PSH_REACTOR_KQUEUE)
+	static const unsigned flags[] = { READABLE, WRITABLE };
+	static const short filters[] = { EVFILT_READ, EVFILT_WRITE };
+
+	// Each filter is changed separately, so failing to delete the filter of a handle that was closed while watched does not affect the other filter
+	for (std::size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+	{
+		if (((events ^ previous) & flags[i]) == 0)
+			continue;
+
+		struct kevent change;
+
+		EV_SET(&change, handle, filters[i], (events & flags[i]) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+
+		if (kevent(_handle, &change, 1, NULL, 0, NULL) < 0 && (events & flags[i]))
+			LOG_ERROR << "Failed to watch handle " << handle << ": " << errno;
+	}
 #endif
+
+	if (it != _watches.end())
+	{
+		_alwaysReadyCount -= it->second.alwaysReady ? 1 : 0;
+		(void)_watches.erase(it);
+	}
+
+	if (events)
+	{
+		Watch watch = { events, context, alwaysReady, generation };
+
+		_alwaysReadyCount += alwaysReady ? 1 : 0;
+		_watches[handle] = watch;
+	}
 }
 
-/** Writes data to the pipe.
+/** Waits for watched handles to become ready.
  *
- * @param buffer the buffer to write to the pipe
- * @return the number of bytes written to the pipe, which may be less than the size of the buffer if the reading end of the pipe is closed
+ * @param events set to the ready handles
+ * @param timeout the maximum time to wait, or negative to wait forever
+ * @return the number of ready handles, which is zero if the timeout expired (or the wait was interrupted by a signal)
  */
-std::size_t k8psh::Pipe::write(const std::string &buffer)
+std::size_t k8psh::Reactor::wait(std::vector<Event> &events, std::chrono::microseconds timeout)
 {
-	if (_input == INVALID_HANDLE)
-		return 0;
+	events.clear();
 
-#ifdef _WIN32
-	DWORD bytesWritten = 0;
+	if (_alwaysReadyCount)
+		timeout = std::chrono::microseconds();
 
-	if (WriteFile(_input, &buffer[0], DWORD(buffer.length()), &bytesWritten, NULL) != 0)
-		return bytesWritten;
+	// Gets the watched events that are ready for a handle, ignoring handles that are no longer watched
+	auto addEvent = [this, &events](int handle, std::uint32_t generation, unsigned ready, bool failed)
+		{
+			auto it = _watches.find(handle);
+
+			if (it != _watches.end() && it->second.generation == generation && !it->second.alwaysReady && (ready = failed ? it->second.events : ready & it->second.events) != 0)
+			{
+				Event event = { handle, ready, it->second.context };
+				events.push_back(event);
+			}
+		};
+
+#if defined(K8PSH_REACTOR_EPOLL)
+	struct epoll_event ready[MAX_REACTOR_EVENTS];
+#ifdef K8PSH_HAVE_EPOLL_PWAIT2
+	struct timespec time = { time_t(timeout.count() / 1000000), long(timeout.count() % 1000000 * 1000) };
+	int count = epoll_pwait2(_handle, ready, MAX_REACTOR_EVENTS, timeout.count() < 0 ? NULL : &time, NULL);
+
+	if (count < 0 && errno == ENOSYS) // Older kernels only support millisecond timeouts
 #else
-	auto wrote = ::write(_input, &buffer[0], buffer.length());
+	int count;
+#endif
+	count = epoll_wait(_handle, ready, MAX_REACTOR_EVENTS, timeout.count() < 0 ? -1 : int((timeout.count() + 999) / 1000));
 
-	if (wrote >= 0)
-		return wrote;
-	else if (errno == EINTR || errno == EAGAIN)
-		return 0;
+	for (int i = 0; i < count; i++)
+		addEvent(int(std::uint32_t(ready[i].data.u64)), std::uint32_t(ready[i].data.u64 >> 32), ((ready[i].events & EPOLLIN) ? READABLE : 0) | ((ready[i].events & EPOLLOUT) ? WRITABLE : 0), (ready[i].events & (EPOLLERR | EPOLLHUP)) != 0);
+#elif defined(K8PSH_REACTOR_KQUEUE)
+	struct kevent ready[MAX_REACTOR_EVENTS];
+	struct timespec time = { time_t(timeout.count() / 1000000), long(timeout.count() % 1000000 * 1000) };
+	int count = kevent(_handle, NULL, 0, ready, MAX_REACTOR_EVENTS, timeout.count() < 0 ? NULL : &time);
+
+	for (int i = 0; i < count; i++)
+		addEvent(int(ready[i].ident), 0, ready[i].filter == EVFILT_READ ? READABLE : ready[i].filter == EVFILT_WRITE ? WRITABLE : 0, (ready[i].flags & EV_ERROR) != 0);
+#else
+	std::vector<struct pollfd> pollSet;
+
+	pollSet.reserve(_watches.size());
+
+	for (auto it = _watches.begin(); it != _watches.end(); ++it)
+	{
+		struct pollfd entry = { };
+
+		entry.fd = it->first;
+		entry.events = short(((it->second.events & READABLE) ? POLLIN : 0) | ((it->second.events & WRITABLE) ? POLLOUT : 0));
+		pollSet.push_back(entry);
+	}
+
+	int count = poll(pollSet.data(), nfds_t(pollSet.size()), timeout.count() < 0 ? -1 : int((timeout.count() + 999) / 1000));
+
+	for (std::size_t i = 0; count > 0 && i < pollSet.size(); i++)
+	{
+		if (pollSet[i].revents)
+			addEvent(pollSet[i].fd, 0, ((pollSet[i].revents & POLLIN) ? READABLE : 0) | ((pollSet[i].revents & POLLOUT) ? WRITABLE : 0), (pollSet[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+	}
 #endif
 
-	closeInput();
-	return 0;
+	if (count < 0 && errno != EINTR)
+		LOG_ERROR << "Failed to wait for handles: " << errno;
+
+	if (_alwaysReadyCount)
+	{
+		for (auto it = _watches.begin(); it != _watches.end(); ++it)
+		{
+			if (it->second.alwaysReady)
+			{
+				Event event = { it->first, it->second.events, it->second.context };
+				events.push_back(event);
+			}
+		}
+	}
+
+	return events.size();
 }
+#endif
 
 /** Changes the working directory of the process.
  *
@@ -388,6 +1518,31 @@ bool k8psh::Utilities::deleteFile(const std::string &filename)
 #endif
 }
 
+// Escapes a string, so it can be placed in a JSON string.
+std::string k8psh::Utilities::escapeJson(const std::string &value)
+{
+	static const char HEX_DIGITS[] = "0123456789abcdef";
+	std::string escaped;
+
+	for (std::size_t i = 0; i < value.length(); i++)
+	{
+		const unsigned char c = static_cast<unsigned char>(value[i]);
+
+		if (c == '"' || c == '\\')
+			(escaped += '\\') += char(c);
+		else if (c < 0x20)
+		{
+			escaped += "\\u00";
+			escaped += HEX_DIGITS[c >> 4];
+			escaped += HEX_DIGITS[c & 0xF];
+		}
+		else
+			escaped += char(c);
+	}
+
+	return escaped;
+}
+
 // Tests if the character is a path separator
 static bool isPathSeparator(char c)
 {
@@ -398,6 +1553,43 @@ static bool isPathSeparator(char c)
 #endif
 }
 
+// Finds an executable by searching the directories in the PATH environment variable (unless the name contains a path separator), returning an empty string if it is not found.
+std::string k8psh::Utilities::findExecutable(const std::string &name)
+{
+#ifdef _WIN32
+	static constexpr char PATH_LIST_SEPARATOR = ';';
+	const std::string filename = name.find('.') == std::string::npos ? name + ".exe" : name;
+	auto isExecutable = [](const std::string &path) { DWORD attributes = GetFileAttributesA(path.c_str()); return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0; };
+#else
+	static constexpr char PATH_LIST_SEPARATOR = ':';
+	const std::string &filename = name;
+	auto isExecutable = [](const std::string &path) { return access(path.c_str(), X_OK) == 0; };
+#endif
+
+	if (std::find_if(filename.begin(), filename.end(), isPathSeparator) != filename.end())
+		return isExecutable(filename) ? filename : std::string();
+
+	const std::string path = getEnvironmentVariable("PATH");
+
+	for (std::size_t start = 0; start <= path.length(); )
+	{
+		std::size_t end = path.find(PATH_LIST_SEPARATOR, start);
+
+		if (end == std::string::npos)
+			end = path.length();
+
+		// Empty directories refer to the working directory
+		const std::string executable = (end == start ? std::string(".") : path.substr(start, end - start)) + PATH_SEPARATOR + filename;
+
+		if (isExecutable(executable))
+			return executable;
+
+		start = end + 1;
+	}
+
+	return std::string();
+}
+
 // Gets the absolute path of the file.
 std::string k8psh::Utilities::getAbsolutePath(const std::string &filename)
 {
@@ -504,6 +1696,57 @@ k8psh::OptionalString k8psh::Utilities::getEnvironmentVariable(const std::unorde
 	return getEnvironmentVariable(name);
 }
 
+// Gets the CPU time (user and system) used by the current process, including its child processes that have exited and been waited on.
+std::chrono::microseconds k8psh::Utilities::getCpuTime()
+{
+#ifdef _WIN32
+	// Windows does not track the CPU time of child processes, and the server runs its sessions on threads
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+
+	if (GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime) == 0)
+		LOG_ERROR << "Failed to get process CPU time: " << GetLastError();
+
+	const auto toMicroseconds = [](const FILETIME &time) { return ((std::uint64_t(time.dwHighDateTime) << 32) + time.dwLowDateTime) / 10; }; // In 100ns intervals
+	return std::chrono::microseconds(toMicroseconds(kernelTime) + toMicroseconds(userTime));
+#else
+	struct rusage self;
+	struct rusage children;
+
+	if (getrusage(RUSAGE_SELF, &self) != 0 || getrusage(RUSAGE_CHILDREN, &children) != 0)
+		LOG_ERROR << "Failed to get process CPU time: " << errno;
+
+	const auto toMicroseconds = [](const struct timeval &time) { return std::chrono::seconds(time.tv_sec) + std::chrono::microseconds(time.tv_usec); };
+	return toMicroseconds(self.ru_utime) + toMicroseconds(self.ru_stime) + toMicroseconds(children.ru_utime) + toMicroseconds(children.ru_stime);
+#endif
+}
+
+// Gets the number of CPUs the process can use according to its cgroup CPU quota (rounded up), or zero if the quota is unlimited or unknown.
+long long k8psh::Utilities::getCpuQuota()
+{
+	long long quota = 0;
+	long long period = 0;
+
+#ifdef __linux__
+	// Version 2 of cgroups lists the quota and period in one file (the quota is "max" when unlimited), while version 1 uses separate files (the quota is -1 when unlimited)
+	const OptionalString cpuMax = readFile("/sys/fs/cgroup/cpu.max");
+	const OptionalString cpuQuota = cpuMax ? OptionalString() : readFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+	const OptionalString cpuPeriod = cpuMax ? OptionalString() : readFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+
+	if (cpuMax)
+		std::istringstream(cpuMax) >> quota >> period;
+	else if (cpuQuota && cpuPeriod)
+	{
+		std::istringstream(cpuQuota) >> quota;
+		std::istringstream(cpuPeriod) >> period;
+	}
+#endif
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+
+	return (quota + period - 1) / period;
+}
+
 // Gets the name of the host.
 std::string k8psh::Utilities::getHostname()
 {
@@ -816,3 +2059,37 @@ std::string k8psh::Utilities::substituteEnvironmentVariables(const std::string &
 
 	return result;
 }
+
+/** Writes the contents of a file, atomically replacing any existing file.
+ *
+ * @param filename the name of the file to write
+ * @param contents the contents of the file
+ * @return true if the file was written, otherwise false
+ */
+bool k8psh::Utilities::writeFile(const std::string &filename, const std::string &contents)
+{
+#ifdef _WIN32
+	const std::string temporaryFilename = filename + '.' + std::to_string(GetCurrentProcessId()) + ".tmp";
+#else
+	const std::string temporaryFilename = filename + '.' + std::to_string(getpid()) + ".tmp";
+#endif
+	std::FILE *file = std::fopen(temporaryFilename.c_str(), FILE_WRITE_MODE);
+
+	if (!file)
+		return false;
+
+	const bool written = std::fwrite(contents.data(), 1, contents.length(), file) == contents.length();
+
+	// Write to a temporary file and then replace the file, so readers never see a partial file
+#ifdef _WIN32
+	if (std::fclose(file) != 0 || !written || MoveFileExA(temporaryFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+	if (std::fclose(file) != 0 || !written || std::rename(temporaryFilename.c_str(), filename.c_str()) != 0)
+#endif
+	{
+		(void)deleteFile(temporaryFilename);
+		return false;
+	}
+
+	return true;
+}
@@ -4,10 +4,15 @@
 #ifndef K8PSH_UTILITIES_HXX
 #define K8PSH_UTILITIES_HXX
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #ifdef _WIN32
 	#include <windows.h>
@@ -61,9 +66,26 @@ private:
 	std::string *_finalMessage;
 
 public:
-	// Checks if debug logging is enabled for the specified filename.
+	// Checks if debug logging is enabled for the specified filename (the categories are read from the environment once).
 	static bool shouldLogDebug(const char *filename);
 
+	// Checks if debug logging is enabled for the specified filename, using the result cached by the statement (negative until it is first checked).
+	static bool shouldLogDebug(const char *filename, std::atomic<signed char> &cached)
+	{
+		signed char shouldLog = cached.load(std::memory_order_relaxed);
+
+		if (shouldLog < 0)
+			cached.store(shouldLog = shouldLogDebug(filename) ? 1 : 0, std::memory_order_relaxed);
+
+		return shouldLog != 0;
+	}
+
+	// Starts writing debug and informational messages from a background thread, so logging never waits for stdout. Messages are queued in a lock-free ring buffer with room for the specified number of messages (debug messages are dropped if it fills, while other messages are written directly).
+	static void startAsyncWriter(std::size_t capacity = 4096);
+
+	// Stops the background writer, writing any queued messages first.
+	static void stopAsyncWriter();
+
 	Logger(const char *filename, std::size_t line, const char *function, Level level, std::string *finalMessage = nullptr) : DebugInformation(filename, line, function), _level(level), _finalMessage(finalMessage) { }
 	~Logger();
 
@@ -72,8 +94,9 @@ public:
 };
 
 // Logs a debug statement (if not enabled, statement has no side effect). Example: `LOG_DEBUG << "Here's some debug info: " << a << ", " << b;`
+// Each statement checks if debug logging is enabled for its file once, then caches the result in a constant-initialized atomic (a static initialized at runtime takes a lock, which a forked child could inherit while held).
 #if defined(DEBUG) || defined(_DEBUG) || defined(K8PSH_DEBUG)
-	#define LOG_DEBUG for (bool LOG_DEBUG_shouldLog_ = ::k8psh::Logger::shouldLogDebug(__FILE__); LOG_DEBUG_shouldLog_; LOG_DEBUG_shouldLog_ = !LOG_DEBUG_shouldLog_) \
+	#define LOG_DEBUG for (bool LOG_DEBUG_shouldLog_ = ::k8psh::Logger::shouldLogDebug(__FILE__, [] () -> std::atomic<signed char> & { static std::atomic<signed char> cached(-1); return cached; }()); LOG_DEBUG_shouldLog_; LOG_DEBUG_shouldLog_ = !LOG_DEBUG_shouldLog_) \
 		::k8psh::Logger(__FILE__, __LINE__, PREPROCESSOR_FUNCTION_IDENTIFIER, ::k8psh::Logger::LEVEL_DEBUG).getStream()
 #else
 struct NullStream
@@ -112,9 +135,13 @@ private:
 	Handle _output;
 
 public:
-	Pipe();
+	// Creates a pipe. On Windows, the output can be created for overlapped reads (it can then only be read using overlapped I/O).
+	Pipe(bool overlappedOutput = false);
 	~Pipe();
 
+	// Closes the current handles and takes ownership of the specified handles.
+	void assign(Handle input, Handle output);
+
 	// Closes the input handle.
 	void closeInput();
 
@@ -132,7 +159,15 @@ public:
 	 * @param buffer the buffer to fill with data from the pipe
 	 * @return the number of bytes read from the pipe
 	 */
-	std::size_t read(std::string &buffer);
+	std::size_t read(std::string &buffer) { return read(&buffer[0], buffer.length()); }
+
+	/** Reads data from the pipe.
+	 *
+	 * @param data the buffer to fill with data from the pipe
+	 * @param length the maximum number of bytes to read
+	 * @return the number of bytes read from the pipe
+	 */
+	std::size_t read(char *data, std::size_t length);
 
 	// Remaps the input to the specified handle.
 	bool remapInput(Handle handle);
@@ -140,6 +175,9 @@ public:
 	// Remaps the output to the specified handle.
 	bool remapOutput(Handle handle);
 
+	// Sets the capacity of the pipe in bytes, returning false if the capacity could not be set (only supported on Linux).
+	bool setCapacity(std::size_t capacity);
+
 	// Sets the input as non-blocking.
 	bool setInputNonblocking();
 
@@ -148,9 +186,353 @@ public:
 	 * @param buffer the buffer to write to the pipe
 	 * @return the number of bytes written to the pipe, which may be less than the size of the buffer if the reading end of the pipe is closed
 	 */
-	std::size_t write(const std::string &buffer);
+	std::size_t write(const std::string &buffer) { return write(buffer.data(), buffer.length()); }
+
+	/** Writes data to the pipe.
+	 *
+	 * @param data the data to write to the pipe
+	 * @param length the number of bytes to write
+	 * @return the number of bytes written to the pipe, which may be less than the length if the pipe is full or the reading end of the pipe is closed
+	 */
+	std::size_t write(const char *data, std::size_t length);
+};
+
+class RingBuffer
+{
+	std::vector<char> _data;
+	std::size_t _capacity;
+	std::size_t _start;
+	std::size_t _size;
+
+public:
+	// Creates a ring buffer that holds up to the specified number of bytes (the storage is allocated once data is first appended).
+	RingBuffer(std::size_t capacity) : _data(), _capacity(capacity), _start(), _size() { }
+
+	/** Appends data to the end of the buffer.
+	 *
+	 * @param data the data to append
+	 * @param length the number of bytes to append
+	 * @return the number of bytes appended, which may be less than the length if the buffer is full
+	 */
+	std::size_t append(const char *data, std::size_t length);
+
+	// Removes all data from the buffer.
+	void clear() { _start = _size = 0; }
+
+	// Removes the specified number of bytes from the front of the buffer.
+	void consume(std::size_t length);
+
+	// Gets the maximum number of bytes the buffer can hold.
+	std::size_t getCapacity() const { return _capacity; }
+
+	/** Gets the contiguous data at the front of the buffer.
+	 *
+	 * @param length set to the number of contiguous bytes at the front of the buffer, which may be less than the size if the data wraps around
+	 * @return a pointer to the data at the front of the buffer
+	 */
+	const char *getFront(std::size_t &length) const
+	{
+		length = _data.size() - _start < _size ? _data.size() - _start : _size;
+		return _data.data() + _start;
+	}
+
+	// Gets the number of bytes in the buffer.
+	std::size_t getSize() const { return _size; }
+
+	// Checks if the buffer is empty.
+	bool isEmpty() const { return _size == 0; }
 };
 
+class MappedFile
+{
+	// Mapped files cannot be copied
+	MappedFile(const MappedFile&);
+	MappedFile &operator=(const MappedFile&);
+
+	const char *_data;
+	std::size_t _size;
+
+public:
+	// Maps the file into memory for reading, creating an invalid mapping if the file does not exist or cannot be mapped.
+	MappedFile(const std::string &filename);
+	~MappedFile();
+
+	// Gets the mapped data.
+	const char *getData() const { return _data; }
+
+	// Gets the number of bytes mapped.
+	std::size_t getSize() const { return _size; }
+
+	// Checks if the file was mapped.
+	bool isValid() const { return _data != nullptr; }
+};
+
+class SharedCounter
+{
+	// Shared counters cannot be copied
+	SharedCounter(const SharedCounter&);
+	SharedCounter &operator=(const SharedCounter&);
+
+	std::atomic<long long> *_value;
+
+public:
+	// Creates a counter starting at zero, which is shared with all child processes forked after it is created.
+	SharedCounter();
+	~SharedCounter();
+
+	// Adds to the counter, returning the new value.
+	long long add(long long delta) { return _value->fetch_add(delta) + delta; }
+
+	// Gets the value of the counter.
+	long long get() const { return _value->load(); }
+};
+
+class FifoSemaphore
+{
+	// Semaphores cannot be copied
+	FifoSemaphore(const FifoSemaphore&);
+	FifoSemaphore &operator=(const FifoSemaphore&);
+
+public:
+	// The maximum number of waiters (tickets beyond this are not issued until the queue shrinks).
+	static constexpr long long MAX_WAITERS = 4096;
+
+	// The maximum number of holders, which also limits the number of times the semaphore can be acquired at once.
+	static constexpr long long MAX_HOLDERS = 4096;
+
+private:
+	struct State
+	{
+		long long creator; // The process that created the semaphore, which identifies the wake handles of its waiters
+		std::atomic<long long> nextTicket;
+		std::atomic<long long> serving; // The ticket at the front of the queue
+		std::atomic<long long> acquired;
+		std::atomic<long long> cancelled[MAX_WAITERS]; // Each slot holds the last ticket cancelled in that slot
+		std::atomic<long long> waiters[MAX_WAITERS]; // Each slot holds the process waiting with the ticket in that slot (zero once it leaves the queue)
+		std::atomic<long long> holders[MAX_HOLDERS]; // The processes that acquired the semaphore (zero for free slots)
+	};
+
+	State *_state;
+	long long _limit;
+
+	// Gets the name of the wake handle of a ticket.
+	std::string getWakeName(long long ticket) const;
+
+	// Skips the cancelled tickets at the front of the queue, returning the ticket now at the front.
+	long long skipCancelled();
+
+	// Signals the wake handle of a ticket, if the ticket is waiting, so it tries to acquire the semaphore again.
+	void wake(long long ticket) const;
+
+public:
+	// Creates a semaphore that can be acquired up to the specified number of times at once (at most MAX_HOLDERS), which is shared with all child processes forked after it is created.
+	FifoSemaphore(long long limit);
+	~FifoSemaphore();
+
+	/** Leaves the queue without acquiring the semaphore.
+	 *
+	 * @param ticket a ticket from enqueue() that has not acquired the semaphore
+	 */
+	void cancel(long long ticket);
+
+	/** Creates a handle that becomes readable once a ticket may be able to acquire the semaphore, so the waiter can wait for it in a reactor (the handle is closed by the caller, and can be read to reset it). On Windows the handle is an event that is reset once a wait for it returns.
+	 *
+	 * @param ticket a ticket from enqueue(), which must be waited for using the handle before it is first tried (so no wake ups are missed)
+	 * @return the handle, or Pipe::INVALID_HANDLE if waking waiters is not supported (the ticket must then be retried periodically)
+	 */
+	Pipe::Handle createWakeHandle(long long ticket) const;
+
+	/** Joins the back of the queue.
+	 *
+	 * @param waiter the process waiting with the ticket, so the queue can be left if it exits while waiting
+	 * @return the ticket used to acquire the semaphore, or negative if the queue is full
+	 */
+	long long enqueue(long long waiter);
+
+	// Gets the number of times the semaphore is acquired.
+	long long getAcquired() const { return _state->acquired.load(); }
+
+	// Gets the number of times the semaphore can be acquired at once.
+	long long getLimit() const { return _limit; }
+
+	// Gets the number of tickets in the queue (including cancelled tickets that have not reached the front).
+	long long getWaiting() const { return _state->nextTicket.load() - _state->serving.load(); }
+
+	/** Releases the semaphore after it was acquired, waking the waiter at the front of the queue.
+	 *
+	 * @param holder the process that acquired the semaphore
+	 * @return true if the process held the semaphore, otherwise false
+	 */
+	bool release(long long holder);
+
+	/** Releases the semaphore as many times as a process acquired it, and leaves the queue for each ticket it is waiting with (used once a process exits without releasing the semaphore, like a killed process).
+	 *
+	 * @param process the process that exited
+	 * @return the number of times the semaphore was released
+	 */
+	long long releaseAll(long long process);
+
+	/** Acquires the semaphore if the ticket is at the front of the queue and the semaphore is available, without waiting.
+	 *
+	 * @param ticket a ticket from enqueue()
+	 * @param holder the process acquiring the semaphore, which releases it
+	 * @return true if the semaphore was acquired, otherwise false
+	 */
+	bool tryAcquire(long long ticket, long long holder);
+};
+
+class FileWatcher
+{
+	// File watchers cannot be copied
+	FileWatcher(const FileWatcher&);
+	FileWatcher &operator=(const FileWatcher&);
+
+#ifdef _WIN32
+	HANDLE _handle;
+#else
+	int _handle;
+#endif
+	std::string _name;
+
+public:
+	// Starts watching for the file to be created or replaced. Changes cannot be detected if the parent directory does not exist or the platform does not support watching files.
+	FileWatcher(const std::string &filename);
+	~FileWatcher();
+
+	// Checks if changes to the file can be detected.
+	bool isValid() const;
+
+	/** Waits for the file to be created or replaced after the watcher was created or last waited.
+	 *
+	 * @param until the time to stop waiting
+	 * @return true if the file (or possibly another file in the same directory) was created or replaced, false if the time expired
+	 */
+	bool wait(std::chrono::steady_clock::time_point until);
+};
+
+#ifdef _WIN32
+class CompletionPort
+{
+	// Completion ports cannot be copied
+	CompletionPort(const CompletionPort&);
+	CompletionPort &operator=(const CompletionPort&);
+
+	// A waitable handle that posts a completion to the port when it is signaled
+	struct Notification
+	{
+		HANDLE port;
+		ULONG_PTR key;
+		HANDLE wait;
+	};
+
+	HANDLE _handle;
+	std::vector<std::unique_ptr<Notification>> _notifications;
+
+	// Posts the completion of a signaled notification.
+	static VOID CALLBACK postNotification(PVOID context, BOOLEAN timedOut);
+
+public:
+	// A completed operation.
+	struct Completion
+	{
+		ULONG_PTR key;
+		OVERLAPPED *overlapped; // The overlapped operation that completed, or null for notifications and posted completions
+		DWORD length;
+		bool succeeded;
+	};
+
+	CompletionPort();
+	~CompletionPort();
+
+	/** Associates a handle opened for overlapped I/O with the port, so all of its operations complete on the port.
+	 *
+	 * @param handle the handle to associate with the port
+	 * @param key the key of the completions for the handle
+	 */
+	void associate(HANDLE handle, ULONG_PTR key);
+
+	/** Posts a completion to the port each time a waitable handle (like an event or a process) is signaled, using the thread pool to wait on the handle.
+	 *
+	 * @param handle the handle to wait on, which must stay open for the lifetime of the port
+	 * @param key the key of the completions for the handle
+	 * @param once true to only post a completion the first time the handle is signaled (for handles that stay signaled)
+	 */
+	void notify(HANDLE handle, ULONG_PTR key, bool once);
+
+	/** Posts a completion to the port.
+	 *
+	 * @param key the key of the completion
+	 * @param length the number of bytes transferred
+	 * @param overlapped the overlapped operation that completed
+	 */
+	void post(ULONG_PTR key, DWORD length, OVERLAPPED *overlapped);
+
+	/** Waits for a completion.
+	 *
+	 * @param completion set to the completion
+	 * @param timeoutMs the maximum time to wait in milliseconds, or INFINITE to wait forever
+	 * @return true if a completion was received, false if the timeout expired
+	 */
+	bool wait(Completion &completion, DWORD timeoutMs);
+};
+#else
+class Reactor
+{
+	// Reactors cannot be copied
+	Reactor(const Reactor&);
+	Reactor &operator=(const Reactor&);
+
+public:
+	static constexpr unsigned READABLE = 1;
+	static constexpr unsigned WRITABLE = 2;
+
+	// A watched handle that is ready.
+	struct Event
+	{
+		int handle;
+		unsigned events; // The watched events that are ready (all watched events are ready if the handle has an error or was closed by the remote side)
+		void *context;
+	};
+
+private:
+	struct Watch
+	{
+		unsigned events;
+		void *context;
+		bool alwaysReady; // Handles that cannot be waited on (like regular files) are always ready, matching poll
+		std::uint32_t generation; // Identifies the registration, so events from handles that were closed and reused are ignored
+	};
+
+	int _handle; // The epoll or kqueue handle (poll is used if neither is supported)
+	std::unordered_map<int, Watch> _watches;
+	std::size_t _alwaysReadyCount;
+	std::uint32_t _generation;
+
+public:
+	Reactor();
+	~Reactor();
+
+	// Gets the number of watched handles.
+	std::size_t getSize() const { return _watches.size(); }
+
+	/** Watches a handle for events, replacing any events it was previously watched for. Handles must stop being watched before they are closed.
+	 *
+	 * @param handle the handle to watch
+	 * @param events the events to watch for (READABLE and / or WRITABLE), or 0 to stop watching the handle
+	 * @param context the context returned with events for the handle
+	 */
+	void watch(int handle, unsigned events, void *context);
+
+	/** Waits for watched handles to become ready.
+	 *
+	 * @param events set to the ready handles
+	 * @param timeout the maximum time to wait, or negative to wait forever
+	 * @return the number of ready handles, which is zero if the timeout expired (or the wait was interrupted by a signal)
+	 */
+	std::size_t wait(std::vector<Event> &events, std::chrono::microseconds timeout);
+};
+#endif
+
 class OptionalString : public std::string
 {
 	bool _exists;
@@ -189,12 +571,24 @@ public:
 	// Deletes the file, returning true if the file exists and was deleted.
 	static bool deleteFile(const std::string &filename);
 
+	// Escapes a string, so it can be placed in a JSON string.
+	static std::string escapeJson(const std::string &value);
+
+	// Finds an executable by searching the directories in the PATH environment variable (unless the name contains a path separator), returning an empty string if it is not found.
+	static std::string findExecutable(const std::string &name);
+
 	// Gets the absolute path of the file.
 	static std::string getAbsolutePath(const std::string &filename);
 
 	// Gets the basename of the file.
 	static std::string getBasename(const std::string &filename);
 
+	// Gets the number of CPUs the process can use according to its cgroup CPU quota (rounded up), or zero if the quota is unlimited or unknown.
+	static long long getCpuQuota();
+
+	// Gets the CPU time (user and system) used by the current process, including its child processes that have exited and been waited on.
+	static std::chrono::microseconds getCpuTime();
+
 	// Gets the basename of an executable file, removing the extension.
 	static std::string getExecutableBasename(const std::string &filename);
 
@@ -258,6 +652,14 @@ public:
 	 * @return the string with the environment variable substitutions made
 	 */
 	static std::string substituteEnvironmentVariables(const std::string &in, const std::unordered_map<std::string, OptionalString> &overrides = std::unordered_map<std::string, OptionalString>());
+
+	/** Writes the contents of a file, atomically replacing any existing file.
+	 *
+	 * @param filename the name of the file to write
+	 * @param contents the contents of the file
+	 * @return true if the file was written, otherwise false
+	 */
+	static bool writeFile(const std::string &filename, const std::string &contents);
 };
 
 } // k8psh
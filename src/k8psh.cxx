@@ -3,7 +3,14 @@
 
 #include "Main.cxx"
 
+#include "Compression.cxx"
 #include "Configuration.cxx"
+#include "LoadGenerator.cxx"
+#include "Metrics.cxx"
+#include "PersistentWorkers.cxx"
 #include "Process.cxx"
+#include "ResultCache.cxx"
+#include "SharedMemoryChannel.cxx"
 #include "Socket.cxx"
+#include "Trace.cxx"
 #include "Utilities.cxx"
@@ -0,0 +1,227 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#define main k8pshMain
+#include "k8psh.cxx"
+#undef main
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// The minimum time measured for each benchmark, so short operations are repeated enough to be timed reliably.
+static const std::chrono::milliseconds MINIMUM_TIME(200);
+
+/** Measures a benchmark and writes the result as a single line of JSON to stdout. The number of iterations is doubled until the benchmark runs for the minimum time.
+ *
+ * @param name the name of the benchmark
+ * @param bytesPerIteration the number of bytes processed by each iteration, or 0 if the benchmark does not measure throughput
+ * @param function the function called with the number of iterations to run
+ */
+template <typename FunctionT> static void measure(const std::string &name, std::size_t bytesPerIteration, FunctionT function)
+{
+	for (std::uint64_t iterations = 1; ; iterations *= 2)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		function(iterations);
+
+		const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+		if (elapsed < MINIMUM_TIME)
+			continue;
+
+		const double nanoseconds = double(elapsed.count()) / double(iterations);
+
+		std::cout << "{\"name\":\"" << name << "\",\"iterations\":" << iterations << ",\"nanosecondsPerIteration\":" << std::uint64_t(nanoseconds);
+
+		if (bytesPerIteration)
+			std::cout << ",\"bytesPerSecond\":" << std::uint64_t(double(bytesPerIteration) * 1e9 / nanoseconds);
+
+		std::cout << "}" << std::endl;
+		return;
+	}
+}
+
+// Creates a configuration with the specified number of hosts, each with the specified number of commands.
+static std::string createConfiguration(std::size_t hosts, std::size_t commands)
+{
+	std::ostringstream configuration;
+
+	configuration << "baseDirectory = ${K8PSH_BENCHMARK_BASE:-/base} # The directory that all relative working directories will be based on\n";
+
+	for (std::size_t i = 0; i < hosts; i++)
+	{
+		configuration << "\n[host" << i << ":" << (1000 + i) << "] --max-connections 16 --timeout 8000\n";
+
+		for (std::size_t j = 0; j < commands; j++)
+			configuration << "command" << j << " ?PATH= HOME=/home/user ARGS=\"-j ${NPROC:-4}\" /usr/bin/command" << j << " --flag 'quoted argument' \"double quoted\\targument\"\n";
+	}
+
+	return configuration.str();
+}
+
+// Connects a client to a server on a loopback socket.
+static void connectLoopback(k8psh::Socket &client, k8psh::Socket &server)
+{
+	k8psh::Socket listener = k8psh::Socket::listen(k8psh::Socket::RANDOM_PORT);
+
+	client = k8psh::Socket::connect(listener.getPort());
+	server = listener.accept();
+
+	if (!client.isValid() || !server.isValid())
+		LOG_ERROR << "Failed to connect loopback sockets";
+}
+
+// Receives stdout payloads until the specified amount of data is received, discarding the data (payloads can be coalesced, so the data is counted rather than the payloads).
+static void receivePayloads(BufferedReceiveSocket &receiveSocket, std::uint64_t size)
+{
+	PayloadType type;
+	std::uint32_t length;
+
+	for (std::uint64_t received = 0; received < size; received += length)
+	{
+		if (!receiveSocket.read(type, length) || type != STDOUT_DATA)
+			LOG_ERROR << "Failed to read payload";
+
+		receiveSocket.readData(length, [](const char *, std::size_t) { });
+	}
+}
+
+int main()
+{
+	k8psh::Socket::Initializer socketInit;
+
+	// Configuration parsing
+	const std::string smallConfiguration = createConfiguration(2, 4);
+	const std::string largeConfiguration = createConfiguration(64, 256);
+
+	measure("Configuration::load/small", smallConfiguration.length(), [&smallConfiguration](std::uint64_t iterations)
+		{
+			for (std::uint64_t i = 0; i < iterations; i++)
+				(void)k8psh::Configuration::load(smallConfiguration);
+		});
+
+	measure("Configuration::load/large", largeConfiguration.length(), [&largeConfiguration](std::uint64_t iterations)
+		{
+			for (std::uint64_t i = 0; i < iterations; i++)
+				(void)k8psh::Configuration::load(largeConfiguration);
+		});
+
+	// Environment variable substitution (the overrides are used, so the environment of the benchmark does not change the results)
+	const std::unordered_map<std::string, k8psh::OptionalString> overrides = { { "HOME", k8psh::OptionalString("/home/user") }, { "NPROC", k8psh::OptionalString("8") }, { "UNSET", k8psh::OptionalString() } };
+	const std::string substitution = "PATH=${HOME}/bin:/usr/local/bin:/usr/bin:/bin ARGS=-j${NPROC} OPTIONAL=${UNSET:-default value} LITERAL=$HOME";
+
+	measure("Utilities::substituteEnvironmentVariables", substitution.length(), [&substitution, &overrides](std::uint64_t iterations)
+		{
+			for (std::uint64_t i = 0; i < iterations; i++)
+				(void)k8psh::Utilities::substituteEnvironmentVariables(substitution, overrides);
+		});
+
+	// Compressing and decompressing output, which is compressed for remote hosts
+	std::string text;
+
+	for (int i = 0; text.length() < 64 * 1024; i++)
+		text += "src/Process.cxx:" + std::to_string(i) + ": warning: unused variable 'value' [-Wunused-variable]\n";
+
+	text.resize(64 * 1024);
+
+	std::string block;
+	std::string decompressed;
+
+	(void)k8psh::Compression::compress(text.data(), text.length(), block);
+
+	measure("Compression::compress/64K", text.length(), [&text](std::uint64_t iterations)
+		{
+			std::string compressed;
+
+			for (std::uint64_t i = 0; i < iterations; i++)
+			{
+				compressed.clear();
+				(void)k8psh::Compression::compress(text.data(), text.length(), compressed);
+			}
+		});
+
+	measure("Compression::decompress/64K", text.length(), [&block, &text, &decompressed](std::uint64_t iterations)
+		{
+			for (std::uint64_t i = 0; i < iterations; i++)
+				(void)k8psh::Compression::decompress(block.data(), block.length(), text.length(), decompressed);
+		});
+
+	// Framing payloads through the buffered sockets, which are received on another thread
+	for (std::size_t size : { std::size_t(16), std::size_t(1024), std::size_t(64 * 1024), std::size_t(1024 * 1024) })
+	{
+		const std::string data(size, 'x');
+		k8psh::Socket client;
+		k8psh::Socket server;
+
+		connectLoopback(client, server);
+
+		BufferedSendSocket sendSocket(client);
+		BufferedSendSocket delayedSendSocket(client, std::chrono::seconds(1));
+		BufferedReceiveSocket receiveSocket(server);
+
+		measure("BufferedSendSocket::write/" + std::to_string(size), size, [&data, &sendSocket, &receiveSocket](std::uint64_t iterations)
+			{
+				std::thread receiver(receivePayloads, std::ref(receiveSocket), iterations * data.length());
+
+				for (std::uint64_t i = 0; i < iterations; i++)
+					sendSocket.write(STDOUT_DATA, data.data(), data.length());
+
+				receiver.join();
+			});
+
+		// Small payloads are also measured when they are coalesced (the delay is long enough that data is only sent once the coalescing buffer fills)
+		if (size <= 1024)
+		{
+			measure("BufferedSendSocket::writeDelayed/" + std::to_string(size), size, [&data, &delayedSendSocket, &receiveSocket](std::uint64_t iterations)
+				{
+					std::thread receiver(receivePayloads, std::ref(receiveSocket), iterations * data.length());
+
+					for (std::uint64_t i = 0; i < iterations; i++)
+						delayedSendSocket.writeDelayed(STDOUT_DATA, data.data(), data.length());
+
+					(void)delayedSendSocket.flush();
+					receiver.join();
+				});
+		}
+	}
+
+	// Loopback round trips of a single byte, echoed by another thread
+	{
+		k8psh::Socket client;
+		k8psh::Socket server;
+
+		connectLoopback(client, server);
+
+		std::thread echo([&server]
+			{
+				std::vector<std::uint8_t> data(1);
+
+				while (server.read(data, 0) == 1)
+					(void)server.write(data);
+			});
+
+		measure("Socket/roundTrip", 0, [&client](std::uint64_t iterations)
+			{
+				std::vector<std::uint8_t> data(1);
+
+				for (std::uint64_t i = 0; i < iterations; i++)
+				{
+					if (client.write(data) != 1 || client.read(data, 0) != 1)
+						LOG_ERROR << "Failed to echo data";
+				}
+			});
+
+		client = k8psh::Socket();
+		echo.join();
+	}
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "Compression.cxx"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "Test.hxx"
+
+#include "Utilities.cxx"
+
+// Compresses and decompresses data, checking that it is unchanged and returning the length of the compressed block (or zero if the data is not compressed)
+static std::size_t roundTrip(const std::string &data)
+{
+	std::string block;
+	std::string decompressed;
+
+	if (!k8psh::Compression::compress(data.data(), data.length(), block))
+		return 0;
+
+	TEST_THAT(block.length() < data.length());
+	TEST_THAT(k8psh::Compression::decompress(block.data(), block.length(), data.length(), decompressed));
+	TEST_THAT(decompressed == data);
+
+	// Blocks can be appended to other data
+	std::string framed = "header";
+
+	TEST_THAT(k8psh::Compression::compress(data.data(), data.length(), framed) && framed.substr(0, 6) == "header" && framed.substr(6) == block);
+	TEST_THAT(k8psh::Compression::decompress(framed.data() + 6, block.length(), data.length(), decompressed));
+	TEST_THAT(decompressed == data);
+	TEST_THAT(!k8psh::Compression::decompress(block.data(), block.length(), data.length() - 1, decompressed));
+	TEST_THAT(!k8psh::Compression::decompress(block.data(), block.length(), data.length() + 1, decompressed));
+	return block.length();
+}
+
+int main()
+{
+	// Blocks written by other LZ4 encoders can be decompressed
+	std::string data;
+
+	TEST_THAT(k8psh::Compression::decompress("\x38" "abc" "\x03\x00" "\x30" "abc", 10, 18, data) && data == "abcabcabcabcabcabc");
+	TEST_THAT(k8psh::Compression::decompress("\x1F" "a" "\x01\x00" "\x0E" "\x10" "b", 7, 35, data) && data == std::string(34, 'a') + "b");
+	TEST_THAT(k8psh::Compression::decompress("\x00", 1, 0, data) && data.empty());
+
+	// Invalid blocks are rejected
+	TEST_THAT(!k8psh::Compression::decompress("", 0, 1, data));
+	TEST_THAT(!k8psh::Compression::decompress("\x30" "ab", 3, 3, data));
+	TEST_THAT(!k8psh::Compression::decompress("\x38" "abc" "\x04\x00", 6, 15, data));
+	TEST_THAT(!k8psh::Compression::decompress("\x38" "abc" "\x00\x00", 6, 15, data));
+	TEST_THAT(!k8psh::Compression::decompress("\x38" "abc" "\x03", 5, 15, data));
+	TEST_THAT(!k8psh::Compression::decompress("\xF0" "\xFF", 2, 300, data));
+
+	// Short and incompressible data is not compressed
+	std::string random;
+	std::uint32_t seed = 1;
+
+	for (std::size_t i = 0; i < 64 * 1024; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		random += char(seed >> 16);
+	}
+
+	TEST_THAT(roundTrip("") == 0);
+	TEST_THAT(roundTrip("short") == 0);
+	TEST_THAT(roundTrip(random) == 0);
+
+	// Repetitive data (like compiler output) is compressed
+	std::string text;
+
+	for (int i = 0; text.length() < 64 * 1024; i++)
+		text += "src/Process.cxx:" + std::to_string(i) + ": warning: unused variable 'value' [-Wunused-variable]\n";
+
+	TEST_THAT(roundTrip(std::string(1024 * 1024, 'k')) < 1024 * 8);
+	TEST_THAT(roundTrip(text) < text.length() / 4);
+	TEST_THAT(roundTrip(text + random.substr(0, 1000) + text.substr(0, 20)) != 0);
+	TEST_THAT(roundTrip(std::string(1000, 'x') + random.substr(0, 40000) + std::string(1000, 'y')) != 0);
+
+	return 0;
+}
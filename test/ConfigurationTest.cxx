@@ -9,6 +9,8 @@
 
 #include "Test.hxx"
 
+#include "SharedMemoryChannel.cxx"
+#include "Socket.cxx"
 #include "Utilities.cxx"
 
 namespace std {
@@ -65,6 +67,16 @@ int main()
 			"[ blah:65_36 ]",
 		"baseDirectory=${PATH}\n"
 			"[blah\n]",
+		"[ blah ] --socket",
+		"[ blah ] --socket=",
+		"[ blah ] --pass-stdio",
+		"[ blah ] --shared-memory",
+		"[ blah ] --address",
+		"[ blah ] --socket blah.sock --address=127.0.0.1",
+		"agentConnections = 0",
+		"agentConnections = many",
+		"[ blah ]\nblah --max-processes=0",
+		"[ blah ]\nblah --max-processes=many",
 	};
 
 	for (auto it = badConfigurations.begin(); it != badConfigurations.end(); ++it)
@@ -92,6 +104,11 @@ int main()
 	TEST_THAT(equals(commandsMap["blah"], "blah", { { "ENV", "some-value" } }, { "blah" }));
 	TEST_THAT(equals(commandsMap["some_exe"], "some_exe", { }, { "theExe" }));
 
+	// Commands in multiple sections are replicas, which end with the host of the command
+	TEST_THAT(commandsMap["blah"].getHosts().size() == 2 && commandsMap["blah"].getHosts()[0]->getHostname() == "blah" && commandsMap["blah"].getHosts()[1]->getHostname() == "blah 2");
+	TEST_THAT(commandsMap["blah"].getHost().getHostname() == "blah 2");
+	TEST_THAT(commandsMap["some_exe"].getHosts().size() == 1);
+
 	// Test server-specific commands
 	std::cout << std::endl << "blah:" << std::endl;
 	auto blahMap = *config.getCommands("blah");
@@ -102,5 +119,136 @@ int main()
 	auto blah2Map = *config.getCommands("blah 2");
 	TEST_THAT(equals(blah2Map["blah"], "blah", { { "ENV", "some-value" } }, { "blah" }));
 
+	// Test Unix domain socket options
+	k8psh::Configuration socketConfig = k8psh::Configuration::load("baseDirectory = /base\n"
+		"[ socket ] ENV=value --socket relative/socket.sock --workers 2 --compress --shared-memory\n"
+		"socket_exe\n"
+		"[ socket-absolute ] --pass-stdio --socket=/run/absolute.sock\n"
+		"absolute_exe\n"
+		"[ tcp ] --workers 2 --compress\n"
+		"tcp_exe\n"
+		"[ remote:2200 ] --address 127.0.0.1 --bind-address=0.0.0.0 --workers 2\n"
+		"remote_exe\n"
+		"[ compressed ] --compress --address 10.1.2.3\n"
+		"compressed_exe\n");
+
+	auto socketCommands = socketConfig.getCommands();
+	TEST_THAT(socketCommands["socket_exe"].getHost().getSocketPath() == k8psh::Utilities::normalizePath("/base/relative/socket.sock"));
+	TEST_THAT(socketCommands["socket_exe"].getHost().getOptions() == std::vector<std::string>({ "--workers", "2" }));
+	TEST_THAT(socketCommands["absolute_exe"].getHost().getSocketPath() == "/run/absolute.sock");
+	TEST_THAT(socketCommands["absolute_exe"].getHost().getOptions().empty());
+	TEST_THAT(socketCommands["absolute_exe"].getHost().shouldPassStdio());
+	TEST_THAT(!socketCommands["socket_exe"].getHost().shouldPassStdio());
+	TEST_THAT(socketCommands["socket_exe"].getHost().shouldUseSharedMemory());
+	TEST_THAT(!socketCommands["absolute_exe"].getHost().shouldUseSharedMemory());
+	TEST_THAT(socketCommands["tcp_exe"].getHost().getSocketPath().empty());
+	TEST_THAT(socketCommands["socket_exe"].getHost().getReadyPath() == socketCommands["socket_exe"].getHost().getSocketPath());
+	TEST_THAT(socketCommands["tcp_exe"].getHost().getReadyPath() == k8psh::Utilities::normalizePath("/base/.k8psh-tcp.ready"));
+	TEST_THAT(socketConfig.getAgentSocketPath().empty());
+
+	// Test network address options
+	TEST_THAT(socketCommands["tcp_exe"].getHost().getAddress().empty() && socketCommands["tcp_exe"].getHost().getBindAddress().empty() && socketCommands["tcp_exe"].getHost().resolveAddress().empty());
+	TEST_THAT(socketCommands["remote_exe"].getHost().getAddress() == "127.0.0.1" && socketCommands["remote_exe"].getHost().getBindAddress() == "0.0.0.0");
+	TEST_THAT(socketCommands["remote_exe"].getHost().resolveAddress() == "127.0.0.1");
+	TEST_THAT(socketCommands["remote_exe"].getHost().getOptions() == std::vector<std::string>({ "--workers", "2" }));
+
+	// Test compression, which is only used for remote addresses
+	TEST_THAT(socketCommands["compressed_exe"].getHost().shouldCompress() && socketCommands["compressed_exe"].getHost().getOptions().empty());
+	TEST_THAT(!socketCommands["socket_exe"].getHost().shouldCompress());
+	TEST_THAT(!socketCommands["tcp_exe"].getHost().shouldCompress() && socketCommands["tcp_exe"].getHost().getOptions() == std::vector<std::string>({ "--workers", "2" }));
+	TEST_THAT(!socketCommands["remote_exe"].getHost().shouldCompress());
+
+	// Test buffer sizes, which use the defaults unless configured
+	k8psh::Configuration sizeConfig = k8psh::Configuration::load("[ sized ] --buffer-size 16K --pipe-size=auto --socket-buffer-size 4M --workers 2\n"
+		"sized_exe\n"
+		"[ automatic ] --buffer-size=auto --pipe-size 1M\n"
+		"automatic_exe\n"
+		"[ default ]\n"
+		"default_exe\n");
+
+	auto sizeCommands = sizeConfig.getCommands();
+	TEST_THAT(sizeCommands["sized_exe"].getHost().getBufferSize() == 1024 * 16 && sizeCommands["sized_exe"].getHost().getPipeSize() == k8psh::Configuration::Host::AUTO_SIZE);
+	TEST_THAT(sizeCommands["sized_exe"].getHost().getSocketBufferSize() == 1024 * 1024 * 4 && sizeCommands["sized_exe"].getHost().getOptions() == std::vector<std::string>({ "--workers", "2" }));
+	TEST_THAT(sizeCommands["automatic_exe"].getHost().getBufferSize() == k8psh::Configuration::Host::AUTO_SIZE && sizeCommands["automatic_exe"].getHost().getPipeSize() == 1024 * 1024);
+	TEST_THAT(sizeCommands["default_exe"].getHost().getBufferSize() == k8psh::Configuration::Host::MAX_BUFFER_SIZE && sizeCommands["default_exe"].getHost().getPipeSize() == 0);
+	TEST_THAT(sizeCommands["default_exe"].getHost().getSocketBufferSize() == 0);
+	TEST_THROWS(k8psh::Configuration::load("[ sized ] --buffer-size 128K\nsized_exe\n"));
+	TEST_THROWS(k8psh::Configuration::load("[ sized ] --buffer-size 100\nsized_exe\n"));
+	TEST_THROWS(k8psh::Configuration::load("[ sized ] --pipe-size 16X\nsized_exe\n"));
+	TEST_THROWS(k8psh::Configuration::load("[ sized ] --socket-buffer-size auto\nsized_exe\n"));
+	TEST_THROWS(k8psh::Configuration::load("[ sized ] --buffer-size\nsized_exe\n"));
+
+	// Test command options
+	k8psh::Configuration cacheConfig = k8psh::Configuration::load("[ cache ]\n"
+		"cached --cache ENV=value gcc -E\n"
+		"uncached gcc --cache\n"
+		"limited --max-processes=2 --cache gcc\n"
+		"persistent --persistent=2 --max-worker-requests=100 javac\n");
+
+	auto cacheCommands = cacheConfig.getCommands();
+	TEST_THAT(equals(cacheCommands["cached"], "cached", { { "ENV", "value" } }, { "gcc", "-E" }) && cacheCommands["cached"].shouldCache());
+	TEST_THAT(equals(cacheCommands["uncached"], "uncached", { }, { "gcc", "--cache" }) && !cacheCommands["uncached"].shouldCache());
+	TEST_THAT(equals(cacheCommands["limited"], "limited", { }, { "gcc" }) && cacheCommands["limited"].shouldCache() && cacheCommands["limited"].getMaxProcesses() == 2);
+	TEST_THAT(cacheCommands["cached"].getMaxProcesses() == 0);
+	TEST_THAT(equals(cacheCommands["persistent"], "persistent", { }, { "javac" }) && cacheCommands["persistent"].getPersistentWorkers() == 2 && cacheCommands["persistent"].getMaxWorkerRequests() == 100);
+	TEST_THAT(cacheCommands["cached"].getPersistentWorkers() == 0 && cacheCommands["cached"].getMaxWorkerRequests() == 0);
+	TEST_THROWS(k8psh::Configuration::load("[ cache ]\nrecycled --max-worker-requests=100 javac\n"));
+	TEST_THROWS(k8psh::Configuration::load("[ cache ]\nnone --persistent=0 javac\n"));
+
+	// Test agent settings
+	k8psh::Configuration agentConfig = k8psh::Configuration::load("agentSocket = agent.sock\n"
+		"agentConnections = 2\n"
+		"baseDirectory = /base\n");
+
+	TEST_THAT(agentConfig.getAgentSocketPath() == k8psh::Utilities::normalizePath("/base/agent.sock"));
+	TEST_THAT(agentConfig.getAgentConnections() == 2);
+
+	// Test snapshots
+	const std::string snapshotConfigString = "baseDirectory = /base\n"
+		"connectTimeoutMs = 100\n"
+		"[ snapshot:2000 ] --socket=snapshot.sock --pass-stdio --shared-memory\n"
+		"snapshot_exe ENV=${K8PSH_SNAPSHOT_TEST:-default} /bin/snapshot arg\n"
+		"other_exe\n"
+		"[ replica ] --address=10.1.2.3 --compress --buffer-size=auto --socket-buffer-size=256K\n"
+		"other_exe\n";
+	const std::string snapshot = k8psh::Configuration::load(snapshotConfigString, "/working").createSnapshot();
+	k8psh::Configuration snapshotConfig;
+
+	TEST_THAT(k8psh::Configuration::loadSnapshot(snapshot.data(), snapshot.size(), snapshotConfigString, "/working", "snapshot_exe", snapshotConfig));
+	TEST_THAT(snapshotConfig.getBaseDirectory() == k8psh::Utilities::normalizePath("/base"));
+	TEST_THAT(snapshotConfig.getConnectTimeoutMs() == 100);
+	TEST_THAT(snapshotConfig.getCommands().size() == 1);
+
+	auto snapshotCommand = snapshotConfig.getCommands().at("snapshot_exe");
+	TEST_THAT(equals(snapshotCommand, "snapshot_exe", { { "ENV", "default" } }, { "/bin/snapshot", "arg" }));
+	TEST_THAT(snapshotCommand.getHost().getHostname() == "snapshot" && snapshotCommand.getHost().getPort() == 2000);
+	TEST_THAT(snapshotCommand.getHost().getSocketPath() == k8psh::Utilities::normalizePath("/base/snapshot.sock"));
+	TEST_THAT(snapshotCommand.getHost().shouldPassStdio() && snapshotCommand.getHost().shouldUseSharedMemory());
+	TEST_THAT(snapshotConfig.getCommands("snapshot") && snapshotConfig.getCommands("snapshot")->size() == 1);
+	TEST_THAT(snapshotCommand.getHosts().size() == 1);
+
+	TEST_THAT(k8psh::Configuration::loadSnapshot(snapshot.data(), snapshot.size(), snapshotConfigString, "/working", "other_exe", snapshotConfig));
+	auto replicaCommand = snapshotConfig.getCommands().at("other_exe");
+	TEST_THAT(replicaCommand.getHosts().size() == 2 && replicaCommand.getHosts()[0]->getPort() == 2000 && replicaCommand.getHosts()[0]->shouldPassStdio());
+	TEST_THAT(replicaCommand.getHost().getHostname() == "replica" && replicaCommand.getHost().getPort() == 2001 && !replicaCommand.getHost().shouldPassStdio() && !replicaCommand.getHost().shouldUseSharedMemory());
+	TEST_THAT(replicaCommand.getHost().getAddress() == "10.1.2.3" && replicaCommand.getHost().resolveAddress() == "10.1.2.3" && replicaCommand.getHosts()[0]->getAddress().empty());
+	TEST_THAT(replicaCommand.getHost().shouldCompress() && !replicaCommand.getHosts()[0]->shouldCompress());
+	TEST_THAT(replicaCommand.getHost().getBufferSize() == k8psh::Configuration::Host::AUTO_SIZE && replicaCommand.getHost().getSocketBufferSize() == 1024 * 256);
+	TEST_THAT(replicaCommand.getHosts()[0]->getBufferSize() == k8psh::Configuration::Host::MAX_BUFFER_SIZE && replicaCommand.getHosts()[0]->getSocketBufferSize() == 0);
+	TEST_THAT(snapshotConfig.getCommands("replica") && snapshotConfig.getCommands("replica")->size() == 1);
+
+	TEST_THAT(k8psh::Configuration::loadSnapshot(snapshot.data(), snapshot.size(), snapshotConfigString, "/working", "missing_exe", snapshotConfig));
+	TEST_THAT(snapshotConfig.getCommands().empty());
+
+	// Stale and invalid snapshots are not loaded
+	TEST_THAT(!k8psh::Configuration::loadSnapshot(snapshot.data(), snapshot.size(), snapshotConfigString + "# Changed\n", "/working", "snapshot_exe", snapshotConfig));
+	TEST_THAT(!k8psh::Configuration::loadSnapshot(snapshot.data(), snapshot.size(), snapshotConfigString, "/other", "snapshot_exe", snapshotConfig));
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("K8PSH_SNAPSHOT_TEST", "changed"));
+	TEST_THAT(!k8psh::Configuration::loadSnapshot(snapshot.data(), snapshot.size(), snapshotConfigString, "/working", "snapshot_exe", snapshotConfig));
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("K8PSH_SNAPSHOT_TEST"));
+
+	for (std::size_t i = 0; i < snapshot.size(); i++)
+		TEST_THAT(!k8psh::Configuration::loadSnapshot(snapshot.data(), i, snapshotConfigString, "/working", "snapshot_exe", snapshotConfig) || snapshotConfig.getCommands().empty());
+
 	std::cout << "Finished testing configuration" << std::endl;
 }
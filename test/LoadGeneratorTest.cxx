@@ -0,0 +1,62 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#define main k8pshMain
+#include "k8psh.cxx"
+#undef main
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Test.hxx"
+
+int main()
+{
+	std::vector<std::chrono::microseconds> latencies;
+
+	for (int i = 1; i <= 1000; i++)
+		latencies.push_back(std::chrono::microseconds(i));
+
+	// Percentiles use the nearest rank
+	TEST_THAT(k8psh::LoadGenerator::getPercentile(std::vector<std::chrono::microseconds>(), 50).count() == 0);
+	TEST_THAT(k8psh::LoadGenerator::getPercentile(latencies, 0).count() == 1);
+	TEST_THAT(k8psh::LoadGenerator::getPercentile(latencies, 50).count() == 500);
+	TEST_THAT(k8psh::LoadGenerator::getPercentile(latencies, 99).count() == 990);
+	TEST_THAT(k8psh::LoadGenerator::getPercentile(latencies, 99.9).count() == 999);
+	TEST_THAT(k8psh::LoadGenerator::getPercentile(latencies, 100).count() == 1000);
+	TEST_THAT(k8psh::LoadGenerator::getPercentile({ std::chrono::microseconds(7) }, 99.9).count() == 7);
+
+	// Scenarios
+	k8psh::LoadGenerator::Scenario scenario = k8psh::LoadGenerator::TINY;
+
+	TEST_THAT(k8psh::LoadGenerator::parseScenario("bulk", scenario) && scenario == k8psh::LoadGenerator::BULK);
+	TEST_THAT(k8psh::LoadGenerator::parseScenario("mixed", scenario) && scenario == k8psh::LoadGenerator::MIXED);
+	TEST_THAT(!k8psh::LoadGenerator::parseScenario("all", scenario) && scenario == k8psh::LoadGenerator::MIXED);
+	TEST_THAT(std::string(k8psh::LoadGenerator::getName(k8psh::LoadGenerator::TINY)) == "tiny");
+
+	// Reports
+	k8psh::LoadGenerator::Options options;
+	k8psh::LoadGenerator::Results results;
+	const k8psh::LoadGenerator::Sample sample = { std::chrono::microseconds(100), std::chrono::microseconds(1500), std::chrono::microseconds(2000) };
+
+	options.concurrency = 3;
+	results.samples.assign(10, sample);
+	results.failures = 1;
+	results.nonzeroExits = 2;
+	results.bytes = 4000000;
+	results.elapsed = std::chrono::seconds(2);
+
+	std::string report = k8psh::LoadGenerator::formatResults(k8psh::LoadGenerator::BULK, options, results);
+
+	TEST_THAT(report.find("bulk: 11 sessions (3 at once) in 2000.000ms, 1 failed, 2 nonzero exit codes\n") == 0);
+	TEST_THAT(report.find("\n  connect       p50 0.100ms  p99 0.100ms  p999 0.100ms\n") != std::string::npos);
+	TEST_THAT(report.find("\n  first output  p50 1.500ms  p99 1.500ms  p999 1.500ms\n") != std::string::npos);
+	TEST_THAT(report.find("\n  total         p50 2.000ms") != std::string::npos);
+	TEST_THAT(report.find("\n  throughput    2.000 MB/s\n") != std::string::npos);
+	TEST_THAT(report.find("\n  server CPU    unknown\n") != std::string::npos);
+
+	results.serverCpuTime = std::chrono::milliseconds(25);
+	report = k8psh::LoadGenerator::formatResults(k8psh::LoadGenerator::BULK, options, results);
+	TEST_THAT(report.find("\n  server CPU    25.000ms\n") != std::string::npos);
+}
@@ -0,0 +1,80 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "Metrics.cxx"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
+
+#include "Test.hxx"
+
+#include "Utilities.cxx"
+
+int main()
+{
+	k8psh::Metrics metrics({ "cat", "quoted\"name" });
+
+	// Seconds are formatted without trailing zeros
+	TEST_THAT(k8psh::Metrics::formatSeconds(0) == "0");
+	TEST_THAT(k8psh::Metrics::formatSeconds(100) == "0.0001");
+	TEST_THAT(k8psh::Metrics::formatSeconds(2500000) == "2.5");
+	TEST_THAT(k8psh::Metrics::formatValue("a", "gauge", "Help.", "1") == "# HELP a Help.\n# TYPE a gauge\na 1\n");
+
+	// Commands are found by name, and unknown commands are ignored
+	TEST_THAT(metrics.findCommand("cat") == 0 && metrics.findCommand("quoted\"name") == 1);
+	TEST_THAT(metrics.findCommand("dog") == k8psh::Metrics::UNKNOWN_COMMAND);
+	metrics.addBytes(k8psh::Metrics::UNKNOWN_COMMAND, k8psh::Metrics::STDOUT, 1);
+	metrics.addExit(k8psh::Metrics::UNKNOWN_COMMAND, 0);
+
+	metrics.addConnection();
+	metrics.addBytes(0, k8psh::Metrics::STDOUT, 10);
+	metrics.addBytes(0, k8psh::Metrics::STDOUT, 5);
+	metrics.addExit(1, 2);
+	metrics.addExit(1, -1);
+	metrics.observe(k8psh::Metrics::SPAWN_TIME, std::chrono::microseconds(200));
+	metrics.observe(k8psh::Metrics::SPAWN_TIME, std::chrono::seconds(20));
+
+#ifndef _WIN32
+	// Metrics are shared with forked processes
+	const pid_t child = fork();
+
+	if (child == 0)
+	{
+		metrics.addConnection();
+		_exit(0);
+	}
+
+	int status = 0;
+
+	TEST_THAT(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	metrics.addConnection();
+#else
+	metrics.addConnection();
+	metrics.addConnection();
+#endif
+
+	const std::string text = metrics.format("extra 1\n");
+
+	TEST_THAT(text.find("\nk8psh_connections_total 3\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_stream_bytes_total{command=\"cat\",stream=\"stdout\"} 15\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_stream_bytes_total{command=\"cat\",stream=\"stdin\"} 0\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_process_exits_total{command=\"quoted\\\"name\",code=\"2\"} 1\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_process_exits_total{command=\"quoted\\\"name\",code=\"other\"} 1\n") != std::string::npos);
+	TEST_THAT(text.find("code=\"0\"") == std::string::npos);
+
+	// Histogram buckets are cumulative
+	TEST_THAT(text.find("\nk8psh_spawn_seconds_bucket{le=\"0.0001\"} 0\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_spawn_seconds_bucket{le=\"0.00025\"} 1\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_spawn_seconds_bucket{le=\"10\"} 1\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_spawn_seconds_bucket{le=\"+Inf\"} 2\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_spawn_seconds_sum 20.0002\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_spawn_seconds_count 2\n") != std::string::npos);
+	TEST_THAT(text.find("\nk8psh_handshake_seconds_count 0\n") != std::string::npos);
+	TEST_THAT(text.length() > 8 && text.compare(text.length() - 8, 8, "extra 1\n") == 0);
+}
@@ -0,0 +1,147 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "PersistentWorkers.cxx"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
+
+#include "Test.hxx"
+
+#include "Utilities.cxx"
+
+#ifndef _WIN32
+// Receives a complete response from a worker, returning false if the worker exited first.
+static bool receiveResponse(k8psh::PersistentWorkers &workers, long long worker, int &exitCode, std::string &output)
+{
+	std::string buffer(1024, '\0');
+	std::string response;
+
+	while (response.find('\n') == std::string::npos)
+	{
+		if (!workers.receive(worker, buffer, response))
+			return false;
+	}
+
+	TEST_THAT(response.back() == '\n');
+	TEST_THAT(k8psh::PersistentWorkers::parseResponse(response.substr(0, response.length() - 1), exitCode, output));
+	return true;
+}
+#endif
+
+int main(int argc, const char *argv[])
+{
+#ifdef _WIN32
+	(void)argc, (void)argv;
+#else
+	// Run as a worker that echoes its process ID, environment, and each request (exiting without a response for an "exit" argument)
+	if (argc == 2 && std::string(argv[1]) == k8psh::PersistentWorkers::WORKER_ARGUMENT)
+	{
+		for (std::string request; std::getline(std::cin, request); )
+		{
+			if (request.find("\"exit\"") != std::string::npos)
+				return 1;
+
+			const std::string output = std::to_string(getpid()) + " " + k8psh::Utilities::getEnvironmentVariable("TEST_WORKER").c_str() + " " + request;
+
+			std::cout << "{\"exitCode\":7,\"output\":\"" << k8psh::Utilities::escapeJson(output) << "\"}" << std::endl;
+		}
+
+		return 0;
+	}
+#endif
+
+	// Requests
+	TEST_THAT(k8psh::PersistentWorkers::formatRequest({ }, "") == "{\"arguments\":[],\"requestId\":0}\n");
+	TEST_THAT(k8psh::PersistentWorkers::formatRequest({ "-d", "out dir", "say \"hi\"\n" }, "") == "{\"arguments\":[\"-d\",\"out dir\",\"say \\\"hi\\\"\\u000a\"],\"requestId\":0}\n");
+	TEST_THAT(k8psh::PersistentWorkers::formatRequest({ "A.java" }, "src/main") == "{\"arguments\":[\"A.java\"],\"requestId\":0,\"sandboxDir\":\"src/main\"}\n");
+
+	// Responses
+	int exitCode = -1;
+	std::string output;
+
+	TEST_THAT(k8psh::PersistentWorkers::parseResponse("{}", exitCode, output) && exitCode == 0 && output.empty());
+	TEST_THAT(k8psh::PersistentWorkers::parseResponse("{\"exitCode\":3,\"output\":\"line\\none\\t\\\"quoted\\\" \\\\ \\/\"}", exitCode, output) && exitCode == 3 && output == "line\none\t\"quoted\" \\ /");
+	TEST_THAT(k8psh::PersistentWorkers::parseResponse(" { \"output\" : \"\\u00e9\\u20ac\\ud83d\\ude00\" , \"exitCode\" : -1 } ", exitCode, output) && exitCode == -1 && output == "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80");
+	TEST_THAT(k8psh::PersistentWorkers::parseResponse("{\"requestId\":0,\"wasCancelled\":false,\"metrics\":{\"a\":[1,2.5,{\"b\":null}],\"c\":\"}\"},\"exitCode\":1}", exitCode, output) && exitCode == 1 && output.empty());
+
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("[]", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"exitCode\":1", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"exitCode\":1,}", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"exitCode\":\"1\"}", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"exitCode\":1.5}", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"output\":1}", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"output\":\"\\x\"}", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{\"output\":\"\\ud83d\"}", exitCode, output));
+	TEST_THAT(!k8psh::PersistentWorkers::parseResponse("{} {}", exitCode, output));
+
+#ifndef _WIN32
+	// Workers are shared by command and environment, and are replaced once they run the maximum number of requests
+	const std::vector<std::string> executable(1, k8psh::Utilities::getExecutablePath());
+	k8psh::PersistentWorkers workers(2);
+
+	workers.add("echo", executable, { "TEST_WORKER=first" }, "", 1, 2);
+	workers.add("other", executable, { "TEST_WORKER=second" }, "", 1, 0);
+	TEST_THROWS(workers.add("full", executable, { }, "", 1, 0));
+
+	TEST_THAT(workers.acquire("echo", { "TEST_WORKER=second" }) < 0);
+	TEST_THAT(workers.acquire("missing", { "TEST_WORKER=first" }) < 0);
+
+	long long worker = workers.acquire("echo", { "TEST_WORKER=first" });
+
+	TEST_THAT(worker >= 0);
+	TEST_THAT(workers.acquire("echo", { "TEST_WORKER=first" }) < 0);
+	TEST_THAT(workers.send(worker, k8psh::PersistentWorkers::formatRequest({ "one" }, "")));
+	TEST_THAT(receiveResponse(workers, worker, exitCode, output) && exitCode == 7);
+	TEST_THAT(output.find(" first {\"arguments\":[\"one\"],\"requestId\":0}") != std::string::npos);
+	workers.release(worker, false);
+
+	const std::string firstProcess = output.substr(0, output.find(' '));
+
+	TEST_THAT(workers.acquire("echo", { "TEST_WORKER=first" }) == worker);
+	TEST_THAT(workers.send(worker, k8psh::PersistentWorkers::formatRequest({ "two" }, "")));
+	TEST_THAT(receiveResponse(workers, worker, exitCode, output) && output.substr(0, output.find(' ')) == firstProcess);
+	workers.release(worker, false);
+
+	TEST_THAT(workers.acquire("echo", { "TEST_WORKER=first" }) < 0);
+
+	std::vector<long long> stopped = workers.replaceRetired();
+
+	TEST_THAT(stopped.size() == 1 && std::to_string(stopped[0]) == firstProcess);
+	TEST_THAT(waitpid(pid_t(stopped[0]), NULL, 0) == pid_t(stopped[0]));
+	TEST_THAT(workers.acquire("echo", { "TEST_WORKER=first" }) == worker);
+	TEST_THAT(workers.send(worker, k8psh::PersistentWorkers::formatRequest({ "three" }, "")));
+	TEST_THAT(receiveResponse(workers, worker, exitCode, output) && output.substr(0, output.find(' ')) != firstProcess);
+	workers.release(worker, false);
+
+	// Workers that exit without a response are replaced
+	long long other = workers.acquire("other", { "TEST_WORKER=second" });
+
+	TEST_THAT(other >= 0 && other != worker);
+	TEST_THAT(workers.send(other, k8psh::PersistentWorkers::formatRequest({ "exit" }, "")));
+
+	std::string response;
+	std::string buffer(1024, '\0');
+
+	TEST_THAT(!workers.receive(other, buffer, response) && response.empty());
+	workers.release(other, true);
+	TEST_THAT(workers.acquire("other", { "TEST_WORKER=second" }) < 0);
+
+	stopped = workers.replaceRetired();
+	TEST_THAT(stopped.size() == 1 && waitpid(pid_t(stopped[0]), NULL, 0) == pid_t(stopped[0]));
+	TEST_THAT(workers.replaceRetired().empty());
+	TEST_THAT((other = workers.acquire("other", { "TEST_WORKER=second" })) >= 0);
+	TEST_THAT(workers.send(other, k8psh::PersistentWorkers::formatRequest({ "four" }, "sub")));
+	TEST_THAT(receiveResponse(workers, other, exitCode, output) && output.find(" second {\"arguments\":[\"four\"],\"requestId\":0,\"sandboxDir\":\"sub\"}") != std::string::npos);
+	workers.release(other, false);
+#endif
+
+	return 0;
+}
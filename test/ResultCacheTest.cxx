@@ -0,0 +1,59 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "ResultCache.cxx"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Test.hxx"
+
+#include "Utilities.cxx"
+
+int main()
+{
+	const std::string directory = "ResultCacheTest.cache";
+	const std::string firstKey = k8psh::ResultCache::createKey("cat", { "/bin/cat" }, { "PATH=/bin" }, "src", "First");
+	const std::string secondKey = k8psh::ResultCache::createKey("cat", { "/bin/cat" }, { "PATH=/bin" }, "src", "Second");
+	const std::string thirdKey = k8psh::ResultCache::createKey("cat", { "/bin/cat" }, { "PATH=/bin" }, "test", "First");
+	const std::string result(1000, 'r');
+	std::string loaded;
+
+	// Keys
+	TEST_THAT(firstKey != secondKey && firstKey != thirdKey);
+	TEST_THAT(k8psh::ResultCache::createKey("a", { "b" }, { }, "", "") != k8psh::ResultCache::createKey("a", { }, { "b" }, "", ""));
+
+	// Results larger than the cache are not stored, and the least recently used results are evicted to keep the size within the limit
+	k8psh::ResultCache cache(directory, 2 * (result.length() + firstKey.length() + 32));
+
+	TEST_THAT(cache.getMaxSize() == 2 * (result.length() + firstKey.length() + 32));
+	TEST_THAT(!cache.load(firstKey, loaded));
+	TEST_THAT(!cache.store(firstKey, std::string(cache.getMaxSize(), 'r')));
+	TEST_THAT(cache.store(firstKey, result));
+	TEST_THAT(cache.load(firstKey, loaded) && loaded == result);
+	TEST_THAT(!cache.load(secondKey, loaded));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20)); // Modification times are used to find the least recently used results
+	TEST_THAT(cache.store(secondKey, result + "2"));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	TEST_THAT(cache.load(firstKey, loaded) && loaded == result);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	TEST_THAT(cache.store(thirdKey, result + "3"));
+
+	TEST_THAT(cache.load(firstKey, loaded) && loaded == result);
+	TEST_THAT(!cache.load(secondKey, loaded));
+	TEST_THAT(cache.load(thirdKey, loaded) && loaded == result + "3");
+
+	// Results are kept between instances
+	TEST_THAT(k8psh::ResultCache(directory, cache.getMaxSize()).load(thirdKey, loaded) && loaded == result + "3");
+
+	const auto storedResults = findStoredResults(cache.getDirectory());
+
+	TEST_THAT(storedResults.size() == 2);
+
+	for (auto it = storedResults.begin(); it != storedResults.end(); ++it)
+		TEST_THAT(k8psh::Utilities::deleteFile(it->filename));
+}
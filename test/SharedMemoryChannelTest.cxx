@@ -0,0 +1,156 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "SharedMemoryChannel.cxx"
+
+#include <iostream>
+#include <string>
+#include <utility>
+
+#ifdef __linux__
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
+
+#include "Test.hxx"
+
+#include "Utilities.cxx"
+
+#ifdef __linux__
+// Reads data from a channel until the string is filled
+static std::string readString(k8psh::SharedMemoryChannel &channel, std::size_t length)
+{
+	std::string value(length, '\0');
+
+	for (std::size_t offset = 0; offset < length; )
+	{
+		const std::size_t received = channel.read(&value[offset], length - offset);
+
+		TEST_THAT(received != 0);
+		offset += received;
+	}
+
+	return value;
+}
+
+// Creates a channel and attaches to it from the same process
+static void createPair(k8psh::SharedMemoryChannel &creator, k8psh::SharedMemoryChannel &attacher)
+{
+	int handles[k8psh::SharedMemoryChannel::HANDLE_COUNT];
+
+	creator = k8psh::SharedMemoryChannel::create(handles);
+	attacher = k8psh::SharedMemoryChannel::attach(handles, k8psh::SharedMemoryChannel::HANDLE_COUNT);
+}
+#endif
+
+int main()
+{
+#ifdef __linux__
+	const std::size_t RING_SIZE = k8psh::SharedMemoryChannel::RING_SIZE;
+	k8psh::SharedMemoryChannel creator;
+	k8psh::SharedMemoryChannel attacher;
+
+	// Test invalid handles
+	std::cout << "Attaching invalid channels" << std::endl;
+	int handles[k8psh::SharedMemoryChannel::HANDLE_COUNT] = { -1, -1, -1, -1 };
+
+	TEST_THAT(!creator.isValid());
+	TEST_THROWS(k8psh::SharedMemoryChannel::attach(handles, 0));
+	TEST_THROWS(k8psh::SharedMemoryChannel::attach(handles, k8psh::SharedMemoryChannel::HANDLE_COUNT));
+
+	creator = k8psh::SharedMemoryChannel::create(handles);
+	TEST_THAT(creator.isValid() && creator.getWaitHandle() != -1);
+	(void)close(handles[0]);
+	handles[0] = open("/dev/null", O_RDWR | O_CLOEXEC); // The memory must have the size of a channel, which cannot be changed
+	TEST_THROWS(k8psh::SharedMemoryChannel::attach(handles, k8psh::SharedMemoryChannel::HANDLE_COUNT));
+
+	// Test writing and reading in both directions
+	std::cout << "Writing and reading data" << std::endl;
+	createPair(creator, attacher);
+	TEST_THAT(!creator.hasData() && !attacher.hasData());
+	TEST_THAT(creator.write("Hello", 5) == 5 && attacher.write("World!", 6) == 6);
+	TEST_THAT(attacher.hasData() && readString(attacher, 5) == "Hello");
+	TEST_THAT(!attacher.hasData()); // The read event is cleared once the channel is empty
+	TEST_THAT(creator.hasData() && readString(creator, 3) == "Wor");
+	TEST_THAT(creator.hasData() && readString(creator, 3) == "ld!");
+	TEST_THAT(!creator.hasData());
+
+	// Test moving channels
+	k8psh::SharedMemoryChannel moved(std::move(attacher));
+
+	TEST_THAT(!attacher.isValid() && moved.isValid());
+	TEST_THAT(creator.write("Moved", 5) == 5 && readString(moved, 5) == "Moved");
+	attacher = std::move(moved);
+
+	// Test filling the ring without waiting, and data that wraps around the end of the ring
+	std::cout << "Filling ring" << std::endl;
+	std::string largeData(RING_SIZE + 10, 'x');
+
+	for (std::size_t i = 0; i < largeData.size(); i++)
+		largeData[i] = char(i * 7);
+
+	TEST_THAT(attacher.write(largeData.data(), largeData.size(), false) == RING_SIZE);
+	TEST_THAT(attacher.write("!", 1, false) == 0);
+	TEST_THAT(readString(creator, 3) == largeData.substr(0, 3));
+	TEST_THAT(attacher.write(largeData.data() + RING_SIZE, 10, false) == 3);
+	TEST_THAT(readString(creator, RING_SIZE - 3) == largeData.substr(3, RING_SIZE - 3));
+	TEST_THAT(readString(creator, 3) == largeData.substr(RING_SIZE, 3));
+	TEST_THAT(!creator.hasData());
+
+	// Test transferring data directly from a pipe and a file
+	std::cout << "Transferring data from pipe and file" << std::endl;
+	k8psh::Pipe pipe;
+
+	TEST_THAT(::write(pipe.getInput(), "Piped", 5) == 5);
+	TEST_THAT(creator.readFrom(pipe.getOutput(), 5) == 5 && readString(attacher, 5) == "Piped");
+	pipe.closeInput();
+	TEST_THAT(creator.readFrom(pipe.getOutput(), 5) == 0); // The pipe has been closed
+
+	TEST_THAT(k8psh::Utilities::writeFile("SharedMemoryChannelTest.file", "Hello, World"));
+	const int file = open("SharedMemoryChannelTest.file", O_RDONLY);
+
+	TEST_THAT(file != -1 && lseek(file, 7, SEEK_SET) == 7);
+	TEST_THAT(creator.readFrom(file, 10) == 5 && readString(attacher, 5) == "World");
+	(void)close(file);
+	TEST_THAT(k8psh::Utilities::deleteFile("SharedMemoryChannelTest.file"));
+
+	// Test shutting down and closing
+	std::cout << "Closing channel" << std::endl;
+	TEST_THAT(creator.write("Last", 4) == 4);
+	creator.shutdown();
+	TEST_THAT(attacher.hasData() && readString(attacher, 4) == "Last"); // Data written before shutting down is read first
+	TEST_THAT(attacher.hasData() && attacher.read(&largeData[0], 1) == 0);
+	TEST_THAT(!creator.isRemoteClosed());
+
+	attacher.close();
+	TEST_THAT(creator.isRemoteClosed() && creator.write("Lost", 4) == 0);
+	TEST_THAT(creator.hasData() && creator.read(&largeData[0], 1) == 0);
+	creator.close();
+
+	// Test the remote side exiting without closing the channel
+	std::cout << "Exiting with an open channel" << std::endl;
+	creator = k8psh::SharedMemoryChannel::create(handles);
+
+	const pid_t child = fork();
+
+	if (child == 0)
+	{
+		attacher = k8psh::SharedMemoryChannel::attach(handles, k8psh::SharedMemoryChannel::HANDLE_COUNT);
+		(void)attacher.write("Exited", 6);
+		_exit(0);
+	}
+
+	for (std::size_t i = 0; i < k8psh::SharedMemoryChannel::HANDLE_COUNT; i++)
+		(void)close(handles[i]);
+
+	int status = 0;
+
+	TEST_THAT(child > 0 && waitpid(child, &status, 0) == child);
+	TEST_THAT(readString(creator, 6) == "Exited");
+	TEST_THAT(creator.read(&largeData[0], 1) == 0 && creator.isRemoteClosed());
+	TEST_THAT(creator.write("Lost", 4) == 0);
+#endif
+
+	std::cout << "Finished testing shared memory channels" << std::endl;
+	return 0;
+}
@@ -8,6 +8,7 @@
 
 #include "Test.hxx"
 
+#include "SharedMemoryChannel.cxx"
 #include "Utilities.cxx"
 
 static std::string readString(k8psh::Socket &socket, std::size_t length)
@@ -32,15 +33,87 @@ int main()
 
 	std::cout << "Listening on port " << listener.getPort() << std::endl;
 
+	// Test non-blocking accepts
+	TEST_THAT(listener.setNonblocking());
+	TEST_THAT(!listener.accept().isValid());
+
 	while (!client.isValid())
 		client = k8psh::Socket::connect(listener.getPort());
 
 	while (!server.isValid())
 		server = listener.accept();
 
+	// Test buffer sizes
+	TEST_THAT(client.setBufferSize(1024 * 256) && server.setBufferSize(1024 * 256));
+
 	std::vector<std::uint8_t> data = { 1, 2, 3, 'H', 'e', 'l', 'l', 'o', 5, 6, 7 };
 	std::vector<std::uint8_t> received;
 
+	// Test addresses
+	TEST_THAT(k8psh::Socket::resolve("127.0.0.1") == "127.0.0.1");
+	TEST_THAT(k8psh::Socket::resolve("::1") == "::1");
+	TEST_THAT(k8psh::Socket::resolve("0:0::1") == "::1");
+	TEST_THROWS(k8psh::Socket::connect("not-numeric", listener.getPort()));
+
+	{
+		k8psh::Socket addressed = k8psh::Socket::connect("127.0.0.1", listener.getPort());
+		k8psh::Socket accepted;
+
+		TEST_THAT(addressed.isValid());
+
+		while (!accepted.isValid())
+			accepted = listener.accept();
+	}
+
+	// Test connecting with a timeout, and reads that time out
+	{
+		k8psh::Socket timed = k8psh::Socket::connect("127.0.0.1", listener.getPort(), true, 1000);
+		k8psh::Socket accepted;
+
+		TEST_THAT(timed.isValid());
+
+		while (!accepted.isValid())
+			accepted = listener.accept();
+
+		received.resize(4096);
+		TEST_THAT(timed.setReceiveTimeout(10));
+		TEST_THROWS(timed.read(received));
+		TEST_THAT(accepted.write(data) == data.size() && timed.setReceiveTimeout(0));
+		TEST_THAT(timed.read(received) == data.size());
+	}
+
+	// Test connecting without waiting, finishing the connection once it is accepted
+	{
+		k8psh::Socket started = k8psh::Socket::startConnect("127.0.0.1", listener.getPort());
+		k8psh::Socket accepted;
+
+		TEST_THAT(started.isValid());
+
+		while (!accepted.isValid())
+			accepted = listener.accept();
+
+		TEST_THAT(started.finishConnect() && accepted.write(data) == data.size());
+		TEST_THAT(started.read(received) == data.size());
+	}
+
+	// Test waiting on sockets to finish connecting and to have data to read
+	{
+		k8psh::Socket started = k8psh::Socket::startConnect("127.0.0.1", listener.getPort());
+		k8psh::Socket accepted;
+		std::vector<k8psh::Socket::Wait> waits = { { &started, true, false } };
+
+		TEST_THAT(k8psh::Socket::wait(waits, 1000) == 1 && waits[0].ready && started.finishConnect());
+
+		while (!accepted.isValid())
+			accepted = listener.accept();
+
+		waits[0].connecting = false;
+		TEST_THAT(k8psh::Socket::wait(waits, 10) == 0 && !waits[0].ready);
+		TEST_THAT(accepted.write(data) == data.size());
+		TEST_THAT(k8psh::Socket::wait(waits, 1000) == 1 && waits[0].ready);
+		TEST_THAT(started.read(received) == data.size());
+	}
+
 	// Test writing and reading
 	std::cout << "Sending data" << std::endl;
 	server.write(data);
@@ -63,6 +136,12 @@ int main()
 	for (std::size_t i = 0; i < data.size() - DATA_OFFSET; i++)
 		TEST_THAT(received[i + READ_OFFSET] == data[i + DATA_OFFSET]);
 
+	// Test writing slices
+	std::cout << "Sending sliced data" << std::endl;
+	const k8psh::Socket::Slice slices[] = { { &data[3], 3 }, { &data[0], 0 }, { &data[6], 2 } };
+	TEST_THAT(client.write(slices, sizeof(slices) / sizeof(slices[0])) == 5);
+	TEST_THAT(readString(server, 5) == "Hello");
+
 	// Test closing
 	std::cout << "Closing sockets" << std::endl;
 	server.close();
@@ -71,5 +150,174 @@ int main()
 	client.close();
 	listener.close();
 
+#ifdef SO_REUSEPORT
+	// Test listeners sharing a port, which each accept some of the connections
+	std::cout << "Creating shared listeners" << std::endl;
+	k8psh::Socket shared = k8psh::Socket::listen(k8psh::Socket::RANDOM_PORT, "", true);
+	k8psh::Socket sharing = k8psh::Socket::listen(shared.getPort(), "", true);
+
+	TEST_THROWS(k8psh::Socket::listen(shared.getPort()));
+	TEST_THAT(shared.setNonblocking() && sharing.setNonblocking());
+
+	{
+		std::vector<k8psh::Socket> clients;
+		std::size_t acceptedShared = 0;
+		std::size_t acceptedSharing = 0;
+
+		while (clients.size() < 64)
+		{
+			k8psh::Socket connected = k8psh::Socket::connect(shared.getPort());
+
+			if (connected.isValid())
+				clients.emplace_back(std::move(connected));
+		}
+
+		for (int attempts = 0; acceptedShared + acceptedSharing < clients.size() && attempts < 100000; attempts++)
+		{
+			acceptedShared += shared.accept().isValid() ? 1 : 0;
+			acceptedSharing += sharing.accept().isValid() ? 1 : 0;
+		}
+
+		TEST_THAT(acceptedShared + acceptedSharing == clients.size());
+		TEST_THAT(acceptedShared > 0 && acceptedSharing > 0);
+	}
+
+	shared.close();
+	sharing.close();
+#endif
+
+#ifndef _WIN32
+	// Test Unix domain sockets
+	std::cout << "Creating Unix domain sockets" << std::endl;
+	const std::string socketPath = k8psh::Utilities::getWorkingDirectory() + "/SocketTest.sock";
+
+	listener = k8psh::Socket::listen(socketPath);
+	TEST_THAT(listener.getPort() == 0);
+
+	client = k8psh::Socket::connect(socketPath);
+	server = listener.accept();
+	TEST_THAT(client.isValid() && server.isValid());
+
+	client.write(data, 3);
+	TEST_THAT(readString(server, 5) == "Hello");
+
+	{
+		k8psh::Socket started = k8psh::Socket::startConnect(socketPath);
+		k8psh::Socket accepted = listener.accept();
+
+		TEST_THAT(started.isValid() && accepted.isValid() && started.finishConnect());
+		started.write(data, 3);
+		TEST_THAT(readString(accepted, 5) == "Hello");
+	}
+
+	TEST_THROWS(k8psh::Socket::listen(socketPath)); // Active sockets are never replaced
+
+	server.close();
+	client.close();
+	listener.close();
+
+	// Stale sockets are replaced
+	listener = k8psh::Socket::listen(socketPath);
+	listener.close();
+	TEST_THAT(k8psh::Utilities::deleteFile(socketPath));
+	TEST_THAT(!k8psh::Socket::connect(socketPath, false).isValid());
+	TEST_THAT(!k8psh::Socket::startConnect(socketPath, false).isValid());
+
+	// Test socket pairs and writing without waiting
+	std::cout << "Creating socket pair" << std::endl;
+	k8psh::Socket::createPair(client, server);
+	TEST_THAT(client.isValid() && server.isValid());
+
+	std::vector<std::uint8_t> largeData(16 * 1024 * 1024, 'x');
+	std::size_t written = 0;
+
+	TEST_THAT(client.writeAvailable(largeData.data(), largeData.size(), written));
+	TEST_THAT(written > 0 && written < largeData.size()); // The socket buffer fills without blocking
+
+	std::size_t totalRead = 0;
+
+	while (totalRead < written)
+		totalRead += server.read(received);
+
+	TEST_THAT(totalRead == written);
+
+	// Test passing handles
+	std::cout << "Passing handles" << std::endl;
+	k8psh::Pipe pipe;
+	std::vector<int> handles;
+	const int sentHandles[] = { pipe.getInput() };
+
+	TEST_THAT(client.write("Hello", 5, sentHandles, 1) == 5);
+	TEST_THAT(server.read(received, 0, handles) == 5 && handles.size() == 1);
+	TEST_THAT(handles[0] != pipe.getInput() && (fcntl(handles[0], F_GETFD) & FD_CLOEXEC) != 0);
+
+	std::string pipeData(5, '\0');
+	TEST_THAT(::write(handles[0], "World", 5) == 5);
+	TEST_THAT(pipe.read(pipeData) == 5 && pipeData == "World");
+	(void)::close(handles[0]);
+
+#ifdef __linux__
+	// Test sending files from their current offset
+	std::cout << "Sending file" << std::endl;
+	TEST_THAT(k8psh::Utilities::writeFile("SocketTest.file", "Hello, World"));
+
+	const int file = open("SocketTest.file", O_RDONLY);
+
+	TEST_THAT(file != -1 && lseek(file, 7, SEEK_SET) == 7);
+	TEST_THAT(client.sendFile(file, 5) == 5);
+	TEST_THAT(readString(server, 5) == "World");
+	TEST_THAT(client.sendFile(file, 5) == 0); // The file has ended
+	(void)::close(file);
+	TEST_THAT(k8psh::Utilities::deleteFile("SocketTest.file"));
+#endif
+
+	server.close();
+	TEST_THAT(!client.writeAvailable(data.data(), data.size(), written));
+	client.close();
+#endif
+
+#ifdef __linux__
+	// Test shared memory channels, which carry all data written to and read from the sockets once they are attached
+	std::cout << "Attaching shared memory channel" << std::endl;
+	int channelHandles[k8psh::SharedMemoryChannel::HANDLE_COUNT];
+
+	k8psh::Socket::createPair(client, server);
+	handles.clear();
+
+	k8psh::SharedMemoryChannel channel = k8psh::SharedMemoryChannel::create(channelHandles);
+
+	TEST_THAT(client.write("C", 1, channelHandles, k8psh::SharedMemoryChannel::HANDLE_COUNT) == 1);
+
+	for (std::size_t i = 0; i < k8psh::SharedMemoryChannel::HANDLE_COUNT; i++)
+		(void)::close(channelHandles[i]);
+
+	TEST_THAT(server.read(received, 0, handles) == 1 && handles.size() == k8psh::SharedMemoryChannel::HANDLE_COUNT);
+	TEST_THAT(!client.hasSpuriousReadEvents());
+	server.attachChannel(k8psh::SharedMemoryChannel::attach(handles.data(), handles.size()));
+	client.attachChannel(std::move(channel));
+	TEST_THAT(client.hasSpuriousReadEvents() && server.hasSpuriousReadEvents() && !server.hasData());
+
+	client.write(data, 3);
+	TEST_THAT(readString(server, 5) == "Hello" && server.hasData());
+	TEST_THAT(readString(server, 3) == "\5\6\7" && !server.hasData());
+
+	const k8psh::Socket::Slice channelSlices[] = { { "Sl", 2 }, { "", 0 }, { "ices", 4 } };
+
+	TEST_THAT(server.write(channelSlices, 3) == 6 && readString(client, 6) == "Slices");
+	TEST_THAT(client.writeAvailable(largeData.data(), largeData.size(), written) && written == k8psh::SharedMemoryChannel::RING_SIZE);
+
+	for (totalRead = 0; totalRead < written; )
+		totalRead += server.read(received);
+
+	TEST_THAT(totalRead == written && !server.hasData());
+	TEST_THROWS(client.write("Split", 5, channelHandles, 1)); // Handles are only sent before the channel is attached
+
+	client.shutdown();
+	TEST_THAT(server.hasData() && server.read(received) == 0);
+	server.close();
+	TEST_THAT(!client.writeAvailable(data.data(), data.size(), written));
+	client.close();
+#endif
+
 	std::cout << "Finished testing sockets" << std::endl;
 }
@@ -0,0 +1,59 @@
+// This software is released as part of the k8psh project.
+// Portions of this software are public domain or licensed under the MIT license. (See the license file for details.)
+
+#include "Trace.cxx"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "Test.hxx"
+
+#include "Utilities.cxx"
+
+int main()
+{
+	const auto start = k8psh::Trace::Clock::now();
+	k8psh::Trace client(start);
+	k8psh::Trace server(start + std::chrono::microseconds(1000));
+
+	// Phases are relative to the start of the trace
+	client.add("client", "connect", start, start + std::chrono::microseconds(500));
+	server.add("server", "spawn", server.getStart() + std::chrono::microseconds(10), server.getStart() + std::chrono::microseconds(30));
+	server.add("server", "run", server.getStart() + std::chrono::microseconds(30), server.getStart() + std::chrono::microseconds(130));
+	TEST_THAT(client.getPhases().size() == 1 && client.getPhases()[0].start.count() == 0 && client.getPhases()[0].duration.count() == 500);
+	TEST_THAT(server.serialize() == "10 20 spawn\n30 100 run\n");
+
+	// Serialized phases are offset by the start of the serialized trace
+	TEST_THAT(client.deserialize("server", server.serialize(), server.getStart()));
+	TEST_THAT(client.getPhases().size() == 3);
+	TEST_THAT(client.getPhases()[1].track == "server" && client.getPhases()[1].name == "spawn" && client.getPhases()[1].start.count() == 1010);
+	TEST_THAT(client.getPhases()[2].name == "run" && client.getPhases()[2].start.count() == 1030 && client.getPhases()[2].duration.count() == 100);
+	TEST_THAT(client.deserialize("server", "", start) && client.getPhases().size() == 3);
+	TEST_THAT(!client.deserialize("server", "10 spawn\n", start) && client.getPhases().size() == 3);
+
+	// Each track is formatted as a separate thread
+	const std::string events = client.format("k8psh \"cat\"", 42);
+
+	TEST_THAT(events.find("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":42,\"args\":{\"name\":\"k8psh \\\"cat\\\"\"}},\n") == 0);
+	TEST_THAT(events.find("\"tid\":0,\"args\":{\"name\":\"client\"}") != std::string::npos);
+	TEST_THAT(events.find("\"tid\":1,\"args\":{\"name\":\"server\"}") != std::string::npos);
+	TEST_THAT(events.find("{\"name\":\"spawn\",\"cat\":\"k8psh\",\"ph\":\"X\",\"ts\":") != std::string::npos);
+	TEST_THAT(events.find(",\"dur\":100,\"pid\":42,\"tid\":1},\n") != std::string::npos);
+	TEST_THAT(events.length() > 3 && events.compare(events.length() - 3, 3, "},\n") == 0);
+
+	// Only the first append writes the opening bracket
+	const std::string filename = "TraceTest.json";
+
+	(void)std::remove(filename.c_str());
+	TEST_THAT(k8psh::Trace::append(filename, events));
+	TEST_THAT(k8psh::Trace::append(filename, events));
+
+	std::ifstream file(filename);
+	const std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	TEST_THAT(contents == "[\n" + events + events);
+	TEST_THAT(!k8psh::Trace::append("TraceTest.missing/trace.json", events));
+}
@@ -7,6 +7,10 @@
 
 #include "Test.hxx"
 
+#ifndef _WIN32
+	#include <sys/wait.h>
+#endif
+
 #ifdef _WIN32
 static const std::string ROOT_PATH = "C:\\";
 #else
@@ -63,4 +67,224 @@ int main()
 #ifdef _WIN32
 	TEST_THAT(k8psh::Utilities::relativizePath(ROOT_PATH + "Blah//blah2", ROOT_PATH + "blah/Blah2/blah3") == "blah3");
 #endif
+
+	// Ring Buffer
+	k8psh::RingBuffer ringBuffer(8);
+	std::size_t length = 0;
+
+	TEST_THAT(ringBuffer.isEmpty() && ringBuffer.getCapacity() == 8);
+	TEST_THAT(ringBuffer.append("Hello", 5) == 5);
+	const char *front = ringBuffer.getFront(length);
+	TEST_THAT(std::string(front, length) == "Hello");
+	ringBuffer.consume(4);
+	TEST_THAT(ringBuffer.append("World!!!", 8) == 7);
+	TEST_THAT(ringBuffer.getSize() == 8);
+	front = ringBuffer.getFront(length);
+	TEST_THAT(std::string(front, length) == "oWor"); // Wrapped data is split into contiguous pieces
+	ringBuffer.consume(length);
+	front = ringBuffer.getFront(length);
+	TEST_THAT(std::string(front, length) == "ld!!");
+	ringBuffer.consume(length);
+	TEST_THAT(ringBuffer.isEmpty());
+
+	// Files
+	const std::string filename = "UtilitiesTest.file";
+
+	TEST_THAT(!k8psh::MappedFile(filename).isValid());
+	TEST_THAT(k8psh::Utilities::writeFile(filename, "First"));
+	TEST_THAT(k8psh::Utilities::writeFile(filename, "Contents"));
+
+	{
+		const k8psh::MappedFile mappedFile(filename);
+		TEST_THAT(mappedFile.isValid() && std::string(mappedFile.getData(), mappedFile.getSize()) == "Contents");
+	}
+
+	TEST_THAT(k8psh::Utilities::deleteFile(filename));
+
+	// Shared counters
+	k8psh::SharedCounter counter;
+
+	TEST_THAT(counter.get() == 0);
+	TEST_THAT(counter.add(2) == 2 && counter.add(-1) == 1);
+
+#ifndef _WIN32
+	const pid_t child = fork();
+
+	if (child == 0)
+		_exit(counter.add(1) == 2 ? 0 : 1);
+
+	int status = 0;
+
+	TEST_THAT(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	TEST_THAT(counter.get() == 2);
+#endif
+
+	// FIFO semaphores (tickets acquire the semaphore in order, skipping cancelled tickets)
+	k8psh::FifoSemaphore semaphore(1);
+	const long long firstTicket = semaphore.enqueue(1);
+	const long long secondTicket = semaphore.enqueue(2);
+	const long long thirdTicket = semaphore.enqueue(3);
+
+	TEST_THAT(firstTicket >= 0 && secondTicket > firstTicket && thirdTicket > secondTicket && semaphore.getWaiting() == 3);
+	TEST_THAT(!semaphore.tryAcquire(secondTicket, 2) && semaphore.tryAcquire(firstTicket, 1) && semaphore.getAcquired() == 1);
+	semaphore.cancel(secondTicket);
+
+	const k8psh::Pipe::Handle wakeHandle = semaphore.createWakeHandle(thirdTicket);
+
+	TEST_THAT(!semaphore.tryAcquire(thirdTicket, 3));
+	TEST_THAT(!semaphore.release(3) && semaphore.release(1));
+#ifdef __linux__
+	// The waiter at the front of the queue is woken once the semaphore is released
+	struct pollfd wakePoll = { };
+
+	wakePoll.fd = wakeHandle;
+	wakePoll.events = POLLIN;
+	TEST_THAT(wakeHandle >= 0 && poll(&wakePoll, 1, 5000) == 1);
+	(void)close(wakeHandle);
+#elif defined(_WIN32)
+	TEST_THAT(wakeHandle != k8psh::Pipe::INVALID_HANDLE && WaitForSingleObject(wakeHandle, 5000) == WAIT_OBJECT_0);
+	(void)CloseHandle(wakeHandle);
+#else
+	TEST_THAT(wakeHandle == k8psh::Pipe::INVALID_HANDLE);
+#endif
+	TEST_THAT(semaphore.tryAcquire(thirdTicket, 3) && semaphore.getAcquired() == 1 && semaphore.getWaiting() == 0);
+
+	// Exited processes release the semaphore and leave the queue
+	const long long fourthTicket = semaphore.enqueue(4);
+	const long long fifthTicket = semaphore.enqueue(5);
+
+	TEST_THAT(semaphore.releaseAll(4) == 0 && semaphore.releaseAll(3) == 1 && semaphore.tryAcquire(fifthTicket, 5));
+	TEST_THAT(!semaphore.tryAcquire(fourthTicket, 4) && semaphore.getWaiting() == 0);
+	TEST_THAT(semaphore.release(5) && semaphore.getAcquired() == 0);
+
+	TEST_THAT(k8psh::Utilities::getCpuQuota() >= 0);
+
+	// File watcher (changes are detected after the watcher is created)
+	k8psh::FileWatcher watcher(filename);
+
+	if (watcher.isValid())
+	{
+		TEST_THAT(!watcher.wait(std::chrono::steady_clock::now() + std::chrono::milliseconds(10)));
+		TEST_THAT(k8psh::Utilities::writeFile(filename, "Ready"));
+		TEST_THAT(watcher.wait(std::chrono::steady_clock::now() + std::chrono::seconds(5)));
+		TEST_THAT(k8psh::Utilities::deleteFile(filename));
+	}
+
+#ifdef _WIN32
+	// Completion port (overlapped reads, signaled handles, and posted completions all complete on the port)
+	HANDLE event = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+	{
+		k8psh::CompletionPort port;
+		k8psh::Pipe pipe(true);
+		k8psh::CompletionPort::Completion completion = { };
+		OVERLAPPED overlapped = { };
+		char buffer[16];
+
+		TEST_THAT(!port.wait(completion, 1)); // Nothing has completed
+
+		port.associate(pipe.getOutput(), 1);
+		TEST_THAT(ReadFile(pipe.getOutput(), buffer, DWORD(sizeof(buffer)), NULL, &overlapped) != 0 || GetLastError() == ERROR_IO_PENDING);
+		TEST_THAT(pipe.write("Hello", 5) == 5);
+		TEST_THAT(port.wait(completion, 5000) && completion.key == 1 && completion.overlapped == &overlapped && completion.length == 5 && completion.succeeded && std::string(buffer, 5) == "Hello");
+
+		port.notify(event, 2, false);
+		TEST_THAT(SetEvent(event) != 0);
+		TEST_THAT(port.wait(completion, 5000) && completion.key == 2 && !completion.overlapped);
+
+		port.post(3, 7, NULL);
+		TEST_THAT(port.wait(completion, 5000) && completion.key == 3 && completion.length == 7 && completion.succeeded);
+
+		// Closing the input of the pipe fails the pending read
+		TEST_THAT(ReadFile(pipe.getOutput(), buffer, DWORD(sizeof(buffer)), NULL, &overlapped) != 0 || GetLastError() == ERROR_IO_PENDING);
+		pipe.closeInput();
+		TEST_THAT(port.wait(completion, 5000) && completion.key == 1 && completion.overlapped == &overlapped && !completion.succeeded);
+	}
+
+	(void)CloseHandle(event);
+#else
+	// Reactor
+	k8psh::Reactor reactor;
+	k8psh::Pipe pipe;
+	std::vector<k8psh::Reactor::Event> events;
+	int context = 0;
+
+	reactor.watch(pipe.getOutput(), k8psh::Reactor::READABLE, &context);
+	reactor.watch(pipe.getInput(), k8psh::Reactor::WRITABLE, &context);
+	TEST_THAT(reactor.getSize() == 2);
+	TEST_THAT(reactor.wait(events, std::chrono::microseconds(-1)) == 1 && events[0].handle == pipe.getInput() && events[0].events == k8psh::Reactor::WRITABLE && events[0].context == &context);
+
+	reactor.watch(pipe.getInput(), 0, &context);
+	TEST_THAT(reactor.getSize() == 1);
+	TEST_THAT(reactor.wait(events, std::chrono::microseconds(1000)) == 0); // Nothing to read
+
+	TEST_THAT(pipe.write("Hello", 5) == 5);
+	TEST_THAT(reactor.wait(events, std::chrono::microseconds(-1)) == 1 && events[0].handle == pipe.getOutput() && events[0].events == k8psh::Reactor::READABLE);
+
+#ifdef F_SETPIPE_SZ
+	// Pipe capacities can be resized without losing buffered data
+	TEST_THAT(pipe.setCapacity(1024 * 128) && fcntl(pipe.getOutput(), F_GETPIPE_SZ) >= 1024 * 128);
+	TEST_THAT(pipe.setCapacity(1024 * 64) && fcntl(pipe.getOutput(), F_GETPIPE_SZ) == 1024 * 64);
+#endif
+
+	// Regular files are always ready
+	TEST_THAT(k8psh::Utilities::writeFile(filename, "Contents"));
+	int file = open(filename.c_str(), O_RDONLY);
+
+	reactor.watch(pipe.getOutput(), 0, &context);
+	reactor.watch(file, k8psh::Reactor::READABLE, &context);
+	TEST_THAT(reactor.wait(events, std::chrono::microseconds(-1)) == 1 && events[0].handle == file);
+	reactor.watch(file, 0, &context);
+	TEST_THAT(reactor.getSize() == 0);
+	(void)close(file);
+	TEST_THAT(k8psh::Utilities::deleteFile(filename));
+
+	// Asynchronous logging writes the messages of all threads and forked processes (informational messages are written directly if the queue is full)
+	const int savedStdout = dup(STDOUT_FILENO);
+	const int logFile = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	std::fflush(stdout);
+	TEST_THAT(savedStdout >= 0 && logFile >= 0 && dup2(logFile, STDOUT_FILENO) == STDOUT_FILENO);
+	(void)close(logFile);
+	k8psh::Logger::startAsyncWriter(4);
+
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < 4; i++)
+		threads.emplace_back([i] { for (int j = 0; j < 100; j++) LOG_INFO << "Async message " << i << "." << j; });
+
+	for (auto &thread : threads)
+		thread.join();
+
+	const pid_t loggingChild = fork();
+
+	if (loggingChild == 0)
+	{
+		LOG_INFO << "Async message from child";
+		std::exit(0);
+	}
+
+	TEST_THAT(loggingChild > 0 && waitpid(loggingChild, NULL, 0) == loggingChild);
+	k8psh::Logger::stopAsyncWriter();
+	std::fflush(stdout);
+	TEST_THAT(dup2(savedStdout, STDOUT_FILENO) == STDOUT_FILENO);
+	(void)close(savedStdout);
+
+	const std::string log = k8psh::Utilities::readFile(filename);
+	std::size_t messages = 0;
+
+	for (std::size_t i = log.find("] Async message "); i != std::string::npos; i = log.find("] Async message ", i + 1))
+		messages++;
+
+	TEST_THAT(messages == 401 && log.find("INFO,  ") != std::string::npos && log.find("] Async message 3.99\n") != std::string::npos && log.find("] Async message from child\n") != std::string::npos);
+	TEST_THAT(k8psh::Utilities::deleteFile(filename));
+#endif
+
+	// Find executable
+	const std::string executable = k8psh::Utilities::getExecutablePath();
+
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", k8psh::Utilities::getParentDirectory(executable)));
+	TEST_THAT(k8psh::Utilities::getBasename(k8psh::Utilities::findExecutable(k8psh::Utilities::getExecutableBasename(executable))) == k8psh::Utilities::getBasename(executable));
+	TEST_THAT(k8psh::Utilities::findExecutable(executable) == executable);
+	TEST_THAT(k8psh::Utilities::findExecutable("UtilitiesTest.missing").empty());
 }
@@ -58,6 +58,40 @@ int main(int argc, const char *argv[])
 {
 	std::string executable = k8psh::Utilities::getExecutablePath();
 	std::string basename = k8psh::Utilities::getExecutableBasename(argv[0]);
+	std::string serverOptions;
+	std::string hostOptions;
+	std::string variant; // Names the files of the variant, which also has its own ports (so the variants can run at the same time)
+	unsigned short variantIndex = 0;
+
+	// Test the server using a single event loop, multiple listeners sharing the port (which also write the log from background threads), or a pool of pre-forked workers, or relaying data through shared memory over a Unix domain socket, if specified
+	if (argc == 2 && std::string(argv[1]) == "--event-loop")
+	{
+		serverOptions = " --event-loop";
+		variant = "EventLoop";
+		variantIndex = 1;
+		argc = 1;
+	}
+	else if (argc == 2 && std::string(argv[1]) == "--listeners")
+	{
+		serverOptions = " --listeners 3 --async-logging";
+		variant = "Listeners";
+		variantIndex = 2;
+		argc = 1;
+	}
+	else if (argc == 2 && std::string(argv[1]) == "--workers")
+	{
+		serverOptions = " --workers 2 --max-workers 4";
+		variant = "Workers";
+		variantIndex = 3;
+		argc = 1;
+	}
+	else if (argc == 2 && std::string(argv[1]) == "--shared-memory")
+	{
+		hostOptions = " --socket " + basename + "SharedMemory.sock --shared-memory";
+		variant = "SharedMemory";
+		variantIndex = 4;
+		argc = 1;
+	}
 
 	// Check for test cases
 	if (argc > 1)
@@ -78,6 +112,7 @@ int main(int argc, const char *argv[])
 				LOG_ERROR << "Expecting additional argument to command";
 
 			TEST_THAT(k8psh::Utilities::getEnvironmentVariable("PATH") != ".");
+			TEST_THAT(k8psh::Utilities::getEnvironmentVariable("K8PSH_TEST_LABEL") == std::string(k8psh::Utilities::getEnvironmentVariable("K8PSH_TEST_NAME")) + "!");
 			std::cerr << k8psh::Utilities::getEnvironmentVariable("K8PSH_TEST_NAME") << ", " << argv[2];
 			std::exit(1);
 		}
@@ -96,6 +131,30 @@ int main(int argc, const char *argv[])
 			std::this_thread::sleep_for(std::chrono::milliseconds(250));
 			std::exit(3);
 		}
+		else if (arg == "5")
+		{
+			std::ofstream("test5.count", std::ios::app) << 'x';
+			std::cout << std::cin.rdbuf();
+			std::exit(0);
+		}
+		else if (arg == "6")
+		{
+			// Persistent workers echo their process ID and each request, other processes echo their arguments
+#ifndef _WIN32
+			if (argc == 3 && std::string(argv[2]) == k8psh::PersistentWorkers::WORKER_ARGUMENT)
+			{
+				for (std::string request; std::getline(std::cin, request); )
+					std::cout << "{\"exitCode\":6,\"output\":\"" << k8psh::Utilities::escapeJson(std::to_string(getpid()) + " " + request) << "\"}" << std::endl;
+			}
+			else
+#endif
+			{
+				for (int i = 2; i < argc; i++)
+					std::cerr << argv[i];
+			}
+
+			std::exit(6);
+		}
 
 		mainClient(argc, argv);
 	}
@@ -103,25 +162,57 @@ int main(int argc, const char *argv[])
 		mainClient(argc, argv);
 
 	// Create configuration file
-	std::ofstream configFile((basename + ".conf").c_str());
+	const std::string configFilename = basename + variant + ".conf";
+	const std::string cacheDirectory = ".k8psh-k8pshTest" + variant + ".cache";
+	const unsigned short serverPort = static_cast<unsigned short>(1120 + variantIndex);
+	const unsigned short metricsPort = static_cast<unsigned short>(1190 + variantIndex);
+	std::ofstream configFile(configFilename.c_str());
 
 	configFile << "baseDirectory = ." << std::endl;
-	configFile << "[k8pshTest] --generate-local-executables --max-connections 4 --timeout 8000 --ignore-invalid-arguments ignoredConfigArg" << std::endl;
+#ifdef _WIN32
+	const int agentConnections = 0;
+	const int agentStatusQueries = 0;
+	const int loadGeneratorSessions = 0;
+	const int persistentSessions = 1;
+	const int directAgentSessions = 0;
+#else
+	const int agentConnections = 1;
+	const int agentStatusQueries = 1; // Replicated commands query the status of the replicas directly, then run the session over that connection instead of through the agent
+	const int loadGeneratorSessions = 4;
+	const int persistentSessions = 3;
+	const int directAgentSessions = hostOptions.empty() ? 0 : 2; // Sessions relayed through shared memory connect directly instead of through the agent, which then never connects (the replicated session uses the connection of its status query)
+
+	configFile << "agentSocket = " << basename << variant << ".agent" << std::endl;
+	configFile << "agentConnections = " << agentConnections << std::endl;
+#endif
+	configFile << "[k8pshTestReplica:1]" << std::endl; // A replica that is never running, so the client uses the other replica
+	configFile << "'0_" << basename << "'" << std::endl;
+	configFile << "[k8pshTest:" << serverPort << "] --generate-local-executables --max-connections " << (agentConnections + agentStatusQueries + loadGeneratorSessions + persistentSessions + directAgentSessions + 12) << " --timeout 8000 --buffer-size auto --pipe-size auto --metrics-port " << metricsPort << " --cache-directory " << cacheDirectory << " --ignore-invalid-arguments ignoredConfigArg" << hostOptions << std::endl;
 	configFile << "'0_" << basename << "' K8PSH_TEST_NAME= PATH= '" << executable << "' 0" << std::endl;
-	configFile << "'1_" << basename << "' K8PSH_TEST_NAME= =PATH= '" << executable << "' 1" << std::endl;
-	configFile << "'2_" << basename << "' K8PSH_TEST_NAME= ?PATH= '" << executable << "' 2" << std::endl;
+	configFile << "'1_" << basename << "' K8PSH_TEST_NAME= =PATH= =K8PSH_TEST_LABEL='${K8PSH_TEST_NAME:-none}!' '" << executable << "' 1" << std::endl;
+	configFile << "'2_" << basename << "' --max-processes=1 K8PSH_TEST_NAME= ?PATH= '" << executable << "' 2" << std::endl;
 	configFile << "'3_" << basename << "' K8PSH_TEST_NAME= ?PATH= '" << executable << "' 3" << std::endl;
+	configFile << "'4_" << basename << "' '" << executable << ".missing'" << std::endl;
+	configFile << "'5_" << basename << "' --cache '" << executable << "' 5" << std::endl;
+	configFile << "'6_" << basename << "' --persistent=1 --max-worker-requests=2 '" << executable << "' 6" << std::endl;
 	configFile.close();
 
+	// Remove any results cached by a previous run
+	const auto storedResults = findStoredResults(cacheDirectory);
+
+	for (auto it = storedResults.begin(); it != storedResults.end(); ++it)
+		(void)k8psh::Utilities::deleteFile(it->filename);
+
 	// Start server
-	k8psh::Utilities::setEnvironmentVariable("K8PSH_CONFIG", basename + ".conf");
+	k8psh::Utilities::setEnvironmentVariable("K8PSH_CONFIG", configFilename);
 	k8psh::Utilities::setEnvironmentVariable("K8PSH_DEBUG", "Main, Configuration, Process");
 
-	std::thread([&] { (void)runCommand(executable + " --name k8pshTest"); }).detach();
+	std::thread([&] { (void)runCommand(executable + " --name k8pshTest" + serverOptions); }).detach();
 	std::this_thread::sleep_for(std::chrono::milliseconds(250));
 	k8psh::Utilities::setEnvironmentVariable("K8PSH_DEBUG");
 
-	// Run test cases
+	// Run test cases (the client executables find their commands using the configuration snapshot)
+	TEST_THAT(k8psh::Utilities::readFile(".k8psh.snapshot"));
 	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", "."));
 	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("K8PSH_TEST_NAME", "Test 0"));
 	TEST_THAT(runCommand("." + k8psh::Utilities::getPathSeparator() + "0_" + basename + " > test.out 2> test.err") == 0);
@@ -136,8 +227,146 @@ int main(int argc, const char *argv[])
 	TEST_THAT(runCommand("2_" + basename + " < test.err > test.out") == 2);
 	TEST_THAT(k8psh::Utilities::readFile("test.out") == static_cast<const std::ostringstream &>(std::ostringstream() << "Test 1, a").str());
 
+	// Large data is relayed in multiple payloads (and spliced on Linux)
+	std::string largeData;
+
+	for (std::size_t i = 0; largeData.length() < 1024 * 1024; i++)
+		largeData.append(std::to_string(i)).append(i % 16 ? " " : "\n");
+
+	std::ofstream("test.big", std::ios::binary) << largeData;
+	TEST_THAT(runCommand("2_" + basename + " < test.big > test.out") == 2);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == largeData);
+
 	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", ".;.:."));
 	TEST_THAT(runCommand("3_" + basename + " < test.out > test3.out 2> test.err") == 3);
 	TEST_THAT(k8psh::Utilities::readFile("test3.out").empty());
 	TEST_THAT(k8psh::Utilities::readFile("test.err").empty());
+
+	// Executables that cannot be started fail (with the same exit code as the shell on POSIX)
+#ifdef _WIN32
+	TEST_THAT(runCommand("4_" + basename) != 0);
+#else
+	TEST_THAT(runCommand("4_" + basename) == 127);
+#endif
+
+	// Results of cached commands are replayed without running the command again (stdin is part of the key, and stdin larger than the stdin window is never cached)
+	(void)k8psh::Utilities::deleteFile("test5.count");
+	std::ofstream("test5.in", std::ios::binary) << "Cached";
+	TEST_THAT(runCommand("5_" + basename + " < test5.in > test.out") == 0);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == "Cached");
+	TEST_THAT(runCommand("5_" + basename + " < test5.in > test.out") == 0);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == "Cached");
+	TEST_THAT(runCommand("5_" + basename + " < test.big > test.out") == 0);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == largeData);
+	TEST_THAT(runCommand("5_" + basename + " < test.big > test.out") == 0);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == largeData);
+
+#ifdef _WIN32
+	TEST_THAT(k8psh::Utilities::readFile("test5.count") == "xxxx");
+#else
+	TEST_THAT(k8psh::Utilities::readFile("test5.count") == "xxx");
+#endif
+
+	// Persistent workers run requests instead of starting a process for each session, and are replaced once they run the maximum number of requests
+	TEST_THAT(runCommand("6_" + basename + " a > test.out 2> test.err") == 6);
+#ifdef _WIN32
+	TEST_THAT(k8psh::Utilities::readFile("test.err") == "a");
+#else
+	const std::string workerOutput = k8psh::Utilities::readFile("test.err").c_str();
+	const std::string workerProcess = workerOutput.substr(0, workerOutput.find(' '));
+	const bool multipleListeners = serverOptions.find("--listeners") != std::string::npos; // Each listener has its own workers, so sessions may use different workers
+
+	TEST_THAT(workerOutput == workerProcess + " {\"arguments\":[\"a\"],\"requestId\":0}");
+	TEST_THAT(runCommand("6_" + basename + " b > test.out 2> test.err") == 6);
+	TEST_THAT(k8psh::Utilities::readFile("test.err") == workerProcess + " {\"arguments\":[\"b\"],\"requestId\":0}" || (multipleListeners && k8psh::Utilities::readFile("test.err").find(" {\"arguments\":[\"b\"],\"requestId\":0}") != std::string::npos));
+	TEST_THAT(runCommand("6_" + basename + " c > test.out 2> test.err") == 6);
+	TEST_THAT(k8psh::Utilities::readFile("test.err").find(workerProcess + " ") != 0 || multipleListeners);
+	TEST_THAT(k8psh::Utilities::readFile("test.err").find(" {\"arguments\":[\"c\"],\"requestId\":0}") != std::string::npos);
+	TEST_THAT(k8psh::Utilities::readFile("test.out").empty());
+#endif
+
+	// Phases of sessions are appended to the trace file
+	(void)k8psh::Utilities::deleteFile("test.trace");
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("K8PSH_TRACE", "test.trace"));
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", "."));
+	TEST_THAT(runCommand("0_" + basename + " > test.out") == 0);
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", ".;.:."));
+	TEST_THAT(runCommand("3_" + basename + " < test5.in > test.out") == 3);
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("K8PSH_TRACE"));
+
+	{
+		const std::string trace = k8psh::Utilities::readFile("test.trace");
+
+		TEST_THAT(trace.find("[\n{\"name\":\"process_name\"") == 0 && trace.find("[", 1) == std::string::npos);
+		TEST_THAT(trace.find("\"name\":\"k8psh 3_" + basename + "\"") != std::string::npos);
+		TEST_THAT(trace.find("{\"name\":\"connect\",") != std::string::npos);
+		TEST_THAT(trace.find("{\"name\":\"spawn\",") != std::string::npos);
+		TEST_THAT(trace.find("\"args\":{\"name\":\"server\"}") != std::string::npos);
+	}
+
+	// Metrics are served over HTTP, even while an idle client is connected (which is closed once it fails to send its request in time)
+	{
+		k8psh::Socket idle = k8psh::Socket::connect(metricsPort);
+		k8psh::Socket metrics = k8psh::Socket::connect(metricsPort);
+		const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+		std::vector<std::uint8_t> response(1024 * 64);
+		std::size_t length = 0;
+
+		TEST_THAT(metrics.write(std::vector<std::uint8_t>(request.begin(), request.end())) == request.length());
+
+		for (std::size_t received = 1; received && length < response.size(); length += received)
+			received = metrics.read(response, length);
+
+		const std::string text(response.begin(), response.begin() + length);
+
+		TEST_THAT(text.find("HTTP/1.0 200 OK\r\n") == 0);
+		TEST_THAT(text.find("\nk8psh_process_exits_total{command=\"1_" + basename + "\",code=\"1\"} 1\n") != std::string::npos);
+		TEST_THAT(text.find("\nk8psh_stream_bytes_total{command=\"2_" + basename + "\",stream=\"stdout\"} " + std::to_string(largeData.length() + 9) + "\n") != std::string::npos);
+		TEST_THAT(text.find("\nk8psh_spawn_seconds_count ") != std::string::npos && text.find("\nk8psh_spawn_seconds_count 0\n") == std::string::npos);
+		TEST_THAT(text.find("\nk8psh_active_sessions ") != std::string::npos);
+	}
+
+#ifndef _WIN32
+	// Sessions are run in-process by the load generator (the command exits with 2, after relaying stdin to stdout)
+	{
+		const k8psh::Configuration configuration = getConfiguration(k8psh::OptionalString());
+		k8psh::LoadGenerator::Options options;
+
+		options.sessions = loadGeneratorSessions;
+		options.concurrency = 2;
+		options.bulkSize = 1024 * 1024;
+		options.metricsPort = metricsPort;
+
+		TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", "."));
+
+		const auto results = k8psh::LoadGenerator::run(k8psh::LoadGenerator::MIXED, options, ".", configuration.getCommands().at("2_" + basename), 0, nullptr, configuration);
+
+		TEST_THAT(results.samples.size() == std::size_t(loadGeneratorSessions) && results.failures == 0 && results.nonzeroExits == loadGeneratorSessions);
+		TEST_THAT(results.bytes == 2 * options.bulkSize * std::uint64_t(loadGeneratorSessions / 2));
+		TEST_THAT(results.serverCpuTime.count() >= 0);
+
+		for (auto it = results.samples.begin(); it != results.samples.end(); ++it)
+			TEST_THAT(it->connect <= it->firstOutput && it->firstOutput <= it->total);
+
+		TEST_THAT(k8psh::LoadGenerator::formatResults(k8psh::LoadGenerator::MIXED, options, results).find("mixed: 4 sessions (2 at once) in ") == 0);
+	}
+
+	// Run test cases through the agent, which uses the last server connection (commands run directly until the agent is started)
+	std::thread([] { k8psh::Process::runAgent(getConfiguration(k8psh::OptionalString())); }).detach();
+	std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("PATH", "."));
+	TEST_THAT(k8psh::Utilities::setEnvironmentVariable("K8PSH_TEST_NAME", "Test 0"));
+	TEST_THAT(runCommand("0_" + basename + " > test.out 2> test.err") == 0);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == "Test 0");
+	TEST_THAT(k8psh::Utilities::readFile("test.err").empty());
+
+	TEST_THAT(runCommand("1_" + basename + " a > test.out 2> test.err") == 1);
+	TEST_THAT(k8psh::Utilities::readFile("test.err") == "Test 0, a");
+
+	// Concurrent commands share the same multiplexed connection (the command runs one process at a time, so the second session waits for the first)
+	TEST_THAT(runCommand("2_" + basename + " < test.big > test.out & 2_" + basename + " < test.big > test2.out; r=$?; wait $!; exit $((r + $?))") == 4);
+	TEST_THAT(k8psh::Utilities::readFile("test.out") == largeData);
+	TEST_THAT(k8psh::Utilities::readFile("test2.out") == largeData);
+#endif
 }